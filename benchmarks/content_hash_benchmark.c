@@ -0,0 +1,89 @@
+/* Measures the content hash that the client array cache tells client
+ * arrays apart by, with each kernel this CPU supports, and checks that
+ * they all agree with the scalar one. The sizes go from the smallest
+ * array that the cache hashes to a large mesh, plus a few odd ones that
+ * end in the middle of a stripe and of a block.
+ *
+ * usage: content_hash_benchmark [bytes hashed per measurement]
+ */
+
+#include "config.h"
+#include "util/content_hash.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const size_t sizes[] = { 24, 100, 1024, 1500, 16384, 65539,
+                                1048576, 8388608 };
+
+static double
+get_time_in_seconds (void)
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static bool
+run_benchmark (content_hash_kernel_t kernel,
+               const void *data,
+               size_t size,
+               size_t total_bytes)
+{
+    size_t iterations = total_bytes / size + 1;
+    uint64_t expected = content_hash_with_kernel (CONTENT_HASH_KERNEL_SCALAR,
+                                                  data, size);
+    uint64_t hash = 0;
+    size_t i;
+
+    double start_time = get_time_in_seconds ();
+    for (i = 0; i < iterations; i++) {
+        hash = content_hash_with_kernel (kernel, data, size);
+        /* Keep the compiler from hoisting the hash out of the loop. */
+        __asm__ volatile ("" : : "r" (hash) : "memory");
+    }
+    double elapsed = get_time_in_seconds () - start_time;
+
+    bool failed = hash != expected;
+    printf ("%-7s %8zu bytes: %11.1f ns/hash, %8.2f GB/s%s\n",
+            content_hash_kernel_get_name (kernel), size,
+            elapsed / iterations * 1e9,
+            iterations * size / elapsed / 1e9,
+            failed ? " (FAILED)" : "");
+    return ! failed;
+}
+
+int
+main (int argc, char **argv)
+{
+    size_t total_bytes = argc > 1 ? strtoul (argv[1], NULL, 10) : 2000000000;
+    size_t largest = sizes[sizeof (sizes) / sizeof (sizes[0]) - 1];
+    bool success = true;
+    size_t i;
+    int kernel;
+
+    /* Offset by a float, as client arrays needn't be aligned any further. */
+    char *buffer = malloc (largest + sizeof (float));
+    char *data = buffer + sizeof (float);
+    if (! buffer)
+        return EXIT_FAILURE;
+
+    for (i = 0; i < largest / sizeof (float); i++) {
+        float value = (i * 7 % 1000) / 10.0f;
+        memcpy (data + i * sizeof (float), &value, sizeof (float));
+    }
+
+    for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+        for (kernel = 0; kernel < CONTENT_HASH_KERNEL_COUNT; kernel++) {
+            if (! content_hash_kernel_is_supported (kernel))
+                continue;
+            success &= run_benchmark (kernel, data, sizes[i], total_bytes);
+        }
+    }
+
+    free (buffer);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
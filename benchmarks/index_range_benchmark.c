@@ -0,0 +1,117 @@
+/* Measures the scan for the smallest and largest index of a draw, which
+ * the caching client runs over the indices of every glDrawElements ()
+ * from client arrays, with each kernel this CPU supports. The sizes go
+ * from a few quads to a large mesh, and the indices walk a strip of
+ * triangles, like those of a real mesh, plus some far outliers so that
+ * the range isn't the first and last index.
+ *
+ * usage: index_range_benchmark [indices scanned per measurement]
+ */
+
+#include "config.h"
+#include "util/index_range.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const size_t index_counts[] = { 36, 600, 6000, 60000, 600000 };
+
+static double
+get_time_in_seconds (void)
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void
+fill_indices (void *indices,
+              size_t count,
+              size_t index_size)
+{
+    uint32_t limit = index_size == 1 ? UINT8_MAX :
+                     index_size == 2 ? UINT16_MAX : 1000000;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        uint32_t index = (i / 3 + i % 3) % (limit / 2) + limit / 4;
+        if (i % 997 == 500)
+            index = i % 2 ? limit - 1 : 1;
+
+        if (index_size == 1)
+            ((uint8_t *) indices)[i] = index;
+        else if (index_size == 2)
+            ((uint16_t *) indices)[i] = index;
+        else
+            ((uint32_t *) indices)[i] = index;
+    }
+}
+
+static bool
+run_benchmark (index_range_kernel_t kernel,
+               const void *indices,
+               size_t count,
+               size_t index_size,
+               size_t total_indices)
+{
+    size_t iterations = total_indices / count + 1;
+    uint32_t expected_min, expected_max;
+    uint32_t min = 0, max = 0;
+    size_t i;
+
+    index_range_scan_with_kernel (INDEX_RANGE_KERNEL_SCALAR, indices, count,
+                                  index_size, &expected_min, &expected_max);
+
+    double start_time = get_time_in_seconds ();
+    for (i = 0; i < iterations; i++) {
+        index_range_scan_with_kernel (kernel, indices, count, index_size,
+                                      &min, &max);
+        /* Keep the compiler from hoisting the scan out of the loop. */
+        __asm__ volatile ("" : : "r" (min), "r" (max) : "memory");
+    }
+    double elapsed = get_time_in_seconds () - start_time;
+
+    bool failed = min != expected_min || max != expected_max;
+    printf ("%-7s %d-byte %7zu indices: %9.1f ns/scan, %8.2f GB/s%s\n",
+            index_range_kernel_get_name (kernel), (int) index_size, count,
+            elapsed / iterations * 1e9,
+            iterations * count * index_size / elapsed / 1e9,
+            failed ? " (FAILED)" : "");
+    return ! failed;
+}
+
+int
+main (int argc, char **argv)
+{
+    static const size_t index_sizes[] = { 1, 2, 4 };
+    size_t total_indices = argc > 1 ? strtoul (argv[1], NULL, 10) : 200000000;
+    size_t largest = index_counts[sizeof (index_counts) / sizeof (index_counts[0]) - 1];
+    bool success = true;
+    size_t i, j;
+    int kernel;
+
+    /* Offset by one index, as the indices of a draw needn't be aligned. */
+    char *buffer = malloc (largest * sizeof (uint32_t) + sizeof (uint32_t));
+    if (! buffer)
+        return EXIT_FAILURE;
+
+    for (i = 0; i < sizeof (index_sizes) / sizeof (index_sizes[0]); i++) {
+        void *indices = buffer + index_sizes[i];
+        fill_indices (indices, largest, index_sizes[i]);
+
+        for (j = 0; j < sizeof (index_counts) / sizeof (index_counts[0]); j++) {
+            for (kernel = 0; kernel < INDEX_RANGE_KERNEL_COUNT; kernel++) {
+                if (! index_range_kernel_is_supported (kernel))
+                    continue;
+                success &= run_benchmark (kernel, indices, index_counts[j],
+                                          index_sizes[i], total_indices);
+            }
+        }
+    }
+
+    free (buffer);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,240 @@
+/* Measures the throughput of the command ring buffer with one producer
+ * and one consumer thread, the same way the client and server threads
+ * use it. The previous implementation, which kept a single shared fill
+ * count updated with a full barrier on both sides, is reproduced here as
+ * "legacy" so that both can be compared on the same machine. "spsc"
+ * publishes every message on its own and "batched" publishes them in
+ * groups, the way the client does between flush points.
+ *
+ * usage: ring_buffer_benchmark [message count] [message size]
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include "ring_buffer.h"
+#include "thread_private.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct message {
+    size_t size;
+    size_t sequence;
+} message_t;
+
+typedef struct legacy_buffer {
+    void *address;
+    size_t length;
+    size_t tail;
+    size_t head;
+    volatile size_t fill_count;
+} legacy_buffer_t;
+
+typedef struct benchmark {
+    buffer_t buffer;
+    legacy_buffer_t legacy;
+    bool use_legacy;
+    size_t batch_size;
+    size_t message_count;
+    size_t message_size;
+    bool failed;
+} benchmark_t;
+
+static void *
+legacy_buffer_write_address (legacy_buffer_t *buffer, size_t *writable_bytes)
+{
+    *writable_bytes = (buffer->length - buffer->fill_count);
+    if (*writable_bytes == 0)
+        return NULL;
+    return ((char*)buffer->address + buffer->head);
+}
+
+static void
+legacy_buffer_write_advance (legacy_buffer_t *buffer, size_t count_bytes)
+{
+    buffer->head = (buffer->head + count_bytes) % buffer->length;
+    __sync_add_and_fetch (&buffer->fill_count, count_bytes);
+}
+
+static void *
+legacy_buffer_read_address (legacy_buffer_t *buffer, size_t *bytes_to_read)
+{
+    *bytes_to_read = buffer->fill_count;
+    if (*bytes_to_read == 0)
+        return NULL;
+    return ((char*) buffer->address + buffer->tail);
+}
+
+static void
+legacy_buffer_read_advance (legacy_buffer_t *buffer, size_t count_bytes)
+{
+    buffer->tail = (buffer->tail + count_bytes) % buffer->length;
+    __sync_sub_and_fetch (&buffer->fill_count, count_bytes);
+}
+
+static void
+pin_to_cpu (int cpu)
+{
+    int available_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (available_cpus < 2)
+        return;
+
+    cpu_set_t cpu_set;
+    CPU_ZERO (&cpu_set);
+    CPU_SET (cpu % available_cpus, &cpu_set);
+    pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), &cpu_set);
+}
+
+static void *
+consumer_thread_func (void *ptr)
+{
+    benchmark_t *benchmark = (benchmark_t *) ptr;
+    size_t expected = 0;
+
+    pin_to_cpu (1);
+
+    while (expected < benchmark->message_count) {
+        size_t bytes_to_read;
+        message_t *message;
+
+        if (benchmark->use_legacy)
+            message = legacy_buffer_read_address (&benchmark->legacy,
+                                                  &bytes_to_read);
+        else
+            message = buffer_read_address (&benchmark->buffer,
+                                           &bytes_to_read);
+        if (! message) {
+            sched_yield ();
+            continue;
+        }
+
+        if (message->sequence != expected)
+            benchmark->failed = true;
+        expected++;
+
+        if (benchmark->use_legacy)
+            legacy_buffer_read_advance (&benchmark->legacy, message->size);
+        else
+            buffer_read_advance (&benchmark->buffer, message->size);
+    }
+
+    return NULL;
+}
+
+static void
+producer_run (benchmark_t *benchmark)
+{
+    size_t i;
+
+    pin_to_cpu (0);
+
+    for (i = 0; i < benchmark->message_count; i++) {
+        message_t *message;
+
+        if (benchmark->use_legacy) {
+            size_t available_space;
+            message = legacy_buffer_write_address (&benchmark->legacy,
+                                                   &available_space);
+            while (! message || available_space < benchmark->message_size) {
+                sched_yield ();
+                message = legacy_buffer_write_address (&benchmark->legacy,
+                                                       &available_space);
+            }
+        } else {
+            message = buffer_write_address (&benchmark->buffer,
+                                            benchmark->message_size);
+            while (! message) {
+                buffer_publish (&benchmark->buffer);
+                sched_yield ();
+                message = buffer_write_address (&benchmark->buffer,
+                                                benchmark->message_size);
+            }
+        }
+
+        message->size = benchmark->message_size;
+        message->sequence = i;
+
+        if (benchmark->use_legacy)
+            legacy_buffer_write_advance (&benchmark->legacy,
+                                         benchmark->message_size);
+        else {
+            buffer_write_advance (&benchmark->buffer,
+                                  benchmark->message_size);
+            if ((i + 1) % benchmark->batch_size == 0)
+                buffer_publish (&benchmark->buffer);
+        }
+    }
+
+    if (! benchmark->use_legacy)
+        buffer_publish (&benchmark->buffer);
+}
+
+static double
+get_time_in_seconds ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static bool
+run_benchmark (benchmark_t *benchmark, bool use_legacy, size_t batch_size)
+{
+    thread_t consumer;
+
+    buffer_clear (&benchmark->buffer);
+    benchmark->legacy.head = benchmark->legacy.tail = 0;
+    benchmark->legacy.fill_count = 0;
+    benchmark->use_legacy = use_legacy;
+    benchmark->batch_size = batch_size;
+    benchmark->failed = false;
+
+    double start_time = get_time_in_seconds ();
+    pthread_create (&consumer, NULL, consumer_thread_func, benchmark);
+    producer_run (benchmark);
+    pthread_join (consumer, NULL);
+    double elapsed = get_time_in_seconds () - start_time;
+
+    printf ("%-8s %10zu messages of %4zu bytes: %8.3f s, %8.2f Mmsg/s, %9.2f MB/s%s\n",
+            use_legacy ? "legacy" : batch_size > 1 ? "batched" : "spsc",
+            benchmark->message_count, benchmark->message_size, elapsed,
+            benchmark->message_count / elapsed / 1e6,
+            benchmark->message_count * benchmark->message_size / elapsed / 1e6,
+            benchmark->failed ? " (FAILED)" : "");
+    return ! benchmark->failed;
+}
+
+int
+main (int argc, char **argv)
+{
+    benchmark_t *benchmark = NULL;
+    bool success = true;
+
+    if (posix_memalign ((void **) &benchmark, CACHE_LINE_SIZE,
+                        sizeof (benchmark_t)))
+        return EXIT_FAILURE;
+
+    benchmark->message_count = argc > 1 ? strtoul (argv[1], NULL, 10) : 10000000;
+    benchmark->message_size = argc > 2 ? strtoul (argv[2], NULL, 10) : 32;
+
+    /* Keep messages aligned like commands are. */
+    benchmark->message_size = (benchmark->message_size + 7) & ~7;
+    if (benchmark->message_size < sizeof (message_t))
+        benchmark->message_size = sizeof (message_t);
+
+    buffer_create (&benchmark->buffer, 512, "benchmark", 0);
+    benchmark->legacy.address = benchmark->buffer.address;
+    benchmark->legacy.length = benchmark->buffer.length;
+
+    success &= run_benchmark (benchmark, true, 1);
+    success &= run_benchmark (benchmark, false, 1);
+    success &= run_benchmark (benchmark, false, 64);
+
+    buffer_free (&benchmark->buffer);
+    free (benchmark);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,190 @@
+/* Measures the round-trip latency of a synchronous command: the client
+ * thread publishes a command and waits until the server thread has
+ * executed it, like glGetError () does. The previous implementation, in
+ * which both sides slept on semaphores, is reproduced here as "semaphore"
+ * and compared with the futex-based waiting in the ring buffer.
+ *
+ * usage: sync_latency_benchmark [round trips] [spin time in microseconds]
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include "ring_buffer.h"
+#include "thread_private.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct message {
+    size_t size;
+    unsigned int token;
+    bool quit;
+} message_t;
+
+typedef struct benchmark {
+    buffer_t buffer;
+    bool use_semaphores;
+    sem_t server_signal;
+    sem_t client_signal;
+    unsigned int last_token;
+    size_t round_trips;
+    uint64_t spin_time;
+    uint64_t *latencies;
+} benchmark_t;
+
+static void
+pin_to_cpu (int cpu)
+{
+    int available_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (available_cpus < 2)
+        return;
+
+    cpu_set_t cpu_set;
+    CPU_ZERO (&cpu_set);
+    CPU_SET (cpu % available_cpus, &cpu_set);
+    pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), &cpu_set);
+}
+
+static void *
+server_thread_func (void *ptr)
+{
+    benchmark_t *benchmark = (benchmark_t *) ptr;
+
+    pin_to_cpu (1);
+
+    while (true) {
+        size_t bytes_to_read;
+        message_t *message = buffer_read_address (&benchmark->buffer,
+                                                  &bytes_to_read);
+        while (! message) {
+            if (benchmark->use_semaphores)
+                sem_wait (&benchmark->server_signal);
+            else
+                buffer_wait_for_data (&benchmark->buffer, benchmark->spin_time);
+            message = buffer_read_address (&benchmark->buffer, &bytes_to_read);
+        }
+
+        bool quit = message->quit;
+        unsigned int token = message->token;
+
+        if (benchmark->use_semaphores) {
+            atomic_store_release (&benchmark->last_token, token);
+            buffer_read_advance (&benchmark->buffer, message->size);
+            sem_post (&benchmark->client_signal);
+        } else {
+            buffer_complete_token (&benchmark->buffer);
+            buffer_read_advance (&benchmark->buffer, message->size);
+        }
+
+        if (quit)
+            break;
+    }
+
+    return NULL;
+}
+
+static void
+run_command (benchmark_t *benchmark, unsigned int token, bool quit)
+{
+    message_t *message = buffer_wait_for_space (&benchmark->buffer,
+                                                sizeof (message_t));
+    message->size = sizeof (message_t);
+    message->token = token;
+    message->quit = quit;
+    buffer_write_advance (&benchmark->buffer, sizeof (message_t));
+    buffer_publish (&benchmark->buffer);
+
+    if (benchmark->use_semaphores) {
+        if (buffer_num_entries (&benchmark->buffer) == sizeof (message_t))
+            sem_post (&benchmark->server_signal);
+        while (atomic_load_acquire (&benchmark->last_token) < token)
+            sem_wait (&benchmark->client_signal);
+    } else {
+        buffer_signal_consumer (&benchmark->buffer);
+        buffer_wait_for_token (&benchmark->buffer, token, benchmark->spin_time);
+    }
+}
+
+static int
+compare_latencies (const void *a, const void *b)
+{
+    uint64_t first = *(const uint64_t *) a;
+    uint64_t second = *(const uint64_t *) b;
+    return first < second ? -1 : first > second;
+}
+
+static void
+run_benchmark (benchmark_t *benchmark, bool use_semaphores)
+{
+    thread_t server;
+    uint64_t total = 0;
+    size_t i;
+
+    buffer_clear (&benchmark->buffer);
+    sem_init (&benchmark->server_signal, 0, 0);
+    sem_init (&benchmark->client_signal, 0, 0);
+    benchmark->last_token = 0;
+    benchmark->use_semaphores = use_semaphores;
+
+    pin_to_cpu (0);
+    pthread_create (&server, NULL, server_thread_func, benchmark);
+
+    for (i = 0; i < benchmark->round_trips; i++) {
+        uint64_t start_time = get_monotonic_time_ns ();
+        run_command (benchmark, i + 1, false);
+        benchmark->latencies[i] = get_monotonic_time_ns () - start_time;
+        total += benchmark->latencies[i];
+    }
+
+    run_command (benchmark, benchmark->round_trips + 1, true);
+    pthread_join (server, NULL);
+    sem_destroy (&benchmark->server_signal);
+    sem_destroy (&benchmark->client_signal);
+
+    qsort (benchmark->latencies, benchmark->round_trips, sizeof (uint64_t),
+           compare_latencies);
+    printf ("%-10s %8zu round trips: mean %8.2f us, median %8.2f us, "
+            "99th percentile %8.2f us\n",
+            use_semaphores ? "semaphore" : "futex",
+            benchmark->round_trips,
+            total / 1e3 / benchmark->round_trips,
+            benchmark->latencies[benchmark->round_trips / 2] / 1e3,
+            benchmark->latencies[benchmark->round_trips * 99 / 100] / 1e3);
+}
+
+int
+main (int argc, char **argv)
+{
+    benchmark_t *benchmark = NULL;
+
+    if (posix_memalign ((void **) &benchmark, CACHE_LINE_SIZE,
+                        sizeof (benchmark_t)))
+        return EXIT_FAILURE;
+
+    benchmark->round_trips = argc > 1 ? strtoul (argv[1], NULL, 10) : 100000;
+    benchmark->spin_time = (argc > 2 ? strtoul (argv[2], NULL, 10) : 20) * 1000;
+    if (benchmark->round_trips == 0)
+        benchmark->round_trips = 1;
+
+    /* Like the client, don't spin when the other thread needs our cpu. */
+    if (sysconf (_SC_NPROCESSORS_ONLN) < 2)
+        benchmark->spin_time = 0;
+
+    benchmark->latencies = malloc (benchmark->round_trips * sizeof (uint64_t));
+    if (! benchmark->latencies)
+        return EXIT_FAILURE;
+
+    buffer_create (&benchmark->buffer, 512, "benchmark", 0);
+
+    run_benchmark (benchmark, true);
+    run_benchmark (benchmark, false);
+
+    buffer_free (&benchmark->buffer);
+    free (benchmark->latencies);
+    free (benchmark);
+    return EXIT_SUCCESS;
+}
@@ -3,9 +3,12 @@
 #include "caching_client.h"
 #include "caching_client_private.h"
 #include "client.h"
+#include "client_array_cache.h"
 #include "command.h"
 #include "enum_validation.h"
+#include "frame_cache.h"
 #include "egl_state.h"
+#include "index_range.h"
 #include "name_handler.h"
 #include "types_private.h"
 #include <EGL/eglext.h>
@@ -218,17 +221,52 @@ _caching_client_destroy_surface (client_t *client,
     mutex_unlock (cached_gl_states_mutex);
 }
 
+/* Rebuilds the masks and the count of client-side arrays of |list| after
+ * its entries changed. */
 static void
-_set_vertex_pointers (vertex_attrib_list_t *list,
-                      vertex_attrib_t *new_attrib)
+_update_vertex_attrib_masks (vertex_attrib_list_t *list)
 {
-    if (! new_attrib->array_enabled)
-        return;
-    void *pointer = new_attrib->pointer;
-    if (! list->first_index_pointer || pointer < list->first_index_pointer->pointer)
-        list->first_index_pointer = new_attrib;
-    if ( ! list->last_index_pointer || pointer > list->last_index_pointer->pointer)
-        list->last_index_pointer = new_attrib;
+    vertex_attrib_t *attribs = list->attribs;
+    int i;
+
+    list->enabled_mask = 0;
+    list->buffer_mask = 0;
+    list->enabled_count = 0;
+
+    for (i = 0; i < list->count; i++) {
+        if (i < NUM_EMBEDDED) {
+            if (attribs[i].array_enabled)
+                list->enabled_mask |= 1u << i;
+            if (attribs[i].array_buffer_binding)
+                list->buffer_mask |= 1u << i;
+        }
+        if (attribs[i].array_enabled && ! attribs[i].array_buffer_binding)
+            list->enabled_count++;
+    }
+}
+
+/* Returns the entry of the next enabled client-side array after |slot|,
+ * or -1 once there are none left. Pass -1 for the first one. */
+static inline int
+_next_client_array (vertex_attrib_list_t *list,
+                    int slot)
+{
+    uint32_t mask;
+
+    slot++;
+    if (slot < NUM_EMBEDDED) {
+        mask = (list->enabled_mask & ~list->buffer_mask) >> slot;
+        if (mask)
+            return slot + __builtin_ctz (mask);
+        slot = NUM_EMBEDDED;
+    }
+
+    for (; slot < list->count; slot++) {
+        if (list->attribs[slot].array_enabled &&
+            ! list->attribs[slot].array_buffer_binding)
+            return slot;
+    }
+    return -1;
 }
 
 /* GLES2 core profile API */
@@ -308,6 +346,7 @@ caching_client_glBindBuffer (void* client, GLenum target, GLuint buffer)
                     attribs[i].current_attrib[3] = 1;
                 }
             }
+            _update_vertex_attrib_masks (attrib_list);
         }
     }
     else if (target == GL_ELEMENT_ARRAY_BUFFER) {
@@ -581,6 +620,33 @@ caching_client_glBlendFuncSeparate (void* client, GLenum srcRGB, GLenum dstRGB,
     CACHING_CLIENT(client)->super_dispatch.glBlendFuncSeparate (client, srcRGB, dstRGB, srcAlpha, dstAlpha);
 }
 
+/* Sends |data| to the bound buffer object one chunk at a time. */
+static void
+caching_client_stream_buffer_sub_data (void *client, GLenum target,
+                                       GLintptr offset, GLsizeiptr size,
+                                       const GLvoid *data)
+{
+    GLsizeiptr chunk_size = client_get_stream_chunk_size (CLIENT (client));
+
+    while (size > 0) {
+        GLsizeiptr chunk = size < chunk_size ? size : chunk_size;
+
+        CACHING_CLIENT(client)->super_dispatch.glBufferSubData (client, target,
+                                                                offset, chunk,
+                                                                data);
+        offset += chunk;
+        data = (const char *) data + chunk;
+        size -= chunk;
+    }
+}
+
+static bool
+caching_client_should_stream (void *client, size_t size)
+{
+    return size > COMMAND_MAX_INLINE_PAYLOAD &&
+           size > client_get_stream_chunk_size (CLIENT (client));
+}
+
 static void
 caching_client_glBufferData (void *client, GLenum target, GLsizeiptr size,
                              const GLvoid *data, GLenum usage)
@@ -621,6 +687,10 @@ caching_client_glBufferData (void *client, GLenum target, GLsizeiptr size,
         buf_obj = state->element_array_buffer_binding_object;
 
         if (buf_obj) {
+            if (buf_obj->index_ranges) {
+                index_range_cache_destroy (buf_obj->index_ranges);
+                buf_obj->index_ranges = NULL;
+            }
             if (buf_obj->size != size) {
                 if (buf_obj->data) {
                     free (buf_obj->data);
@@ -640,6 +710,13 @@ caching_client_glBufferData (void *client, GLenum target, GLsizeiptr size,
         }
     }
 
+    if (data && caching_client_should_stream (client, size)) {
+        CACHING_CLIENT(client)->super_dispatch.glBufferData (client, target,
+                                                             size, NULL, usage);
+        caching_client_stream_buffer_sub_data (client, target, 0, size, data);
+        return;
+    }
+
     CACHING_CLIENT(client)->super_dispatch.glBufferData (client, target,
                                                          size, data, usage);
 }
@@ -681,8 +758,15 @@ caching_client_glBufferSubData (void *client, GLenum target,
         }
         if (data && buf_obj->data)
             memcpy (buf_obj->data + offset, data, size);
+        if (buf_obj->index_ranges)
+            index_range_cache_invalidate (buf_obj->index_ranges, offset, size);
     }
     
+    if (data && caching_client_should_stream (client, size)) {
+        caching_client_stream_buffer_sub_data (client, target, offset, size, data);
+        return;
+    }
+
     CACHING_CLIENT(client)->super_dispatch.glBufferSubData (client, target,
                                                             offset, size,
                                                             data);
@@ -1213,55 +1297,19 @@ caching_client_glShaderSource (void *client, GLuint shader, GLsizei count,
     if (!cached_shader)
         return;
 
-    GLint *caching_client_length = NULL;
-    if (length != NULL) {
-        size_t lengths_size = sizeof (GLint *) * count;
-        caching_client_length = malloc (lengths_size);
-        memcpy (caching_client_length, length, lengths_size);
-    }
-
-    char **caching_client_string;
-    caching_client_string = malloc (sizeof (GLchar *) * count);
-
     unsigned i = 0;
-    int n;
-    bool null_terminated = false;
-
     for (i = 0; i < count; i++) {
         if (! string[i]) {
-            if (caching_client_length)
-                free (caching_client_length);
-            for (n = 0; n < i; n++)
-                free (caching_client_string[n]);
-            free (caching_client_string);
             caching_client_glSetError (client, GL_INVALID_OPERATION);
-	    return;
+            return;
         }
-
-        size_t string_length = length ? length[i] : strlen (string[i]);
-        if (string_length < 0)
-            string_length = strlen (string[i]);
-
-        if (!length || length[i] < 0)
-            null_terminated = true;
-        else
-            null_terminated = false;
-
-        if (null_terminated)
-            caching_client_string[i] = malloc (string_length + 1);
-        else
-            caching_client_string[i] = malloc (string_length);
-
-        memcpy (caching_client_string[i], string[i], string_length);
-        if (null_terminated)
-            caching_client_string[i][string_length] = 0;
     }
 
     caching_client_set_needs_get_error (CLIENT (client));
 
+    /* The command copies the strings, so they can be passed as they are. */
     CACHING_CLIENT(client)->super_dispatch.glShaderSource(client, shader, count,
-                                                          (const char **)caching_client_string,
-                                                          caching_client_length);
+                                                          string, length);
 }
 
 static void
@@ -1510,6 +1558,7 @@ caching_client_glDeleteBuffers (void* client, GLsizei n, const GLuint *buffers)
             }
         }
     }
+    _update_vertex_attrib_masks (attrib_list);
 }
 
 static void inline
@@ -1904,33 +1953,9 @@ caching_client_glSetVertexAttribArray (void* client,
 
     /* update client state */
     if (found_index != -1) {
-        if (bound_buffer) {
+        if (bound_buffer)
             attribs[found_index].array_buffer_binding = bound_buffer;
-            if (enable) 
-                attrib_list->enabled_count++;
-            else
-                attrib_list->enabled_count--;
-        }
-        else {
-            if (enable) {
-                attrib_list->enabled_count++;
-                _set_vertex_pointers (attrib_list, &attribs[found_index]);
-            }
-            else {
-                if (&attribs[found_index] == attrib_list->first_index_pointer)
-                    attrib_list->first_index_pointer = 0;
-                if (&attribs[found_index] == attrib_list->last_index_pointer)
-                    attrib_list->last_index_pointer = 0;
-
-                attrib_list->enabled_count = 0;
-                for (i = 0; i < attrib_list->count; i++) {
-                    if (attribs[i].array_enabled && !attribs[i].array_buffer_binding) {
-                        attrib_list->enabled_count++;
-                        _set_vertex_pointers (attrib_list, &attribs[i]);
-                    }
-                }
-            }
-        }
+        _update_vertex_attrib_masks (attrib_list);
         return;
     }
 
@@ -1945,13 +1970,6 @@ caching_client_glSetVertexAttribArray (void* client,
         attribs[i].data = NULL;
         attribs[i].array_buffer_binding = bound_buffer;
         attrib_list->count ++;
-    
-        if (! bound_buffer) {
-            if (enable) {
-                attrib_list->enabled_count++;
-                _set_vertex_pointers (attrib_list, &attribs[i]);
-            }
-        }
     }
     else {
         vertex_attrib_t *new_attribs =
@@ -1971,15 +1989,9 @@ caching_client_glSetVertexAttribArray (void* client,
         new_attribs[count].data = NULL;
         new_attribs[count].array_buffer_binding = bound_buffer;
         attrib_list->attribs = new_attribs;
-
-        if (! bound_buffer) {
-            if (enable) {
-                attrib_list->enabled_count++;
-                _set_vertex_pointers (attrib_list, &new_attribs[count]);
-            }
-        }
         attrib_list->count ++;
     }
+    _update_vertex_attrib_masks (attrib_list);
 }
 
 static inline int
@@ -2019,28 +2031,52 @@ caching_client_glEnableVertexAttribArray (void* client, GLuint index)
     caching_client_glSetVertexAttribArray (client, index, state, GL_TRUE);
 }
 
-static char *
-_create_data_array (vertex_attrib_t *attrib, int count)
+static size_t
+_get_data_array_size (vertex_attrib_t *attrib, int count)
+{
+    return _get_data_size (attrib->type) * attrib->size * count;
+}
+
+static size_t
+_get_data_stride (vertex_attrib_t *attrib)
+{
+    return attrib->stride ? (size_t) attrib->stride :
+                            _get_data_array_size (attrib, 1);
+}
+
+/* Copies the elements |first| to |first + count - 1| of a client-side
+ * array, without the stride. */
+static void
+_copy_data_array (vertex_attrib_t *attrib, size_t first, int count, char *data)
 {
     int i;
+    size_t size = _get_data_array_size (attrib, 1);
+    size_t stride = _get_data_stride (attrib);
+    const char *pointer = (const char *) attrib->pointer + first * stride;
+
+    if (size == stride)
+        memcpy (data, pointer, size * count);
+    else {
+        for (i = 0; i < count; i++)
+            memcpy (data + i * size, pointer + stride * i, size);
+    }
+}
+
+static char *
+_create_data_array (vertex_attrib_t *attrib, size_t first, int count)
+{
     char *data = NULL;
-    int size = 0;
+    size_t size = 0;
 
     INSTRUMENT();
 
-    size = _get_data_size (attrib->type);
+    size = _get_data_array_size (attrib, count);
 
     if (size == 0)
         return NULL;
 
-    data = (char *)malloc (size * count * attrib->size);
-
-    if (attrib->size * size == attrib->stride || attrib->stride == 0)
-        memcpy (data, attrib->pointer, attrib->size * size * count);
-    else {
-        for (i = 0; i < count; i++)
-            memcpy (data + i * attrib->size * size, attrib->pointer + attrib->stride * i, attrib->size * size);
-    }
+    data = (char *) memory_pool_alloc (size);
+    _copy_data_array (attrib, first, count, data);
 
     return data;
 }
@@ -2054,7 +2090,7 @@ caching_client_clear_attribute_list_data (client_t *client)
     vertex_attrib_list_t *attrib_list = &state->vertex_attribs;
 
     int i = -1;
-    for (i = 0; i < attrib_list->count; i++)
+    while ((i = _next_client_array (attrib_list, i)) != -1)
         attrib_list->attribs[i].data = NULL;
 }
 
@@ -2067,48 +2103,244 @@ client_has_vertex_attrib_array_set (client_t *client)
     vertex_attrib_list_t *attrib_list = &state->vertex_attribs;
     vertex_attrib_t *attribs = attrib_list->attribs;
 
+    if (attrib_list->enabled_mask || attrib_list->buffer_mask)
+        return true;
+
     int i;
-    for (i = 0; i < attrib_list->count; i++) {
+    for (i = NUM_EMBEDDED; i < attrib_list->count; i++) {
         if (attribs[i].array_enabled || attribs[i].array_buffer_binding)
             return true;
     }
     return false;
 }
 
+/* The bytes of client memory that a draw reads, which the arrays that
+ * overlap, like interleaved ones, share. */
+typedef struct client_array_span {
+    const char *start;
+    const char *end;
+} client_array_span_t;
+
+/* Whether the entry |slot| of the client-side arrays is read from a
+ * buffer of the client array cache in this draw. */
+static inline bool
+_is_cached_client_array (uint32_t cached_mask,
+                         int slot)
+{
+    return slot < NUM_EMBEDDED && (cached_mask >> slot) & 1;
+}
+
+/* Fills |spans| with the bytes that the vertices |first| to
+ * |first + count - 1| take in the enabled client-side arrays that aren't
+ * in |cached_mask|, sorted and merged where they overlap, and returns the
+ * size they need in the command buffer. |spans| must have room for
+ * NUM_EMBEDDED of them. */
 static size_t
-caching_client_vertex_attribs_array_size (client_t *client,
-                                          size_t count)
+caching_client_client_array_spans (vertex_attrib_list_t *attrib_list,
+                                   size_t first,
+                                   size_t count,
+                                   uint32_t cached_mask,
+                                   client_array_span_t *spans,
+                                   int *span_count)
 {
-    egl_state_t *state = client_get_current_state (CLIENT (client));
-    if (! state)
+    vertex_attrib_t *attribs = attrib_list->attribs;
+    size_t size = 0;
+    int n = 0;
+    int i = -1;
+    int j;
+
+    while ((i = _next_client_array (attrib_list, i)) != -1) {
+        size_t stride = _get_data_stride (&attribs[i]);
+        client_array_span_t span;
+
+        if (! stride || _is_cached_client_array (cached_mask, i))
+            continue;
+        span.start = (const char *) attribs[i].pointer + first * stride;
+        span.end = span.start + stride * (count - 1) +
+                   _get_data_array_size (&attribs[i], 1);
+
+        for (j = n; j > 0 && spans[j - 1].start > span.start; j--)
+            spans[j] = spans[j - 1];
+        spans[j] = span;
+        n++;
+    }
+
+    *span_count = 0;
+    for (i = 0; i < n; i++) {
+        if (*span_count && spans[i].start <= spans[*span_count - 1].end) {
+            if (spans[i].end > spans[*span_count - 1].end)
+                spans[*span_count - 1].end = spans[i].end;
+        } else
+            spans[(*span_count)++] = spans[i];
+    }
+
+    for (i = 0; i < *span_count; i++)
+        size += COMMAND_ALIGN (spans[i].end - spans[i].start);
+    return size;
+}
+
+/* The size of the enabled client-side arrays that aren't in |cached_mask|
+ * once their strides have been removed. */
+static size_t
+caching_client_packed_arrays_size (vertex_attrib_list_t *attrib_list,
+                                   size_t count,
+                                   uint32_t cached_mask)
+{
+    size_t size = 0;
+    int i = -1;
+
+    while ((i = _next_client_array (attrib_list, i)) != -1) {
+        if (! _is_cached_client_array (cached_mask, i))
+            size += COMMAND_ALIGN (_get_data_array_size (&attrib_list->attribs[i], count));
+    }
+    return size;
+}
+
+/* Returns the buffer of the client array cache that holds the |size| bytes
+ * at |data|, which it copies them to if they were seen before, bound to
+ * |target|, or 0 if the cache has none. */
+static GLuint
+caching_client_get_cached_client_array (client_t *client,
+                                        egl_state_t *state,
+                                        GLenum target,
+                                        const void *data,
+                                        size_t size)
+{
+    uint64_t hash;
+    bool upload;
+    GLuint buffer = client_array_cache_lookup (state->client_array_cache,
+                                               data, size, &hash, &upload);
+
+    if (! buffer && ! upload)
         return 0;
+
+    if (! buffer) {
+        mutex_lock (cached_shared_states_mutex);
+        name_handler_alloc_names (egl_state_get_array_buffer_name_handler (state), 1, &buffer);
+        hash_insert (state->array_buffer_cache, buffer, NULL);
+        mutex_unlock (cached_shared_states_mutex);
+
+        CACHING_CLIENT(client)->super_dispatch.glGenBuffers (client, 1, &buffer);
+    }
+    CACHING_CLIENT(client)->super_dispatch.glBindBuffer (client, target, buffer);
+    if (! upload)
+        return buffer;
+
+    if (caching_client_should_stream (client, size)) {
+        CACHING_CLIENT(client)->super_dispatch.glBufferData (client, target, size,
+                                                             NULL, GL_STATIC_DRAW);
+        caching_client_stream_buffer_sub_data (client, target, 0, size, data);
+    } else
+        CACHING_CLIENT(client)->super_dispatch.glBufferData (client, target, size,
+                                                             data, GL_STATIC_DRAW);
+    client_array_cache_add (state->client_array_cache, hash, size, buffer);
+    return buffer;
+}
+
+/* Deletes the buffers of the client array cache that it has no room for
+ * anymore, once the draw that may read them is in the command buffer. */
+static void
+caching_client_evict_cached_client_arrays (client_t *client,
+                                           egl_state_t *state)
+{
+    GLuint buffer;
+
+    if (! state->client_array_cache)
+        return;
+
+    while ((buffer = client_array_cache_evict (state->client_array_cache))) {
+        CACHING_CLIENT(client)->super_dispatch.glDeleteBuffers (client, 1, &buffer);
+
+        mutex_lock (cached_shared_states_mutex);
+        name_handler_delete_names (egl_state_get_array_buffer_name_handler (state), 1, &buffer);
+        hash_remove (state->array_buffer_cache, buffer);
+        mutex_unlock (cached_shared_states_mutex);
+    }
+}
+
+/* Points the client-side arrays whose bytes the client array cache holds
+ * at its buffers, and returns the mask of their entries. Unlike the copies
+ * in the command buffer, the buffers can't be addressed below the array
+ * pointers, so the bytes of each array start at its pointer rather than at
+ * vertex |first|. */
+static uint32_t
+caching_client_use_cached_client_arrays (client_t *client,
+                                         egl_state_t *state,
+                                         size_t first,
+                                         size_t count)
+{
     vertex_attrib_list_t *attrib_list = &state->vertex_attribs;
+    vertex_attrib_t *attribs = attrib_list->attribs;
+    client_array_span_t spans[NUM_EMBEDDED];
+    uint32_t cached_mask = 0;
+    bool bound = false;
+    int span_count;
+    int i, j;
 
-    vertex_attrib_t *last_pointer = attrib_list->last_index_pointer;
-    if (! last_pointer)
-        return 0;
-    if (! last_pointer->array_enabled || last_pointer->array_buffer_binding)
-        return 0;
+    caching_client_client_array_spans (attrib_list, 0, first + count, 0,
+                                       spans, &span_count);
 
-    int data_size = _get_data_size (last_pointer->type);
-    if (data_size == 0)
-        return 0;
+    for (j = 0; j < span_count; j++) {
+        GLuint buffer = caching_client_get_cached_client_array (
+            client, state, GL_ARRAY_BUFFER, spans[j].start,
+            spans[j].end - spans[j].start);
+        if (! buffer)
+            continue;
+        bound = true;
+
+        i = -1;
+        while ((i = _next_client_array (attrib_list, i)) != -1 && i < NUM_EMBEDDED) {
+            const char *pointer = attribs[i].pointer;
+            command_t *attrib_command;
 
-    unsigned int stride = last_pointer->stride ? last_pointer->stride :
-                                                 (last_pointer->size * data_size);
-    return stride * count + (char *)last_pointer->pointer - (char*) attrib_list->first_index_pointer->pointer;
+            if (! _get_data_stride (&attribs[i]) ||
+                pointer < spans[j].start || pointer >= spans[j].end)
+                continue;
+
+            attrib_command = client_get_space_for_command (COMMAND_GLVERTEXATTRIBPOINTER);
+            command_glvertexattribpointer_init (attrib_command,
+                                                attribs[i].index,
+                                                attribs[i].size,
+                                                attribs[i].type,
+                                                attribs[i].array_normalized,
+                                                attribs[i].stride,
+                                                (const void *) (pointer - spans[j].start));
+            client_run_command_async (attrib_command);
+            cached_mask |= 1u << i;
+        }
+    }
+
+    if (bound)
+        CACHING_CLIENT(client)->super_dispatch.glBindBuffer (client, GL_ARRAY_BUFFER,
+                                                             state->array_buffer_binding);
+    return cached_mask;
 }
 
+/* Only the vertices |first| to |first + count - 1| of the client-side
+ * arrays are copied. Each copy is written at an offset, so that the
+ * pointers still address vertex |first| at |first| strides.
+ *
+ * When the arrays are too large for the command buffer, they are copied
+ * to the transfer buffer, along with room for |index_array_size| bytes of
+ * indices at |*transfer_data|, or to the heap if that fails too, unless
+ * the server runs in another process and can't read them there. When
+ * |*transfer_data| is set the draw command must be flagged with
+ * COMMAND_FLAG_TRANSFER_PAYLOAD.
+ *
+ * The arrays that the client array cache holds aren't copied at all. */
 static void
 caching_client_setup_vertex_attrib_pointer_if_necessary (client_t *client,
+                                                         size_t first,
                                                          size_t count,
                                                          link_list_t **allocated_data_arrays,
                                                          command_t **command,
                                                          size_t *array_size,
+                                                         char **transfer_data,
                                                          size_t index_array_size,
                                                          bool is_draw_elements)
 {
-    int i = 0;
+    int i = -1;
+    int j;
 
     INSTRUMENT();
 
@@ -2118,51 +2350,106 @@ caching_client_setup_vertex_attrib_pointer_if_necessary (client_t *client,
     vertex_attrib_list_t *attrib_list = &state->vertex_attribs;
     vertex_attrib_t *attribs = attrib_list->attribs;
 
+    if (! attrib_list->enabled_count || ! count)
+        return;
+
+    uint32_t cached_mask = 0;
+    if (state->client_array_cache && attrib_list->enabled_count <= NUM_EMBEDDED)
+        cached_mask = caching_client_use_cached_client_arrays (client, state,
+                                                               first, count);
+    int copied_count = attrib_list->enabled_count - __builtin_popcount (cached_mask);
+    if (! copied_count)
+        return;
+
     size_t draw_command_size = is_draw_elements ?
         command_get_size (COMMAND_GLDRAWELEMENTS) :
         command_get_size (COMMAND_GLDRAWARRAYS);
     size_t commands_size =
-        command_get_size (COMMAND_GLVERTEXATTRIBPOINTER) * attrib_list->enabled_count +
+        command_get_size (COMMAND_GLVERTEXATTRIBPOINTER) * copied_count +
         draw_command_size;
 
-    *array_size = caching_client_vertex_attribs_array_size (client, count);
-    if (!*array_size)
-        return;
-
-    bool fits_in_one_array = *array_size < ATTRIB_BUFFER_SIZE;
+    client_array_span_t spans[NUM_EMBEDDED];
+    int span_count = 0;
+    if (attrib_list->enabled_count <= NUM_EMBEDDED)
+        *array_size = caching_client_client_array_spans (attrib_list, first, count,
+                                                         cached_mask, spans,
+                                                         &span_count);
+
+    /* The command buffer may be configured smaller than the attribute
+     * buffer size, and a single reservation has to fit in it. */
+    size_t reserved_size = commands_size + COMMAND_ALIGN (*array_size + index_array_size);
+    bool fits_in_one_array = *array_size && *array_size < ATTRIB_BUFFER_SIZE &&
+        reserved_size <= client->buffer.length;
     command_t *glDraw_command = NULL;
+    char *span_data[NUM_EMBEDDED];
     if (fits_in_one_array) {
-        *command = client_get_space_for_size (client, commands_size + *array_size + index_array_size);
+        *command = client_get_space_for_size (client, reserved_size);
 
         glDraw_command = (command_t *)((char*)*command +
-                                       command_get_size (COMMAND_GLVERTEXATTRIBPOINTER) * attrib_list->enabled_count);
+                                       command_get_size (COMMAND_GLVERTEXATTRIBPOINTER) * copied_count);
+
+        char *data = (char *)*command + commands_size;
+        for (j = 0; j < span_count; j++) {
+            span_data[j] = data;
+            memcpy (data, spans[j].start, spans[j].end - spans[j].start);
+            data += COMMAND_ALIGN (spans[j].end - spans[j].start);
+        }
+    } else {
+        size_t transfer_size =
+            caching_client_packed_arrays_size (attrib_list, count, cached_mask) +
+            index_array_size;
 
-        memcpy ((char *)*command + commands_size,
-                attrib_list->first_index_pointer->pointer,
-                *array_size);
+        *array_size = 0;
+        *transfer_data = client_allocate_transfer (client, transfer_size);
+        if (! *transfer_data && client_is_remote (client))
+            client_abort_remote_heap_payload (transfer_size);
     }
 
     int attrib_count = 0;
-    for (i = 0; i < attrib_list->count; i++) {
+    frame_cache_set_client_arrays (client, true);
+    while ((i = _next_client_array (attrib_list, i)) != -1) {
         command_t *attrib_command = NULL;
 
-        if (! attribs[i].array_enabled || attribs[i].array_buffer_binding) {
+        if (_is_cached_client_array (cached_mask, i))
             continue;
-        }
 
         if (fits_in_one_array) {
-            attribs[i].data = (char *)attribs[i].pointer - (char *)attrib_list->first_index_pointer->pointer +
-                (char *)*command + commands_size;
+            size_t stride = _get_data_stride (&attribs[i]);
+            const char *start = (const char *) attribs[i].pointer + first * stride;
+
             attrib_command = (command_t *)((char *)*command +
                                            command_get_size (COMMAND_GLVERTEXATTRIBPOINTER) * attrib_count);
-            attrib_command->type = COMMAND_GLVERTEXATTRIBPOINTER;
+            attrib_command->flags = 0;
             attrib_command->size = command_get_size (COMMAND_GLVERTEXATTRIBPOINTER);
-            attrib_command->token = 0;
+            attrib_count++;
+
+            /* An array whose element size is unknown, as its type is
+             * or its size is 0, has no span, but its slot before the
+             * draw still has to hold a command. */
+            if (! stride) {
+                attrib_command->type = COMMAND_NO_OP;
+                client_run_command_async (attrib_command);
+                continue;
+            }
+            attrib_command->type = COMMAND_GLVERTEXATTRIBPOINTER;
+
+            for (j = span_count - 1; j > 0 && spans[j].start > start; j--)
+                ;
+            attribs[i].data = span_data[j] + ((const char *) attribs[i].pointer - spans[j].start);
+        } else if (*transfer_data) {
+            size_t data_array_size = _get_data_array_size (&attribs[i], count);
+            if (! data_array_size)
+                continue;
+            _copy_data_array (&attribs[i], first, count, *transfer_data);
+            attribs[i].data = *transfer_data - first * _get_data_array_size (&attribs[i], 1);
+            *transfer_data += COMMAND_ALIGN (data_array_size);
+            attrib_command = client_get_space_for_command (COMMAND_GLVERTEXATTRIBPOINTER);
         } else {
-            attribs[i].data = _create_data_array (&attribs[i], count);
-            if (! attribs[i].data)
+            char *data = _create_data_array (&attribs[i], first, count);
+            if (! data)
                 continue;
-            link_list_prepend (allocated_data_arrays, attribs[i].data, free);
+            link_list_prepend (allocated_data_arrays, data, memory_pool_free);
+            attribs[i].data = data - first * _get_data_array_size (&attribs[i], 1);
             attrib_command = client_get_space_for_command (COMMAND_GLVERTEXATTRIBPOINTER);
         }
 
@@ -2183,9 +2470,8 @@ caching_client_setup_vertex_attrib_pointer_if_necessary (client_t *client,
                                             0,
                                             (const void *)attribs[i].data);
         client_run_command_async (attrib_command);
-
-        attrib_count++;
     }
+    frame_cache_set_client_arrays (client, false);
 
     if (fits_in_one_array)
         *command = glDraw_command;
@@ -2240,143 +2526,95 @@ caching_client_glDrawArrays (void* client,
     link_list_t *arrays_to_free = NULL;
     command_t *command = NULL;
     size_t array_size = 0;
+    char *transfer_data = NULL;
     if (! state->vertex_array_binding) {
-        size_t true_count = first > 0 ? first + count : count;
         caching_client_setup_vertex_attrib_pointer_if_necessary (CLIENT(client),
-                                                                 true_count,
+                                                                 first,
+                                                                 count,
                                                                  &arrays_to_free,
                                                                  &command,
                                                                  &array_size,
+                                                                 &transfer_data,
                                                                  0, 0);
     }
 
-    if (!command)
+    if (!command) {
         command = client_get_space_for_command (COMMAND_GLDRAWARRAYS);
-    else {
+        if (transfer_data)
+            command->flags = COMMAND_FLAG_TRANSFER_PAYLOAD;
+    } else {
         command->type = COMMAND_GLDRAWARRAYS;
-        command->size = command_get_size (COMMAND_GLDRAWARRAYS) + array_size;
-        command->token = 0;
+        command->flags = 0;
+        command->size = COMMAND_ALIGN (command_get_size (COMMAND_GLDRAWARRAYS) + array_size);
     }
 
     command_gldrawarrays_init (command, mode, first, count);
     ((command_gldrawarrays_t *) command)->arrays_to_free = arrays_to_free;
-     client_run_command_async (command);
+    client_run_command_async (command);
+    caching_client_evict_cached_client_arrays (CLIENT (client), state);
+    if (! frame_cache_holds_replay (CLIENT (client)))
+        client_flush (CLIENT (client));
 
     caching_client_clear_attribute_list_data (CLIENT(client));
     if (framebuffer && framebuffer->id && framebuffer->complete == FRAMEBUFFER_COMPLETE_UNKNOWN)
         caching_client_set_needs_get_error (CLIENT (client));
 }
 
-#ifdef __ARM_NEON__
-#include <arm_neon.h>
-union __char_result {
-    unsigned char     chars[16];
-    uint8x16_t result;
-};
-
-union __short_result {
-    uint16x8_t result;
-    unsigned short shorts[8];
-};
-
+/* Returns the number of vertices from the smallest to the largest of the
+ * |count| indices, and sets |*first| to the smallest. */
 static size_t
-_get_elements_count (GLenum type, const GLvoid *indices, GLsizei count)
+_get_elements_range (GLenum type, const GLvoid *indices, GLsizei count,
+                     size_t *first)
 {
-    uint8x16_t *char_indices;
-    unsigned char *char_idx;
-    uint16x8_t *short_indices;
-    unsigned short *short_idx;
-
-    size_t elements_count = 0;
-    int i;
-    int num;
-    int remain;
-    int j;
-
-    union __short_result short_result = { {0, 0, 0, 0,
-                                           0, 0, 0, 0} };
-    union __char_result char_result = { {0, 0, 0, 0,
-                                        0, 0, 0, 0,
-                                        0, 0, 0, 0,
-                                        0, 0, 0, 0 } };
+    uint32_t min_index;
+    uint32_t max_index;
+    size_t index_size = type == GL_UNSIGNED_BYTE ? sizeof (GLubyte) :
+                        type == GL_UNSIGNED_SHORT ? sizeof (GLushort) :
+                                                    sizeof (GLuint);
 
     INSTRUMENT();
 
-    if (type == GL_UNSIGNED_BYTE) {
-        num = count / 16;
-        remain = count - num * 16;
-    }
-    else {
-        num = count / 8;
-        remain = count - num * 8;
-    }
-
-    if (type == GL_UNSIGNED_BYTE) {
-        char_indices = (uint8x16_t *)indices;
-        for (i = 0; i < num ; i++) {
-            char_result.result = vmaxq_u8 (*(char_indices + i),
-                                           char_result.result);
-        }
-        char_idx = (unsigned char *)char_result.chars;
-        for (j = 0; j < 16; j++) {
-            if (elements_count < (size_t)char_idx[j])
-                elements_count = (size_t)char_idx[j];
-        }
-        char_idx = (unsigned char *)indices + num * 16;
-        for (i = 0; i < remain; i++) {
-            if ((size_t) char_idx[i] > elements_count)
-                elements_count = (size_t) char_idx[i];
-        }
-    }
-    else {
-        short_indices = (uint16x8_t *)indices;
-        for (i = 0; i < num ; i++) {
-            short_result.result = vmaxq_u16 (*(short_indices + i),
-                                             short_result.result);
-        }
-        short_idx = (unsigned short *)short_result.shorts;
-        for (j = 0; j < 8; j++) {
-            if (elements_count < (size_t)short_idx[j])
-                elements_count = (size_t)short_idx[j];
-        }
-        short_idx = (unsigned short *)indices + num * 8;
-        for (i = 0; i < (size_t) remain; i++) {
-            if ((size_t)short_idx[i] > elements_count)
-                elements_count = (size_t)short_idx[i];
-        }
-    }
+    index_range_scan (indices, count, index_size, &min_index, &max_index);
 
-    return elements_count + 1;
+    *first = min_index;
+    return (size_t) max_index - min_index + 1;
 }
-#else
+
+/* The same for indices in an element array buffer, at |offset| bytes,
+ * which the buffer caches. Returns 0 if they aren't all in the buffer. */
 static size_t
-_get_elements_count (GLenum type, const GLvoid *indices, GLsizei count)
+_get_buffer_elements_range (array_buffer_t *buffer, GLenum type,
+                            GLintptr offset, GLsizei count, size_t *first)
 {
-    unsigned char *char_indices = NULL;
-    unsigned short *short_indices = NULL;
-    size_t elements_count = 0;
-    size_t i;
+    uint32_t min_index;
+    uint32_t max_index;
+    size_t index_size = type == GL_UNSIGNED_BYTE ? sizeof (GLubyte) :
+                        type == GL_UNSIGNED_SHORT ? sizeof (GLushort) :
+                                                    sizeof (GLuint);
 
     INSTRUMENT();
 
-    if (type == GL_UNSIGNED_BYTE) {
-        char_indices = (unsigned char *)indices;
-        for (i = 0; i < (size_t) count; i++) {
-            if ((size_t) char_indices[i] > elements_count)
-                elements_count = (size_t) char_indices[i];
-        }
-    }
-    else {
-        short_indices = (unsigned short *)indices;
-        for (i = 0; i < (size_t) count; i++) {
-            if ((size_t)short_indices[i] > elements_count) 
-                elements_count = (size_t)short_indices[i];
-        }
+    if (! buffer || ! buffer->data || offset < 0)
+        return 0;
+
+    if (! buffer->index_ranges)
+        buffer->index_ranges = index_range_cache_new (buffer->size);
+    if (buffer->index_ranges) {
+        if (! index_range_cache_scan (buffer->index_ranges, buffer->data,
+                                      offset, count, index_size,
+                                      &min_index, &max_index))
+            return 0;
+    } else {
+        if ((size_t) offset > (size_t) buffer->size ||
+            (size_t) count > ((size_t) buffer->size - offset) / index_size)
+            return 0;
+        index_range_scan (buffer->data + offset, count, index_size,
+                          &min_index, &max_index);
     }
 
-    return elements_count + 1;
+    *first = min_index;
+    return (size_t) max_index - min_index + 1;
 }
-#endif
 
 static size_t
 calculate_index_array_size (GLenum type,
@@ -2455,47 +2693,99 @@ caching_client_glDrawElements (void* client,
     char* indices_to_pass = (char*) indices;
     command_gldrawelements_t *command = NULL;
     size_t array_size = 0;
+    char *transfer_data = NULL;
+    size_t first_element = 0;
     size_t elements_count = 0;
 
-    if (!copy_indices) {
-        vertex_attrib_list_t *attrib_list = &state->vertex_attribs;
-        if (attrib_list->last_index_pointer)
-            elements_count = _get_elements_count (type, (char *)state->element_array_buffer_binding_object->data, count);
-        else
-            elements_count = 0;
+    /* Only the vertices that the indices refer to are copied. The indices
+     * of an element array buffer usually don't change, so the buffer keeps
+     * their ranges. */
+    if (! state->vertex_attribs.enabled_count)
+        elements_count = 0;
+    else if (!copy_indices) {
+        elements_count = _get_buffer_elements_range (state->element_array_buffer_binding_object,
+                                                     type, (GLintptr) indices,
+                                                     count, &first_element);
+        if (! elements_count) {
+            caching_client_clear_attribute_list_data (CLIENT(client));
+            goto finish;
+        }
     }
     else
-        elements_count = _get_elements_count (type, indices, count);
+        elements_count = _get_elements_range (type, indices, count, &first_element);
+
+    /* Indices that the client array cache holds are read from its buffer,
+     * which stays bound to the draw. */
+    GLuint cached_indices = 0;
+    if (copy_indices && state->client_array_cache)
+        cached_indices = caching_client_get_cached_client_array (CLIENT (client), state,
+                                                                 GL_ELEMENT_ARRAY_BUFFER,
+                                                                 indices, index_array_size);
+    if (cached_indices) {
+        copy_indices = false;
+        index_array_size = 0;
+        indices_to_pass = NULL;
+    }
 
     caching_client_setup_vertex_attrib_pointer_if_necessary (
             CLIENT (client),
-            elements_count, &arrays_to_free,
+            first_element, elements_count, &arrays_to_free,
             (command_t **)&command,
             &array_size,
+            &transfer_data,
             index_array_size, 1);
     
     if (command) {
         ((command_t *)command)->type = COMMAND_GLDRAWELEMENTS;
-        ((command_t *)command)->size = command_get_size (COMMAND_GLDRAWELEMENTS) + array_size + index_array_size;
-        ((command_t *)command)->token = 0;
+        ((command_t *)command)->flags = 0;
+        ((command_t *)command)->size = COMMAND_ALIGN (command_get_size (COMMAND_GLDRAWELEMENTS) + array_size + index_array_size);
+    }
+
+    /* Index arrays without copied vertex arrays follow the command, or get
+     * a transfer allocation of their own if they are large. */
+    if (copy_indices && ! command && ! transfer_data) {
+        if (index_array_size > COMMAND_MAX_INLINE_PAYLOAD)
+            transfer_data = client_allocate_transfer (CLIENT (client),
+                                                      index_array_size);
+        else {
+            size_t command_size = COMMAND_ALIGN (command_get_size (COMMAND_GLDRAWELEMENTS) + index_array_size);
+            command = (command_gldrawelements_t *)
+                client_get_space_for_size (CLIENT (client), command_size);
+            ((command_t *)command)->type = COMMAND_GLDRAWELEMENTS;
+            ((command_t *)command)->flags = 0;
+            ((command_t *)command)->size = command_size;
+        }
     }
 
     if (copy_indices && command)
         indices_to_pass = ((char *) command) + command_get_size (COMMAND_GLDRAWELEMENTS) + array_size;
+    else if (copy_indices && transfer_data)
+        indices_to_pass = transfer_data;
     else if (copy_indices) {
-        indices_to_pass = malloc (index_array_size);
-        link_list_prepend (&arrays_to_free, indices_to_pass, free);
+        if (client_is_remote (CLIENT (client)))
+            client_abort_remote_heap_payload (index_array_size);
+        indices_to_pass = memory_pool_alloc (index_array_size);
+        link_list_prepend (&arrays_to_free, indices_to_pass, memory_pool_free);
     }
 
     if (copy_indices)
         memcpy (indices_to_pass, indices, index_array_size);
     
-    if (! command)
+    if (! command) {
         command = (command_gldrawelements_t *) client_get_space_for_command (COMMAND_GLDRAWELEMENTS);
+        if (transfer_data)
+            command->header.flags = COMMAND_FLAG_TRANSFER_PAYLOAD;
+    }
 
     command_gldrawelements_init (&command->header, mode, count, type, indices_to_pass);
     ((command_gldrawelements_t *) command)->arrays_to_free = arrays_to_free;
     client_run_command_async (&command->header);
+    if (cached_indices)
+        CACHING_CLIENT(client)->super_dispatch.glBindBuffer (client, GL_ELEMENT_ARRAY_BUFFER,
+                                                             state->element_array_buffer_binding);
+    caching_client_evict_cached_client_arrays (CLIENT (client), state);
+    if (! frame_cache_holds_replay (CLIENT (client)))
+        client_flush (CLIENT (client));
 
 finish:
     caching_client_clear_attribute_list_data (CLIENT(client));
@@ -2636,10 +2926,7 @@ caching_client_glGenBuffers (void* client, GLsizei n, GLuint *buffers)
         hash_insert(state->array_buffer_cache, buffers[i], NULL);
     mutex_unlock (cached_shared_states_mutex);
 
-    GLuint *server_buffers = (GLuint *)malloc (n * sizeof (GLuint));
-    memcpy (server_buffers, buffers, n * sizeof (GLuint));
-
-    CACHING_CLIENT(client)->super_dispatch.glGenBuffers (client, n, server_buffers);
+    CACHING_CLIENT(client)->super_dispatch.glGenBuffers (client, n, buffers);
 }
 
 static void
@@ -2658,10 +2945,8 @@ caching_client_glGenFramebuffers (void* client, GLsizei n, GLuint *framebuffers)
     }
 
     name_handler_alloc_names (state->framebuffer_name_handler, n, framebuffers);
-    GLuint *server_framebuffers = (GLuint *)malloc (n * sizeof (GLuint));
-    memcpy (server_framebuffers, framebuffers, n * sizeof (GLuint));
 
-    CACHING_CLIENT(client)->super_dispatch.glGenFramebuffers (client, n, server_framebuffers);
+    CACHING_CLIENT(client)->super_dispatch.glGenFramebuffers (client, n, framebuffers);
     
     /* add framebuffers to cache */
     int i;
@@ -2693,10 +2978,7 @@ caching_client_glGenRenderbuffers (void* client, GLsizei n, GLuint *renderbuffer
         egl_state_create_cached_renderbuffer (state, renderbuffers[i]);
     mutex_unlock (cached_shared_states_mutex);
 
-    GLuint *server_renderbuffers = (GLuint *)malloc (n * sizeof (GLuint));
-    memcpy (server_renderbuffers, renderbuffers, n * sizeof (GLuint));
-
-    CACHING_CLIENT(client)->super_dispatch.glGenRenderbuffers (client, n, server_renderbuffers);
+    CACHING_CLIENT(client)->super_dispatch.glGenRenderbuffers (client, n, renderbuffers);
     
 }
 
@@ -2726,10 +3008,7 @@ caching_client_glGenTextures (void* client, GLsizei n, GLuint *textures)
     }
     mutex_unlock (cached_shared_states_mutex);
 
-    GLuint *server_textures = (GLuint *)malloc (n * sizeof (GLuint));
-    memcpy (server_textures, textures, n * sizeof (GLuint));
-
-    CACHING_CLIENT(client)->super_dispatch.glGenTextures (client, n, server_textures);
+    CACHING_CLIENT(client)->super_dispatch.glGenTextures (client, n, textures);
 
 }
 
@@ -3874,14 +4153,134 @@ caching_client_glTexParameterf (void* client, GLenum target, GLenum pname, GLflo
     caching_client_glTexParameteri (client, target, pname, parami);
 }
 
+/* Works out how to send an image in bands that each fit in a chunk:
+ * |*rows_per_band| rows at a time, or, if a single row is already too
+ * large for a chunk, one row at a time in bands of |*columns_per_band|
+ * pixels. Returns false if the image should be sent at once. */
+static bool
+caching_client_get_stream_bands (void *client, GLsizei width, GLsizei height,
+                                 GLenum format, GLenum type,
+                                 GLsizei *rows_per_band,
+                                 GLsizei *columns_per_band,
+                                 uint32_t *padded_row_size)
+{
+    uint32_t image_size;
+    uint32_t unpadded_row_size;
+    size_t chunk_size;
+
+    if (! compute_image_data_sizes (width, height, format, type,
+                                    client_get_unpack_alignment (),
+                                    client_get_unpack_row_length (),
+                                    client_get_unpack_skip_rows (),
+                                    &image_size, &unpadded_row_size,
+                                    padded_row_size))
+        return false;
+
+    if (! caching_client_should_stream (client, image_size))
+        return false;
+
+    chunk_size = client_get_stream_chunk_size (CLIENT (client));
+    *columns_per_band = width;
+    if (*padded_row_size <= chunk_size) {
+        *rows_per_band = chunk_size / *padded_row_size;
+        return true;
+    }
+
+    /* With a row length set, a row takes that much data however narrow
+     * the band is, so such rows are sent whole. */
+    *rows_per_band = 1;
+    if (! client_get_unpack_row_length ()) {
+        GLsizei columns = chunk_size / compute_image_group_size (format, type);
+        if (columns < width)
+            *columns_per_band = columns;
+    }
+    return true;
+}
+
+/* Sends the image to the texture one band at a time. The bands keep the
+ * unpack state of the whole image, so each one starts |padded_row_size|
+ * bytes per row and a pixel's worth of bytes per column further into
+ * |pixels|. */
+static void
+caching_client_stream_tex_sub_image_2d (void *client, GLenum target,
+                                        GLint level, GLint xoffset,
+                                        GLint yoffset, GLsizei width,
+                                        GLsizei height, GLenum format,
+                                        GLenum type, const void *pixels,
+                                        GLsizei rows_per_band,
+                                        GLsizei columns_per_band,
+                                        uint32_t padded_row_size)
+{
+    uint32_t group_size = compute_image_group_size (format, type);
+    GLsizei row;
+    GLsizei column;
+
+    for (row = 0; row < height; row += rows_per_band) {
+        GLsizei rows = height - row < rows_per_band ? height - row :
+                                                      rows_per_band;
+
+        for (column = 0; column < width; column += columns_per_band) {
+            GLsizei columns = width - column < columns_per_band ?
+                              width - column : columns_per_band;
+
+            CACHING_CLIENT(client)->super_dispatch.glTexSubImage2D (
+                client, target, level, xoffset + column, yoffset + row,
+                columns, rows, format, type,
+                (const char *) pixels + row * padded_row_size +
+                                        column * group_size);
+        }
+    }
+}
+
+/* Records the image that glTexImage2D () gives the texture bound to
+ * |target|, or returns false if that texture has another target. */
+static bool
+caching_client_set_cached_texture_image (void *client,
+                                         egl_state_t *state,
+                                         GLenum target,
+                                         GLint internalformat,
+                                         GLsizei width,
+                                         GLsizei height,
+                                         GLenum type)
+{
+    GLuint tex_id;
+
+    if (target == GL_TEXTURE_2D)
+        tex_id = state->texture_binding[0];
+    else
+        tex_id = state->texture_binding[1];
+
+    /* FIXME: Is it right? */
+    texture_t *texture = egl_state_lookup_cached_texture (state, tex_id);
+    if (! texture || tex_id == 0) {
+        caching_client_set_needs_get_error (CLIENT (client));
+        return true;
+    }
+    if (texture->target != target && texture->initialized)
+        return false;
+
+    texture->target = target;
+    texture->initialized = true;
+    texture->internal_format = internalformat;
+    texture->width = width;
+    texture->height = height;
+    texture->data_type = type;
+
+    /* update framebuffer in cache */
+    if (texture->framebuffer_id) {
+        framebuffer_t *framebuffer = egl_state_lookup_cached_framebuffer (state, texture->framebuffer_id);
+        if (framebuffer)
+            framebuffer->complete = FRAMEBUFFER_COMPLETE_UNKNOWN;
+    }
+    return true;
+}
+
 static void
 caching_client_glTexImage2D (void* client, GLenum target, GLint level,
                              GLint internalformat, GLsizei width,
                              GLsizei height, GLint border, GLenum format,
                              GLenum type, const void *pixels)
 {
-    GLuint tex_id;
-
     egl_state_t *state = client_get_current_state (CLIENT (client));
 
     INSTRUMENT();
@@ -3927,37 +4326,30 @@ caching_client_glTexImage2D (void* client, GLenum target, GLint level,
     }
 
     /* FIXME: we need more checks on max width/height and level */
-    if (target == GL_TEXTURE_2D)
-        tex_id = state->texture_binding[0];
-    else
-        tex_id = state->texture_binding[1];
-
-    /* FIXME: Is it right? */
-    texture_t *texture = egl_state_lookup_cached_texture (state, tex_id);
-    if (! texture || tex_id == 0)
-        caching_client_set_needs_get_error (CLIENT (client));
-    else if (texture->target != target && texture->initialized) {
+    if (! caching_client_set_cached_texture_image (client, state, target,
+                                                   internalformat, width,
+                                                   height, type)) {
         caching_client_glSetError (client, GL_INVALID_OPERATION);
         return;
     }
-    else {
-        texture->target = target;
-        texture->initialized = true;
-        texture->internal_format = internalformat;
-        texture->width = width;
-        texture->height = height;
-        texture->data_type = type;
-    }
-
-    CACHING_CLIENT(client)->super_dispatch.glTexImage2D (client, target, level, internalformat,
-                                                         width, height, border, format, type, pixels);
 
-    /* update framebuffer in cache */
-    if (texture && texture->framebuffer_id) {
-        framebuffer_t *framebuffer = egl_state_lookup_cached_framebuffer (state, texture->framebuffer_id);
-        if (framebuffer)
-            framebuffer->complete = FRAMEBUFFER_COMPLETE_UNKNOWN;
-    }
+    uint32_t padded_row_size;
+    GLsizei rows_per_band;
+    GLsizei columns_per_band;
+    if (pixels &&
+        caching_client_get_stream_bands (client, width, height, format, type,
+                                         &rows_per_band, &columns_per_band,
+                                         &padded_row_size)) {
+        CACHING_CLIENT(client)->super_dispatch.glTexImage2D (client, target, level, internalformat,
+                                                             width, height, border, format, type, NULL);
+        caching_client_stream_tex_sub_image_2d (client, target, level, 0, 0,
+                                                width, height, format, type,
+                                                pixels, rows_per_band,
+                                                columns_per_band,
+                                                padded_row_size);
+    } else
+        CACHING_CLIENT(client)->super_dispatch.glTexImage2D (client, target, level, internalformat,
+                                                             width, height, border, format, type, pixels);
 }
 
 static void
@@ -4036,6 +4428,22 @@ caching_client_glTexSubImage2D (void* client,
     if (texture && texture->internal_format != format)
         caching_client_set_needs_get_error (CLIENT (client));
 
+    uint32_t padded_row_size;
+    GLsizei rows_per_band;
+    GLsizei columns_per_band;
+    if (pixels &&
+        caching_client_get_stream_bands (client, width, height, format, type,
+                                         &rows_per_band, &columns_per_band,
+                                         &padded_row_size)) {
+        caching_client_stream_tex_sub_image_2d (client, target, level,
+                                                xoffset, yoffset, width,
+                                                height, format, type, pixels,
+                                                rows_per_band,
+                                                columns_per_band,
+                                                padded_row_size);
+        return;
+    }
+
     /* FIXME: we need to check level */
     CACHING_CLIENT(client)->super_dispatch.glTexSubImage2D (client, target, level, xoffset, yoffset,
                                                             width, height, format, type, pixels);
@@ -4787,12 +5195,8 @@ caching_client_glVertexAttribPointer (void* client, GLuint index, GLint size,
                 attribs[i].stride == stride &&
                 attribs[i].array_buffer_binding == bound_buffer &&
                 attribs[i].array_normalized == normalized &&
-                attribs[i].pointer == pointer) {
-                if (! bound_buffer && attribs[i].array_enabled) {
-                    _set_vertex_pointers (attrib_list, &attribs[i]);
-                }
+                attribs[i].pointer == pointer)
                 return;
-            }
             else {
                 found_index = i;
                 break;
@@ -4812,20 +5216,8 @@ caching_client_glVertexAttribPointer (void* client, GLuint index, GLint size,
         attribs[found_index].type = type;
         attribs[found_index].array_normalized = normalized;
         attribs[found_index].array_buffer_binding = bound_buffer;
-
-        if (attrib_list->last_index_pointer == &attribs[found_index])
-            attrib_list->last_index_pointer = 0;
-        if (attrib_list->first_index_pointer == &attribs[found_index])
-            attrib_list->first_index_pointer = 0;
-
         attribs[found_index].pointer = (GLvoid *)pointer;
-        attrib_list->enabled_count = 0;
-        for (i = 0; i < attrib_list->count; i++) {
-            if (attribs[i].array_enabled && !attribs[i].array_buffer_binding) {
-                attrib_list->enabled_count++;
-                _set_vertex_pointers (attrib_list, &attribs[i]);
-            }
-        }
+        _update_vertex_attrib_masks (attrib_list);
         return;
     }
 
@@ -4862,13 +5254,7 @@ caching_client_glVertexAttribPointer (void* client, GLuint index, GLint size,
         attrib_list->attribs = new_attribs;
         attrib_list->count ++;
     }
-    attrib_list->enabled_count = 0;
-    for (i = 0; i < attrib_list->count; i++) {
-        if (attribs[i].array_enabled && !attribs[i].array_buffer_binding) {
-            attrib_list->enabled_count++;
-            _set_vertex_pointers (attrib_list, &attribs[i]);
-        }
-    }
+    _update_vertex_attrib_masks (attrib_list);
 }
 
 static void
@@ -6500,6 +6886,55 @@ caching_client_glProgramBinaryOES (void* client,
                                          binaryFormat, binary, length);
 }
 
+#include "caching_client_command_list_autogen.c"
+
+void
+caching_client_call_command_list (caching_client_t *client,
+                                  command_list_t *list)
+{
+    buffer_t *buffer = &client->super.buffer;
+    /* Without a context the entry points would drop everything. */
+    egl_state_t *state = client_get_current_state (CLIENT (client));
+    size_t offset = 0;
+
+    while (offset < list->size) {
+        command_t *command = (command_t *) (list->commands + offset);
+        size_t size = 0;
+
+        if (state && caching_client_runs_list_command (command)) {
+            caching_client_run_list_command (client, command);
+            /* The entry point made copies of its own. */
+            command_destroy_arguments (command);
+            offset += command->size;
+            continue;
+        }
+
+        /* Copy the commands up to the next one that goes through an entry
+         * point in pieces of at most a quarter of the buffer, in whole
+         * commands, so that a long list doesn't need a bigger buffer. */
+        while (offset + size < list->size) {
+            command = (command_t *) (list->commands + offset + size);
+            if (size && (size + command->size > buffer->length / 4 ||
+                         (state && caching_client_runs_list_command (command))))
+                break;
+
+            if (state && command->type == COMMAND_GLTEXIMAGE2D) {
+                command_glteximage2d_t *tex_image =
+                    (command_glteximage2d_t *) command;
+                caching_client_set_cached_texture_image (
+                    client, state, tex_image->target, tex_image->internalformat,
+                    tex_image->width, tex_image->height, tex_image->type);
+            }
+            size += command->size;
+        }
+
+        memcpy (client_get_space_for_size (CLIENT (client), size),
+                list->commands + offset, size);
+        buffer_write_advance (buffer, size);
+        offset += size;
+    }
+}
+
 static void
 caching_client_init (caching_client_t *client)
 {
@@ -6517,7 +6952,12 @@ caching_client_init (caching_client_t *client)
 caching_client_t *
 caching_client_new ()
 {
-    caching_client_t *client = (caching_client_t *)malloc (sizeof (caching_client_t));
+    caching_client_t *client = NULL;
+
+    /* The command buffer indices are cache line aligned. */
+    if (posix_memalign ((void **) &client, CACHE_LINE_SIZE,
+                        sizeof (caching_client_t)))
+        return NULL;
     caching_client_init (client);
     return client;
 }
@@ -25,5 +25,15 @@ caching_client_new ();
 private void
 caching_client_destroy (caching_client_t *client);
 
+/* Copies the commands of |list| into the command buffer, except those that
+ * change state that the client caches, like bindings, enables and the
+ * objects it keeps track of. Those go through the entry points of the
+ * caching client instead, as if the thread had made the calls itself, so
+ * that the cache follows the list and doesn't drop the calls that undo
+ * what it did. */
+private void
+caching_client_call_command_list (caching_client_t *client,
+                                  command_list_t *list);
+
 
 #endif /* CACHING_CLIENT_H */
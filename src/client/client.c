@@ -7,8 +7,15 @@
 #include "caching_client.h"
 #include "caching_client_private.h"
 #include "command.h"
+#include "frame_cache.h"
+#include "gles2_utils.h"
 #include "name_handler.h"
+#include "server_connection.h"
+#include "server_scheduler.h"
+#include "server_stream.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -25,8 +32,16 @@ __thread bool initializing_client
 __thread bool initialized
     __attribute__(( tls_model ("initial-exec"))) = false;
 
+/* The client of the thread while it records a command list. */
+static __thread client_t* client_before_recording
+    __attribute__(( tls_model ("initial-exec"))) = NULL;
+
 mutex_static_init (client_thread_mutex);
 
+mutex_static_init (server_scheduler_mutex);
+static server_scheduler_t *server_scheduler = NULL;
+static bool server_scheduler_initialized = false;
+
 static void
 client_fill_dispatch_table (dispatch_table_t *client);
 
@@ -63,10 +78,7 @@ start_server_thread_func (void *ptr)
 {
     client_thread = false;
     client_t *client = (client_t *)ptr;
-    server_t *server = server_new (&client->buffer);
-
-    server->server_signal = &client->server_signal;
-    server->client_signal = &client->client_signal;
+    server_t *server = server_new (&client->buffer, &client->transfer_buffer);
 
     mutex_unlock (client->server_started_mutex);
     prctl (PR_SET_TIMERSLACK, 1);
@@ -110,9 +122,137 @@ start_server_thread_func (void *ptr)
     return NULL;
 }
 
+static void
+server_scheduler_thread_init (void)
+{
+    client_thread = false;
+    prctl (PR_SET_TIMERSLACK, 1);
+}
+
+/* The server threads shared by all the clients of the process, if
+ * GPUPROCESS_SERVER_THREADS asks for them. */
+static server_scheduler_t *
+client_get_server_scheduler ()
+{
+    mutex_lock (server_scheduler_mutex);
+    if (! server_scheduler_initialized) {
+        const char *thread_count = getenv ("GPUPROCESS_SERVER_THREADS");
+        if (thread_count)
+            server_scheduler =
+                server_scheduler_new (strtoul (thread_count, NULL, 10),
+                                      server_scheduler_thread_init);
+        server_scheduler_initialized = true;
+    }
+    mutex_unlock (server_scheduler_mutex);
+    return server_scheduler;
+}
+
+static bool
+client_create_transfer_buffer (client_t *client)
+{
+    buffer_t *buffer = &client->transfer_buffer;
+
+    if (likely (buffer->address))
+        return true;
+    if (! client->transfer_buffer_size)
+        return false;
+
+    buffer_create (buffer, client->transfer_buffer_size, "transfer",
+                   client->buffer.flags);
+    if (! buffer->address) {
+        client->transfer_buffer_size = 0;
+        return false;
+    }
+    return true;
+}
+
+/* Has a thread of ours stream the commands to the server, which can't map
+ * our buffers, as it may well be on another machine. */
+static bool
+client_start_stream (client_t *client, const char *address)
+{
+    const char *compression = getenv ("GPUPROCESS_STREAM_COMPRESSION");
+    const char *cache_size = getenv ("GPUPROCESS_STREAM_CACHE_SIZE");
+    uint32_t flags = 0;
+    size_t cache_kilobytes = SERVER_STREAM_DEFAULT_CACHE_SIZE;
+    server_stream_t *stream;
+
+    /* Compression only pays off when the link is slower than memory. */
+    if (compression ? strcmp (compression, "0") != 0 :
+                      server_connection_is_tcp (address))
+        flags |= SERVER_CONNECTION_COMPRESS;
+    if (cache_size)
+        cache_kilobytes = strtoul (cache_size, NULL, 10);
+
+    if (! server_connection_send_stream_request (client->server_socket,
+                                                 &client->buffer,
+                                                 &client->transfer_buffer,
+                                                 flags, cache_kilobytes))
+        return false;
+
+    stream = server_stream_new (client->server_socket, &client->buffer,
+                                &client->transfer_buffer, flags,
+                                cache_kilobytes * 1024);
+    if (pthread_create (&client->server_thread, NULL,
+                        server_stream_forward, stream)) {
+        server_stream_destroy (stream);
+        return false;
+    }
+    client->stream_transport = true;
+    return true;
+}
+
+/* Hands the buffers to the server listening at |address|, or streams the
+ * commands to it when it is reached over TCP or asked to with
+ * GPUPROCESS_SERVER_TRANSPORT=stream. */
+static bool
+client_connect_server (client_t *client, const char *address)
+{
+    const char *transport = getenv ("GPUPROCESS_SERVER_TRANSPORT");
+    bool stream = server_connection_is_tcp (address) ||
+                  (transport && ! strcmp (transport, "stream"));
+    bool connected;
+
+    /* The transfer buffer can only be handed over now, and a remote
+     * server needs it for everything too large for the command buffer,
+     * which would otherwise go to the heap. */
+    client->server_socket = -1;
+    if (client_create_transfer_buffer (client))
+        client->server_socket = server_connection_connect (address);
+    if (client->server_socket >= 0) {
+        connected = stream ? client_start_stream (client, address) :
+                             server_connection_send_request (client->server_socket,
+                                                             &client->buffer,
+                                                             &client->transfer_buffer);
+        if (connected)
+            return true;
+    }
+
+    fprintf (stderr, "gpuprocess: could not hand the command buffer to the "
+             "server at %s, starting a server thread instead\n", address);
+    if (client->server_socket >= 0)
+        close (client->server_socket);
+    client->server_socket = -1;
+    return false;
+}
+
 void
 client_start_server (client_t *client)
 {
+    const char *server_socket = getenv ("GPUPROCESS_SERVER_SOCKET");
+    server_scheduler_t *scheduler;
+
+    if (server_socket && client_connect_server (client, server_socket))
+        return;
+
+    scheduler = client_get_server_scheduler ();
+    if (scheduler) {
+        server_scheduler_add (scheduler,
+                              server_new (&client->buffer,
+                                          &client->transfer_buffer));
+        return;
+    }
+
     mutex_init (client->server_started_mutex);
     mutex_lock (client->server_started_mutex);
     pthread_create (&client->server_thread, NULL, start_server_thread_func, client);
@@ -141,19 +281,108 @@ client_start_server (client_t *client)
 client_t *
 client_new ()
 {
-    client_t *client = (client_t *)malloc (sizeof (client_t));
+    client_t *client = NULL;
+
+    /* The command buffer indices are cache line aligned. */
+    if (posix_memalign ((void **) &client, CACHE_LINE_SIZE, sizeof (client_t)))
+        return NULL;
     client_init (client);
 
     return client;
 }
 
+static size_t
+client_get_size_from_environment (const char *name, size_t default_kilobytes)
+{
+    const char *value = getenv (name);
+    if (value) {
+        long kilobytes = strtol (value, NULL, 10);
+        if (kilobytes > 0)
+            return kilobytes;
+    }
+    return default_kilobytes;
+}
+
+static bool
+client_get_flag_from_environment (const char *name)
+{
+    const char *value = getenv (name);
+    return value && strcmp (value, "0");
+}
+
+static void
+client_init_buffer (client_t *client)
+{
+    size_t buffer_size =
+        client_get_size_from_environment ("GPUPROCESS_COMMAND_BUFFER_SIZE",
+                                          DEFAULT_COMMAND_BUFFER_SIZE);
+    size_t buffer_max_size =
+        client_get_size_from_environment ("GPUPROCESS_COMMAND_BUFFER_MAX_SIZE",
+                                          DEFAULT_COMMAND_BUFFER_MAX_SIZE);
+    unsigned int buffer_flags = 0;
+    const char *flush_size;
+    const char *transfer_buffer_size;
+
+    if (client_get_flag_from_environment ("GPUPROCESS_COMMAND_BUFFER_HUGEPAGES"))
+        buffer_flags |= BUFFER_HUGE_PAGES;
+    if (client_get_flag_from_environment ("GPUPROCESS_COMMAND_BUFFER_LOCK"))
+        buffer_flags |= BUFFER_LOCKED;
+    /* A server in another process needs the files behind the buffers. */
+    if (getenv ("GPUPROCESS_SERVER_SOCKET"))
+        buffer_flags |= BUFFER_SHAREABLE;
+
+    buffer_create (&client->buffer, buffer_size, "command", buffer_flags);
+
+    client->adaptive_buffer =
+        client_get_flag_from_environment ("GPUPROCESS_COMMAND_BUFFER_ADAPTIVE") &&
+        ! (buffer_flags & BUFFER_SHAREABLE);
+    client->buffer_min_size = client->buffer.length;
+    client->buffer_max_size = buffer_max_size * 1024;
+    if (client->buffer_max_size < client->buffer_min_size)
+        client->buffer_max_size = client->buffer_min_size;
+    client->buffer_stalls = 0;
+    client->buffer_idle_syncs = 0;
+    client->buffer_high_water_mark = 0;
+
+    flush_size = getenv ("GPUPROCESS_COMMAND_BUFFER_FLUSH_SIZE");
+    client->flush_size = (flush_size ? strtoul (flush_size, NULL, 10) :
+                                       DEFAULT_COMMAND_BUFFER_FLUSH_SIZE) * 1024;
+    client->flush_deadline = 0;
+
+    client->server_socket = -1;
+    client->stream_transport = false;
+    client->remote_strings = NULL;
+
+    /* The transfer buffer is created when it is first used. */
+    memset (&client->transfer_buffer, 0, sizeof (buffer_t));
+    transfer_buffer_size = getenv ("GPUPROCESS_TRANSFER_BUFFER_SIZE");
+    client->transfer_buffer_size =
+        transfer_buffer_size ? strtoul (transfer_buffer_size, NULL, 10) :
+                               DEFAULT_TRANSFER_BUFFER_SIZE;
+}
+
+static void
+client_init_sync_spin_time (client_t *client)
+{
+    const char *spin_limit = getenv ("GPUPROCESS_CLIENT_SPIN_LIMIT");
+
+    /* Spinning would only keep the server from running. */
+    if (sysconf (_SC_NPROCESSORS_ONLN) < 2) {
+        client->sync_spin_time = 0;
+        return;
+    }
+
+    client->sync_spin_time = (spin_limit ? strtoul (spin_limit, NULL, 10) :
+                                           DEFAULT_CLIENT_SPIN_LIMIT) * 1000;
+}
+
 void
 client_init (client_t *client)
 {
     prctl (PR_SET_TIMERSLACK, 1);
     initializing_client = true;
 
-    buffer_create (&client->buffer, 512, "command");
+    client_init_buffer (client);
 
     // We initialize the base dispatch table synchronously here, so that we
     // don't have to worry about the server thread trying to initialize it
@@ -163,11 +392,11 @@ client_init (client_t *client)
     client_fill_dispatch_table (&client->dispatch);
 
     client->token = 0;
-
-    sem_init (&client->server_signal, 0, 0);
-    sem_init (&client->client_signal, 0, 0);
+    client_init_sync_spin_time (client);
 
     client->active_state = NULL;
+    client->command_list = NULL;
+    client->frame_cache = frame_cache_new ();
    
     client_start_server (client);
     initializing_client = false;
@@ -186,10 +415,30 @@ client_destroy (client_t *client)
 {
     client_shutdown_server (client);
 
-    buffer_free (&client->buffer);
+#if ENABLE_PROFILING
+    printf ("command buffer: %" PRIu64 " stalls waiting for space, %.3f ms in total\n",
+            client->buffer.producer.stall_count,
+            client->buffer.producer.stall_time / 1e6);
+#endif
+
+    /* The forwarding thread returns right after it completes the token
+     * of the shutdown. */
+    if (client->stream_transport)
+        pthread_join (client->server_thread, NULL);
+
+    /* The eventfd of a server in this process belongs to the server. */
+    if (client->server_socket >= 0) {
+        close (client->server_socket);
+        if (client->buffer.consumer_event_fd >= 0)
+            close (client->buffer.consumer_event_fd);
+    }
+    link_list_clear (&client->remote_strings);
 
-    sem_destroy (&client->server_signal);
-    sem_destroy (&client->client_signal);
+    buffer_free (&client->buffer);
+    if (client->transfer_buffer.address)
+        buffer_free (&client->transfer_buffer);
+    if (client->frame_cache)
+        frame_cache_destroy (client->frame_cache);
 
     free (client);
 
@@ -210,6 +459,10 @@ client_destroy_thread_local ()
 {
     if (! thread_local_client)
         return;
+    if (thread_local_client->command_list)
+        client_end_command_list ();
+    if (! thread_local_client)
+        return;
 
     caching_client_destroy (CACHING_CLIENT (thread_local_client));
     thread_local_client = NULL;
@@ -219,50 +472,97 @@ command_t *
 client_get_space_for_size (client_t *client,
                            size_t size)
 {
-    size_t available_space;
+    buffer_t *buffer = &client->buffer;
     command_t *write_location;
 
-    write_location = (command_t *) buffer_write_address (&client->buffer,
-                                                         &available_space);
-    while (! write_location || available_space < size) {
-        sched_yield ();
-        write_location = (command_t *) buffer_write_address (&client->buffer,
-                                                             &available_space);
+    if (unlikely (client->command_list))
+        return command_list_get_space (client->command_list, size);
+
+    /* A command that doesn't fit at all needs a bigger buffer, which can
+     * only be swapped in once the server has retired everything. */
+    if (unlikely (size > buffer->length)) {
+        buffer_wait_for_space (buffer, buffer->length);
+        if (! buffer_resize (buffer, size)) {
+            fprintf (stderr, "Could not grow the command buffer to %zu bytes.\n",
+                     size);
+            abort ();
+        }
     }
 
-    return write_location;
+    write_location = (command_t *) buffer_write_address (buffer, size);
+    if (likely (write_location))
+        return write_location;
+
+    client->buffer_stalls++;
+    return (command_t *) buffer_wait_for_space (buffer, size);
 }
 
-command_t *
-client_get_space_for_command (command_type_t command_type)
+/* This is called after a synchronous command, when the client has just
+ * seen the server catch up with everything it was sent. That makes it
+ * a cheap point to swap the mapping for one of a different size. */
+static void
+client_adapt_buffer_size (client_t *client)
 {
-    assert (command_type >= 0 && command_type < COMMAND_MAX_COMMAND);
+    buffer_t *buffer = &client->buffer;
+    size_t new_length = buffer->length;
+
+    if (client->buffer_stalls >= COMMAND_BUFFER_GROW_STALLS &&
+        buffer->length < client->buffer_max_size) {
+        new_length = buffer->length * 2;
+        if (new_length > client->buffer_max_size)
+            new_length = client->buffer_max_size;
+        client->buffer_idle_syncs = 0;
+    } else if (client->buffer_stalls == 0 &&
+               client->buffer_high_water_mark < buffer->length / 4 &&
+               buffer->length > client->buffer_min_size) {
+        if (++client->buffer_idle_syncs >= COMMAND_BUFFER_SHRINK_IDLE_SYNCS) {
+            new_length = buffer->length / 2;
+            if (new_length < client->buffer_min_size)
+                new_length = client->buffer_min_size;
+            client->buffer_idle_syncs = 0;
+        }
+    } else
+        client->buffer_idle_syncs = 0;
 
-    client_t *client = client_get_thread_local ();
-    size_t command_size = command_get_size (command_type);
-    command_t *command = client_get_space_for_size (client, command_size);
-    command->type = command_type;
-    command->size = command_size;
-    command->token = 0;
-    return command;
+    client->buffer_stalls = 0;
+    client->buffer_high_water_mark = 0;
+
+    if (new_length == buffer->length)
+        return;
+
+    /* The token is published just before the server retires the command
+     * that carried it, so wait until the server is really done with the
+     * mapping. */
+    buffer_wait_for_space (buffer, buffer->length);
+    buffer_resize (buffer, new_length);
 }
 
 void
 client_run_command (command_t *command)
 {
     client_t *client = client_get_thread_local ();
-    unsigned int token = ++client->token;
+    /* The server counts the synchronous commands it completes, so the
+     * token is simply our own count. */
+    unsigned int token;
+
+    /* The results would only arrive once the list runs, long after the
+     * caller is gone, so the command is dropped; synchronous commands use
+     * the memory of the caller, and have nothing of their own to free. */
+    if (unlikely (client->command_list)) {
+        client->command_list->dropped_commands = true;
+        return;
+    }
 
-    /* Overflow case */
-    if (token == 0)
-        token = 1;
+    command->flags |= COMMAND_FLAG_SYNCHRONOUS;
 
-    command->token = token;
+    token = ++client->token;
     client_run_command_async (command);
+    client_flush (client);
 
-    while (client->buffer.last_token < token) {
-        sem_wait (&client->client_signal);
-    }
+    buffer_wait_for_token (&client->buffer, token, client->sync_spin_time);
+
+    if (client->adaptive_buffer)
+        client_adapt_buffer_size (client);
 }
 
 inline void
@@ -270,19 +570,277 @@ client_run_command_async (command_t *command)
 {
     client_t *client = client_get_thread_local ();
 
-    buffer_write_advance (&client->buffer, command->size);
+    buffer_t *buffer = &client->buffer;
+    size_t pending;
+
+    if (unlikely (client->command_list)) {
+        /* Like synchronous ones, commands that hand results back without
+         * being waited for, such as glGenBuffers, have nowhere to put
+         * them by the time the list runs. */
+        if (unlikely (command_has_results (command))) {
+            command_destroy_arguments (command);
+            client->command_list->dropped_commands = true;
+            return;
+        }
+        command_list_advance (client->command_list, command);
+        return;
+    }
 
-    if (client->buffer.fill_count == command->size) {
-        sem_post (&client->server_signal);
+    if (client->frame_cache) {
+        command = frame_cache_filter (client, command);
+        /* It went into the replay that is already there, which still
+         * has to reach the server in time. */
+        if (! command) {
+            if (get_coarse_monotonic_time_ns () >= client->flush_deadline)
+                client_flush (client);
+            return;
+        }
     }
+
+    buffer_write_advance (buffer, command->size);
+
+    if (client->adaptive_buffer) {
+        size_t used = buffer->producer.cursor - buffer->producer.cached_tail;
+        if (used > client->buffer_high_water_mark)
+            client->buffer_high_water_mark = used;
+    }
+
+    pending = buffer->producer.cursor - buffer->producer.head;
+    if (pending >= client->flush_size)
+        client_flush (client);
+    else if (pending == command->size)
+        client->flush_deadline = get_coarse_monotonic_time_ns () +
+                                 COMMAND_BUFFER_FLUSH_TIMEOUT;
+    else if (get_coarse_monotonic_time_ns () >= client->flush_deadline)
+        client_flush (client);
+
+    if (client->frame_cache && command->type == COMMAND_EGLSWAPBUFFERS)
+        frame_cache_end_frame (client);
+}
+
+void *
+client_allocate_transfer (client_t *client,
+                          size_t size)
+{
+    buffer_t *buffer = &client->transfer_buffer;
+    size_t allocation_size = COMMAND_ALIGN (sizeof (uint64_t) + size);
+    uint64_t *allocation;
+
+    if (client->command_list || ! client_create_transfer_buffer (client))
+        return NULL;
+
+    if (allocation_size > buffer->length)
+        return NULL;
+
+    allocation = buffer_write_address (buffer, allocation_size);
+    if (! allocation) {
+        /* Space is only given back as the server executes the commands
+         * that own it, so make sure it has all of them. */
+        client_flush (client);
+        allocation = buffer_wait_for_space (buffer, allocation_size);
+    }
+
+    *allocation = allocation_size;
+    buffer_write_advance (buffer, allocation_size);
+    buffer_publish (buffer);
+    return allocation + 1;
+}
+
+command_t *
+client_get_space_for_remote_command (command_type_t command_type,
+                                     size_t payload_size)
+{
+    command_t *command =
+        client_get_space_for_command_with_payload (command_type, payload_size);
+
+    if (unlikely (! command_has_payload (command)))
+        client_abort_remote_heap_payload (payload_size);
+    return command;
+}
+
+void
+client_abort_remote_heap_payload (size_t size)
+{
+    fprintf (stderr, "Could not fit %zu bytes of arguments in the "
+             "transfer buffer.\n", size);
+    abort ();
+}
+
+const char *
+client_keep_remote_string (client_t *client,
+                           const char *string)
+{
+    link_list_t *entry;
+    char *copy;
+
+    if (! string)
+        return NULL;
+
+    for (entry = client->remote_strings; entry; entry = entry->next) {
+        if (! strcmp (entry->data, string))
+            return entry->data;
+    }
+
+    copy = strdup (string);
+    link_list_prepend (&client->remote_strings, copy, free);
+    return copy;
+}
+
+size_t
+client_get_parameter_count (client_t *client,
+                            GLenum pname)
+{
+    GLint count = 0;
+
+    switch (pname) {
+    case GL_COLOR_CLEAR_VALUE:
+    case GL_COLOR_WRITEMASK:
+    case GL_VIEWPORT:
+    case GL_SCISSOR_BOX:
+    case GL_BLEND_COLOR:
+        return 4;
+    case GL_DEPTH_RANGE:
+    case GL_ALIASED_POINT_SIZE_RANGE:
+    case GL_ALIASED_LINE_WIDTH_RANGE:
+    case GL_MAX_VIEWPORT_DIMS:
+        return 2;
+    case GL_COMPRESSED_TEXTURE_FORMATS:
+        client->dispatch.glGetIntegerv (client, GL_NUM_COMPRESSED_TEXTURE_FORMATS,
+                                        &count);
+        return count > 0 ? count : 0;
+    case GL_SHADER_BINARY_FORMATS:
+        client->dispatch.glGetIntegerv (client, GL_NUM_SHADER_BINARY_FORMATS,
+                                        &count);
+        return count > 0 ? count : 0;
+    case GL_PROGRAM_BINARY_FORMATS_OES:
+        client->dispatch.glGetIntegerv (client, GL_NUM_PROGRAM_BINARY_FORMATS_OES,
+                                        &count);
+        return count > 0 ? count : 0;
+    default:
+        return 1;
+    }
+}
+
+size_t
+client_get_read_pixels_size (client_t *client,
+                             GLsizei width,
+                             GLsizei height,
+                             GLenum format,
+                             GLenum type)
+{
+    int pack_alignment = client->active_state ?
+                         client->active_state->pack_alignment : 4;
+    uint32_t size;
+
+    if (width <= 0 || height <= 0 ||
+        ! compute_image_data_sizes (width, height, format, type,
+                                    pack_alignment, 0, 0, &size, NULL, NULL))
+        return 0;
+    return size;
+}
+
+size_t
+client_get_stream_chunk_size (client_t *client)
+{
+    size_t length;
+
+    if (! client->transfer_buffer_size)
+        return COMMAND_MAX_INLINE_PAYLOAD;
+
+    /* Don't map the transfer buffer just to find out how large it is. */
+    length = client->transfer_buffer.address ? client->transfer_buffer.length :
+                                               client->transfer_buffer_size * 1024;
+    if (length < BUFFER_MINIMUM_SIZE)
+        length = BUFFER_MINIMUM_SIZE;
+
+    /* A quarter of the transfer buffer lets the client copy the next
+     * chunk while the server is still uploading the previous ones. */
+    return length / 4;
 }
 
 bool
 client_flush (client_t *client)
 {
+    if (client->command_list)
+        return true;
+    if (buffer_publish (&client->buffer))
+        buffer_signal_consumer (&client->buffer);
     return true;
 }
 
+void
+client_begin_command_list (command_list_t *list)
+{
+    client_t *client = NULL;
+
+    if (thread_local_client && thread_local_client->command_list)
+        return;
+
+    /* Only the dispatch table of the encoders is needed: no buffers, no
+     * server, and no state, as the thread has no context. */
+    if (posix_memalign ((void **) &client, CACHE_LINE_SIZE, sizeof (client_t)))
+        return;
+    memset (client, 0, sizeof (client_t));
+    client_fill_dispatch_table (&client->dispatch);
+    client->server_socket = -1;
+    client->command_list = list;
+    list->recording = true;
+
+    client_before_recording = thread_local_client;
+    thread_local_client = client;
+}
+
+void
+client_end_command_list (void)
+{
+    client_t *client = thread_local_client;
+
+    if (! client || ! client->command_list)
+        return;
+
+    client->command_list->recording = false;
+    thread_local_client = client_before_recording;
+    client_before_recording = NULL;
+    free (client);
+}
+
+void
+client_call_command_list (client_t *client,
+                          command_list_t *list)
+{
+    egl_state_t *state;
+
+    if (client->command_list) {
+        command_list_append (client->command_list, list);
+        return;
+    }
+
+    /* The list holds pointers to the heap of this process. */
+    if (client_is_remote (client)) {
+        fprintf (stderr, "Command lists can't be submitted to a server in "
+                 "another process.\n");
+        command_list_discard (list);
+        return;
+    }
+
+    /* The frame cache can't follow the commands of the list. */
+    frame_cache_abandon (client);
+
+    caching_client_call_command_list (CACHING_CLIENT (client), list);
+    client_flush (client);
+
+    /* The calls that the list dropped count as the first error, like
+     * those that the caching client catches itself. */
+    state = client_get_current_state (client);
+    if (state && ! list->dropped_commands)
+        state->need_get_error = true;
+    else if (state && state->error == GL_NO_ERROR) {
+        state->error = GL_INVALID_OPERATION;
+        state->need_get_error = false;
+    }
+    command_list_clear (list);
+}
+
 int
 client_get_unpack_alignment ()
 {
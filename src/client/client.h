@@ -2,13 +2,14 @@
 #define CLIENT_H
 
 typedef struct _client client_t;
+typedef struct _frame_cache frame_cache_t;
 
+#include "command_list.h"
 #include "dispatch_table.h"
 #include "egl_state.h"
 #include "ring_buffer.h"
 #include "server.h"
 #include "types_private.h"
-#include <semaphore.h>
 
 #define CLIENT(object) ((client_t *) (object))
 
@@ -19,12 +20,44 @@ typedef struct _client client_t;
  *   COMMAND_NAME_initialize (command, parameter1, parameter2, ...);
  *   client_write_command (command);
  */
-#define MEM_1K_SIZE  64
-#define MEM_2K_SIZE  64
-#define MEM_4K_SIZE  64
-#define MEM_8K_SIZE  64
-#define MEM_16K_SIZE 32
-#define MEM_32K_SIZE 32
+/* The command buffer size can be set with GPUPROCESS_COMMAND_BUFFER_SIZE
+ * (in kilobytes). When GPUPROCESS_COMMAND_BUFFER_ADAPTIVE is set, the
+ * buffer grows, up to GPUPROCESS_COMMAND_BUFFER_MAX_SIZE, when the client
+ * keeps finding it full, and shrinks back when it stays mostly empty. */
+#define DEFAULT_COMMAND_BUFFER_SIZE     512
+#define DEFAULT_COMMAND_BUFFER_MAX_SIZE (1024 * 16)
+
+/* Number of times the client had to wait for space between two
+ * synchronous commands before the buffer is grown. */
+#define COMMAND_BUFFER_GROW_STALLS      16
+
+/* Number of consecutive synchronous commands that must see the buffer
+ * less than a quarter full before it is shrunk. */
+#define COMMAND_BUFFER_SHRINK_IDLE_SYNCS 256
+
+/* Commands are handed to the server in batches: at draws, synchronous
+ * commands (which include eglSwapBuffers, glFlush and glFinish), once
+ * this many kilobytes are pending, or when the oldest pending command has
+ * waited for COMMAND_BUFFER_FLUSH_TIMEOUT nanoseconds. The timeout is
+ * checked as commands are written; GL only promises that commands execute
+ * after one of the explicit flush points anyway.
+ * GPUPROCESS_COMMAND_BUFFER_FLUSH_SIZE overrides the size, and 0 hands
+ * every command to the server as soon as it is written. */
+#define DEFAULT_COMMAND_BUFFER_FLUSH_SIZE 16
+#define COMMAND_BUFFER_FLUSH_TIMEOUT (2 * 1000 * 1000)
+
+/* How long, in microseconds, the client spins waiting for the result of
+ * a synchronous command before going to sleep. Most round trips finish
+ * well within this. GPUPROCESS_CLIENT_SPIN_LIMIT overrides it; the client
+ * never spins on a machine with a single cpu. */
+#define DEFAULT_CLIENT_SPIN_LIMIT 20
+
+/* Pointer arguments too large for the command buffer, like texture uploads
+ * and big client-side vertex arrays, are copied to a second shared ring,
+ * the transfer buffer, rather than to the heap. It is only mapped once the
+ * client first needs it. GPUPROCESS_TRANSFER_BUFFER_SIZE sets its size in
+ * kilobytes, and 0 turns it off. */
+#define DEFAULT_TRANSFER_BUFFER_SIZE (1024 * 16)
 
 struct _client {
     dispatch_table_t dispatch;
@@ -32,14 +65,50 @@ struct _client {
     buffer_t buffer;
     unsigned int token;
 
+    /* Adaptive command buffer sizing, all sizes in bytes. */
+    bool adaptive_buffer;
+    size_t buffer_min_size;
+    size_t buffer_max_size;
+    unsigned int buffer_stalls;
+    unsigned int buffer_idle_syncs;
+    size_t buffer_high_water_mark;
+
+    /* How long to spin waiting for a synchronous command, in ns. */
+    uint64_t sync_spin_time;
+
+    /* Batched publication of commands. */
+    size_t flush_size;
+    uint64_t flush_deadline;
+
+    /* Allocations in the transfer buffer are made and given back in
+     * order; each starts with its size. */
+    buffer_t transfer_buffer;
+    size_t transfer_buffer_size;
+
     egl_state_t *active_state;
 
+    /* The connection to a server in another process, or -1 when the
+     * server runs on a thread of ours. */
+    int server_socket;
+    /* Whether the server gets the commands through the socket, from a
+     * thread of ours that takes the place of the server thread, rather
+     * than reading our buffers itself. */
+    bool stream_transport;
+    /* Copies of the strings that the server returned, which have to outlive
+     * the commands that brought them. */
+    link_list_t *remote_strings;
+
     mutex_t server_started_mutex;
     thread_t server_thread;
     bool initializing;
 
-    sem_t server_signal;
-    sem_t client_signal;
+    /* Set for the client that a thread records a command list with,
+     * which writes the commands to the list instead of to a buffer. */
+    command_list_t *command_list;
+
+    /* Replays the commands that repeat those of an earlier frame, or NULL;
+     * see frame_cache.h. */
+    frame_cache_t *frame_cache;
 };
 
 private client_t *
@@ -64,8 +133,135 @@ private command_t *
 client_get_space_for_size (client_t *client,
                            size_t size);
 
+/* Returns |size| bytes in the transfer buffer, or NULL if they don't fit.
+ * The command that the data belongs to must be flagged with
+ * COMMAND_FLAG_TRANSFER_PAYLOAD, and must be the next one to be flagged,
+ * so that the server gives the allocation back after executing it. */
+private void *
+client_allocate_transfer (client_t *client,
+                          size_t size);
+
+/* This is inline so that the size and the header of the command are
+ * constants in every generated entry point. */
+static inline command_t *
+client_get_space_for_command (command_type_t command_type)
+{
+    assert (command_type >= 0 && command_type < COMMAND_MAX_COMMAND);
+
+    client_t *client = client_get_thread_local ();
+    size_t command_size = command_get_size (command_type);
+    command_t *command = client_get_space_for_size (client, command_size);
+    command->type = command_type;
+    command->flags = 0;
+    command->size = command_size;
+    return command;
+}
+
+/* A server in another process can't follow pointers into the memory of
+ * the client, so the synchronous commands that take them carry copies of
+ * what they point to as their payload, and the results are copied back
+ * once the command has run. */
+static inline bool
+client_is_remote (client_t *client)
+{
+    return client->server_socket >= 0;
+}
+
+/* Called when |size| bytes of arguments fit in neither the command buffer
+ * nor the transfer buffer of a remote client, whose server can't read the
+ * copies the client would otherwise make on its heap. */
+private void
+client_abort_remote_heap_payload (size_t size) __attribute__((noreturn));
+
+/* Like client_get_space_for_command (), but also reserves |payload_size|
+ * bytes after the command, or in the transfer buffer if that is too much,
+ * which command_*_init () uses for the copies of the pointer arguments
+ * instead of allocating them. */
+static inline command_t *
+client_get_space_for_command_with_payload (command_type_t command_type,
+                                           size_t payload_size)
+{
+    client_t *client = client_get_thread_local ();
+    size_t command_size = command_get_size (command_type);
+    command_t *command;
+
+    /* Pointers into a command list would not survive the copy to the
+     * command buffer. */
+    if (unlikely (client->command_list))
+        return client_get_space_for_command (command_type);
+
+    if (payload_size > COMMAND_MAX_INLINE_PAYLOAD) {
+        /* The allocation has to be made first, as it may have to wait for
+         * the server to catch up on the commands already written. */
+        void *payload = client_allocate_transfer (client, payload_size);
+        if (! payload) {
+            if (unlikely (client_is_remote (client)))
+                client_abort_remote_heap_payload (payload_size);
+            return client_get_space_for_command (command_type);
+        }
+
+        command = client_get_space_for_size (client,
+                                             command_size + sizeof (void *));
+        *(void **) ((char *) command + command_size) = payload;
+        command->type = command_type;
+        command->flags = COMMAND_FLAG_TRANSFER_PAYLOAD;
+        command->size = command_size + sizeof (void *);
+        return command;
+    }
+
+    command = client_get_space_for_size (client, command_size + payload_size);
+    command->type = command_type;
+    command->flags = COMMAND_FLAG_INLINE_PAYLOAD;
+    command->size = command_size + payload_size;
+    return command;
+}
+
+/* Like client_get_space_for_command_with_payload (), but a command for a
+ * remote server can't do without its payload. */
 private command_t *
-client_get_space_for_command (command_type_t command_type);
+client_get_space_for_remote_command (command_type_t command_type,
+                                     size_t payload_size);
+
+/* Copies |size| bytes from |argument| to |*payload|, which is moved past
+ * them, and returns the copy. */
+static inline void *
+client_relocate_argument (char **payload,
+                          const void *argument,
+                          size_t size)
+{
+    char *copy = *payload;
+
+    if (! argument)
+        return NULL;
+    memcpy (copy, argument, size);
+    *payload += COMMAND_ALIGN (size);
+    return copy;
+}
+
+/* Returns a copy of |string| that lives as long as the client. */
+private const char *
+client_keep_remote_string (client_t *client,
+                           const char *string);
+
+/* The number of values glGet*v () writes for |pname|. */
+private size_t
+client_get_parameter_count (client_t *client,
+                            GLenum pname);
+
+/* The number of bytes glReadPixels () writes. */
+private size_t
+client_get_read_pixels_size (client_t *client,
+                             GLsizei width,
+                             GLsizei height,
+                             GLenum format,
+                             GLenum type);
+
+/* Uploads larger than this are streamed to the server in chunks of at
+ * most this many bytes, so that they never need more memory than the
+ * transfer buffer, or the command buffer if there is no transfer buffer,
+ * already provides. */
+private size_t
+client_get_stream_chunk_size (client_t *client);
 
 private void
 client_run_command_async (command_t *command);
@@ -76,6 +272,19 @@ client_run_command (command_t *command);
 private bool
 client_flush (client_t *client);
 
+/* Has the GL calls of this thread recorded into |list| until
+ * client_end_command_list (). */
+private void
+client_begin_command_list (command_list_t *list);
+
+private void
+client_end_command_list (void);
+
+/* Appends the commands of |list| to those of |client|, and empties it. */
+private void
+client_call_command_list (client_t *client,
+                          command_list_t *list);
+
 private bool
 should_use_base_dispatch ();
 
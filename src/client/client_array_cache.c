@@ -0,0 +1,196 @@
+#include "config.h"
+#include "client_array_cache.h"
+
+#include "content_hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Every lookup goes through all of the entries, which is still cheap next
+ * to hashing the arrays. */
+#define CLIENT_ARRAY_CACHE_MAX_BUFFERS 256
+#define CLIENT_ARRAY_CACHE_MAX_CANDIDATES 64
+
+typedef struct client_array_cache_entry {
+    uint64_t hash;
+    size_t size;
+    uint64_t last_use;
+    /* 0 while the bytes were only seen once. */
+    GLuint buffer;
+} client_array_cache_entry_t;
+
+struct _client_array_cache {
+    client_array_cache_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    size_t buffer_count;
+    size_t candidate_count;
+
+    /* The bytes that the buffers hold, and how many they may hold. */
+    size_t size;
+    size_t limit;
+    uint64_t clock;
+};
+
+client_array_cache_t *
+client_array_cache_new (void)
+{
+    const char *value = getenv ("GPUPROCESS_CLIENT_ARRAY_CACHE");
+    client_array_cache_t *cache;
+    size_t kilobytes;
+
+    if (! value || ! (kilobytes = strtoul (value, NULL, 10)))
+        return NULL;
+
+    cache = malloc (sizeof (client_array_cache_t));
+    if (! cache)
+        return NULL;
+    memset (cache, 0, sizeof (client_array_cache_t));
+
+    cache->limit = kilobytes * 1024;
+    return cache;
+}
+
+void
+client_array_cache_destroy (client_array_cache_t *cache)
+{
+    free (cache->entries);
+    free (cache);
+}
+
+static client_array_cache_entry_t *
+client_array_cache_find (client_array_cache_t *cache,
+                         uint64_t hash,
+                         size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < cache->count; i++) {
+        if (cache->entries[i].hash == hash && cache->entries[i].size == size)
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+/* Returns the entry of the least recently used buffer, or, if |candidate|
+ * is set, of the least recently seen bytes without one. */
+static client_array_cache_entry_t *
+client_array_cache_find_oldest (client_array_cache_t *cache,
+                                bool candidate)
+{
+    client_array_cache_entry_t *oldest = NULL;
+    size_t i;
+
+    for (i = 0; i < cache->count; i++) {
+        client_array_cache_entry_t *entry = &cache->entries[i];
+        if ((entry->buffer == 0) == candidate &&
+            (! oldest || entry->last_use < oldest->last_use))
+            oldest = entry;
+    }
+    return oldest;
+}
+
+static client_array_cache_entry_t *
+client_array_cache_append (client_array_cache_t *cache)
+{
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 64;
+        client_array_cache_entry_t *entries =
+            realloc (cache->entries, capacity * sizeof (client_array_cache_entry_t));
+        if (! entries)
+            return NULL;
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    return &cache->entries[cache->count++];
+}
+
+/* Remembers bytes that were seen for the first time, in place of those
+ * that were seen the longest ago once there are too many. */
+static void
+client_array_cache_remember (client_array_cache_t *cache,
+                             uint64_t hash,
+                             size_t size)
+{
+    client_array_cache_entry_t *entry;
+
+    if (cache->candidate_count == CLIENT_ARRAY_CACHE_MAX_CANDIDATES)
+        entry = client_array_cache_find_oldest (cache, true);
+    else if ((entry = client_array_cache_append (cache)))
+        cache->candidate_count++;
+    if (! entry)
+        return;
+
+    entry->hash = hash;
+    entry->size = size;
+    entry->last_use = ++cache->clock;
+    entry->buffer = 0;
+}
+
+GLuint
+client_array_cache_lookup (client_array_cache_t *cache,
+                           const void *data,
+                           size_t size,
+                           uint64_t *hash,
+                           bool *upload)
+{
+    client_array_cache_entry_t *entry;
+
+    *upload = false;
+    if (size < CLIENT_ARRAY_CACHE_MIN_SIZE || size > cache->limit)
+        return 0;
+
+    *hash = content_hash (data, size);
+    entry = client_array_cache_find (cache, *hash, size);
+    if (! entry) {
+        client_array_cache_remember (cache, *hash, size);
+        return 0;
+    }
+
+    entry->last_use = ++cache->clock;
+    if (! entry->buffer)
+        *upload = true;
+    return entry->buffer;
+}
+
+void
+client_array_cache_add (client_array_cache_t *cache,
+                        uint64_t hash,
+                        size_t size,
+                        GLuint buffer)
+{
+    client_array_cache_entry_t *entry = client_array_cache_find (cache, hash, size);
+
+    /* The entry of the bytes is usually still there from the lookup. */
+    if (entry)
+        cache->candidate_count--;
+    else if (! (entry = client_array_cache_append (cache)))
+        return;
+
+    entry->hash = hash;
+    entry->size = size;
+    entry->last_use = ++cache->clock;
+    entry->buffer = buffer;
+    cache->buffer_count++;
+    cache->size += size;
+}
+
+GLuint
+client_array_cache_evict (client_array_cache_t *cache)
+{
+    client_array_cache_entry_t *oldest;
+    GLuint buffer;
+
+    if (cache->size <= cache->limit &&
+        cache->buffer_count <= CLIENT_ARRAY_CACHE_MAX_BUFFERS)
+        return 0;
+
+    oldest = client_array_cache_find_oldest (cache, false);
+    if (! oldest)
+        return 0;
+
+    buffer = oldest->buffer;
+    cache->size -= oldest->size;
+    cache->buffer_count--;
+    *oldest = cache->entries[--cache->count];
+    return buffer;
+}
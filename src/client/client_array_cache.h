@@ -0,0 +1,62 @@
+#ifndef GPUPROCESS_CLIENT_ARRAY_CACHE_H
+#define GPUPROCESS_CLIENT_ARRAY_CACHE_H
+
+#include "compiler_private.h"
+#include <GLES2/gl2.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Applications that draw from client-side arrays mostly draw the same
+ * geometry frame after frame, which the caching client would otherwise
+ * copy into the command buffer for every draw.
+ *
+ * The cache tells the bytes that a draw reads apart by their content hash
+ * and size, and keeps buffer objects on the server that hold a copy of
+ * them. The first time some bytes are seen they are only remembered, so
+ * that arrays that change every frame don't fill the cache, and the
+ * second time the caching client copies them to a new buffer object. From
+ * then on, the draws that read the same bytes bind that buffer instead of
+ * copying them. The buffers that were used least recently are deleted once
+ * they take more than the size of the cache.
+ *
+ * Each context has its own cache, which is off unless
+ * GPUPROCESS_CLIENT_ARRAY_CACHE is set to its size in kilobytes. */
+
+typedef struct _client_array_cache client_array_cache_t;
+
+/* Arrays smaller than this are cheaper to copy than to hash. */
+#define CLIENT_ARRAY_CACHE_MIN_SIZE 1024
+
+/* Returns NULL if the cache is off. */
+private client_array_cache_t *
+client_array_cache_new (void);
+
+/* The buffers are left to the context, which deletes them with itself. */
+private void
+client_array_cache_destroy (client_array_cache_t *cache);
+
+/* Returns the buffer that holds the |size| bytes at |data|, or 0 if there
+ * is none. When there is none and the same bytes were seen before, it sets
+ * |*upload|, and the caller should copy them to a new buffer and hand that
+ * to client_array_cache_add () with |*hash|, before the next lookup. */
+private GLuint
+client_array_cache_lookup (client_array_cache_t *cache,
+                           const void *data,
+                           size_t size,
+                           uint64_t *hash,
+                           bool *upload);
+
+private void
+client_array_cache_add (client_array_cache_t *cache,
+                        uint64_t hash,
+                        size_t size,
+                        GLuint buffer);
+
+/* Returns a buffer that the caller should delete, as the cache is over its
+ * size, or 0 once it isn't. Called after a draw, so that none of the
+ * buffers that it reads is deleted before it runs. */
+private GLuint
+client_array_cache_evict (client_array_cache_t *cache);
+
+#endif /* GPUPROCESS_CLIENT_ARRAY_CACHE_H */
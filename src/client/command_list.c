@@ -0,0 +1,151 @@
+#include "config.h"
+#include "command_list.h"
+
+#include "client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMMAND_LIST_INITIAL_CAPACITY (4 * 1024)
+
+command_list_t *
+command_list_new (void)
+{
+    command_list_t *list = malloc (sizeof (command_list_t));
+    if (! list)
+        return NULL;
+    memset (list, 0, sizeof (command_list_t));
+    return list;
+}
+
+void
+command_list_destroy (command_list_t *list)
+{
+    command_list_discard (list);
+    free (list->commands);
+    free (list);
+}
+
+void
+command_list_discard (command_list_t *list)
+{
+    size_t offset = 0;
+
+    while (offset < list->size) {
+        command_t *command = (command_t *) (list->commands + offset);
+        command_destroy_arguments (command);
+        offset += command->size;
+    }
+    command_list_clear (list);
+}
+
+static void
+command_list_reserve (command_list_t *list,
+                      size_t size)
+{
+    size_t capacity = list->capacity ? list->capacity :
+                                       COMMAND_LIST_INITIAL_CAPACITY;
+    char *commands;
+
+    if (list->size + size <= list->capacity)
+        return;
+
+    while (capacity < list->size + size)
+        capacity *= 2;
+
+    commands = realloc (list->commands, capacity);
+    if (! commands) {
+        fprintf (stderr, "Could not grow a command list to %zu bytes.\n",
+                 capacity);
+        abort ();
+    }
+    list->commands = commands;
+    list->capacity = capacity;
+}
+
+command_t *
+command_list_get_space (command_list_t *list,
+                        size_t size)
+{
+    command_t *command;
+
+    command_list_reserve (list, size);
+    command = (command_t *) (list->commands + list->size);
+
+    /* The encoders leave the fields that the caching client fills in,
+     * like the arrays a draw frees, to whoever reserved the command. */
+    memset (command, 0, size);
+    return command;
+}
+
+void
+command_list_advance (command_list_t *list,
+                      command_t *command)
+{
+    list->size += command->size;
+}
+
+void
+command_list_append (command_list_t *list,
+                     command_list_t *other)
+{
+    command_list_reserve (list, other->size);
+    memcpy (list->commands + list->size, other->commands, other->size);
+    list->size += other->size;
+    list->dropped_commands |= other->dropped_commands;
+    command_list_clear (other);
+}
+
+void
+command_list_clear (command_list_t *list)
+{
+    list->size = 0;
+    list->dropped_commands = false;
+}
+
+/* The entry points of GL_GPUPROCESS_command_list, which only
+ * eglGetProcAddress () hands out. */
+GLcommandlistGPUPROCESS
+__hidden_gpuproxy_glCreateCommandListGPUPROCESS (void)
+{
+    INSTRUMENT();
+    if (should_use_base_dispatch ())
+        return NULL;
+    return command_list_new ();
+}
+
+void
+__hidden_gpuproxy_glBeginCommandListGPUPROCESS (GLcommandlistGPUPROCESS list)
+{
+    INSTRUMENT();
+    if (should_use_base_dispatch () || ! list || list->recording)
+        return;
+    client_begin_command_list (list);
+}
+
+void
+__hidden_gpuproxy_glEndCommandListGPUPROCESS (void)
+{
+    INSTRUMENT();
+    if (should_use_base_dispatch ())
+        return;
+    client_end_command_list ();
+}
+
+void
+__hidden_gpuproxy_glCallCommandListGPUPROCESS (GLcommandlistGPUPROCESS list)
+{
+    INSTRUMENT();
+    if (should_use_base_dispatch () || ! list || list->recording)
+        return;
+    client_call_command_list (client_get_thread_local (), list);
+}
+
+void
+__hidden_gpuproxy_glDeleteCommandListGPUPROCESS (GLcommandlistGPUPROCESS list)
+{
+    INSTRUMENT();
+    if (should_use_base_dispatch () || ! list || list->recording)
+        return;
+    command_list_destroy (list);
+}
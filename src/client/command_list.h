@@ -0,0 +1,75 @@
+#ifndef GPUPROCESS_COMMAND_LIST_H
+#define GPUPROCESS_COMMAND_LIST_H
+
+#include "command.h"
+#include "compiler_private.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Commands recorded by a thread without a context, which the thread that
+ * has one later submits into its command buffer, through the
+ * GL_GPUPROCESS_command_list entry points that eglGetProcAddress ()
+ * returns:
+ *   GLcommandlistGPUPROCESS glCreateCommandListGPUPROCESS (void);
+ *   void glBeginCommandListGPUPROCESS (GLcommandlistGPUPROCESS list);
+ *   void glEndCommandListGPUPROCESS (void);
+ *   void glCallCommandListGPUPROCESS (GLcommandlistGPUPROCESS list);
+ *   void glDeleteCommandListGPUPROCESS (GLcommandlistGPUPROCESS list);
+ *
+ * Between glBeginCommandListGPUPROCESS () and glEndCommandListGPUPROCESS (),
+ * the GL calls of a thread go to a client of its own whose command buffer
+ * is the list, encoded exactly as they would be in the command buffer.
+ * The copies of their pointer arguments live on the heap rather than
+ * after the commands, so that the list can be copied into the command
+ * buffer as it is. Calls that return something or write through their
+ * arguments can't be recorded: they are dropped, and the list makes
+ * glCallCommandListGPUPROCESS () raise GL_INVALID_OPERATION.
+ *
+ * The server frees those copies as it executes the commands, so
+ * glCallCommandListGPUPROCESS () leaves the list empty, ready to be
+ * recorded again. */
+typedef struct _command_list {
+    char *commands;
+    size_t size;
+    size_t capacity;
+
+    /* Whether calls were dropped while recording. */
+    bool dropped_commands;
+
+    bool recording;
+} command_list_t;
+
+typedef command_list_t *GLcommandlistGPUPROCESS;
+
+private command_list_t *
+command_list_new (void);
+
+/* Also frees the arguments of commands that were never submitted. */
+private void
+command_list_destroy (command_list_t *list);
+
+/* Frees the arguments of the commands and forgets them, for commands that
+ * won't be submitted. */
+private void
+command_list_discard (command_list_t *list);
+
+/* Returns room for a command of |size| bytes at the end of the list. */
+private command_t *
+command_list_get_space (command_list_t *list,
+                        size_t size);
+
+/* Adds the command that command_list_get_space () returned to the list. */
+private void
+command_list_advance (command_list_t *list,
+                      command_t *command);
+
+/* Moves the commands of |other| to the end of |list|. */
+private void
+command_list_append (command_list_t *list,
+                     command_list_t *other);
+
+/* Forgets the commands, once they have been submitted. */
+private void
+command_list_clear (command_list_t *list);
+
+#endif /* GPUPROCESS_COMMAND_LIST_H */
@@ -58,6 +58,13 @@ eglGetProcAddress (const char *procname)
         return dispatch_table_get_base ()->eglGetProcAddress (NULL, procname);
     }
 
+    /* Implemented by the library, whatever the driver supports. */
+    RETURN_HIDDEN_SYMBOL_IF_NAME_MATCHES (glCreateCommandListGPUPROCESS);
+    RETURN_HIDDEN_SYMBOL_IF_NAME_MATCHES (glBeginCommandListGPUPROCESS);
+    RETURN_HIDDEN_SYMBOL_IF_NAME_MATCHES (glEndCommandListGPUPROCESS);
+    RETURN_HIDDEN_SYMBOL_IF_NAME_MATCHES (glCallCommandListGPUPROCESS);
+    RETURN_HIDDEN_SYMBOL_IF_NAME_MATCHES (glDeleteCommandListGPUPROCESS);
+
     if (_has_extension ("GL_OES_EGL_image")) {
          RETURN_HIDDEN_SYMBOL_IF_NAME_MATCHES (glEGLImageTargetTexture2DOES);
          RETURN_HIDDEN_SYMBOL_IF_NAME_MATCHES (glEGLImageTargetRenderbufferStorageOES);
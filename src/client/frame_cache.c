@@ -0,0 +1,324 @@
+#include "config.h"
+#include "frame_cache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_CACHE_INITIAL_CAPACITY 1024
+
+typedef enum frame_cache_mode {
+    /* Comparing each frame with the one before. */
+    FRAME_CACHE_IDLE,
+    /* The server records the current frame. */
+    FRAME_CACHE_RECORDING,
+    /* The current frame is replayed from the recorded one. */
+    FRAME_CACHE_REPLAYING
+} frame_cache_mode_t;
+
+typedef struct frame_cache_entry {
+    uint64_t hash;
+    uint16_t type;
+    bool replayable;
+} frame_cache_entry_t;
+
+typedef struct frame_cache_frame {
+    frame_cache_entry_t *entries;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int replayable_count;
+    /* Set for a frame with more than COMMAND_FRAME_MAX_COMMANDS commands,
+     * or one that had commands the cache didn't see. */
+    bool overflowed;
+} frame_cache_frame_t;
+
+struct _frame_cache {
+    frame_cache_frame_t frames[3];
+    frame_cache_frame_t *current;
+    frame_cache_frame_t *previous;
+    /* The frame that the server recorded. */
+    frame_cache_frame_t *block;
+
+    frame_cache_mode_t mode;
+    bool client_arrays;
+
+    /* Where the current frame is in the recorded one, how many of its
+     * commands differed so far, and whether it took another shape. */
+    unsigned int cursor;
+    unsigned int patches;
+    bool diverged;
+
+    /* The last replay that went into the command buffer, and its index
+     * there, or NULL if a live command came after it. */
+    command_frame_replay_t *replay;
+    size_t replay_index;
+};
+
+frame_cache_t *
+frame_cache_new (void)
+{
+    const char *value = getenv ("GPUPROCESS_FRAME_CACHE");
+    frame_cache_t *cache;
+
+    if (! value || ! strcmp (value, "0"))
+        return NULL;
+
+    cache = malloc (sizeof (frame_cache_t));
+    if (! cache)
+        return NULL;
+    memset (cache, 0, sizeof (frame_cache_t));
+
+    cache->current = &cache->frames[0];
+    cache->previous = &cache->frames[1];
+    cache->block = &cache->frames[2];
+    cache->mode = FRAME_CACHE_IDLE;
+    return cache;
+}
+
+void
+frame_cache_destroy (frame_cache_t *cache)
+{
+    unsigned int i;
+
+    for (i = 0; i < 3; i++)
+        free (cache->frames[i].entries);
+    free (cache);
+}
+
+static void
+frame_cache_frame_append (frame_cache_frame_t *frame,
+                          command_t *command,
+                          uint64_t hash,
+                          bool replayable)
+{
+    frame_cache_entry_t *entry;
+
+    if (frame->overflowed)
+        return;
+
+    if (frame->count == frame->capacity) {
+        unsigned int capacity = frame->capacity ? frame->capacity * 2 :
+                                                  FRAME_CACHE_INITIAL_CAPACITY;
+        frame_cache_entry_t *entries;
+
+        if (frame->capacity == COMMAND_FRAME_MAX_COMMANDS ||
+            ! (entries = realloc (frame->entries,
+                                  capacity * sizeof (frame_cache_entry_t)))) {
+            frame->overflowed = true;
+            return;
+        }
+        frame->entries = entries;
+        frame->capacity = capacity;
+    }
+
+    entry = &frame->entries[frame->count++];
+    entry->hash = hash;
+    entry->type = command->type;
+    entry->replayable = replayable;
+    if (replayable)
+        frame->replayable_count++;
+}
+
+static void
+frame_cache_frame_clear (frame_cache_frame_t *frame)
+{
+    frame->count = 0;
+    frame->replayable_count = 0;
+    frame->overflowed = false;
+}
+
+/* Whether |frame| is close enough to |other| for the next frame to be
+ * worth recording. */
+static bool
+frame_cache_frames_match (frame_cache_frame_t *frame,
+                          frame_cache_frame_t *other)
+{
+    unsigned int differences = 0;
+    unsigned int i;
+
+    if (frame->overflowed || other->overflowed ||
+        frame->count != other->count || ! frame->replayable_count)
+        return false;
+
+    for (i = 0; i < frame->count; i++) {
+        frame_cache_entry_t *entry = &frame->entries[i];
+        frame_cache_entry_t *other_entry = &other->entries[i];
+
+        if (entry->type != other_entry->type)
+            return false;
+        if (entry->replayable != other_entry->replayable ||
+            (entry->replayable && entry->hash != other_entry->hash))
+            differences++;
+    }
+    return differences * 4 <= frame->replayable_count;
+}
+
+static bool
+frame_cache_is_replayable (frame_cache_t *cache,
+                           command_t *command)
+{
+    if (! command_is_replayable (command))
+        return false;
+
+    switch (command->type) {
+    case COMMAND_GLVERTEXATTRIBPOINTER:
+        return ! cache->client_arrays;
+    case COMMAND_GLDRAWARRAYS:
+        return ! ((command_gldrawarrays_t *) command)->arrays_to_free;
+    case COMMAND_GLDRAWELEMENTS:
+        return ! ((command_gldrawelements_t *) command)->arrays_to_free;
+    default:
+        return true;
+    }
+}
+
+static void
+frame_cache_write_record (client_t *client,
+                          bool begin)
+{
+    command_frame_record_t *command = (command_frame_record_t *)
+        client_get_space_for_command (COMMAND_FRAME_RECORD);
+    command->begin = begin;
+    client_run_command_async (&command->header);
+}
+
+/* Runs the command at |index| of the recorded frame in place of the one
+ * at the write cursor. */
+static command_t *
+frame_cache_replay (client_t *client,
+                    unsigned int index)
+{
+    frame_cache_t *cache = client->frame_cache;
+    buffer_t *buffer = &client->buffer;
+    command_frame_replay_t *replay = cache->replay;
+
+    /* The last replay can still grow as long as the server can't have
+     * seen it. */
+    if (replay && replay->first + replay->count == index &&
+        buffer->producer.head <= cache->replay_index) {
+        replay->count++;
+        return NULL;
+    }
+
+    replay = (command_frame_replay_t *)
+        client_get_space_for_command (COMMAND_FRAME_REPLAY);
+    replay->first = index;
+    replay->count = 1;
+
+    cache->replay = replay;
+    cache->replay_index = buffer->producer.cursor;
+    return &replay->header;
+}
+
+command_t *
+frame_cache_filter (client_t *client,
+                    command_t *command)
+{
+    frame_cache_t *cache = client->frame_cache;
+    frame_cache_entry_t *recorded;
+    bool replayable;
+    uint64_t hash;
+
+    if (command->type == COMMAND_FRAME_RECORD ||
+        command->type == COMMAND_FRAME_REPLAY)
+        return command;
+
+    replayable = frame_cache_is_replayable (cache, command);
+    hash = replayable ? command_hash (command) : 0;
+    frame_cache_frame_append (cache->current, command, hash, replayable);
+
+    if (cache->mode != FRAME_CACHE_REPLAYING || cache->diverged)
+        return command;
+
+    if (cache->cursor == cache->block->count ||
+        cache->block->entries[cache->cursor].type != command->type) {
+        cache->diverged = true;
+        cache->replay = NULL;
+        return command;
+    }
+
+    recorded = &cache->block->entries[cache->cursor++];
+    if (! replayable || ! recorded->replayable || recorded->hash != hash) {
+        if (replayable || recorded->replayable)
+            cache->patches++;
+        cache->replay = NULL;
+        return command;
+    }
+    return frame_cache_replay (client, cache->cursor - 1);
+}
+
+bool
+frame_cache_holds_replay (client_t *client)
+{
+    frame_cache_t *cache = client->frame_cache;
+
+    return cache && cache->replay &&
+           client->buffer.producer.head <= cache->replay_index;
+}
+
+void
+frame_cache_end_frame (client_t *client)
+{
+    frame_cache_t *cache = client->frame_cache;
+    frame_cache_frame_t *finished = cache->current;
+
+    switch (cache->mode) {
+    case FRAME_CACHE_IDLE:
+        if (frame_cache_frames_match (cache->current, cache->previous)) {
+            frame_cache_write_record (client, true);
+            cache->mode = FRAME_CACHE_RECORDING;
+        }
+        break;
+    case FRAME_CACHE_RECORDING:
+        frame_cache_write_record (client, false);
+        if (finished->overflowed) {
+            cache->mode = FRAME_CACHE_IDLE;
+            break;
+        }
+        cache->current = cache->block;
+        cache->block = finished;
+        cache->mode = FRAME_CACHE_REPLAYING;
+        finished = NULL;
+        break;
+    case FRAME_CACHE_REPLAYING:
+        if (cache->diverged || cache->cursor != cache->block->count ||
+            cache->patches * 4 > cache->block->replayable_count)
+            cache->mode = FRAME_CACHE_IDLE;
+        break;
+    }
+
+    /* The recorded frame took the place of the current one. */
+    if (finished) {
+        cache->current = cache->previous;
+        cache->previous = finished;
+    }
+    frame_cache_frame_clear (cache->current);
+
+    cache->cursor = 0;
+    cache->patches = 0;
+    cache->diverged = false;
+    cache->replay = NULL;
+}
+
+void
+frame_cache_abandon (client_t *client)
+{
+    frame_cache_t *cache = client->frame_cache;
+
+    if (! cache)
+        return;
+
+    if (cache->mode == FRAME_CACHE_RECORDING)
+        frame_cache_write_record (client, false);
+    cache->mode = FRAME_CACHE_IDLE;
+    cache->current->overflowed = true;
+    cache->replay = NULL;
+}
+
+void
+frame_cache_set_client_arrays (client_t *client,
+                               bool client_arrays)
+{
+    if (client->frame_cache)
+        client->frame_cache->client_arrays = client_arrays;
+}
@@ -0,0 +1,67 @@
+#ifndef GPUPROCESS_FRAME_CACHE_H
+#define GPUPROCESS_FRAME_CACHE_H
+
+#include "client.h"
+#include "compiler_private.h"
+#include <stdbool.h>
+
+/* Most applications send the same commands frame after frame, so rather
+ * than encoding them again, the client can have the server run them from
+ * a copy of an earlier frame, much like a display list.
+ *
+ * The client keeps a hash of every command of the current frame, over the
+ * command and its inline payload, and compares the frame with the previous
+ * one at eglSwapBuffers (). Once two frames in a row match, it has the
+ * server record the next one with COMMAND_FRAME_RECORD. From then on,
+ * every command that matches the command at the same position of the
+ * recorded frame is left out of the command buffer, and runs of them
+ * become a single COMMAND_FRAME_REPLAY instead. The commands that differ,
+ * like a uniform that changes every frame, are sent as they are, between
+ * the runs they split. A frame that takes another shape, or in which more
+ * than a quarter of the commands differ, goes back to comparing frames.
+ *
+ * Only commands that are complete without the memory of the client or the
+ * transfer buffer are replayed: synchronous commands, draws from client
+ * arrays and commands whose payload doesn't fit in the command buffer
+ * always run live. The cache is off unless GPUPROCESS_FRAME_CACHE is set to
+ * a value other than 0. */
+
+/* Returns NULL if the frame cache is off. */
+private frame_cache_t *
+frame_cache_new (void);
+
+private void
+frame_cache_destroy (frame_cache_t *cache);
+
+/* Called with each command of |client| before it is added to the command
+ * buffer, with the command at the write cursor. Returns the command to
+ * add instead, which is either |command| or a COMMAND_FRAME_REPLAY that
+ * took its place, or NULL if the command went into the replay that is
+ * already there. */
+private command_t *
+frame_cache_filter (client_t *client,
+                    command_t *command);
+
+/* Whether the last command in the command buffer is a replay that later
+ * commands can still go into, which publishing it would prevent. The
+ * caching client doesn't flush after the draws that went into one. */
+private bool
+frame_cache_holds_replay (client_t *client);
+
+/* Called once eglSwapBuffers () is in the command buffer. */
+private void
+frame_cache_end_frame (client_t *client);
+
+/* Gives up on the current frame, for commands that don't go through
+ * frame_cache_filter (), like those of a command list. */
+private void
+frame_cache_abandon (client_t *client);
+
+/* The caching client writes the glVertexAttribPointer () commands of
+ * client arrays in between these, as they point at copies that only live
+ * until the draw. */
+private void
+frame_cache_set_client_arrays (client_t *client,
+                               bool client_arrays);
+
+#endif /* GPUPROCESS_FRAME_CACHE_H */
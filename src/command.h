@@ -2,6 +2,7 @@
 #define GPUPROCESS_COMMAND_H
 
 #include "compiler_private.h"
+#include "memory_pool.h"
 #include "types_private.h"
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
@@ -10,31 +11,142 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 typedef enum command_type {
     COMMAND_NO_OP,
     COMMAND_SHUTDOWN,
+    /* Sent by the frame cache of the client, see frame_cache.h. */
+    COMMAND_FRAME_RECORD,
+    COMMAND_FRAME_REPLAY,
 
 #include "generated/command_types_autogen.h"
 
     COMMAND_MAX_COMMAND
 } command_type_t;
 
+/* Every command starts at a multiple of this in the command buffer. */
+#define COMMAND_ALIGNMENT 8
+#define COMMAND_ALIGN(size) \
+    (((size) + COMMAND_ALIGNMENT - 1) & ~((size_t) COMMAND_ALIGNMENT - 1))
+
+typedef enum command_flags {
+    /* The client waits until the server has executed this command. The
+     * server executes synchronous commands in the order the client sends
+     * them, so it completes them by counting; no token is stored. */
+    COMMAND_FLAG_SYNCHRONOUS = 1 << 0,
+    /* The copies of the pointer arguments follow the command in the
+     * command buffer, instead of living on the heap. */
+    COMMAND_FLAG_INLINE_PAYLOAD = 1 << 1,
+    /* The copies of the pointer arguments live in an allocation in the
+     * client's transfer buffer, which the server gives back once it has
+     * executed the command. Unless the command manages the allocation
+     * itself, like the draw calls do, a pointer to it follows the command
+     * struct. */
+    COMMAND_FLAG_TRANSFER_PAYLOAD = 1 << 2,
+    /* Set by the server's prepare stage once it has done the work of the
+     * command that doesn't need the GL context, which the handler then
+     * skips. */
+    COMMAND_FLAG_PREPARED = 1 << 3
+} command_flags_t;
+
+/* Pointer arguments larger than this go to the transfer buffer, or to the
+ * heap if they don't fit there either, so that they don't force the
+ * command buffer to grow. */
+#define COMMAND_MAX_INLINE_PAYLOAD (8 * 1024)
+
+/* The header is packed into 8 bytes, and its alignment pads every command
+ * struct to a multiple of COMMAND_ALIGNMENT. */
 typedef struct command {
-    command_type_t type;
-    size_t size;
+    uint16_t type;
+    uint16_t flags;
+
+    /* The size of the whole command in bytes, including any data that
+     * the client stored after the struct. */
+    uint32_t size;
+} __attribute__((aligned (COMMAND_ALIGNMENT))) command_t;
+
+/* Whether the copies of the pointer arguments belong to the command buffer
+ * or the transfer buffer, in which case they must not be freed. */
+static inline bool
+command_has_payload (command_t *command)
+{
+    return command->flags & (COMMAND_FLAG_INLINE_PAYLOAD |
+                             COMMAND_FLAG_TRANSFER_PAYLOAD);
+}
+
+/* Returns where command_*_init () should copy the pointer arguments of a
+ * command whose struct is |command_size| bytes long, or NULL if they have
+ * to be allocated on the heap. */
+static inline char *
+command_get_payload (command_t *command, size_t command_size)
+{
+    if (command->flags & COMMAND_FLAG_INLINE_PAYLOAD)
+        return (char *) command + command_size;
+    if (command->flags & COMMAND_FLAG_TRANSFER_PAYLOAD)
+        return *(char **) ((char *) command + command_size);
+    return NULL;
+}
 
-    /* The token is used for making synchronous calls. */
-    unsigned int token; 
-} command_t;
+/* The client of a server in another process reserves this many bytes
+ * of payload for commands that return strings, as the server's copy of
+ * the string is out of its reach. */
+#define COMMAND_MAX_STRING_RESULT (16 * 1024)
 
-private void
-command_initialize_sizes (size_t* sizes);
+/* Copies the string returned by a command to the payload the client
+ * reserved for it, if any, and returns the string the client should see. */
+static inline const char *
+command_copy_string_result (command_t *command,
+                            size_t command_size,
+                            const char *result)
+{
+    char *payload = command_get_payload (command, command_size);
+    if (! payload || ! result)
+        return result;
 
-private size_t
-command_get_size (command_type_t command_type);
+    strncpy (payload, result, COMMAND_MAX_STRING_RESULT - 1);
+    payload[COMMAND_MAX_STRING_RESULT - 1] = '\0';
+    return payload;
+}
+
+/* The hash the frame cache tells commands apart by, which only needs to
+ * be good enough that two different commands practically never collide,
+ * and fast. */
+#define COMMAND_HASH_PRIME_1 0x9e3779b185ebca87ull
+#define COMMAND_HASH_PRIME_2 0xc2b2ae3d27d4eb4full
+
+static inline uint64_t
+command_hash_word (uint64_t hash,
+                   uint64_t word)
+{
+    hash ^= word * COMMAND_HASH_PRIME_2;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * COMMAND_HASH_PRIME_1;
+}
+
+/* For the fields of a command, which are at most 8 bytes long. */
+static inline uint64_t
+command_hash_value (uint64_t hash,
+                    const void *value,
+                    size_t size)
+{
+    uint64_t word = 0;
+    memcpy (&word, value, size);
+    return command_hash_word (hash, word);
+}
+
+private uint64_t
+command_hash_bytes (uint64_t hash,
+                    const void *data,
+                    size_t size);
 
 #include "command_custom.h"
 #include "generated/command_autogen.h"
 
+static inline size_t
+command_get_size (command_type_t command_type)
+{
+    return command_sizes[command_type];
+}
+
 #endif /* GPUPROCESS_COMMAND_H */
@@ -3,6 +3,93 @@
 #include "gles2_utils.h"
 #include <string.h>
 
+/* Computes how many bytes the copy of an image takes with the current
+ * unpack state. Returns false if the dimensions are invalid. */
+static bool
+command_compute_image_size (GLsizei width,
+                            GLsizei height,
+                            GLenum format,
+                            GLenum type,
+                            uint32_t *dest_size,
+                            uint32_t *unpadded_row_size,
+                            uint32_t *padded_row_size)
+{
+    return compute_image_data_sizes (width, height, format, type,
+                                     client_get_unpack_alignment (),
+                                     client_get_unpack_row_length (),
+                                     client_get_unpack_skip_rows (),
+                                     dest_size, unpadded_row_size,
+                                     padded_row_size);
+}
+
+static size_t
+command_image_payload_size (GLsizei width,
+                            GLsizei height,
+                            GLenum format,
+                            GLenum type,
+                            const void *pixels)
+{
+    uint32_t dest_size;
+    uint32_t unpadded_row_size;
+    uint32_t padded_row_size;
+
+    if (! pixels ||
+        ! command_compute_image_size (width, height, format, type, &dest_size,
+                                      &unpadded_row_size, &padded_row_size))
+        return 0;
+    return COMMAND_ALIGN (dest_size);
+}
+
+/* Copies the pixels to the payload the client reserved for the command or,
+ * failing that, to the heap. */
+static void *
+command_copy_image (command_t *abstract_command,
+                    size_t command_size,
+                    GLsizei width,
+                    GLsizei height,
+                    GLenum format,
+                    GLenum type,
+                    const void *pixels)
+{
+    uint32_t dest_size;
+    uint32_t unpadded_row_size;
+    uint32_t padded_row_size;
+    void *copy;
+
+    if (! pixels)
+        return NULL;
+
+    if (! command_compute_image_size (width, height, format, type, &dest_size,
+                                      &unpadded_row_size, &padded_row_size)) {
+        /* TODO: Set an error on the client-side.
+         SetGLError(GL_INVALID_VALUE, "glTexImage2D", "dimension < 0"); */
+        return NULL;
+    }
+
+    copy = command_get_payload (abstract_command, command_size);
+    if (! copy)
+        copy = memory_pool_alloc (dest_size);
+    copy_rect_to_buffer (pixels, copy, format, type, height,
+                         client_get_unpack_skip_pixels (),
+                         client_get_unpack_skip_rows (),
+                         unpadded_row_size, padded_row_size, padded_row_size);
+    return copy;
+}
+
+size_t
+command_glteximage2d_payload_size (GLenum target,
+                                   GLint level,
+                                   GLint internalformat,
+                                   GLsizei width,
+                                   GLsizei height,
+                                   GLint border,
+                                   GLenum format,
+                                   GLenum type,
+                                   const void* pixels)
+{
+    return command_image_payload_size (width, height, format, type, pixels);
+}
+
 void
 command_glteximage2d_init (command_t *abstract_command,
                            GLenum target,
@@ -25,31 +112,24 @@ command_glteximage2d_init (command_t *abstract_command,
     command->border = (GLint) border;
     command->format = (GLenum) format;
     command->type = (GLenum) type;
-    command->pixels = NULL;
-
-    uint32_t dest_size;
-    uint32_t unpadded_row_size;
-    uint32_t padded_row_size;
-    uint32_t unpack_alignment = client_get_unpack_alignment ();
-    uint32_t unpack_row_length = client_get_unpack_row_length ();
-    uint32_t unpack_skip_pixels = client_get_unpack_skip_pixels ();
-    uint32_t unpack_skip_rows = client_get_unpack_skip_rows ();
-
-    if (! pixels)
-        return;
-
-    if (!compute_image_data_sizes (width, height, format, type,
-                                   unpack_alignment, unpack_row_length, unpack_skip_rows, &dest_size,
-                                   &unpadded_row_size, &padded_row_size)) {
-        /* TODO: Set an error on the client-side.
-         SetGLError(GL_INVALID_VALUE, "glTexImage2D", "dimension < 0"); */
-        return;
-    }
+    command->pixels = command_copy_image (abstract_command,
+                                          sizeof (command_glteximage2d_t),
+                                          width, height, format, type,
+                                          pixels);
+}
 
-    command->pixels = malloc (dest_size);
-    copy_rect_to_buffer (pixels, command->pixels, format, type, height,
-                         unpack_skip_pixels, unpack_skip_rows,
-                         unpadded_row_size, padded_row_size, padded_row_size);
+size_t
+command_gltexsubimage2d_payload_size (GLenum target,
+                                      GLint level,
+                                      GLint xoffset,
+                                      GLint yoffset,
+                                      GLsizei width,
+                                      GLsizei height,
+                                      GLenum format,
+                                      GLenum type,
+                                      const void* pixels)
+{
+    return command_image_payload_size (width, height, format, type, pixels);
 }
 
 void
@@ -74,32 +154,43 @@ command_gltexsubimage2d_init (command_t *abstract_command,
     command->height = (GLsizei) height;
     command->format = (GLenum) format;
     command->type = (GLenum) type;
+    command->pixels = command_copy_image (abstract_command,
+                                          sizeof (command_gltexsubimage2d_t),
+                                          width, height, format, type,
+                                          pixels);
+}
 
-    uint32_t dest_size;
-    uint32_t unpadded_row_size;
-    uint32_t padded_row_size;
-    uint32_t unpack_alignment = client_get_unpack_alignment ();
-    uint32_t unpack_row_length = client_get_unpack_row_length ();
-    uint32_t unpack_skip_pixels = client_get_unpack_skip_pixels ();
-    uint32_t unpack_skip_rows = client_get_unpack_skip_rows ();
-
-    if (! compute_image_data_sizes (width, height, format,
-                                    type, unpack_alignment, unpack_skip_rows, unpack_row_length,
-                                    &dest_size, &unpadded_row_size,
-                                    &padded_row_size)) {
-        /* XXX: Set a GL error on the client side here. */
-        /* SetGLError(GL_INVALID_VALUE, "glTexSubImage2D", "size to large"); */
-        return;
-    }
+static size_t
+command_glshadersource_string_length (const GLchar **string,
+                                      const GLint *length,
+                                      GLsizei i)
+{
+    if (! string[i])
+        return 0;
+    if (length && length[i] >= 0)
+        return length[i];
+    return strlen (string[i]);
+}
 
-    command->pixels = malloc (dest_size);
-    copy_rect_to_buffer (pixels, command->pixels, format, type, height,
-                         unpack_skip_pixels, unpack_skip_rows,
-                         unpadded_row_size, padded_row_size, padded_row_size);
+size_t
+command_glshadersource_payload_size (GLuint shader,
+                                     GLsizei count,
+                                     const GLchar **string,
+                                     const GLint *length)
+{
+    size_t strings_size = 0;
+    GLsizei i;
+
+    if (count <= 0 || ! string)
+        return 0;
+
+    for (i = 0; i < count; i++)
+        strings_size += command_glshadersource_string_length (string, length, i) + 1;
+    return COMMAND_ALIGN (count * sizeof (char *)) + COMMAND_ALIGN (strings_size);
 }
 
-/* XXX: command_glshadersource_init: could be auto generated, however it will break the logic */
-/* in the python code */
+/* The strings are copied null-terminated, so the server doesn't need the
+ * lengths. */
 void
 command_glshadersource_init (command_t *abstract_command,
                              GLuint shader,
@@ -109,54 +200,52 @@ command_glshadersource_init (command_t *abstract_command,
 {
     command_glshadersource_t *command =
         (command_glshadersource_t *) abstract_command;
+    char *payload = command_get_payload (abstract_command,
+                                         sizeof (command_glshadersource_t));
+    GLsizei i;
+
     command->shader = (GLuint) shader;
     command->count = (GLsizei) count;
-    command->string = ( char**) string;
-    command->length = ( GLint*) length;
+    command->length = NULL;
+    command->string = NULL;
+
+    if (count <= 0 || ! string) {
+        command->count = 0;
+        return;
+    }
+
+    if (payload) {
+        command->string = (char **) payload;
+        payload += COMMAND_ALIGN (count * sizeof (char *));
+    } else
+        command->string = memory_pool_alloc (count * sizeof (char *));
+
+    for (i = 0; i < count; i++) {
+        size_t string_length =
+            command_glshadersource_string_length (string, length, i);
+
+        if (payload) {
+            command->string[i] = payload;
+            payload += string_length + 1;
+        } else
+            command->string[i] = memory_pool_alloc (string_length + 1);
+
+        if (string_length)
+            memcpy (command->string[i], string[i], string_length);
+        command->string[i][string_length] = 0;
+    }
 }
 
 void
 command_glshadersource_destroy_arguments (command_glshadersource_t *command)
 {
-    if (command->count <= 0)
+    if (command->count <= 0 || command_has_payload (&command->header))
         return;
 
     unsigned i = 0;
     for (i = 0; i < command->count; i++)
-        free (command->string[i]);
-    free (command->string);
-}
-
-void
-command_gltexparameteriv_init (command_t *abstract_command,
-                               GLenum target,
-                               GLenum pname,
-                               const GLint *params)
-{
-    command_gltexparameteriv_t *command =
-        (command_gltexparameteriv_t *) abstract_command;
-    command->target = target;
-    command->pname = pname;
-
-    size_t params_size = sizeof (GLint);
-    command->params = malloc (params_size);
-    memcpy (command->params, params, params_size);
-}
-
-void
-command_gltexparameterfv_init (command_t *abstract_command,
-                               GLenum target,
-                               GLenum pname,
-                               const GLfloat *params)
-{
-    command_gltexparameterfv_t *command =
-        (command_gltexparameterfv_t *) abstract_command;
-    command->target = target;
-    command->pname = pname;
-
-    size_t params_size = sizeof (GLfloat);
-    command->params = malloc (params_size);
-    memcpy (command->params, params, params_size);
+        memory_pool_free (command->string[i]);
+    memory_pool_free (command->string);
 }
 
 void
@@ -178,3 +267,22 @@ command_glvertexattribpointer_destroy_arguments (command_glvertexattribpointer_t
     /* This command is asynchronous, but we don't want to free the pointer
      * until after glDraw(Elements/Arrays). */
 }
+
+uint64_t
+command_hash_bytes (uint64_t hash,
+                    const void *data,
+                    size_t size)
+{
+    const char *bytes = data;
+    uint64_t word;
+    size_t i;
+
+    hash = command_hash_word (hash, size);
+    for (i = 0; i + sizeof (uint64_t) <= size; i += sizeof (uint64_t)) {
+        memcpy (&word, bytes + i, sizeof (uint64_t));
+        hash = command_hash_word (hash, word);
+    }
+    if (i < size)
+        hash = command_hash_value (hash, bytes + i, size - i);
+    return hash;
+}
@@ -14,3 +14,20 @@ typedef struct _command_gldrawarrays {
     GLsizei count;
     link_list_t *arrays_to_free;
 } command_gldrawarrays_t;
+
+/* Starts or ends the recording of the frame that the server keeps, which
+ * holds at most COMMAND_FRAME_MAX_COMMANDS commands. */
+#define COMMAND_FRAME_MAX_COMMANDS (64 * 1024)
+
+typedef struct _command_frame_record {
+    command_t header;
+    uint32_t begin;
+} command_frame_record_t;
+
+/* Runs |count| commands of the recorded frame, starting with the one at
+ * |first|, in place of the same commands of the current frame. */
+typedef struct _command_frame_replay {
+    command_t header;
+    uint32_t first;
+    uint32_t count;
+} command_frame_replay_t;
@@ -22,6 +22,11 @@
 
 #define UNUSED_PARAM(var) (void)var
 
+/* Data written by different threads should live on different cache
+ * lines, otherwise every write invalidates the line in the other core. */
+#define CACHE_LINE_SIZE 64
+#define cache_line_aligned __attribute__((aligned (CACHE_LINE_SIZE)))
+
 #if ENABLE_PROFILING
 private unsigned long
 get_time_in_milliseconds ();
@@ -12,6 +12,8 @@ _free_array_buffer (void *data)
 
     if (buffer->data)
         free (buffer->data);
+    if (buffer->index_ranges)
+        index_range_cache_destroy (buffer->index_ranges);
 
     free (buffer);
 }
@@ -58,8 +60,8 @@ egl_state_init (egl_state_t *state,
 
     state->vertex_attribs.attribs = state->vertex_attribs.embedded_attribs;
     
-    state->vertex_attribs.first_index_pointer = 0;
-    state->vertex_attribs.last_index_pointer = 0;
+    state->vertex_attribs.enabled_mask = 0;
+    state->vertex_attribs.buffer_mask = 0;
 
     state->max_combined_texture_image_units = 8;
     state->max_vertex_attribs_queried = false;
@@ -121,6 +123,7 @@ egl_state_init (egl_state_t *state,
 
     state->element_array_buffer_binding = 0;
     state->element_array_buffer_binding_object = NULL;
+    state->client_array_cache = client_array_cache_new ();
     state->framebuffer_binding = 0;
     state->renderbuffer_binding = 0;
     
@@ -210,6 +213,9 @@ egl_state_destroy (void *abstract_state)
 
     link_list_clear (&state->shader_objects);
 
+    if (state->client_array_cache)
+        client_array_cache_destroy (state->client_array_cache);
+
     if (state->vendor_string)
         free (state->vendor_string);
     if (state->renderer_string)
@@ -685,6 +691,7 @@ _create_array_buffer (GLuint id)
     buffer->id = id;
     buffer->size = 0;
     buffer->data = NULL;
+    buffer->index_ranges = NULL;
     return buffer; 
 }
 
@@ -1,13 +1,16 @@
 #ifndef GPUPROCESS_EGL_STATE_H
 #define GPUPROCESS_EGL_STATE_H
 
+#include "client_array_cache.h"
 #include "hash.h"
+#include "index_range.h"
 #include "name_handler.h"
 #include "program.h"
 #include "thread_private.h"
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define NUM_EMBEDDED 32
 #define ATTRIB_BUFFER_SIZE (1024 * 512)
@@ -30,11 +33,14 @@ typedef struct vertex_attrib
 typedef struct vertex_attrib_list
 {
     int                 count;          /* initial 0 */
-    int                 enabled_count;  /* initial 0 */
+    int                 enabled_count;  /* enabled client-side arrays, initial 0 */
     vertex_attrib_t     embedded_attribs[NUM_EMBEDDED];
     vertex_attrib_t     *attribs;
-    vertex_attrib_t     *first_index_pointer;
-    vertex_attrib_t     *last_index_pointer;
+    /* One bit per entry of |attribs|, for those that are enabled and those
+     * that source a buffer object, so that draws only look at the client-side
+     * arrays. Entries past NUM_EMBEDDED have no bit. */
+    uint32_t            enabled_mask;   /* initial 0 */
+    uint32_t            buffer_mask;    /* initial 0 */
 } vertex_attrib_list_t;
 
 typedef struct _texture {
@@ -86,6 +92,9 @@ typedef struct _array_buffer
     GLuint id;
     GLsizeiptr size;
     unsigned char *data;
+    /* The index ranges that draws found in |data|, created by the first
+     * draw that uses the buffer. */
+    index_range_cache_t *index_ranges;
 } array_buffer_t;
 
 typedef struct egl_state  egl_state_t;
@@ -116,6 +125,7 @@ struct egl_state {
     bool                    need_get_error;
     link_list_t           *shader_objects;         /* initial is NULL */
     vertex_attrib_list_t  vertex_attribs;    /* client states */
+    client_array_cache_t  *client_array_cache;  /* NULL unless enabled */
     name_handler_t        *shader_objects_name_handler; /* shared across shared context */
 
 /* GL states from glGet () */
@@ -83,18 +83,25 @@ _DEFAULT_RETURN_VALUES = {
 # default_return:   Defines what the default return value of this function is, if
 #                   it differs from the list of default return values above.
 
+# remote_argument_size: The size in bytes of what pointer arguments of a
+#                   synchronous function point to, for those it can't be
+#                   derived from the other entries. A client of a server in
+#                   another process copies that much in and out of the command.
+
 _FUNCTION_INFO = {
-  'glDrawArrays' : {
-    'type': 'Synchronous',
-  },
+  # Draws don't wait for the server. The caching client copies client
+  # arrays and indices into the command buffer, the transfer buffer or
+  # the arrays_to_free of the command, which the server frees once the
+  # draw has run; the indices that the base client passes through are
+  # offsets into a buffer object, or data that outlives a command list.
   'glDrawElements' : {
-    'type': 'Synchronous',
+    'type': 'Passthrough',
   },
   'glMultiDrawArraysEXT' : {
-    'type': 'Synchronous',
+    'argument_has_size': { 'first': 'primcount', 'count': 'primcount' },
   },
   'glMultiDrawElementsEXT' : {
-    'type': 'Synchronous',
+    'argument_has_size': { 'count': 'primcount', 'indices': 'primcount' },
   },
   'glTexImage3DOES' : {
     'type': 'Synchronous',
@@ -239,6 +246,12 @@ _FUNCTION_INFO = {
     'argument_has_size': { 'value': 'count' },
     'argument_element_size': { 'value': 16 }
   },
+  'glTexParameterfv': {
+    'argument_element_size': { 'params': 1 }
+  },
+  'glTexParameteriv': {
+    'argument_element_size': { 'params': 1 }
+  },
   'glVertexAttrib1fv': {
     'argument_element_size': { 'values': 1 }
   },
@@ -264,6 +277,7 @@ _FUNCTION_INFO = {
     'out_arguments': ['major', 'minor']
   },
   'eglGetConfigs': {
+    'remote_argument_size': {'configs': 'config_size * sizeof (EGLConfig)'},
     'out_arguments': ['configs', 'num_config']
   },
   'eglGetConfigAttrib': {
@@ -288,29 +302,36 @@ _FUNCTION_INFO = {
     'out_arguments': ['value']
   },
   'glGetBooleanv': {
+    'remote_argument_size': {'params': 'client_get_parameter_count (client, pname) * sizeof (GLboolean)'},
     'out_arguments': ['params']
   },
   'glGetFloatv': {
+    'remote_argument_size': {'params': 'client_get_parameter_count (client, pname) * sizeof (GLfloat)'},
     'out_arguments': ['params']
   },
   'glGetIntegerv': {
+    'remote_argument_size': {'params': 'client_get_parameter_count (client, pname) * sizeof (GLint)'},
     'out_arguments': ['params']
   },
   'glGenBuffers': {
     'type': 'Asynchronous',
-    'out_arguments': ['buffers']
+    'out_arguments': ['buffers'],
+    'argument_has_size': { 'buffers': 'n' }
   },
   'glGenFramebuffers': {
     'type': 'Asynchronous',
-    'out_arguments': ['framebuffers']
+    'out_arguments': ['framebuffers'],
+    'argument_has_size': { 'framebuffers': 'n' }
   },
   'glGenRenderbuffers': {
     'type': 'Asynchronous',
-    'out_arguments': ['renderbuffers']
+    'out_arguments': ['renderbuffers'],
+    'argument_has_size': { 'renderbuffers': 'n' }
   },
   'glGenTextures': {
     'type': 'Asynchronous',
-    'out_arguments': ['textures']
+    'out_arguments': ['textures'],
+    'argument_has_size': { 'textures': 'n' }
   },
   'glCreateProgram': {
     'type': 'Asynchronous'
@@ -319,14 +340,17 @@ _FUNCTION_INFO = {
     'type': 'Asynchronous'
   },
   'glGetActiveAttrib': {
+    'remote_argument_size': {'name': 'bufsize'},
     'out_arguments': ['length', 'size', 'type', 'name'],
     'mapped_names': {'type': 'shader_object', 'attrib_list': ['program']}
   },
   'glGetActiveUniform': {
+    'remote_argument_size': {'name': 'bufsize'},
     'out_arguments': ['length', 'size', 'type', 'name'],
     'mapped_names': {'type': 'shader_object', 'attrib_list': ['program']}
   },
   'glGetAttachedShaders': {
+    'remote_argument_size': {'shaders': 'maxcount * sizeof (GLuint)'},
     'out_arguments': ['count', 'shaders'],
     'mapped_names': {'type': 'shader_object', 'attrib_list': ['program']}
   },
@@ -337,6 +361,7 @@ _FUNCTION_INFO = {
     'out_arguments': {'attrib_list': ['params']}
   },
   'glGetProgramInfoLog': {
+    'remote_argument_size': {'infolog': 'bufsize'},
     'out_arguments': ['length', 'infolog'],
     'mapped_names': {'type': 'shader_object', 'attrib_list': ['program']}
   },
@@ -348,13 +373,16 @@ _FUNCTION_INFO = {
     'out_arguments': ['params']
   },
   'glGetShaderInfoLog': {
+    'remote_argument_size': {'infolog': 'bufsize'},
     'out_arguments': ['length', 'infolog'],
     'mapped_names': {'type': 'shader_object', 'attrib_list': ['shader']}
   },
   'glGetShaderPrecisionFormat': {
+    'remote_argument_size': {'range': '2 * sizeof (GLint)'},
     'out_arguments': ['range', 'precision']
   },
   'glGetShaderSource': {
+    'remote_argument_size': {'source': 'bufsize'},
     'out_arguments': ['length', 'source'],
     'mapped_names': {'type': 'shader_object', 'attrib_list': ['shader']}
   },
@@ -369,26 +397,32 @@ _FUNCTION_INFO = {
     'out_arguments': ['params']
   },
   'glGetUniformiv': {
+    'remote_argument_size': {'params': '16 * sizeof (GLint)'},
     'out_arguments': ['params'],
     'mapped_names': {'type': 'shader_object', 'attrib_list': ['program']}
   },
   'glGetUniformfv': {
+    'remote_argument_size': {'params': '16 * sizeof (GLfloat)'},
     'out_arguments': ['params'],
     'mapped_names': {'type': 'shader_object', 'attrib_list': ['program']}
   },
   'glGetVertexAttribiv': {
+    'remote_argument_size': {'params': '(pname == GL_CURRENT_VERTEX_ATTRIB ? 4 : 1) * sizeof (GLint)'},
     'out_arguments': ['params']
   },
   'glGetVertexAttribfv': {
+    'remote_argument_size': {'params': '(pname == GL_CURRENT_VERTEX_ATTRIB ? 4 : 1) * sizeof (GLfloat)'},
     'out_arguments': ['params']
   },
   'glReadPixels': {
+    'remote_argument_size': {'pixels': 'client_get_read_pixels_size (client, width, height, format, type)'},
     'out_arguments': ['pixels']
   },
   'glGetVertexAttribPointerv': {
     'out_arguments': ['pointer']
   },
   'glGetProgramBinaryOES': {
+    'remote_argument_size': {'binary': 'bufSize'},
     'out_arguments': ['length', 'binaryFormat', 'binary']
   },
   'glGetBufferPointervOES': {
@@ -401,18 +435,23 @@ _FUNCTION_INFO = {
     'out_arguments': ['monitors']
   },
   'glGetPerfMonitorGroupsAMD': {
+    'remote_argument_size': {'groups': 'groupsSize * sizeof (GLuint)'},
     'out_arguments': ['numGroups', 'groups']
   },
   'glGetPerfMonitorCountersAMD': {
+    'remote_argument_size': {'counters': 'counterSize * sizeof (GLuint)'},
     'out_arguments': ['numCounters', 'maxActiveCounters', 'counters']
   },
   'glGetPerfMonitorCounterDataAMD': {
+    'remote_argument_size': {'data': 'dataSize'},
     'out_arguments': ['data', 'bytesWritten']
   },
   'glGetPerfMonitorGroupStringAMD': {
+    'remote_argument_size': {'groupString': 'bufSize'},
     'out_arguments': ['length', 'groupString']
   },
   'glGetPerfMonitorCounterStringAMD': {
+    'remote_argument_size': {'counterString': 'bufSize'},
     'out_arguments': ['length', 'counterString']
   },
   'glGetPerfMonitorCounterInfoAMD': {
@@ -425,21 +464,27 @@ _FUNCTION_INFO = {
     'out_arguments': ['params']
   },
   'glGetDriverControlsQCOM': {
+    'remote_argument_size': {'driverControls': 'size * sizeof (GLuint)'},
     'out_arguments': ['num', 'driverControls']
   },
   'glGetDriverControlStringQCOM': {
+    'remote_argument_size': {'driverControlString': 'bufSize'},
     'out_arguments': ['length', 'driverControlString']
   },
   'glExtGetTexturesQCOM': {
+    'remote_argument_size': {'textures': 'maxTextures * sizeof (GLuint)'},
     'out_arguments': ['textures', 'numTextures']
   },
   'glExtGetBuffersQCOM': {
+    'remote_argument_size': {'buffers': 'maxBuffers * sizeof (GLuint)'},
     'out_arguments': ['buffers', 'numBuffers']
   },
   'glExtGetRenderbuffersQCOM': {
+    'remote_argument_size': {'renderbuffers': 'maxRenderbuffers * sizeof (GLuint)'},
     'out_arguments': ['renderbuffers', 'numRenderbuffers']
   },
   'glExtGetFramebuffersQCOM': {
+    'remote_argument_size': {'framebuffers': 'maxFramebuffers * sizeof (GLuint)'},
     'out_arguments': ['framebuffers', 'numFramebuffers']
   },
   'glExtGetTexLevelParameterivQCOM': {
@@ -452,9 +497,11 @@ _FUNCTION_INFO = {
     'out_arguments': ['params']
   },
   'glExtGetShadersQCOM': {
+    'remote_argument_size': {'shaders': 'maxShaders * sizeof (GLuint)'},
     'out_arguments': ['shaders', 'numShaders']
   },
   'glExtGetProgramsQCOM': {
+    'remote_argument_size': {'programs': 'maxPrograms * sizeof (GLuint)'},
     'out_arguments': ['programs', 'numPrograms']
   },
   'glExtGetProgramBinarySourceQCOM': {
@@ -470,6 +517,7 @@ _FUNCTION_INFO = {
     'out_arguments': ['params']
   },
   'eglChooseConfig': {
+    'remote_argument_size': {'configs': 'config_size * sizeof (EGLConfig)'},
     'out_arguments': ['configs', 'num_config'],
     'argument_size_from_function': {'attrib_list': '_get_egl_attrib_list_size'}
   },
@@ -1594,46 +1642,95 @@ class TypeHandler(object):
     file.Write(func.MakeTypedOriginalArgString(""), split=False)
     file.Write(");")
 
-  def WriteCommandInitArgumentCopy(self, func, arg, file):
-    # FIXME: Handle constness more gracefully.
+  def GetPayloadArgs(self, func):
+    """Returns the pointer arguments that are copied into the command."""
+    # Synchronous functions can use the caller's memory directly.
     if func.IsSynchronous():
-      type = arg.type.replace("const", "")
-      file.Write("    command->%s = (%s) %s;\n" % (arg.name, type, arg.name))
-      return
-
+      return []
+    return [arg for arg in func.GetOriginalArgs()
+            if arg.type.find("char*") != -1 or
+               arg.name in func.info.argument_has_size or
+               arg.name in func.info.argument_element_size or
+               arg.name in func.info.argument_size_from_function]
+
+  def GetPayloadArgSize(self, func, arg):
+    """Returns an expression for the size in bytes of a copied argument."""
     if arg.type.find("char*") != -1:
-      file.Write("    command->%s = strdup (%s);\n" % (arg.name, arg.name))
-      return
-
-    # We only need to copy arguments if the function is asynchronous.
-    if  (arg.name in func.info.argument_has_size or \
-         arg.name in func.info.argument_element_size or \
-         arg.name in func.info.argument_size_from_function):
-
-      components = []
-      if arg.name in func.info.argument_has_size:
-          components.append(func.info.argument_has_size[arg.name])
-      if arg.name in func.info.argument_element_size:
-          components.append("%i" % func.info.argument_element_size[arg.name])
-      if arg.name in func.info.argument_size_from_function:
-          components.append("%s (%s)" % (func.info.argument_size_from_function[arg.name], arg.name))
-      if arg.type.find("void*") == -1:
-          components.append("sizeof (%s)" % arg.type)
-      arg_size = " * ".join(components)
-
-      file.Write("    if (%s) {\n" % (arg.name))
-      file.Write("        command->%s = malloc (%s);\n" % (arg.name, arg_size))
-      file.Write("        memcpy (command->%s, %s, %s);\n" % (arg.name, arg.name, arg_size))
-      file.Write("    } else\n")
-      file.Write("        command->%s = 0;\n" % (arg.name))
-      return
+      return "strlen (%s) + 1" % arg.name
+
+    components = []
+    if arg.name in func.info.argument_has_size:
+        components.append(func.info.argument_has_size[arg.name])
+    if arg.name in func.info.argument_element_size:
+        components.append("%i" % func.info.argument_element_size[arg.name])
+    if arg.name in func.info.argument_size_from_function:
+        components.append("%s (%s)" % (func.info.argument_size_from_function[arg.name], arg.name))
+    if arg.IsDoublePointer():
+        components.append("sizeof (void *)")
+    elif arg.type.find("void*") == -1:
+        element_type = arg.type.replace("const", "").replace("*", "").strip()
+        components.append("sizeof (%s)" % element_type)
+    return " * ".join(components)
+
+  def GetRemoteArgs(self, func):
+    """Returns the pointer arguments of a synchronous function that travel
+    with the command to a server in another process, along with their sizes.
+    Those whose size isn't known are passed as they are."""
+    remote_args = []
+    for arg in func.GetOriginalArgs():
+      if not arg.IsPointer():
+        continue
+      if arg.name in func.info.remote_argument_size:
+        size = func.info.remote_argument_size[arg.name]
+      elif arg.name in func.info.argument_has_size or \
+           arg.name in func.info.argument_element_size or \
+           arg.name in func.info.argument_size_from_function:
+        size = self.GetPayloadArgSize(func, arg)
+      elif arg.IsDoublePointer():
+        # Only pointers that the server returns, which mean nothing to
+        # the client, but the slot has to be there.
+        if arg.type.find("const") != -1:
+          continue
+        size = "sizeof (void *)"
+      elif arg.IsString():
+        if arg.type.find("const") == -1:
+          continue
+        size = self.GetPayloadArgSize(func, arg)
+      elif arg.type.find("const") == -1 and arg.type.find("void") == -1:
+        # A single value that the function returns.
+        size = "sizeof (%s)" % arg.type.replace("*", "").strip()
+      else:
+        continue
+      remote_args.append((arg, size))
+    return remote_args
 
+  def WriteCommandInitArgumentCopy(self, func, arg, file):
     # FIXME: Handle constness more gracefully.
     type = arg.type.replace("const", "")
-    file.Write("    command->%s = (%s) %s;\n" % (arg.name, type, arg.name))
+    if not arg in self.GetPayloadArgs(func):
+      file.Write("    command->%s = (%s) %s;\n" % (arg.name, type, arg.name))
+      return
+
+    # The client reserves room for the copies right after the command or in
+    # the transfer buffer, unless they are too large, in which case they come
+    # from the memory pool of the thread.
+    file.Write("    if (%s) {\n" % arg.name)
+    file.Write("        size_t %s_size = %s;\n" % (arg.name, self.GetPayloadArgSize(func, arg)))
+    # The padding is cleared so that the frame cache can hash the payload
+    # as a whole.
+    file.Write("        if (payload) {\n")
+    file.Write("            command->%s = (%s) payload;\n" % (arg.name, type))
+    file.Write("            memset (payload + %s_size, 0,\n" % arg.name)
+    file.Write("                    COMMAND_ALIGN (%s_size) - %s_size);\n" % (arg.name, arg.name))
+    file.Write("            payload += COMMAND_ALIGN (%s_size);\n" % arg.name)
+    file.Write("        } else\n")
+    file.Write("            command->%s = memory_pool_alloc (%s_size);\n" % (arg.name, arg.name))
+    file.Write("        memcpy (command->%s, %s, %s_size);\n" % (arg.name, arg.name, arg.name))
+    file.Write("    } else\n")
+    file.Write("        command->%s = 0;\n" % (arg.name))
 
   def WriteCommandInit(self, func, file):
-    file.Write ("inline ")
+    file.Write ("static inline ")
     self.WriteInitSignature(func, file)
     file.Write("\n{\n")
 
@@ -1641,6 +1738,8 @@ class TypeHandler(object):
     if len(args):
         subclass_command_type = "command_%s_t" % func.name.lower()
         file.Write("    %s *command = (%s *) abstract_command;\n" % (subclass_command_type, subclass_command_type))
+        if self.GetPayloadArgs(func):
+            file.Write("    char *payload = command_get_payload (abstract_command, sizeof (%s));\n" % subclass_command_type)
 
         for arg in args:
             self.WriteCommandInitArgumentCopy(func, arg, file)
@@ -1650,17 +1749,41 @@ class TypeHandler(object):
 
     file.Write("}\n\n")
 
+  def WritePayloadSizeSignature(self, func, file):
+    """Writes the declaration of the function returning the payload size."""
+    file.Write("size_t\n")
+    call = "command_%s_payload_size (" % func.name.lower()
+    file.Write(call)
+    args = func.MakeTypedOriginalArgString("", separator=",\n" + (" " * len(call)))
+    if not args:
+        args = "void"
+    file.Write(args)
+    file.Write(")")
+
+  def WritePayloadSize(self, func, file):
+    file.Write("static inline ")
+    self.WritePayloadSizeSignature(func, file)
+    file.Write("\n{\n")
+    file.Write("    size_t payload_size = 0;\n")
+    for arg in self.GetPayloadArgs(func):
+      file.Write("    if (%s)\n" % arg.name)
+      file.Write("        payload_size += COMMAND_ALIGN (%s);\n" % self.GetPayloadArgSize(func, arg))
+    file.Write("    return payload_size;\n")
+    file.Write("}\n\n")
+
   def WriteCommandDestroy(self, func, file):
     file.Write("void\n");
     file.Write("command_%s_destroy_arguments (command_%s_t *command)\n" % \
         (func.name.lower(), func.name.lower()))
     file.Write("\n{\n")
 
-    # The only thing we do for the moment is free arguments.
+    # The only thing we do for the moment is free arguments. Copies that
+    # live in the command or transfer buffer go away with the command.
     arguments_to_free = [arg for arg in func.GetOriginalArgs() if arg.IsPointer()]
     for arg in arguments_to_free:
-      file.Write("    if (command->%s)\n" % arg.name)
-      file.Write("        free (command->%s);\n" % arg.name)
+      file.Write("    if (command->%s &&\n" % arg.name)
+      file.Write("        ! command_has_payload (&command->header))\n")
+      file.Write("        memory_pool_free (command->%s);\n" % arg.name)
     file.Write("}\n")
 
   def WriteInitSignature(self, func, file):
@@ -1736,6 +1859,8 @@ class FunctionInfo(object):
       self.argument_size_from_function = {}
     if not 'mapped_names' in info:
       self.mapped_names = {}
+    if not 'remote_argument_size' in info:
+      self.remote_argument_size = {}
 
 class Argument(object):
   """A class that represents a function argument."""
@@ -2215,6 +2340,11 @@ class Function(object):
   def HasReturnValue(self):
     return self.return_type != 'void'
 
+  def HasResults(self):
+    """Whether the function returns something or writes through its
+    arguments, even if the client doesn't wait for it."""
+    return self.HasReturnValue() or len(self.info.out_arguments) > 0
+
   def IsOutArgument(self, arg):
     """Returns true if given argument is an out argument for this function"""
     return arg.name in self.info.out_arguments
@@ -2304,6 +2434,15 @@ class Function(object):
   def WriteInitSignature(self, file):
     self.type_handler.WriteInitSignature(self, file)
 
+  def GetPayloadArgs(self):
+    return self.type_handler.GetPayloadArgs(self)
+
+  def WritePayloadSizeSignature(self, file):
+    self.type_handler.WritePayloadSizeSignature(self, file)
+
+  def WritePayloadSize(self, file):
+    self.type_handler.WritePayloadSize(self, file)
+
   def WriteEnumName(self, file):
     self.type_handler.WriteEnumName(self, file)
 
@@ -2658,12 +2797,88 @@ class GLGenerator(object):
 
     file.Close()
 
+  def ReturnsString(self, func):
+    return func.return_type in ['const char*', 'const GLubyte*']
+
+  def NeedsRemoteDispatch(self, func):
+    """Whether a synchronous function passes the server pointers into the
+    memory of the client, which a server in another process can't use."""
+    if not func.IsSynchronous() or self.HasCustomInit(func):
+      return False
+    return self.ReturnsString(func) or \
+           len(func.type_handler.GetRemoteArgs(func)) > 0
+
+  def WriteRemoteDispatch(self, func, file):
+    """Writes the variant of the base client function for a server in
+    another process, which copies the pointer arguments into the command."""
+    remote_args = func.type_handler.GetRemoteArgs(func)
+    command_type = "command_%s_t" % func.name.lower()
+
+    file.Write("static %s\n" % func.return_type)
+    file.Write("client_dispatch_%s_remote (void* object" % func.name.lower())
+    file.Write(func.MakeTypedOriginalArgString("", separator=",\n    ", add_separator=True))
+    file.Write(")\n")
+    file.Write("{\n")
+    if self.ReturnsString(func) or \
+       [size for (arg, size) in remote_args if size.find("client") != -1]:
+      file.Write("    client_t *client = CLIENT (object);\n")
+    payload_sizes = []
+    for (arg, size) in remote_args:
+      file.Write("    size_t %s_size = %s ? %s : 0;\n" % (arg.name, arg.name, size))
+      payload_sizes.append("COMMAND_ALIGN (%s_size)" % arg.name)
+    if self.ReturnsString(func):
+      # The string is copied to the start of the payload.
+      assert not remote_args
+      payload_sizes.append("COMMAND_MAX_STRING_RESULT")
+
+    file.Write("    size_t payload_size = %s;\n" % " + ".join(payload_sizes))
+    file.Write("    command_t *command =\n")
+    file.Write("        client_get_space_for_remote_command (COMMAND_%s, payload_size);\n" % func.name.upper())
+
+    if remote_args:
+      file.Write("    char *payload = command_get_payload (command, sizeof (%s));\n" % command_type)
+      for (arg, size) in remote_args:
+        type = arg.type.replace("const", "").strip()
+        file.Write("    %s remote_%s =\n" % (type, arg.name))
+        file.Write("        client_relocate_argument (&payload, %s, %s_size);\n" % (arg.name, arg.name))
+    file.Write("\n")
+
+    remote_names = [arg.name for (arg, size) in remote_args]
+    header = "    command_%s_init (" % func.name.lower()
+    file.Write(header + "command")
+    for arg in func.GetOriginalArgs():
+      file.Write(",\n" + " " * len(header))
+      if arg.name in remote_names:
+        file.Write("remote_%s" % arg.name)
+      else:
+        file.Write(arg.name)
+    file.Write(");\n")
+    file.Write("    client_run_command (command);\n")
+
+    for (arg, size) in remote_args:
+      if arg.type.find("const") != -1:
+        continue
+      file.Write("    if (%s)\n" % arg.name)
+      file.Write("        memcpy (%s, remote_%s, %s_size);\n" % (arg.name, arg.name, arg.name))
+
+    if self.ReturnsString(func):
+      file.Write("\n")
+      file.Write("    return (%s) client_keep_remote_string (\n" % func.return_type)
+      file.Write("        client, (const char *) ((%s *) command)->result);\n" % command_type)
+    elif func.HasReturnValue():
+      file.Write("\n")
+      file.Write("    return ((%s *) command)->result;\n" % command_type)
+    file.Write("}\n\n")
+
   def WriteBaseClient(self, filename):
     """Writes the base server implementation, which just places the commands on the command buffer and runs them."""
     file = CWriter(filename)
     self.WriteGLHeaders(file)
 
     for func in self.functions:
+        if self.NeedsRemoteDispatch(func):
+            self.WriteRemoteDispatch(func, file)
+
         file.Write("static %s\n" % func.return_type)
         file.Write("client_dispatch_%s (void* object" % func.name.lower())
         file.Write(func.MakeTypedOriginalArgString("", separator=",\n    ", add_separator=True))
@@ -2677,7 +2892,30 @@ class GLGenerator(object):
             file.Write("        state->need_get_error = true;\n\n");
 
         file.Write("    INSTRUMENT();\n");
-        file.Write("    command_t *command = client_get_space_for_command (COMMAND_%s);\n" % func.name.upper())
+        if self.NeedsRemoteDispatch(func):
+            file.Write("    if (client_is_remote (CLIENT (object)))\n")
+            file.Write("        ")
+            if func.HasReturnValue():
+                file.Write("return ")
+            else:
+                file.Write("{\n            ")
+            file.Write("client_dispatch_%s_remote (object" % func.name.lower())
+            file.Write(func.MakeOriginalArgString("", add_separator=True))
+            file.Write(");\n")
+            if not func.HasReturnValue():
+                file.Write("            return;\n")
+                file.Write("        }\n")
+            file.Write("\n")
+
+        if self.HasPayload(func):
+          header = "    size_t payload_size = command_%s_payload_size (" % func.name.lower()
+          file.Write(header)
+          file.Write(func.MakeOriginalArgString(" " * len(header), separator = ",\n").lstrip())
+          file.Write(");\n")
+          file.Write("    command_t *command =\n")
+          file.Write("        client_get_space_for_command_with_payload (COMMAND_%s, payload_size);\n" % func.name.upper())
+        else:
+          file.Write("    command_t *command = client_get_space_for_command (COMMAND_%s);\n" % func.name.upper())
 
         header = "    command_%s_init (" % func.name.lower()
         indent = " " * len(header)
@@ -2716,7 +2954,10 @@ class GLGenerator(object):
     file.Write("#include <EGL/egl.h>\n")
     file.Write("#include <EGL/eglext.h>\n")
     file.Write("#include <GLES2/gl2.h>\n")
-    file.Write("#include <GLES2/gl2ext.h>\n\n")
+    file.Write("#include <GLES2/gl2ext.h>\n")
+    file.Write("#include <stdlib.h>\n")
+    file.Write("#include <string.h>\n\n")
+    file.Write('#include "gles2_utils.h"\n\n')
 
     for func in self.functions:
       if self.HasCustomStruct(func):
@@ -2725,16 +2966,57 @@ class GLGenerator(object):
 
     file.Write("\n")
 
+    # The sizes are constants, so that the compiler can fold them into the
+    # client entry points.
+    file.Write("static const uint32_t command_sizes[COMMAND_MAX_COMMAND] = {\n")
+    file.Write("    [COMMAND_NO_OP] = 0,\n")
+    file.Write("    [COMMAND_SHUTDOWN] = sizeof (command_t),\n")
+    file.Write("    [COMMAND_FRAME_RECORD] = sizeof (command_frame_record_t),\n")
+    file.Write("    [COMMAND_FRAME_REPLAY] = sizeof (command_frame_replay_t),\n")
     for func in self.functions:
-      file.Write("private ");
-      func.WriteInitSignature(file)
-      file.Write(";\n\n")
+        file.Write("    [COMMAND_%s] = sizeof (command_%s_t),\n" % \
+                    (func.name.upper(), func.name.lower()))
+    file.Write("};\n\n")
+
+    # Initializers are defined here so that they can be inlined into the
+    # client entry points; the custom ones live in command_custom.c.
+    for func in self.functions:
+      if self.HasCustomInit(func):
+        file.Write("private ");
+        func.WriteInitSignature(file)
+        file.Write(";\n\n")
+        if self.HasCustomPayloadSize(func):
+          file.Write("private ");
+          func.WritePayloadSizeSignature(file)
+          file.Write(";\n\n")
+      else:
+        func.WriteCommandInit(file)
+        if self.HasPayload(func):
+          func.WritePayloadSize(file)
 
       if func.NeedsDestructor() or self.HasCustomDestroyArguments(func):
         file.Write("private void\n");
         file.Write("command_%s_destroy_arguments (command_%s_t *command);\n\n" % \
           (func.name.lower(), func.name.lower()))
 
+    file.Write("private void\n");
+    file.Write("command_destroy_arguments (command_t *command);\n\n")
+
+    # For the frame cache: whether a command owns nothing that goes away
+    # once it has run, a hash of the command and its payload, and a way to
+    # point a copy of a command that was at |from| to its own payload.
+    file.Write("private bool\n")
+    file.Write("command_is_replayable (command_t *command);\n\n")
+    file.Write("private uint64_t\n")
+    file.Write("command_hash (command_t *command);\n\n")
+    file.Write("private void\n")
+    file.Write("command_relocate_payload (command_t *command,\n")
+    file.Write("                          const char *from);\n\n")
+
+    # Whether a command returns something or writes through its arguments.
+    file.Write("private bool\n")
+    file.Write("command_has_results (command_t *command);\n\n")
+
     file.Write("#endif /*COMMAND_AUTOGEN_H*/\n")
     file.Close()
 
@@ -2768,6 +3050,16 @@ class GLGenerator(object):
     init_name = "command_%s_destroy_arguments " % func.name.lower()
     return self.CommandCustomText().find(init_name) != -1
 
+  def HasCustomPayloadSize(self, func):
+    function_name = "command_%s_payload_size " % func.name.lower()
+    return self.CommandCustomText().find(function_name) != -1
+
+  def HasPayload(self, func):
+    """Whether the client reserves room for copies of pointer arguments."""
+    if self.HasCustomInit(func):
+      return self.HasCustomPayloadSize(func)
+    return len(func.GetPayloadArgs()) > 0
+
   def HasCustomStruct(self, func):
     struct_declaration = "typedef struct _command_%s " % func.name.lower()
     return self.CommandCustomHeaderText().find(struct_declaration) != -1
@@ -2776,31 +3068,139 @@ class GLGenerator(object):
     handler_name = "server_handle_%s " % func.name.lower()
     return self.ServerText().find(handler_name) != -1
 
-  def WriteCommandInitilizationAndSizeFunction(self, filename):
-    """Writes the command implementation for the client-side"""
+  def WriteCommandDestroyFunctions(self, filename):
+    """Writes the functions that free the arguments of a command"""
     file = CWriter(filename)
 
     file.Write("#include \"command.h\"\n")
     file.Write("#include <string.h>\n\n")
-    file.Write('#include "gles2_utils.h"\n')
 
     for func in self.functions:
-      if not self.HasCustomInit(func):
-        func.WriteCommandInit(file)
       if not self.HasCustomDestroyArguments(func):
         func.WriteCommandDestroy(file)
 
-    file.Write("void\n")
-    file.Write("command_initialize_sizes (size_t *sizes)\n")
+    self.WriteCommandReplayFunctions(file)
+
+    # Command lists have nobody to hand the results to.
+    file.Write("bool\n")
+    file.Write("command_has_results (command_t *command)\n")
     file.Write("{\n")
+    file.Write("    switch (command->type) {\n")
     for func in self.functions:
-        file.Write("sizes[COMMAND_%s] = sizeof (command_%s_t);\n" % \
-                    (func.name.upper(), func.name.lower()))
+      if func.HasResults():
+        file.Write("    case COMMAND_%s:\n" % func.name.upper())
+    file.Write("        return true;\n")
+    file.Write("    default:\n")
+    file.Write("        return false;\n")
+    file.Write("    }\n")
+    file.Write("}\n")
+
+    # For commands that are dropped rather than executed, like those of a
+    # command list that is deleted before it is submitted.
+    file.Write("\nvoid\n")
+    file.Write("command_destroy_arguments (command_t *command)\n")
+    file.Write("{\n")
+    file.Write("    switch (command->type) {\n")
+    for func in self.functions:
+      if func.NeedsDestructor() or self.HasCustomDestroyArguments(func):
+        file.Write("    case COMMAND_%s:\n" % func.name.upper())
+        file.Write("        command_%s_destroy_arguments (\n" % func.name.lower())
+        file.Write("            (command_%s_t *) command);\n" % func.name.lower())
+        file.Write("        break;\n")
+    file.Write("    default:\n")
+    file.Write("        break;\n")
+    file.Write("    }\n")
     file.Write("}\n")
 
     file.Write("\n")
     file.Close()
 
+  def WriteCommandReplayFunctions(self, file):
+    """Writes what the frame cache needs to know about the commands"""
+    file.Write("bool\n")
+    file.Write("command_is_replayable (command_t *command)\n")
+    file.Write("{\n")
+    file.Write("    if (command->flags & (COMMAND_FLAG_SYNCHRONOUS |\n")
+    file.Write("                          COMMAND_FLAG_TRANSFER_PAYLOAD))\n")
+    file.Write("        return false;\n\n")
+    file.Write("    switch (command->type) {\n")
+    for func in self.functions:
+      if self.HasCustomInit(func):
+        file.Write("    case COMMAND_%s:\n" % func.name.upper())
+    file.Write("        return false;\n")
+    # Copies on the heap are freed once the command has run.
+    for func in self.functions:
+      if not self.HasCustomInit(func) and func.GetPayloadArgs():
+        file.Write("    case COMMAND_%s:\n" % func.name.upper())
+    file.Write("        return command->flags & COMMAND_FLAG_INLINE_PAYLOAD;\n")
+    # Anything after the command, like the client arrays of a draw, was
+    # put there by the caching client.
+    file.Write("    default:\n")
+    file.Write("        return command->size == command_get_size (command->type);\n")
+    file.Write("    }\n")
+    file.Write("}\n\n")
+
+    # The payload is hashed as a whole, instead of the pointers to it.
+    file.Write("uint64_t\n")
+    file.Write("command_hash (command_t *abstract_command)\n")
+    file.Write("{\n")
+    file.Write("    uint64_t hash = command_hash_word (abstract_command->type,\n")
+    file.Write("                                       abstract_command->size);\n\n")
+    file.Write("    switch (abstract_command->type) {\n")
+    for func in self.functions:
+      if self.HasCustomInit(func):
+        continue
+      payload_args = func.GetPayloadArgs()
+      args = [arg for arg in func.GetOriginalArgs() if not arg in payload_args]
+      if not args:
+        continue
+      command_type = "command_%s_t" % func.name.lower()
+      file.Write("    case COMMAND_%s: {\n" % func.name.upper())
+      file.Write("        %s *command = (%s *) abstract_command;\n" % (command_type, command_type))
+      for arg in args:
+        file.Write("        hash = command_hash_value (hash, &command->%s,\n" % arg.name)
+        file.Write("                                   sizeof (command->%s));\n" % arg.name)
+      file.Write("        break;\n")
+      file.Write("    }\n")
+    file.Write("    default:\n")
+    file.Write("        break;\n")
+    file.Write("    }\n\n")
+    file.Write("    if (abstract_command->flags & COMMAND_FLAG_INLINE_PAYLOAD) {\n")
+    file.Write("        size_t size = command_get_size (abstract_command->type);\n")
+    file.Write("        hash = command_hash_bytes (hash, (char *) abstract_command + size,\n")
+    file.Write("                                   abstract_command->size - size);\n")
+    file.Write("    }\n")
+    file.Write("    return hash;\n")
+    file.Write("}\n\n")
+
+    file.Write("void\n")
+    file.Write("command_relocate_payload (command_t *abstract_command,\n")
+    file.Write("                          const char *from)\n")
+    file.Write("{\n")
+    file.Write("    if (! (abstract_command->flags & COMMAND_FLAG_INLINE_PAYLOAD))\n")
+    file.Write("        return;\n\n")
+    file.Write("    switch (abstract_command->type) {\n")
+    for func in self.functions:
+      if self.HasCustomInit(func):
+        continue
+      payload_args = func.GetPayloadArgs()
+      if not payload_args:
+        continue
+      command_type = "command_%s_t" % func.name.lower()
+      file.Write("    case COMMAND_%s: {\n" % func.name.upper())
+      file.Write("        %s *command = (%s *) abstract_command;\n" % (command_type, command_type))
+      for arg in payload_args:
+        type = arg.type.replace("const", "")
+        file.Write("        if (command->%s)\n" % arg.name)
+        file.Write("            command->%s = (%s) ((char *) abstract_command +\n" % (arg.name, type))
+        file.Write("                ((const char *) command->%s - from));\n" % arg.name)
+      file.Write("        break;\n")
+      file.Write("    }\n")
+    file.Write("    default:\n")
+    file.Write("        break;\n")
+    file.Write("    }\n")
+    file.Write("}\n")
+
   def WriteDispatchTable(self, filename):
     """Writes the dispatch struct for the server-side"""
     file = CHeaderWriter(filename)
@@ -2826,6 +3226,42 @@ class GLGenerator(object):
         if self.HasCustomServerHandler(func):
             continue
 
+        # Translating the names doesn't need the GL context, so the
+        # prepare stage can do it ahead of the handler.
+        mapped_names = func.GetMappedNameAttributes()
+        if mapped_names:
+          file.Write("static server_prepare_result_t\n")
+          file.Write("server_prepare_%s (server_t *server, command_t *abstract_command)\n" % func.name.lower())
+          file.Write("{\n")
+          file.Write("    command_%s_t *command =\n" % func.name.lower())
+          file.Write("            (command_%s_t *)abstract_command;\n" % func.name.lower())
+          for mapped_name in mapped_names:
+            # The lookup, the insertion and the read of the mapping are
+            # one critical section, as the prepare stage and the server
+            # threads share the mapping.
+            file.Write("    if (command->%s) {\n" % mapped_name)
+            file.Write("        mutex_lock (name_mapping_mutex);\n")
+            file.Write("        GLuint *%s = hash_lookup (server->name_mapping->%s, command->%s);\n" % (mapped_name, func.GetMappedNameType(),  mapped_name))
+            file.Write("        if (!%s) {\n" % mapped_name)
+            if (func.NeedsCreateMappedName(mapped_name)):
+              file.Write("            GLuint *data = (GLuint *) malloc (1 * sizeof (GLuint));\n")
+              file.Write("            if (! data) {\n")
+              file.Write("                fprintf (stderr, \"Could not map the name %%u.\\n\", command->%s);\n" % mapped_name)
+              file.Write("                abort ();\n")
+              file.Write("            }\n")
+              file.Write("            *data = command->%s;\n" % mapped_name)
+              file.Write("            hash_insert (server->name_mapping->%s, *data, data);\n" % func.GetMappedNameType())
+              file.Write("            %s = data;\n" % mapped_name)
+            else:
+              file.Write("            mutex_unlock (name_mapping_mutex);\n")
+              file.Write("            return SERVER_PREPARE_SKIP;\n")
+            file.Write("        }\n");
+            file.Write("        command->%s = *%s;\n" % (mapped_name, mapped_name))
+            file.Write("        mutex_unlock (name_mapping_mutex);\n")
+            file.Write("    }\n")
+          file.Write("    return SERVER_PREPARE_READY;\n")
+          file.Write("}\n\n")
+
         file.Write("static void\n")
         file.Write("server_handle_%s (server_t *server, command_t *abstract_command)\n" % func.name.lower())
         file.Write("{\n")
@@ -2836,23 +3272,10 @@ class GLGenerator(object):
           file.Write("    command_%s_t *command =\n" % func.name.lower())
           file.Write("            (command_%s_t *)abstract_command;\n" % func.name.lower())
 
-        mapped_names = func.GetMappedNameAttributes()
-        for mapped_name in mapped_names:
-          file.Write("    if (command->%s) {\n" % mapped_name)
-          file.Write("        mutex_lock (name_mapping_mutex);\n")
-          file.Write("        GLuint *%s = hash_lookup (name_mapping_%s, command->%s);\n" % (mapped_name, func.GetMappedNameType(),  mapped_name))
-          file.Write("        mutex_unlock (name_mapping_mutex);\n")
-          file.Write("        if (!%s) {\n" % mapped_name)
-          if (func.NeedsCreateMappedName(mapped_name)):
-            file.Write("        GLuint *data = (GLuint *) malloc (1 * sizeof (GLuint));\n")
-            file.Write("        *data = command->%s;\n" %mapped_name)
-            file.Write("        hash_insert (name_mapping_%s, *data, data);\n" %func.GetMappedNameType())
-            file.Write("        %s = data;\n" %mapped_name)
-          else:
-            file.Write("            return;\n")
-          file.Write("        }\n");
-          file.Write("        command->%s = *%s;\n" % (mapped_name, mapped_name))
-          file.Write("    }\n")
+        if mapped_names:
+          file.Write("    if (! (abstract_command->flags & COMMAND_FLAG_PREPARED) &&\n")
+          file.Write("        server_prepare_%s (server, abstract_command) != SERVER_PREPARE_READY)\n" % func.name.lower())
+          file.Write("        return;\n")
 
         file.Write("    ")
         if func.HasReturnValue():
@@ -2866,6 +3289,12 @@ class GLGenerator(object):
           file.Write("command->%s" % arg.name)
         file.Write(");\n")
 
+        if self.ReturnsString(func):
+          file.Write("    command->result = (%s)\n" % func.return_type)
+          file.Write("        command_copy_string_result (abstract_command,\n")
+          file.Write("                                    sizeof (command_%s_t),\n" % func.name.lower())
+          file.Write("                                    (const char *) command->result);\n")
+
         if need_destructor_call:
           file.Write("    command_%s_destroy_arguments (command);\n" % func.name.lower())
         file.Write("}\n\n")
@@ -2878,6 +3307,16 @@ class GLGenerator(object):
       file.Write("        server_handle_%s;\n" % func.name.lower())
     file.Write("}\n\n")
 
+    file.Write("static void\n")
+    file.Write("server_fill_command_prepare_table (server_t* server)\n")
+    file.Write("{\n")
+    for func in self.functions:
+      if self.HasCustomServerHandler(func) or not func.GetMappedNameAttributes():
+        continue
+      file.Write("    server->prepare_table[COMMAND_%s] = \n" % func.name.upper())
+      file.Write("        server_prepare_%s;\n" % func.name.lower())
+    file.Write("}\n\n")
+
     file.Close()
 
   def WritePassthroughDispatchTableImplementation(self, filename):
@@ -2945,6 +3384,63 @@ class GLGenerator(object):
         file.Write('    client->super.dispatch.%s = %s;\n' % (func.name, caching_func_name))
     file.Close()
 
+  def IsCopiedListCommand(self, func):
+    """Whether the caching client copies the command of a command list as
+    it is, as it leaves the cache alone or, for pixel uploads, because it
+    can't encode it again."""
+    return (func.name in ['glClear', 'glDrawArrays', 'glDrawElements',
+                          'glMultiDrawArraysEXT', 'glMultiDrawElementsEXT',
+                          'glTexImage2D', 'glTexSubImage2D'] or
+            func.name.startswith('glUniform'))
+
+  def WriteCachingClientCommandListFunctions(self, filename):
+    """Writes how the caching client submits the commands of a list"""
+    caching_client_text = open(os.path.join('..', 'client', 'caching_client.c')).read()
+    file = CWriter(filename)
+
+    # Lists never hold commands with results, see command_has_results ().
+    funcs = [func for func in self.functions
+             if caching_client_text.find("caching_client_%s " % func.name) != -1
+                and not func.IsSynchronous() and not func.HasResults()
+                and not self.IsCopiedListCommand(func)]
+
+    file.Write("static bool\n")
+    file.Write("caching_client_runs_list_command (command_t *command)\n")
+    file.Write("{\n")
+    file.Write("    switch (command->type) {\n")
+    for func in funcs:
+      file.Write("    case COMMAND_%s:\n" % func.name.upper())
+    file.Write("        return true;\n")
+    file.Write("    default:\n")
+    file.Write("        return false;\n")
+    file.Write("    }\n")
+    file.Write("}\n\n")
+
+    file.Write("static void\n")
+    file.Write("caching_client_run_list_command (void *client,\n")
+    file.Write("                                 command_t *abstract_command)\n")
+    file.Write("{\n")
+    file.Write("    switch (abstract_command->type) {\n")
+    for func in funcs:
+      file.Write("    case COMMAND_%s: {\n" % func.name.upper())
+      if len(func.GetOriginalArgs()) > 0:
+        file.Write("        command_%s_t *command =\n" % func.name.lower())
+        file.Write("            (command_%s_t *) abstract_command;\n" % func.name.lower())
+      file.Write("        caching_client_%s (client" % func.name)
+      for arg in func.GetOriginalArgs():
+        file.Write(", ")
+        if arg.IsDoublePointer() and arg.type.find("const") != -1:
+          file.Write("(%s) " % arg.type)
+        file.Write("command->%s" % arg.name)
+      file.Write(");\n")
+      file.Write("        break;\n")
+      file.Write("    }\n")
+    file.Write("    default:\n")
+    file.Write("        break;\n")
+    file.Write("    }\n")
+    file.Write("}\n")
+    file.Close()
+
   def WriteCommandEnum(self, filename):
     """Writes the command format"""
     file = CWriter(filename)
@@ -3005,10 +3501,11 @@ def main(argv):
   gen.WriteEnumValidation("enum_validation.h")
 
   # These are used on the client-side.
-  gen.WriteCommandInitilizationAndSizeFunction("command_autogen.c")
+  gen.WriteCommandDestroyFunctions("command_autogen.c")
   gen.WriteClientEntryPoints("client_entry_points.c")
   gen.WriteBaseClient("client_autogen.c")
   gen.WriteCachingClientDispatchTableImplementation("caching_client_dispatch_autogen.c")
+  gen.WriteCachingClientCommandListFunctions("caching_client_command_list_autogen.c")
 
   # These are used on the server-side.
   gen.WriteBaseServer("server_autogen.c")
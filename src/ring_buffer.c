@@ -1,12 +1,17 @@
+#define _GNU_SOURCE
 #include "config.h"
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include "ring_buffer.h"
+#include "thread_private.h"
 
 private void
 report_exceptional_condition(const char* error)
@@ -14,16 +19,34 @@ report_exceptional_condition(const char* error)
     fprintf(stderr, "%s: %s\n", error, strerror (errno));
 }
 
-void
-buffer_create(buffer_t *buffer, int size, const char *buffer_name)
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static int
+buffer_memfd_create (const char *buffer_name, unsigned int flags)
+{
+#if HAVE_MEMFD_CREATE
+    return memfd_create (buffer_name, flags);
+#elif defined(__NR_memfd_create)
+    return syscall (__NR_memfd_create, buffer_name, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* The old way of getting a shareable file, used when the kernel does not
+ * have memfd_create (). */
+static int
+buffer_create_shm_file (const char *buffer_name)
 {
-    /* The size of the buffer (in bytes). Note that for some buffers
-     * such as the memory-mirrored ring buffer the actual buffer size
-     * may be larger.
-     */
-    /* TODO: Make this configurable. */
-    static unsigned long default_buffer_size = 1024 * 512;
-    unsigned long buffer_size = 1024 * size;
     int name_length = strlen (buffer_name);
     
     char *path = malloc (sizeof (char) * (name_length + 29));
@@ -31,63 +54,341 @@ buffer_create(buffer_t *buffer, int size, const char *buffer_name)
     memcpy (path + 21, buffer_name, name_length);
     memcpy (path + 21 + name_length, "-XXXXXX", 7);
     path[name_length+28] = 0;
- 
-    if (buffer_size < default_buffer_size)
-        buffer_size = default_buffer_size;
-
-    //char path[] = "/dev/shm/ring-buffer-XXXXXX";
-    int file_descriptor;
-    void *address;
-    int status;
 
-    file_descriptor = mkstemp (path);
+    int file_descriptor = mkstemp (path);
     if (file_descriptor < 0) {
         free (path);
         report_exceptional_condition("Could not get a file descriptor.");
-        return;
+        return -1;
     }
 
-    status = unlink(path);
-    if (status)
+    if (unlink(path))
         report_exceptional_condition("Could not unlink.");
+    free (path);
+    return file_descriptor;
+}
+
+/* Returns a shareable file, or -1 on failure. */
+static int
+buffer_create_file (const char *buffer_name)
+{
+    int file_descriptor = buffer_memfd_create (buffer_name, MFD_CLOEXEC);
+    if (file_descriptor < 0)
+        file_descriptor = buffer_create_shm_file (buffer_name);
+    return file_descriptor;
+}
+
+/* Maps |file_descriptor| twice, back to back. The mirror starts at an
+ * |alignment| boundary, which hugetlb mappings require, or at
+ * |wanted_address| if that isn't NULL. */
+static void *
+buffer_map_mirrored (int file_descriptor, size_t length, size_t alignment,
+                     int map_flags, void *wanted_address)
+{
+    size_t reserved_length = (length << 1) + alignment;
+    char *reserved_address;
+    char *buffer_address;
+    void *address;
+
+    if (wanted_address) {
+        /* Older kernels take the address as a mere hint. */
+        reserved_length = length << 1;
+        reserved_address = mmap (wanted_address, reserved_length, PROT_NONE,
+                                 MAP_ANONYMOUS | MAP_PRIVATE |
+                                 MAP_FIXED_NOREPLACE, -1, 0);
+        if (reserved_address != MAP_FAILED &&
+            reserved_address != wanted_address) {
+            munmap (reserved_address, reserved_length);
+            reserved_address = MAP_FAILED;
+            errno = EEXIST;
+        }
+    } else
+        reserved_address = mmap (NULL, reserved_length, PROT_NONE,
+                                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (reserved_address == MAP_FAILED) {
+        report_exceptional_condition("Failed to map full memory.");
+        return NULL;
+    }
 
-    // Round up the length to the nearest page boundary.
+    /* Give back the parts of the reservation we do not need. */
+    buffer_address = wanted_address ? reserved_address :
+        (char *) (((uintptr_t) reserved_address + alignment - 1) &
+                  ~((uintptr_t) alignment - 1));
+    if (buffer_address != reserved_address)
+        munmap (reserved_address, buffer_address - reserved_address);
+    if (reserved_address + reserved_length != buffer_address + (length << 1))
+        munmap (buffer_address + (length << 1),
+                reserved_address + reserved_length - (buffer_address + (length << 1)));
+
+    address = mmap (buffer_address, length, PROT_READ | PROT_WRITE,
+                    MAP_FIXED | MAP_SHARED | map_flags, file_descriptor, 0);
+    if (address != buffer_address) {
+        munmap (buffer_address, length << 1);
+        return NULL;
+    }
+
+    address = mmap (buffer_address + length, length, PROT_READ | PROT_WRITE,
+                    MAP_FIXED | MAP_SHARED | map_flags, file_descriptor, 0);
+    if (address != buffer_address + length) {
+        munmap (buffer_address, length << 1);
+        return NULL;
+    }
+
+    return buffer_address;
+}
+
+/* Creates the memory-mirrored mapping. The length is rounded up to the
+ * nearest page boundary (or huge page boundary, when huge pages are used)
+ * and returned in |length|. The file behind the mapping is returned in
+ * |file_descriptor| for BUFFER_SHAREABLE buffers, and closed otherwise. */
+static void *
+buffer_map (size_t *length, const char *buffer_name, unsigned int flags,
+            int *file_descriptor)
+{
     long page_size = sysconf(_SC_PAGESIZE);
-    buffer->length = ((buffer_size + page_size - 1) / page_size) * page_size;
+    void *buffer_address = NULL;
+    size_t map_length = 0;
+
+    *file_descriptor = -1;
+
+    /* Both halves of the mirror are populated up front, so that the
+     * client does not take page faults while it writes commands. */
+    if (flags & BUFFER_HUGE_PAGES) {
+        *file_descriptor = buffer_memfd_create (buffer_name,
+                                                MFD_CLOEXEC | MFD_HUGETLB);
+        if (*file_descriptor >= 0) {
+            map_length = ((*length + BUFFER_HUGE_PAGE_SIZE - 1) /
+                          BUFFER_HUGE_PAGE_SIZE) * BUFFER_HUGE_PAGE_SIZE;
+            if (! ftruncate (*file_descriptor, map_length))
+                buffer_address = buffer_map_mirrored (*file_descriptor,
+                                                      map_length,
+                                                      BUFFER_HUGE_PAGE_SIZE,
+                                                      MAP_POPULATE, NULL);
+            if (! buffer_address) {
+                close (*file_descriptor);
+                *file_descriptor = -1;
+            }
+        }
+    }
+
+    if (! buffer_address) {
+        /* Huge pages are only a hint; there may be none reserved. */
+        map_length = ((*length + page_size - 1) / page_size) * page_size;
+
+        *file_descriptor = buffer_create_file (buffer_name);
+        if (*file_descriptor < 0)
+            return NULL;
+
+        if (ftruncate(*file_descriptor, map_length))
+            report_exceptional_condition("Could not truncate.");
+
+        buffer_address = buffer_map_mirrored (*file_descriptor, map_length,
+                                              page_size, MAP_POPULATE, NULL);
+        if (! buffer_address)
+            report_exceptional_condition("Failed to map mirror memory.");
+    }
 
-    buffer->fill_count = 0;
-    buffer->head = buffer->tail = 0;
+    if (! buffer_address || ! (flags & BUFFER_SHAREABLE)) {
+        if (close(*file_descriptor))
+            report_exceptional_condition("Could not close file descriptor.");
+        *file_descriptor = -1;
+    }
+
+    if (! buffer_address)
+        return NULL;
+
+    if ((flags & BUFFER_LOCKED) && mlock (buffer_address, map_length << 1))
+        report_exceptional_condition("Could not lock memory.");
+
+    *length = map_length;
+    return buffer_address;
+}
 
-    status = ftruncate(file_descriptor, buffer->length);
-    if (status)
+/* Maps the state both sides of the ring write. Only a shareable ring
+ * needs a file behind it. */
+static buffer_shared_t *
+buffer_map_shared (const char *buffer_name, unsigned int flags,
+                   int *file_descriptor)
+{
+    void *address;
+
+    /* Threads share private memory too, and futexes in it are cheaper. */
+    if (! (flags & BUFFER_SHAREABLE)) {
+        *file_descriptor = -1;
+        address = mmap (NULL, sizeof (buffer_shared_t), PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        return address == MAP_FAILED ? NULL : address;
+    }
+
+    *file_descriptor = buffer_create_file (buffer_name);
+    if (*file_descriptor < 0)
+        return NULL;
+
+    if (ftruncate (*file_descriptor, sizeof (buffer_shared_t))) {
         report_exceptional_condition("Could not truncate.");
+        close (*file_descriptor);
+        *file_descriptor = -1;
+        return NULL;
+    }
+
+    address = mmap (NULL, sizeof (buffer_shared_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, *file_descriptor, 0);
+    if (address == MAP_FAILED) {
+        close (*file_descriptor);
+        *file_descriptor = -1;
+        return NULL;
+    }
+    return address;
+}
+
+void
+buffer_create(buffer_t *buffer, int size, const char *buffer_name,
+              unsigned int flags)
+{
+    /* The size of the buffer (in bytes). Note that for some buffers
+     * such as the memory-mirrored ring buffer the actual buffer size
+     * may be larger.
+     */
+    size_t buffer_size = 1024 * (size_t) size;
 
-    buffer->address = mmap (NULL, buffer->length << 1, PROT_NONE,
-                                                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buffer_size < BUFFER_MINIMUM_SIZE)
+        buffer_size = BUFFER_MINIMUM_SIZE;
 
-    if (buffer->address == MAP_FAILED)
-        report_exceptional_condition("Failed to map full memory.");
+    buffer->name = buffer_name;
+    buffer->flags = flags;
+    buffer->length = buffer_size;
+    buffer->file_descriptor = -1;
+    buffer->consumer_event_fd = -1;
+    buffer->shared = buffer_map_shared (buffer_name, flags,
+                                        &buffer->shared_file_descriptor);
+    buffer->address = NULL;
+    if (buffer->shared)
+        buffer->address = buffer_map (&buffer->length, buffer_name, flags,
+                                      &buffer->file_descriptor);
+    if (! buffer->address) {
+        if (buffer->shared)
+            munmap (buffer->shared, sizeof (buffer_shared_t));
+        if (buffer->shared_file_descriptor >= 0)
+            close (buffer->shared_file_descriptor);
+        buffer->shared = NULL;
+        buffer->shared_file_descriptor = -1;
+        buffer->length = 0;
+        return;
+    }
+
+    buffer_clear (buffer);
+}
 
-    address =
-        mmap (buffer->address, buffer->length, PROT_READ | PROT_WRITE,
-                    MAP_FIXED | MAP_SHARED, file_descriptor, 0);
+bool
+buffer_create_at (buffer_t *buffer, const char *buffer_name,
+                  size_t length, void *address)
+{
+    long page_size = sysconf (_SC_PAGESIZE);
+    int file_descriptor;
 
-    if (address != buffer->address)
-        report_exceptional_condition("Failed to map initial memory.");
+    buffer->name = buffer_name;
+    buffer->flags = 0;
+    buffer->length = length;
+    buffer->file_descriptor = -1;
+    buffer->shared_file_descriptor = -1;
+    buffer->consumer_event_fd = -1;
+    buffer->address = NULL;
+    buffer->shared = NULL;
 
-    address = mmap (buffer->address + buffer->length,
-                                    buffer->length, PROT_READ | PROT_WRITE,
-                                    MAP_FIXED | MAP_SHARED, file_descriptor, 0);
+    if (! length || length % page_size)
+        return false;
 
-    if (address != buffer->address + buffer->length)
-        report_exceptional_condition("Failed to map mirror memory.");
+    file_descriptor = buffer_create_file (buffer_name);
+    if (file_descriptor < 0)
+        return false;
+    if (! ftruncate (file_descriptor, length))
+        buffer->address = buffer_map_mirrored (file_descriptor, length,
+                                               page_size, MAP_POPULATE,
+                                               address);
+    close (file_descriptor);
 
-    status = close(file_descriptor);
-    if (status)
-        report_exceptional_condition("Could not close file descriptor.");
+    if (buffer->address)
+        buffer->shared = buffer_map_shared (buffer_name, 0,
+                                            &buffer->shared_file_descriptor);
+    if (! buffer->shared) {
+        if (buffer->address)
+            munmap (buffer->address, length << 1);
+        buffer->address = NULL;
+        buffer->length = 0;
+        return false;
+    }
 
-    buffer->last_token = 0;
-    free (path);
+    buffer_clear (buffer);
+    return true;
+}
+
+bool
+buffer_attach (buffer_t *buffer, const char *buffer_name,
+               int file_descriptor, int shared_file_descriptor,
+               size_t length, void *address)
+{
+    void *shared;
+
+    buffer->name = buffer_name;
+    buffer->flags = 0;
+    buffer->length = length;
+    buffer->file_descriptor = -1;
+    buffer->shared_file_descriptor = -1;
+    buffer->consumer_event_fd = -1;
+
+    shared = mmap (NULL, sizeof (buffer_shared_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, shared_file_descriptor, 0);
+    buffer->shared = shared == MAP_FAILED ? NULL : shared;
+    buffer->address = buffer_map_mirrored (file_descriptor, length,
+                                           sysconf (_SC_PAGESIZE),
+                                           MAP_POPULATE, address);
+    close (file_descriptor);
+    close (shared_file_descriptor);
+
+    if (! buffer->shared || ! buffer->address) {
+        if (buffer->shared)
+            munmap (buffer->shared, sizeof (buffer_shared_t));
+        if (buffer->address)
+            munmap (buffer->address, length << 1);
+        buffer->shared = NULL;
+        buffer->address = NULL;
+        buffer->length = 0;
+        return false;
+    }
+
+    /* Only the consumer's own state starts out fresh. */
+    buffer->consumer.cached_head = buffer->shared->consumer.tail;
+    return true;
+}
+
+bool
+buffer_resize (buffer_t *buffer, size_t size)
+{
+    size_t new_length = size;
+    void *new_address;
+    int file_descriptor;
+
+    if (buffer->flags & BUFFER_SHAREABLE)
+        return false;
+
+    if (new_length < BUFFER_MINIMUM_SIZE)
+        new_length = BUFFER_MINIMUM_SIZE;
+
+    new_address = buffer_map (&new_length, buffer->name, buffer->flags,
+                              &file_descriptor);
+    if (! new_address)
+        return false;
+
+    if (munmap (buffer->address, buffer->length << 1))
+        report_exceptional_condition("Could not unmap memory.");
+
+    /* The indices are left alone. The buffer is empty, so head and tail
+     * map to the same offset in the new mapping too. The consumer only
+     * looks at the address and length after it observes a new head, which
+     * is published with release semantics after this point. */
+    buffer->address = new_address;
+    buffer->length = new_length;
+    return true;
 }
 
 void
@@ -95,53 +396,304 @@ buffer_free (buffer_t *buffer)
 {
     if (munmap (buffer->address, buffer->length << 1))
         report_exceptional_condition("Could not unmap memory.");
+    if (munmap (buffer->shared, sizeof (buffer_shared_t)))
+        report_exceptional_condition("Could not unmap memory.");
+    if (buffer->file_descriptor >= 0)
+        close (buffer->file_descriptor);
+    if (buffer->shared_file_descriptor >= 0)
+        close (buffer->shared_file_descriptor);
 }
 
 size_t
 buffer_num_entries(buffer_t *buffer)
 {
-    return buffer->fill_count;
+    return atomic_load_acquire (&buffer->shared->producer.head) -
+           atomic_load_acquire (&buffer->shared->consumer.tail);
 }
 
 void *
 buffer_write_address (buffer_t *buffer,
-                     size_t *writable_bytes)
+                      size_t size)
 {
-    *writable_bytes = (buffer->length - buffer->fill_count);
-    if (*writable_bytes == 0)
-        return NULL;
-    return ((char*)buffer->address + buffer->head);
+    size_t cursor = buffer->producer.cursor;
+
+    /* Only look at the consumer's cache line when the space we already
+     * know about is not enough. */
+    if (buffer->length - (cursor - buffer->producer.cached_tail) < size) {
+        buffer->producer.cached_tail =
+            atomic_load_acquire (&buffer->shared->consumer.tail);
+        if (buffer->length - (cursor - buffer->producer.cached_tail) < size)
+            return NULL;
+    }
+
+    return ((char*)buffer->address + cursor % buffer->length);
 }
 
 void
 buffer_write_advance (buffer_t *buffer,
-                     size_t count_bytes)
+                      size_t count_bytes)
 {
-    buffer->head = (buffer->head + count_bytes) % buffer->length;
-    __sync_add_and_fetch (&buffer->fill_count, count_bytes);
+    buffer->producer.cursor += count_bytes;
+}
+
+bool
+buffer_publish (buffer_t *buffer)
+{
+    if (buffer->producer.cursor == buffer->producer.head)
+        return false;
+
+    /* The release store publishes the command contents to the consumer. */
+    buffer->producer.head = buffer->producer.cursor;
+    atomic_store_release (&buffer->shared->producer.head, buffer->producer.head);
+    return true;
 }
 
 void *
 buffer_read_address(buffer_t *buffer,
                     size_t *bytes_to_read)
 {
-    *bytes_to_read = buffer->fill_count;
+    size_t tail = buffer->shared->consumer.tail;
+
+    if (buffer->consumer.cached_head == tail)
+        buffer->consumer.cached_head =
+            atomic_load_acquire (&buffer->shared->producer.head);
+
+    *bytes_to_read = buffer->consumer.cached_head - tail;
     if (*bytes_to_read == 0)
         return NULL;
-    return ((char*) buffer->address + buffer->tail);
+    return ((char*) buffer->address + tail % buffer->length);
+}
+
+void *
+buffer_read_address_at(buffer_t *buffer,
+                       size_t index,
+                       size_t *bytes_to_read)
+{
+    *bytes_to_read = atomic_load_acquire (&buffer->shared->producer.head) - index;
+    if (*bytes_to_read == 0)
+        return NULL;
+    return ((char*) buffer->address + index % buffer->length);
 }
 
 void
 buffer_read_advance(buffer_t *buffer,
                     size_t count_bytes)
 {
-    buffer->tail = (buffer->tail + count_bytes) % buffer->length;
-    __sync_sub_and_fetch (&buffer->fill_count, count_bytes);
+    /* The release store tells the producer that it may reuse the space. */
+    atomic_store_release (&buffer->shared->consumer.tail,
+                          buffer->shared->consumer.tail + count_bytes);
 }
 
 void
 buffer_clear(buffer_t *buffer)
 {
-    buffer->head = buffer->tail = 0;
-    buffer->fill_count = 0;
+    buffer->producer.head = buffer->producer.cursor = 0;
+    buffer->producer.cached_tail = 0;
+    buffer->producer.stall_count = buffer->producer.stall_time = 0;
+    buffer->consumer.cached_head = 0;
+    memset (buffer->shared, 0, sizeof (buffer_shared_t));
+}
+
+static inline bool
+buffer_has_data (buffer_t *buffer,
+                 size_t index)
+{
+    return atomic_load_acquire (&buffer->shared->producer.head) != index;
+}
+
+uint64_t
+buffer_wait_for_data (buffer_t *buffer,
+                      uint64_t spin_time)
+{
+    return buffer_wait_for_data_at (buffer, buffer->shared->consumer.tail,
+                                    spin_time);
+}
+
+uint64_t
+buffer_wait_for_data_at (buffer_t *buffer,
+                         size_t index,
+                         uint64_t spin_time)
+{
+    uint64_t start_time, current_time;
+    int i;
+
+    if (buffer_has_data (buffer, index))
+        return 0;
+
+    start_time = current_time = get_monotonic_time_ns ();
+    while (current_time - start_time < spin_time) {
+        /* Don't read the clock on every iteration. */
+        for (i = 0; i < 64; i++) {
+            if (buffer_has_data (buffer, index))
+                return get_monotonic_time_ns () - start_time;
+            cpu_relax ();
+        }
+        current_time = get_monotonic_time_ns ();
+    }
+
+    unsigned int sequence = atomic_load_acquire (&buffer->shared->consumer_wait.sequence);
+
+    /* Announce that we are going to sleep before looking at the head
+     * one last time. The producer publishes the head before looking at
+     * the flag, so at least one of us sees the other. */
+    atomic_store_relaxed (&buffer->shared->consumer_wait.sleeping, 1);
+    atomic_full_barrier ();
+
+    if (! buffer_has_data (buffer, index))
+        futex_wait (&buffer->shared->consumer_wait.sequence, sequence);
+
+    atomic_store_relaxed (&buffer->shared->consumer_wait.sleeping, 0);
+
+    return get_monotonic_time_ns () - start_time;
+}
+
+static inline void
+buffer_wake_sleeping_consumer (buffer_t *buffer)
+{
+    atomic_increment (&buffer->shared->consumer_wait.sequence);
+    if (buffer->consumer_event_fd >= 0)
+        eventfd_write (buffer->consumer_event_fd, 1);
+    else
+        futex_wake (&buffer->shared->consumer_wait.sequence, 1);
+}
+
+void
+buffer_signal_consumer (buffer_t *buffer)
+{
+    atomic_full_barrier ();
+    if (! atomic_load_relaxed (&buffer->shared->consumer_wait.sleeping))
+        return;
+
+    buffer_wake_sleeping_consumer (buffer);
+}
+
+void
+buffer_wake_consumer (buffer_t *buffer)
+{
+    buffer_wake_sleeping_consumer (buffer);
+}
+
+bool
+buffer_prepare_to_sleep (buffer_t *buffer)
+{
+    atomic_store_relaxed (&buffer->shared->consumer_wait.sleeping, 1);
+    atomic_full_barrier ();
+
+    if (! buffer_has_data (buffer, buffer->shared->consumer.tail))
+        return true;
+
+    atomic_store_relaxed (&buffer->shared->consumer_wait.sleeping, 0);
+    return false;
+}
+
+void
+buffer_finish_sleep (buffer_t *buffer)
+{
+    atomic_store_relaxed (&buffer->shared->consumer_wait.sleeping, 0);
+}
+
+void
+buffer_complete_token (buffer_t *buffer)
+{
+    /* Only the consumer writes the token, so this needn't be atomic. */
+    atomic_store_release (&buffer->shared->completion.token,
+                          buffer->shared->completion.token + 1);
+    atomic_full_barrier ();
+    if (atomic_load_relaxed (&buffer->shared->completion.waiters))
+        futex_wake (&buffer->shared->completion.token, INT_MAX);
+}
+
+void
+buffer_wait_for_token (buffer_t *buffer,
+                       unsigned int token,
+                       uint64_t spin_time)
+{
+    uint64_t start_time, current_time;
+    unsigned int completed;
+    int i;
+
+    /* The producer only has one synchronous command in flight, so the
+     * token we are waiting for is the next one to complete. Comparing for
+     * equality keeps this working when the token wraps around. */
+    if (atomic_load_acquire (&buffer->shared->completion.token) == token)
+        return;
+
+    start_time = current_time = get_monotonic_time_ns ();
+    while (current_time - start_time < spin_time) {
+        for (i = 0; i < 64; i++) {
+            if (atomic_load_acquire (&buffer->shared->completion.token) == token)
+                return;
+            cpu_relax ();
+        }
+        current_time = get_monotonic_time_ns ();
+    }
+
+    atomic_store_relaxed (&buffer->shared->completion.waiters, 1);
+    atomic_full_barrier ();
+
+    while ((completed = atomic_load_acquire (&buffer->shared->completion.token)) != token)
+        futex_wait (&buffer->shared->completion.token, completed);
+
+    atomic_store_relaxed (&buffer->shared->completion.waiters, 0);
+}
+
+void *
+buffer_wait_for_space (buffer_t *buffer,
+                       size_t size)
+{
+    void *address = buffer_write_address (buffer, size);
+    uint64_t start_time;
+
+    if (likely (address))
+        return address;
+
+    assert (size <= buffer->length);
+
+    start_time = get_monotonic_time_ns ();
+    buffer->producer.stall_count++;
+
+    /* The consumer can't free space it hasn't been given. */
+    if (buffer_publish (buffer))
+        buffer_signal_consumer (buffer);
+
+    atomic_store_relaxed (&buffer->shared->producer_wait.wanted_tail,
+                          buffer->producer.cursor + size - buffer->length);
+
+    while (! address) {
+        unsigned int sequence = atomic_load_acquire (&buffer->shared->producer_wait.sequence);
+
+        /* See buffer_wait_for_data (). */
+        atomic_store_relaxed (&buffer->shared->producer_wait.sleeping, 1);
+        atomic_full_barrier ();
+
+        address = buffer_write_address (buffer, size);
+        if (! address)
+            futex_wait (&buffer->shared->producer_wait.sequence, sequence);
+
+        atomic_store_relaxed (&buffer->shared->producer_wait.sleeping, 0);
+    }
+
+    buffer->producer.stall_time += get_monotonic_time_ns () - start_time;
+    return address;
+}
+
+bool
+buffer_producer_is_waiting (buffer_t *buffer)
+{
+    return atomic_load_relaxed (&buffer->shared->producer_wait.sleeping);
+}
+
+void
+buffer_signal_producer (buffer_t *buffer)
+{
+    atomic_full_barrier ();
+    if (! atomic_load_relaxed (&buffer->shared->producer_wait.sleeping))
+        return;
+
+    /* Don't wake the producer just to have it go back to sleep. */
+    if (buffer->shared->consumer.tail < atomic_load_relaxed (&buffer->shared->producer_wait.wanted_tail))
+        return;
+
+    atomic_increment (&buffer->shared->producer_wait.sequence);
+    futex_wake (&buffer->shared->producer_wait.sequence, 1);
 }
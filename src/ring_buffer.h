@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,39 +11,240 @@
 #include <unistd.h>
 #include "compiler_private.h"
 
+/* Rings smaller than this are rounded up. */
+#define BUFFER_MINIMUM_SIZE (1024 * 64)
+
+/* The default huge page size on x86-64 and ARM64. */
+#define BUFFER_HUGE_PAGE_SIZE (1024 * 1024 * 2)
+
+typedef enum buffer_flags {
+    /* Back the ring with huge pages when the system has some reserved,
+     * which saves TLB entries while commands stream through it. */
+    BUFFER_HUGE_PAGES = 1 << 0,
+    /* Lock the ring into memory. */
+    BUFFER_LOCKED     = 1 << 1,
+    /* Keep the files behind the ring open, so that they can be handed to
+     * a consumer in another process. Such a ring can't be resized. */
+    BUFFER_SHAREABLE  = 1 << 2
+} buffer_flags_t;
+
+/* The state that both sides of the ring write. It lives in a small
+ * mapping of its own, so that a consumer in another process sees the
+ * same indices, and so that it survives buffer_resize (). */
+typedef struct buffer_shared
+{
+    /* Only written by the producer. */
+    struct {
+        size_t head;
+    } producer cache_line_aligned;
+
+    /* Only written by the consumer. */
+    struct {
+        size_t tail;
+    } consumer cache_line_aligned;
+
+    /* The consumer writes the token of every synchronous command it
+     * completes here. The producer spins on it for a while and then
+     * registers as a waiter and sleeps on the token itself, so the consumer
+     * only makes a system call when somebody is actually asleep. */
+    struct {
+        unsigned int token;
+        unsigned int waiters;
+    } completion cache_line_aligned;
+
+    /* The consumer announces here that it is going to sleep, and the
+     * producer bumps the sequence to wake it. This is rarely written,
+     * so the producer can check it after every publish without pulling
+     * the line away from the consumer. */
+    struct {
+        unsigned int sequence;
+        unsigned int sleeping;
+    } consumer_wait cache_line_aligned;
+
+    /* The same for a producer waiting for space: it sleeps until the
+     * consumer's tail reaches wanted_tail. */
+    struct {
+        unsigned int sequence;
+        unsigned int sleeping;
+        size_t wanted_tail;
+    } producer_wait cache_line_aligned;
+} buffer_shared_t;
+
+/* A single-producer/single-consumer ring buffer. The client thread is
+ * the only producer and the server thread the only consumer, so each
+ * side owns its own index and keeps a cached copy of the other side's
+ * index. The cached copy is only refreshed when it no longer tells us
+ * whether there is enough space (or data), which keeps the indices from
+ * bouncing between cores on every command.
+ *
+ * The producer writes at a private cursor and only moves the head, which
+ * is what the consumer sees, in buffer_publish (). That way a run of
+ * small commands costs a single release store.
+ *
+ * The indices grow monotonically; the offset into the mapping is the
+ * index modulo the length. The mapping is mirrored, so a read or write
+ * that crosses the end of the buffer is still contiguous in memory.
+ */
 typedef struct buffer
 {
+    /* These only change in buffer_resize (), which the producer calls
+     * while the buffer is empty. */
     void *address;
-
     size_t length;
-    size_t tail;
-    size_t head;
-    unsigned int last_token;
-    volatile size_t fill_count;
+    const char *name;
+    unsigned int flags;
+
+    /* The files behind the ring and the shared state, which are only
+     * kept open for BUFFER_SHAREABLE rings and are -1 otherwise. */
+    int file_descriptor;
+    int shared_file_descriptor;
+    buffer_shared_t *shared;
+
+    /* An eventfd that the producer signals instead of the futex when the
+     * consumer serves several rings and sleeps on that, or -1. */
+    int consumer_event_fd;
+
+    /* Only used by the producer. The head is a copy of the one in the
+     * shared state, which the producer then never needs to read back. */
+    struct {
+        size_t head;
+        size_t cursor;
+        size_t cached_tail;
+        /* How many times, and for how long in nanoseconds, the producer
+         * had to wait for the consumer to free some space. */
+        uint64_t stall_count;
+        uint64_t stall_time;
+    } producer cache_line_aligned;
+
+    /* Only used by the consumer. */
+    struct {
+        size_t cached_head;
+    } consumer cache_line_aligned;
 } buffer_t;
 
 private void
-buffer_create(buffer_t *buffer, int size, const char *buffer_name);
+buffer_create(buffer_t *buffer, int size, const char *buffer_name,
+              unsigned int flags);
+
+/* Maps a ring that the producer in another process created from its
+ * files, at the same address as in the producer, so that pointers into
+ * the ring stay valid. The files are closed. Returns false if the
+ * address range is already taken. */
+private bool
+buffer_attach(buffer_t *buffer, const char *buffer_name,
+              int file_descriptor, int shared_file_descriptor,
+              size_t length, void *address);
+
+/* Creates a private ring of |length| bytes, a multiple of the page size,
+ * at |address|, to mirror a ring of a producer that can't share memory
+ * with us; see server_stream.h. Returns false if the address range is
+ * already taken. */
+private bool
+buffer_create_at(buffer_t *buffer, const char *buffer_name,
+                 size_t length, void *address);
 
 private void
 buffer_free(buffer_t *buffer);
 
+/* Replaces the mapping with one of a new size. This must only be called
+ * by the producer when the buffer is empty, i.e. when the consumer has
+ * retired every command it was given. It fails for BUFFER_SHAREABLE
+ * rings, whose consumer may have mapped the old files. */
+private bool
+buffer_resize(buffer_t *buffer, size_t size);
+
 private size_t
 buffer_num_entries(buffer_t *buffer);
 
 private void *
-buffer_write_address(buffer_t *buffer, size_t *writable_bytes);
+buffer_write_address(buffer_t *buffer, size_t size);
 
+/* Moves the private write cursor; the data is not visible to the
+ * consumer until buffer_publish () is called. */
 private void
 buffer_write_advance(buffer_t *buffer, size_t count_bytes);
 
+/* Makes everything written so far visible to the consumer. Returns false
+ * if there was nothing to publish. */
+private bool
+buffer_publish(buffer_t *buffer);
+
 private void *
 buffer_read_address(buffer_t *buffer, size_t *bytes_to_read);
 
 private void
 buffer_read_advance(buffer_t *buffer, size_t count_bytes);
 
+/* Like buffer_read_address (), but for a reader that runs ahead of the
+ * consumer and has read everything before |index|. Only the consumer's
+ * tail frees space, so the data stays put until the consumer is done. */
+private void *
+buffer_read_address_at(buffer_t *buffer, size_t index, size_t *bytes_to_read);
+
 private void
 buffer_clear(buffer_t *buffer);
 
+/* Called by the consumer when the buffer is empty. Spins for at most
+ * |spin_time| nanoseconds and then sleeps until the producer publishes
+ * more data. It may also return early, when it is woken with
+ * buffer_wake_consumer () or by a signal, so the caller has to check for
+ * data again. Returns how long it waited, in nanoseconds. */
+private uint64_t
+buffer_wait_for_data(buffer_t *buffer, uint64_t spin_time);
+
+/* The same for the reader of buffer_read_address_at (), which waits for
+ * data past |index| instead of past the tail. */
+private uint64_t
+buffer_wait_for_data_at(buffer_t *buffer, size_t index, uint64_t spin_time);
+
+/* Called by the producer after publishing data; this only makes a system
+ * call if the consumer has announced that it is sleeping. */
+private void
+buffer_signal_consumer(buffer_t *buffer);
+
+/* Wakes the consumer even though there is no new data, for instance to
+ * have it notice that the producer has gone away. */
+private void
+buffer_wake_consumer(buffer_t *buffer);
+
+/* For a consumer that serves several rings and sleeps on their shared
+ * consumer_event_fd rather than in buffer_wait_for_data (). Announces
+ * that the consumer is about to sleep, unless there is data to read, in
+ * which case it returns false. Once the consumer wakes up, or decides
+ * not to sleep after all, it calls buffer_finish_sleep (). */
+private bool
+buffer_prepare_to_sleep(buffer_t *buffer);
+
+private void
+buffer_finish_sleep(buffer_t *buffer);
+
+/* Called by the consumer when it has executed a synchronous command.
+ * They complete in the order the producer issued them, so the tokens are
+ * just a count: the first one is 1 and they wrap around. */
+private void
+buffer_complete_token(buffer_t *buffer);
+
+/* Called by the producer to wait until the consumer has completed |token|.
+ * Spins for at most |spin_time| nanoseconds before going to sleep. */
+private void
+buffer_wait_for_token(buffer_t *buffer, unsigned int token,
+                      uint64_t spin_time);
+
+/* Like buffer_write_address (), but sleeps until the consumer has freed
+ * |size| bytes instead of failing. |size| must not exceed the length of
+ * the buffer. Pending data is published and the consumer woken before
+ * going to sleep. */
+private void *
+buffer_wait_for_space(buffer_t *buffer, size_t size);
+
+/* Tells the consumer whether the producer is asleep waiting for space, in
+ * which case it should retire data as soon as it can. */
+private bool
+buffer_producer_is_waiting(buffer_t *buffer);
+
+/* Called by the consumer after retiring data; wakes the producer if it is
+ * sleeping and enough space is now free. */
+private void
+buffer_signal_producer(buffer_t *buffer);
+
 #endif /* GPUPROCESS_RING_BUFFER_H */
@@ -0,0 +1,390 @@
+/* A GPU server running in a process of its own. Clients started with
+ * GPUPROCESS_SERVER_SOCKET pointing at the socket this listens on hand it
+ * their command buffers instead of starting a server thread, so a single
+ * process owns the driver for all of them. Each client gets a thread of
+ * its own that runs the usual server work loop on the client's buffers,
+ * unless GPUPROCESS_SERVER_THREADS asks for a fixed number of threads
+ * that serve all the clients between them.
+ *
+ * Clients that stream their commands, which is the only way for a client
+ * on another machine, get a thread of their own that reads the stream
+ * and executes it. Such a client sees the server listen at "tcp:host:port".
+ *
+ * usage: gpuprocess-server [socket path | tcp:host:port]
+ *
+ * The path defaults to GPUPROCESS_SERVER_SOCKET. The GL and EGL libraries
+ * are loaded from GPUPROCESS_LIBGLES_PATH and GPUPROCESS_LIBEGL_PATH, as in
+ * the client, which makes it possible to run against stub libraries on a
+ * machine without a GPU.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include "server.h"
+#include "server_connection.h"
+#include "server_scheduler.h"
+#include "server_stream.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+typedef struct connection {
+    int socket;
+    buffer_t buffer;
+    buffer_t transfer_buffer;
+    server_t *server;
+    thread_t thread;
+    pid_t pid;
+    server_name_mapping_t *name_mapping;
+} connection_t;
+
+static connection_t **connections = NULL;
+static size_t connection_count = 0;
+
+/* NULL when every client gets a thread of its own. */
+static server_scheduler_t *scheduler = NULL;
+
+/* The threads of a client process share the names of their objects, but
+ * different processes pick them independently, so each process gets a
+ * name mapping of its own. */
+static server_name_mapping_t *
+connection_find_name_mapping (pid_t pid)
+{
+    size_t i;
+    for (i = 0; i < connection_count; i++) {
+        if (connections[i]->pid == pid)
+            return connections[i]->name_mapping;
+    }
+    return server_name_mapping_new ();
+}
+
+static void
+connection_release_name_mapping (connection_t *connection)
+{
+    size_t i;
+    for (i = 0; i < connection_count; i++) {
+        if (connections[i] != connection && connections[i]->pid == connection->pid)
+            return;
+    }
+    server_name_mapping_destroy (connection->name_mapping);
+}
+
+static void
+connection_thread_init (void)
+{
+    prctl (PR_SET_TIMERSLACK, 1);
+}
+
+static void *
+connection_thread_func (void *ptr)
+{
+    connection_t *connection = (connection_t *) ptr;
+
+    connection_thread_init ();
+    server_start_work_loop (connection->server);
+    return NULL;
+}
+
+static void
+connection_free (connection_t *connection)
+{
+    connection_release_name_mapping (connection);
+    buffer_free (&connection->buffer);
+    if (connection->transfer_buffer.address)
+        buffer_free (&connection->transfer_buffer);
+    close (connection->socket);
+    free (connection);
+}
+
+/* A client that streams its commands. The main loop doesn't keep track of
+ * these, as their thread reads the socket and notices when the client has
+ * gone away. A client on another machine has no pid we could tell its
+ * threads apart by, so each gets a name mapping of its own. */
+typedef struct stream_connection {
+    int socket;
+    buffer_t buffer;
+    buffer_t transfer_buffer;
+    server_t *server;
+    server_stream_t *stream;
+} stream_connection_t;
+
+static void
+stream_connection_destroy (stream_connection_t *connection)
+{
+    server_name_mapping_t *name_mapping = connection->server->name_mapping;
+
+    server_stream_destroy (connection->stream);
+    server_destroy (connection->server);
+    server_name_mapping_destroy (name_mapping);
+    buffer_free (&connection->buffer);
+    buffer_free (&connection->transfer_buffer);
+    close (connection->socket);
+    free (connection);
+}
+
+static void *
+stream_connection_thread_func (void *ptr)
+{
+    stream_connection_t *connection = (stream_connection_t *) ptr;
+
+    connection_thread_init ();
+    server_stream_serve (connection->stream, connection->server);
+    stream_connection_destroy (connection);
+    return NULL;
+}
+
+static void
+stream_connection_start (int socket,
+                         server_connection_request_t *request)
+{
+    stream_connection_t *connection = NULL;
+    struct timeval no_timeout = { 0, 0 };
+    pthread_attr_t attributes;
+    pthread_t thread;
+
+    /* Our copies of the buffers go where the client has its own, which
+     * may be taken here. The client then runs a server thread itself. */
+    if (! request->transfer_buffer.length ||
+        posix_memalign ((void **) &connection, CACHE_LINE_SIZE,
+                        sizeof (stream_connection_t)))
+        goto FAIL;
+    memset (connection, 0, sizeof (stream_connection_t));
+    connection->socket = socket;
+
+    if (! buffer_create_at (&connection->buffer, "command",
+                            request->buffer.length,
+                            (void *) (uintptr_t) request->buffer.address))
+        goto FAIL;
+    if (! buffer_create_at (&connection->transfer_buffer, "transfer",
+                            request->transfer_buffer.length,
+                            (void *) (uintptr_t) request->transfer_buffer.address)) {
+        buffer_free (&connection->buffer);
+        goto FAIL;
+    }
+
+    connection->server = server_new (&connection->buffer,
+                                     &connection->transfer_buffer);
+    connection->server->name_mapping = server_name_mapping_new ();
+    connection->stream = server_stream_new (socket, &connection->buffer,
+                                            &connection->transfer_buffer,
+                                            request->flags,
+                                            (size_t) request->cache_size * 1024);
+
+    /* The stream may well sit idle for longer than the request could. */
+    setsockopt (socket, SOL_SOCKET, SO_RCVTIMEO, &no_timeout,
+                sizeof (no_timeout));
+
+    pthread_attr_init (&attributes);
+    pthread_attr_setdetachstate (&attributes, PTHREAD_CREATE_DETACHED);
+    if (! server_connection_send_reply (socket, true, -1) ||
+        pthread_create (&thread, &attributes, stream_connection_thread_func,
+                        connection)) {
+        pthread_attr_destroy (&attributes);
+        stream_connection_destroy (connection);
+        return;
+    }
+    pthread_attr_destroy (&attributes);
+    return;
+
+FAIL:
+    free (connection);
+    server_connection_send_reply (socket, false, -1);
+    close (socket);
+}
+
+static connection_t *
+connection_new (int socket)
+{
+    server_connection_request_t request;
+    int file_descriptors[SERVER_CONNECTION_MAX_FILES];
+    int file_count;
+    connection_t *connection = NULL;
+    struct ucred credentials;
+    socklen_t credentials_length = sizeof (credentials);
+
+    /* Don't let a client that never sends its request hold up the
+     * others. */
+    struct timeval timeout = { 1, 0 };
+    setsockopt (socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+    file_count = server_connection_receive_request (socket, &request,
+                                                    file_descriptors);
+    if (file_count < 0)
+        goto FAIL;
+
+    if (request.flags & SERVER_CONNECTION_STREAM) {
+        stream_connection_start (socket, &request);
+        return NULL;
+    }
+
+    if (getsockopt (socket, SOL_SOCKET, SO_PEERCRED,
+                    &credentials, &credentials_length)) {
+        for (file_count--; file_count >= 0; file_count--)
+            close (file_descriptors[file_count]);
+        goto FAIL;
+    }
+
+    /* The buffer indices are cache line aligned. */
+    if (posix_memalign ((void **) &connection, CACHE_LINE_SIZE,
+                        sizeof (connection_t)))
+        goto FAIL;
+    memset (connection, 0, sizeof (connection_t));
+    connection->socket = socket;
+    connection->pid = credentials.pid;
+
+    if (file_count > 2 &&
+        ! buffer_attach (&connection->transfer_buffer, "transfer",
+                         file_descriptors[2], file_descriptors[3],
+                         request.transfer_buffer.length,
+                         (void *) (uintptr_t) request.transfer_buffer.address)) {
+        close (file_descriptors[0]);
+        close (file_descriptors[1]);
+        goto FAIL;
+    }
+
+    if (! buffer_attach (&connection->buffer, "command",
+                         file_descriptors[0], file_descriptors[1],
+                         request.buffer.length,
+                         (void *) (uintptr_t) request.buffer.address)) {
+        if (connection->transfer_buffer.address)
+            buffer_free (&connection->transfer_buffer);
+        goto FAIL;
+    }
+
+    connection->name_mapping = connection_find_name_mapping (connection->pid);
+    connection->server =
+        server_new (&connection->buffer,
+                    connection->transfer_buffer.address ?
+                        &connection->transfer_buffer : NULL);
+    connection->server->name_mapping = connection->name_mapping;
+
+    if (scheduler) {
+        int event_fd = server_scheduler_add (scheduler, connection->server);
+        if (server_connection_send_reply (socket, true, event_fd))
+            return connection;
+    } else if (server_connection_send_reply (socket, true, -1) &&
+               ! pthread_create (&connection->thread, NULL,
+                                 connection_thread_func, connection)) {
+        return connection;
+    }
+
+    if (scheduler)
+        server_scheduler_remove (scheduler, &connection->buffer);
+    else
+        server_destroy (connection->server);
+    connection_free (connection);
+    return NULL;
+
+FAIL:
+    /* The client falls back to a server thread of its own. */
+    free (connection);
+    server_connection_send_reply (socket, false, -1);
+    close (socket);
+    return NULL;
+}
+
+static void
+connection_destroy (connection_t *connection)
+{
+    /* The scheduler destroys the server itself. */
+    if (scheduler) {
+        server_scheduler_remove (scheduler, &connection->buffer);
+    } else {
+        atomic_store_release (&connection->server->disconnected, 1);
+        buffer_wake_consumer (&connection->buffer);
+        pthread_join (connection->thread, NULL);
+        server_destroy (connection->server);
+    }
+    connection_free (connection);
+}
+
+/* Clients only ever close their end of the socket. */
+static bool
+connection_is_closed (connection_t *connection)
+{
+    char byte;
+    ssize_t result = recv (connection->socket, &byte, 1, MSG_DONTWAIT);
+    return result == 0 || (result < 0 && errno != EAGAIN && errno != EINTR);
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : getenv ("GPUPROCESS_SERVER_SOCKET");
+    const char *thread_count = getenv ("GPUPROCESS_SERVER_THREADS");
+    struct pollfd *poll_fds = NULL;
+    size_t capacity = 0;
+    int listen_socket;
+    size_t i;
+
+    if (! path) {
+        fprintf (stderr, "usage: %s [socket path | tcp:host:port]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (thread_count)
+        scheduler = server_scheduler_new (strtoul (thread_count, NULL, 10),
+                                          connection_thread_init);
+
+    listen_socket = server_connection_listen (path);
+    if (listen_socket < 0) {
+        fprintf (stderr, "gpuprocess-server: could not listen on %s: %s\n",
+                 path, strerror (errno));
+        return EXIT_FAILURE;
+    }
+
+    while (true) {
+        if (connection_count + 1 > capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            connections = realloc (connections, capacity * sizeof (connection_t *));
+            poll_fds = realloc (poll_fds, capacity * sizeof (struct pollfd));
+        }
+
+        poll_fds[0].fd = listen_socket;
+        poll_fds[0].events = POLLIN;
+        for (i = 0; i < connection_count; i++) {
+            poll_fds[i + 1].fd = connections[i]->socket;
+            poll_fds[i + 1].events = POLLIN;
+        }
+
+        if (poll (poll_fds, connection_count + 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        /* Walk backwards, so that removing a connection doesn't skip the
+         * one after it. */
+        for (i = connection_count; i > 0; i--) {
+            if (! poll_fds[i].revents || ! connection_is_closed (connections[i - 1]))
+                continue;
+            connection_destroy (connections[i - 1]);
+            connections[i - 1] = connections[--connection_count];
+        }
+
+        if (poll_fds[0].revents & POLLIN) {
+            int client_socket = accept4 (listen_socket, NULL, NULL, SOCK_CLOEXEC);
+            connection_t *connection;
+
+            if (client_socket < 0)
+                continue;
+            connection = connection_new (client_socket);
+            if (connection)
+                connections[connection_count++] = connection;
+        }
+    }
+
+    close (listen_socket);
+    if (! server_connection_is_tcp (path))
+        unlink (path);
+    free (connections);
+    free (poll_fds);
+    return EXIT_FAILURE;
+}
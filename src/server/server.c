@@ -3,6 +3,8 @@
 
 #include "ring_buffer.h"
 #include "dispatch_table.h"
+#include "server_frame_cache.h"
+#include "server_pipeline.h"
 #include "thread_private.h"
 #include <time.h>
 
@@ -11,49 +13,188 @@
 static void
 server_fill_command_handler_table (server_t *server);
 
+static void
+server_fill_command_prepare_table (server_t *server);
+
+void
+server_wait_for_commands (server_t *server,
+                          size_t index)
+{
+    uint64_t wait_time = buffer_wait_for_data_at (server->buffer, index,
+                                                  server->spin_time);
+
+    server->average_wait_time = (server->average_wait_time * 7 + wait_time) / 8;
+
+    /* Spinning only pays off if commands usually arrive before we give
+     * up; when they don't, go to sleep right away and save the cpu. */
+    if (server->average_wait_time < server->spin_limit)
+        server->spin_time = server->average_wait_time * 2 < server->spin_limit ?
+                            server->average_wait_time * 2 : server->spin_limit;
+    else
+        server->spin_time = 0;
+}
+
+/* Pulls a command into the cache ahead of its execution. Only the first
+ * few lines are fetched, since a large payload would evict the commands
+ * that come after it. */
+static inline void
+server_prefetch_command (const char *command,
+                         size_t size)
+{
+    size_t offset;
+
+    if (size > SERVER_PREFETCH_LIMIT)
+        size = SERVER_PREFETCH_LIMIT;
+    for (offset = 0; offset < size; offset += CACHE_LINE_SIZE)
+        __builtin_prefetch (command + offset, 0, 3);
+}
+
+/* Gives back the oldest allocation in the transfer buffer, which belongs
+ * to the command that was just executed. */
+static void
+server_release_transfer (server_t *server)
+{
+    size_t available;
+    uint64_t *allocation = buffer_read_address (server->transfer_buffer,
+                                                &available);
+
+    buffer_read_advance (server->transfer_buffer, *allocation);
+    buffer_signal_producer (server->transfer_buffer);
+}
+
+ssize_t
+server_execute_commands (server_t *server,
+                         size_t budget)
+{
+    buffer_t *buffer = server->buffer;
+    size_t available;
+    size_t offset = 0;
+    size_t retired = 0;
+    char *commands = server->pipeline ?
+        server_pipeline_read_address (server->pipeline, &available) :
+        buffer_read_address (buffer, &available);
+
+    if (! commands)
+        return 0;
+
+    /* Everything the client has published so far is complete, so run as
+     * much of it as the budget allows before touching the shared indices
+     * again. */
+    while (offset < available && offset < budget) {
+        command_t *command = (command_t *) (commands + offset);
+        size_t next_offset = offset + command->size;
+
+        /* The header of the next command was prefetched during the
+         * previous iteration, so its size should be at hand. */
+        if (next_offset < available) {
+            command_t *next_command = (command_t *) (commands + next_offset);
+            size_t after_next_offset = next_offset + next_command->size;
+
+            server_prefetch_command ((char *) next_command,
+                                     next_command->size);
+            if (after_next_offset < available)
+                __builtin_prefetch (commands + after_next_offset, 0, 3);
+        }
+
+        if (command->type == COMMAND_SHUTDOWN)
+            return -1;
+
+        if (unlikely (server->recording_frame))
+            server_frame_cache_record (server, command);
+
+        server->handler_table[command->type](server, command);
+        offset = next_offset;
+
+        if (command->flags & COMMAND_FLAG_TRANSFER_PAYLOAD)
+            server_release_transfer (server);
+
+        /* The client is waiting for this one, so don't keep it waiting
+         * for the rest of the batch. The same goes for a client that
+         * has run out of space. */
+        if (command->flags & COMMAND_FLAG_SYNCHRONOUS) {
+            buffer_complete_token (buffer);
+            buffer_read_advance (buffer, offset - retired);
+            retired = offset;
+            buffer_signal_producer (buffer);
+        } else if (unlikely (buffer_producer_is_waiting (buffer))) {
+            buffer_read_advance (buffer, offset - retired);
+            retired = offset;
+            buffer_signal_producer (buffer);
+        }
+    }
+
+    if (retired < offset) {
+        buffer_read_advance (buffer, offset - retired);
+        buffer_signal_producer (buffer);
+    }
+    if (server->pipeline)
+        server_pipeline_signal_executed (server->pipeline);
+    return offset;
+}
+
 void
 server_start_work_loop (server_t *server)
 {
+    ssize_t executed;
+
+    if (server_pipeline_is_enabled ())
+        server->pipeline = server_pipeline_new (server);
+
     while (true) {
-        size_t data_left_to_read;
-        command_t *read_command = (command_t *) buffer_read_address (server->buffer,
-                                                                     &data_left_to_read);
-        /* The buffer is empty, so wait until there's something to read. */
-         /*int times_slept = 0;
-         while (! read_command && times_slept < 20) {
-             sleep_nanoseconds (500);
-             read_command = (command_t *) buffer_read_address (server->buffer,
-                                                           &data_left_to_read);
-             times_slept++;
-         }*/
-
-        /* We ran out of hot cycles, try a more lackadaisical approach. */
-        while (! read_command) {
-            sem_wait (server->server_signal);
-            read_command = (command_t *) buffer_read_address (server->buffer,
-                                                              &data_left_to_read);
-        }
+        executed = server_execute_commands (server, SIZE_MAX);
 
-        if (read_command->type == COMMAND_SHUTDOWN)
+        if (unlikely (executed < 0))
             break;
 
-        server->handler_table[read_command->type](server, read_command);
-
-        if (read_command->token) {
-            server->buffer->last_token = read_command->token;
-            buffer_read_advance (server->buffer, read_command->size);
-            sem_post (server->client_signal);
+        /* The buffer is empty, so wait until there's something to read. */
+        if (executed)
+            continue;
+        if (server->pipeline) {
+            if (! server_pipeline_wait_for_commands (server->pipeline))
+                break;
+        } else {
+            if (unlikely (atomic_load_acquire (&server->disconnected)))
+                break;
+            server_wait_for_commands (server,
+                                      server->buffer->shared->consumer.tail);
         }
-        else
-            buffer_read_advance (server->buffer, read_command->size);
     }
+
+    if (server->pipeline) {
+        server_pipeline_destroy (server->pipeline);
+        server->pipeline = NULL;
+    }
+    /* Otherwise the client has gone away. */
+    if (executed < 0)
+        buffer_complete_token (server->buffer);
+}
+
+void
+server_switch_context (server_t *from,
+                       server_t *to)
+{
+    if (to && from && to->current.context == from->current.context &&
+        to->current.display == from->current.display &&
+        to->current.draw == from->current.draw &&
+        to->current.read == from->current.read)
+        return;
+
+    if (to && to->current.context != EGL_NO_CONTEXT)
+        to->dispatch.eglMakeCurrent (to, to->current.display,
+                                     to->current.draw, to->current.read,
+                                     to->current.context);
+    else if (from && from->current.context != EGL_NO_CONTEXT)
+        from->dispatch.eglMakeCurrent (from, from->current.display,
+                                       EGL_NO_SURFACE, EGL_NO_SURFACE,
+                                       EGL_NO_CONTEXT);
 }
 
 server_t *
-server_new (buffer_t *buffer)
+server_new (buffer_t *buffer,
+            buffer_t *transfer_buffer)
 {
     server_t *server = malloc (sizeof (server_t));
-    server_init (server, buffer);
+    server_init (server, buffer, transfer_buffer);
     return server;
 }
 
@@ -65,102 +206,186 @@ server_handle_no_op (server_t *server,
 }
 
 mutex_static_init (name_mapping_mutex);
-static HashTable *name_mapping_buffer = NULL;
-static HashTable *name_mapping_renderbuffer = NULL;
-static HashTable *name_mapping_shader_object = NULL;
-static HashTable *name_mapping_texture = NULL;
-static HashTable *name_mapping_framebuffer = NULL;
+static server_name_mapping_t *process_name_mapping = NULL;
 
-static void
-server_handle_glbindbuffer (server_t *server, command_t *abstract_command)
+server_name_mapping_t *
+server_name_mapping_new ()
+{
+    server_name_mapping_t *name_mapping = malloc (sizeof (server_name_mapping_t));
+    name_mapping->buffer = new_hash_table(free);
+    name_mapping->renderbuffer = new_hash_table(free);
+    name_mapping->shader_object = new_hash_table(free);
+    name_mapping->texture = new_hash_table(free);
+    name_mapping->framebuffer = new_hash_table(free);
+    return name_mapping;
+}
+
+void
+server_name_mapping_destroy (server_name_mapping_t *name_mapping)
+{
+    delete_hash_table (name_mapping->buffer);
+    delete_hash_table (name_mapping->renderbuffer);
+    delete_hash_table (name_mapping->shader_object);
+    delete_hash_table (name_mapping->texture);
+    delete_hash_table (name_mapping->framebuffer);
+    free (name_mapping);
+}
+
+static server_prepare_result_t
+server_prepare_glbindbuffer (server_t *server, command_t *abstract_command)
 {
-    INSTRUMENT ();
     command_glbindbuffer_t *command =
             (command_glbindbuffer_t *)abstract_command;
     if (command->buffer) {
         mutex_lock (name_mapping_mutex);
-        GLuint *buffer = hash_lookup (name_mapping_buffer, command->buffer);
-        mutex_unlock (name_mapping_mutex);
+        GLuint *buffer = hash_lookup (server->name_mapping->buffer, command->buffer);
         if (!buffer) {
             GLuint *data = (GLuint *) malloc (1 * sizeof (GLuint));
+            if (! data) {
+                fprintf (stderr, "Could not map the name %u.\n", command->buffer);
+                abort ();
+            }
             *data = command->buffer;
-            hash_insert (name_mapping_buffer, *data, data);
+            hash_insert (server->name_mapping->buffer, *data, data);
             buffer = data;
         }
         command->buffer = *buffer;
+        mutex_unlock (name_mapping_mutex);
     }
-    server->dispatch.glBindBuffer (server, command->target, command->buffer);
-    command_glbindbuffer_destroy_arguments (command);
+    return SERVER_PREPARE_READY;
 }
+
 static void
-server_handle_glbindtexture (server_t *server, command_t *abstract_command)
+server_handle_glbindbuffer (server_t *server, command_t *abstract_command)
 {
     INSTRUMENT ();
+    command_glbindbuffer_t *command =
+            (command_glbindbuffer_t *)abstract_command;
+    if (! (abstract_command->flags & COMMAND_FLAG_PREPARED))
+        server_prepare_glbindbuffer (server, abstract_command);
+    server->dispatch.glBindBuffer (server, command->target, command->buffer);
+    command_glbindbuffer_destroy_arguments (command);
+}
+static server_prepare_result_t
+server_prepare_glbindtexture (server_t *server, command_t *abstract_command)
+{
     command_glbindtexture_t *command =
             (command_glbindtexture_t *)abstract_command;
     if (command->texture) {
         mutex_lock (name_mapping_mutex);
-        GLuint *texture = hash_lookup (name_mapping_texture, command->texture);
-        mutex_unlock (name_mapping_mutex);
+        GLuint *texture = hash_lookup (server->name_mapping->texture, command->texture);
         if (!texture) {
             GLuint *data = (GLuint *) malloc (1 * sizeof (GLuint));
+            if (! data) {
+                fprintf (stderr, "Could not map the name %u.\n", command->texture);
+                abort ();
+            }
             *data = command->texture;
-            hash_insert (name_mapping_texture, *data, data);
+            hash_insert (server->name_mapping->texture, *data, data);
             texture = data;
         }
         command->texture = *texture;
+        mutex_unlock (name_mapping_mutex);
     }
-    server->dispatch.glBindTexture (server, command->target, command->texture);
-    command_glbindtexture_destroy_arguments (command);
+    return SERVER_PREPARE_READY;
 }
 
 static void
-server_handle_glbindframebuffer (server_t *server, command_t *abstract_command)
+server_handle_glbindtexture (server_t *server, command_t *abstract_command)
 {
     INSTRUMENT ();
+    command_glbindtexture_t *command =
+            (command_glbindtexture_t *)abstract_command;
+    if (! (abstract_command->flags & COMMAND_FLAG_PREPARED))
+        server_prepare_glbindtexture (server, abstract_command);
+    server->dispatch.glBindTexture (server, command->target, command->texture);
+    command_glbindtexture_destroy_arguments (command);
+}
+
+static server_prepare_result_t
+server_prepare_glbindframebuffer (server_t *server, command_t *abstract_command)
+{
     command_glbindframebuffer_t *command =
             (command_glbindframebuffer_t *)abstract_command;
     if (command->framebuffer) {
         mutex_lock (name_mapping_mutex);
         GLuint *framebuffer =
-            hash_lookup (name_mapping_framebuffer, command->framebuffer);
-        mutex_unlock (name_mapping_mutex);
+            hash_lookup (server->name_mapping->framebuffer, command->framebuffer);
         if (!framebuffer) {
             GLuint *data = (GLuint *) malloc (1 * sizeof (GLuint));
+            if (! data) {
+                fprintf (stderr, "Could not map the name %u.\n", command->framebuffer);
+                abort ();
+            }
             *data = command->framebuffer;
-            hash_insert (name_mapping_framebuffer, *data, data);
+            hash_insert (server->name_mapping->framebuffer, *data, data);
             framebuffer = data;
         }
         command->framebuffer = *framebuffer;
+        mutex_unlock (name_mapping_mutex);
     }
-    server->dispatch.glBindFramebuffer (server, command->target, command->framebuffer);
-    command_glbindframebuffer_destroy_arguments (command);
+    return SERVER_PREPARE_READY;
 }
 
 static void
-server_handle_glbindrenderbuffer (
-    server_t *server, command_t *abstract_command)
+server_handle_glbindframebuffer (server_t *server, command_t *abstract_command)
 {
     INSTRUMENT ();
+    command_glbindframebuffer_t *command =
+            (command_glbindframebuffer_t *)abstract_command;
+    if (! (abstract_command->flags & COMMAND_FLAG_PREPARED))
+        server_prepare_glbindframebuffer (server, abstract_command);
+    server->dispatch.glBindFramebuffer (server, command->target, command->framebuffer);
+    command_glbindframebuffer_destroy_arguments (command);
+}
+
+static server_prepare_result_t
+server_prepare_glbindrenderbuffer (server_t *server, command_t *abstract_command)
+{
     command_glbindrenderbuffer_t *command =
             (command_glbindrenderbuffer_t *)abstract_command;
     if (command->renderbuffer) {
         mutex_lock (name_mapping_mutex);
         GLuint *renderbuffer =
-            hash_lookup (name_mapping_renderbuffer, command->renderbuffer);
-        mutex_unlock (name_mapping_mutex);
+            hash_lookup (server->name_mapping->renderbuffer, command->renderbuffer);
         if (!renderbuffer) {
             GLuint *data = (GLuint *) malloc (1 * sizeof (GLuint));
+            if (! data) {
+                fprintf (stderr, "Could not map the name %u.\n", command->renderbuffer);
+                abort ();
+            }
             *data = command->renderbuffer;
-            hash_insert (name_mapping_renderbuffer, *data, data);
+            hash_insert (server->name_mapping->renderbuffer, *data, data);
             renderbuffer = data;
         }
         command->renderbuffer = *renderbuffer;
+        mutex_unlock (name_mapping_mutex);
     }
+    return SERVER_PREPARE_READY;
+}
+
+static void
+server_handle_glbindrenderbuffer (
+    server_t *server, command_t *abstract_command)
+{
+    INSTRUMENT ();
+    command_glbindrenderbuffer_t *command =
+            (command_glbindrenderbuffer_t *)abstract_command;
+    if (! (abstract_command->flags & COMMAND_FLAG_PREPARED))
+        server_prepare_glbindrenderbuffer (server, abstract_command);
     server->dispatch.glBindRenderbuffer (server, command->target, command->renderbuffer);
     command_glbindrenderbuffer_destroy_arguments (command);
 }
 
+/* For the commands whose handlers add names to the mapping, or take them
+ * out, as the prepare stage can't translate the names of the commands
+ * that come after them until then. */
+static server_prepare_result_t
+server_prepare_wait (server_t *server, command_t *abstract_command)
+{
+    return SERVER_PREPARE_WAIT;
+}
+
 static void
 server_handle_glgenbuffers (server_t *server,
                                    command_t *abstract_command)
@@ -178,7 +403,7 @@ server_handle_glgenbuffers (server_t *server,
     for (i = 0; i < command->n; i++) {
         GLuint *data = (GLuint *)malloc (sizeof (GLuint));
         *data = server_buffers[i];
-        hash_insert (name_mapping_buffer, command->buffers[i], data);
+        hash_insert (server->name_mapping->buffer, command->buffers[i], data);
     }
     mutex_unlock (name_mapping_mutex);
 
@@ -197,7 +422,7 @@ server_handle_gldeletebuffers (server_t *server, command_t *abstract_command)
     int i;
     mutex_lock (name_mapping_mutex);
     for (i = 0; i < command->n; i++) {
-        GLuint *entry = hash_take (name_mapping_buffer, command->buffers[i]);
+        GLuint *entry = hash_take (server->name_mapping->buffer, command->buffers[i]);
         if (entry) {
             command->buffers[i] = *entry;
             free (entry);
@@ -226,7 +451,7 @@ server_handle_glgenframebuffers (server_t *server, command_t *abstract_command)
     for (i = 0; i < command->n; i++) {
         GLuint *data = (GLuint *)malloc (sizeof (GLuint));
         *data = server_framebuffers[i];
-        hash_insert (name_mapping_framebuffer, command->framebuffers[i], data);
+        hash_insert (server->name_mapping->framebuffer, command->framebuffers[i], data);
     }
     mutex_unlock (name_mapping_mutex);
 
@@ -245,7 +470,7 @@ server_handle_gldeleteframebuffers (server_t *server, command_t *abstract_comman
     int i;
     mutex_lock (name_mapping_mutex);
     for (i = 0; i < command->n; i++) {
-        GLuint *entry = hash_take (name_mapping_framebuffer, command->framebuffers[i]);
+        GLuint *entry = hash_take (server->name_mapping->framebuffer, command->framebuffers[i]);
         if (entry) {
             command->framebuffers[i] = *entry;
             free (entry);
@@ -274,7 +499,7 @@ server_handle_glgentextures (server_t *server, command_t *abstract_command)
     for (i = 0; i < command->n; i++) {
         GLuint *data = (GLuint *)malloc (sizeof (GLuint));
         *data = server_textures[i];
-        hash_insert (name_mapping_texture, command->textures[i], data);
+        hash_insert (server->name_mapping->texture, command->textures[i], data);
     }
     mutex_unlock (name_mapping_mutex);
 
@@ -293,7 +518,7 @@ server_handle_gldeletetextures (server_t *server, command_t *abstract_command)
     int i;
     mutex_lock (name_mapping_mutex);
     for (i = 0; i < command->n; i++) {
-        GLuint *entry = hash_take (name_mapping_texture, command->textures[i]);
+        GLuint *entry = hash_take (server->name_mapping->texture, command->textures[i]);
         if (entry) {
             command->textures[i] = *entry;
             free (entry);
@@ -323,7 +548,7 @@ server_handle_glgenrenderbuffers (server_t *server,
     for (i = 0; i < command->n; i++) {
         GLuint *data = (GLuint *)malloc (sizeof (GLuint));
         *data = server_renderbuffers[i];
-        hash_insert (name_mapping_renderbuffer, command->renderbuffers[i], data);
+        hash_insert (server->name_mapping->renderbuffer, command->renderbuffers[i], data);
     }
     mutex_unlock (name_mapping_mutex);
 
@@ -342,7 +567,7 @@ server_handle_gldeleterenderbuffers (server_t *server, command_t *abstract_comma
     int i;
     mutex_lock (name_mapping_mutex);
     for (i = 0; i < command->n; i++) {
-        GLuint *entry = hash_take (name_mapping_renderbuffer, command->renderbuffers[i]);
+        GLuint *entry = hash_take (server->name_mapping->renderbuffer, command->renderbuffers[i]);
         if (entry) {
             command->renderbuffers[i] = *entry;
             free (entry);
@@ -366,7 +591,7 @@ server_handle_glcreateprogram (server_t *server, command_t *abstract_command)
     *program = server->dispatch.glCreateProgram (server);
 
     mutex_lock (name_mapping_mutex);
-    hash_insert (name_mapping_shader_object, command->result, program);
+    hash_insert (server->name_mapping->shader_object, command->result, program);
     mutex_unlock (name_mapping_mutex);
 
 }
@@ -380,7 +605,7 @@ server_handle_gldeleteprogram (server_t *server, command_t *abstract_command)
             (command_gldeleteprogram_t *)abstract_command;
 
     mutex_lock (name_mapping_mutex);
-    GLuint *program = hash_take (name_mapping_shader_object, command->program);
+    GLuint *program = hash_take (server->name_mapping->shader_object, command->program);
     
     if (program) {
         GLuint program_value = *program;
@@ -404,7 +629,7 @@ server_handle_glcreateshader (server_t *server, command_t *abstract_command)
     *shader = server->dispatch.glCreateShader (server, command->type);
 
     mutex_lock (name_mapping_mutex);
-    hash_insert (name_mapping_shader_object, command->result, shader);
+    hash_insert (server->name_mapping->shader_object, command->result, shader);
     mutex_unlock (name_mapping_mutex);
 }
 
@@ -417,7 +642,7 @@ server_handle_gldeleteshader (server_t *server, command_t *abstract_command)
             (command_gldeleteshader_t *)abstract_command;
 
     mutex_lock (name_mapping_mutex);
-    GLuint *shader = hash_take (name_mapping_shader_object, command->shader);
+    GLuint *shader = hash_take (server->name_mapping->shader_object, command->shader);
     mutex_unlock (name_mapping_mutex);
 
     if (shader) {
@@ -443,7 +668,7 @@ server_handle_glgetprogrambinaryoes (
             (command_glgetprogrambinaryoes_t *)abstract_command;
     
     mutex_lock (name_mapping_mutex);
-    GLuint *program = hash_take (name_mapping_shader_object, command->program);
+    GLuint *program = hash_take (server->name_mapping->shader_object, command->program);
     
     if (program) {
         GLuint program_value = *program;
@@ -463,7 +688,7 @@ server_handle_glprogrambinaryoes (
             (command_glprogrambinaryoes_t *)abstract_command;
     
     mutex_lock (name_mapping_mutex);
-    GLuint *program = hash_take (name_mapping_shader_object, command->program);
+    GLuint *program = hash_take (server->name_mapping->shader_object, command->program);
     
     if (program) {
         GLuint program_value = *program;
@@ -508,17 +733,78 @@ server_handle_glgeterror (server_t *server, command_t *abstract_command)
         error = server->dispatch.glGetError (server);
 }
 
+static void
+server_handle_eglmakecurrent (server_t *server, command_t *abstract_command)
+{
+    INSTRUMENT ();
+    command_eglmakecurrent_t *command =
+            (command_eglmakecurrent_t *)abstract_command;
+    command->result = server->dispatch.eglMakeCurrent (server, command->dpy,
+                                                       command->draw,
+                                                       command->read,
+                                                       command->ctx);
+    if (command->result == EGL_FALSE)
+        return;
+
+    server->current.display = command->dpy;
+    server->current.draw = command->draw;
+    server->current.read = command->read;
+    server->current.context = command->ctx;
+}
+
+static void
+server_handle_eglreleasethread (server_t *server, command_t *abstract_command)
+{
+    INSTRUMENT ();
+    command_eglreleasethread_t *command =
+            (command_eglreleasethread_t *)abstract_command;
+    command->result = server->dispatch.eglReleaseThread (server);
+    if (command->result == EGL_FALSE)
+        return;
+
+    server->current.display = EGL_NO_DISPLAY;
+    server->current.draw = EGL_NO_SURFACE;
+    server->current.read = EGL_NO_SURFACE;
+    server->current.context = EGL_NO_CONTEXT;
+}
+
 void
 server_init (server_t *server,
-             buffer_t *buffer)
+             buffer_t *buffer,
+             buffer_t *transfer_buffer)
 {
+    const char *spin_limit;
+
     server->buffer = buffer;
+    server->transfer_buffer = transfer_buffer;
+    server->disconnected = 0;
+    server->pipeline = NULL;
+    server->frame_cache = NULL;
+    server->recording_frame = false;
+    server->current.display = EGL_NO_DISPLAY;
+    server->current.draw = EGL_NO_SURFACE;
+    server->current.read = EGL_NO_SURFACE;
+    server->current.context = EGL_NO_CONTEXT;
     server->dispatch = *dispatch_table_get_base();
+
+    spin_limit = getenv ("GPUPROCESS_SERVER_SPIN_LIMIT");
+    server->spin_limit = (spin_limit ? strtoul (spin_limit, NULL, 10) :
+                                       SERVER_DEFAULT_SPIN_LIMIT) * 1000;
+    /* Spinning would only keep the client from running. */
+    if (sysconf (_SC_NPROCESSORS_ONLN) < 2)
+        server->spin_limit = 0;
+    server->spin_time = server->spin_limit;
+    server->average_wait_time = 0;
     server->command_post_hook = NULL;
 
     server->handler_table[COMMAND_NO_OP] = server_handle_no_op;
+    server->handler_table[COMMAND_FRAME_RECORD] = server_handle_frame_record;
+    server->handler_table[COMMAND_FRAME_REPLAY] = server_handle_frame_replay;
     server_fill_command_handler_table (server);
 
+    memset (server->prepare_table, 0, sizeof (server->prepare_table));
+    server_fill_command_prepare_table (server);
+
     server->handler_table[COMMAND_GLGENBUFFERS] =
         server_handle_glgenbuffers;
     server->handler_table[COMMAND_GLDELETEBUFFERS] =
@@ -552,26 +838,45 @@ server_init (server_t *server,
     server->handler_table[COMMAND_GLREADPIXELS] = 
         server_handle_glreadpixels;
 
+    server->prepare_table[COMMAND_GLBINDBUFFER] =
+        server_prepare_glbindbuffer;
+    server->prepare_table[COMMAND_GLBINDTEXTURE] =
+        server_prepare_glbindtexture;
+    server->prepare_table[COMMAND_GLBINDFRAMEBUFFER] =
+        server_prepare_glbindframebuffer;
+    server->prepare_table[COMMAND_GLBINDRENDERBUFFER] =
+        server_prepare_glbindrenderbuffer;
+    server->prepare_table[COMMAND_GLGENBUFFERS] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLDELETEBUFFERS] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLGENFRAMEBUFFERS] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLDELETEFRAMEBUFFERS] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLGENTEXTURES] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLDELETETEXTURES] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLGENRENDERBUFFERS] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLDELETERENDERBUFFERS] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLCREATEPROGRAM] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLDELETEPROGRAM] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLCREATESHADER] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLDELETESHADER] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLGETPROGRAMBINARYOES] = server_prepare_wait;
+    server->prepare_table[COMMAND_GLPROGRAMBINARYOES] = server_prepare_wait;
+    /* A replay may map names too. */
+    server->prepare_table[COMMAND_FRAME_REPLAY] = server_prepare_wait;
+
+    /* The clients of a process draw their names from the same pool, so
+     * they can share the mapping. */
     mutex_lock (name_mapping_mutex);
-    if (name_mapping_buffer
-        && name_mapping_renderbuffer
-        && name_mapping_shader_object
-        && name_mapping_texture
-        && name_mapping_framebuffer) {
-	mutex_unlock (name_mapping_mutex);
-        return;
-    }
-    name_mapping_buffer = new_hash_table(free);
-    name_mapping_renderbuffer = new_hash_table(free);
-    name_mapping_shader_object = new_hash_table(free);
-    name_mapping_texture = new_hash_table(free);
-    name_mapping_framebuffer = new_hash_table(free);
+    if (! process_name_mapping)
+        process_name_mapping = server_name_mapping_new ();
+    server->name_mapping = process_name_mapping;
     mutex_unlock (name_mapping_mutex);
 }
 
 bool
 server_destroy (server_t *server)
 {
+    if (server->frame_cache)
+        server_frame_cache_destroy (server->frame_cache);
     free (server);
     return true;
 }
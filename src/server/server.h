@@ -3,6 +3,8 @@
 #define GPUPROCESS_SERVER_H
 
 typedef struct _server server_t;
+typedef struct _server_pipeline server_pipeline_t;
+typedef struct _server_frame_cache server_frame_cache_t;
 
 #include "command.h"
 #include "compiler_private.h"
@@ -12,40 +14,142 @@ typedef struct _server server_t;
 #include "thread_private.h"
 #include "types_private.h"
 #include <pthread.h>
-#include <semaphore.h>
 
 typedef void (*command_handler_t)(server_t *server, command_t *command);
 
+typedef enum server_prepare_result {
+    /* The command is ready for its handler. */
+    SERVER_PREPARE_READY,
+    /* The handler would do nothing, so the command becomes a no-op. */
+    SERVER_PREPARE_SKIP,
+    /* The handler changes the name mapping with what the driver returns,
+     * so the commands after it can't be prepared until it has run. */
+    SERVER_PREPARE_WAIT
+} server_prepare_result_t;
+
+/* Does the work of a command that doesn't need the GL context, like
+ * translating names, either in the prepare stage or in the handler. */
+typedef server_prepare_result_t (*command_prepare_t)(server_t *server,
+                                                     command_t *command);
+
+/* When the command buffer runs dry, the server spins for a while before
+ * going to sleep, since the client usually sends the next command soon.
+ * The time spent spinning follows a moving average of how long it has
+ * recently taken for commands to arrive, and never exceeds the limit
+ * below (in microseconds), which GPUPROCESS_SERVER_SPIN_LIMIT overrides.
+ * A limit of 0 makes the server go to sleep right away, which is also
+ * what happens on a machine with a single cpu. */
+#define SERVER_DEFAULT_SPIN_LIMIT 50
+
+/* The server prefetches at most this many bytes of the next command while
+ * it executes the current one. */
+#define SERVER_PREFETCH_LIMIT (CACHE_LINE_SIZE * 4)
+
+/* Maps the names that clients give their objects to the ones the driver
+ * gave them. */
+typedef struct _server_name_mapping {
+    HashTable *buffer;
+    HashTable *renderbuffer;
+    HashTable *shader_object;
+    HashTable *texture;
+    HashTable *framebuffer;
+} server_name_mapping_t;
+
 struct _server {
     dispatch_table_t dispatch;
 
     /* This is an optimization to avoid a giant switch statement. */
     command_handler_t handler_table[COMMAND_MAX_COMMAND];
+    /* NULL for the commands that have nothing to prepare. */
+    command_prepare_t prepare_table[COMMAND_MAX_COMMAND];
 
     mutex_t thread_started_mutex;
     buffer_t *buffer;
+    /* Where the client puts the pointer arguments of commands flagged
+     * with COMMAND_FLAG_TRANSFER_PAYLOAD. */
+    buffer_t *transfer_buffer;
     thread_t thread;
     bool threaded;
 
+    /* The prepare stage running ahead of the work loop, or NULL. */
+    server_pipeline_t *pipeline;
+
+    /* Shared by all the servers in a process, unless the server belongs
+     * to a client in another process, whose names may clash with those of
+     * the other clients. */
+    server_name_mapping_t *name_mapping;
+
+    /* The frame that the client had us record, or NULL, and whether we
+     * are recording it; see server_frame_cache.h. */
+    server_frame_cache_t *frame_cache;
+    bool recording_frame;
+
     void (*command_post_hook)(server_t *server, command_t *command);
 
-    sem_t *server_signal;
-    sem_t *client_signal;
+    /* Adaptive waiting for commands, all in nanoseconds. */
+    uint64_t spin_limit;
+    uint64_t spin_time;
+    uint64_t average_wait_time;
+
+    /* Set, followed by buffer_wake_consumer (), when the client of a
+     * server running in another process has gone away without shutting
+     * the server down. The work loop then returns once it runs dry. */
+    unsigned int disconnected;
+
+    /* What the client last made current, so that a server thread that
+     * serves other clients too can switch back to it. */
+    struct {
+        EGLDisplay display;
+        EGLSurface draw;
+        EGLSurface read;
+        EGLContext context;
+    } current;
 };
 
 private void
 server_init (server_t *server,
-             buffer_t *buffer);
+             buffer_t *buffer,
+             buffer_t *transfer_buffer);
 
 private server_t *
-server_new (buffer_t *buffer);
+server_new (buffer_t *buffer,
+            buffer_t *transfer_buffer);
 
 private bool
 server_destroy (server_t *server);
 
+private server_name_mapping_t *
+server_name_mapping_new ();
+
+private void
+server_name_mapping_destroy (server_name_mapping_t *name_mapping);
+
+/* Spins or sleeps until the client has published commands past |index|
+ * in the command buffer, adapting the time it spins to how long commands
+ * have recently taken to arrive. */
+private void
+server_wait_for_commands (server_t *server,
+                          size_t index);
+
 private void
 server_start_work_loop (server_t *server);
 
+/* Executes the commands in the buffer until it is empty or at least
+ * |budget| bytes of them have run, and returns how many bytes ran. When
+ * it reaches COMMAND_SHUTDOWN it returns -1 instead, and leaves the token
+ * for the caller to complete once it is done with the server, since the
+ * client frees the buffers as soon as it sees it. */
+private ssize_t
+server_execute_commands (server_t *server,
+                         size_t budget);
+
+/* Makes the context of |to| current on the calling thread, which last
+ * executed the commands of |from|, or releases that of |from| when |to|
+ * has none. Either may be NULL. */
+private void
+server_switch_context (server_t *from,
+                       server_t *to);
+
 private void
 server_custom_init (void);
 
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include "config.h"
+#include "server_connection.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_CONNECTION_TCP_PREFIX "tcp:"
+
+static bool
+server_connection_get_address (const char *path,
+                               struct sockaddr_un *address)
+{
+    memset (address, 0, sizeof (struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (address->sun_path)) {
+        fprintf (stderr, "gpuprocess: socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy (address->sun_path, path);
+    return true;
+}
+
+bool
+server_connection_is_tcp (const char *address)
+{
+    return ! strncmp (address, SERVER_CONNECTION_TCP_PREFIX,
+                      strlen (SERVER_CONNECTION_TCP_PREFIX));
+}
+
+/* Resolves "tcp:host:port". An empty host means any address when
+ * listening, and the local host when connecting. */
+static struct addrinfo *
+server_connection_resolve_tcp (const char *address,
+                               bool listening)
+{
+    const char *host = address + strlen (SERVER_CONNECTION_TCP_PREFIX);
+    const char *port = strrchr (host, ':');
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    char *host_copy;
+    int error;
+
+    if (! port) {
+        fprintf (stderr, "gpuprocess: no port in %s\n", address);
+        return NULL;
+    }
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+    host_copy = strndup (host, port - host);
+    error = getaddrinfo (*host_copy ? host_copy : NULL, port + 1, &hints,
+                         &result);
+    free (host_copy);
+    if (error) {
+        fprintf (stderr, "gpuprocess: could not resolve %s: %s\n", address,
+                 gai_strerror (error));
+        return NULL;
+    }
+    return result;
+}
+
+/* Commands are small and the client often waits for the answer, so don't
+ * let them sit in the socket waiting for more. */
+static void
+server_connection_set_no_delay (int tcp_socket)
+{
+    int enable = 1;
+    setsockopt (tcp_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof (enable));
+}
+
+static int
+server_connection_open_tcp (const char *address,
+                            bool listening)
+{
+    struct addrinfo *addresses = server_connection_resolve_tcp (address,
+                                                                listening);
+    struct addrinfo *info;
+    int tcp_socket = -1;
+    int enable = 1;
+
+    for (info = addresses; info; info = info->ai_next) {
+        tcp_socket = socket (info->ai_family, info->ai_socktype | SOCK_CLOEXEC,
+                             info->ai_protocol);
+        if (tcp_socket < 0)
+            continue;
+
+        if (listening) {
+            setsockopt (tcp_socket, SOL_SOCKET, SO_REUSEADDR,
+                        &enable, sizeof (enable));
+            if (! bind (tcp_socket, info->ai_addr, info->ai_addrlen) &&
+                ! listen (tcp_socket, SOMAXCONN))
+                break;
+        } else if (! connect (tcp_socket, info->ai_addr, info->ai_addrlen)) {
+            server_connection_set_no_delay (tcp_socket);
+            break;
+        }
+
+        close (tcp_socket);
+        tcp_socket = -1;
+    }
+
+    if (addresses)
+        freeaddrinfo (addresses);
+    return tcp_socket;
+}
+
+int
+server_connection_connect (const char *address)
+{
+    struct sockaddr_un unix_address;
+    int server_socket;
+
+    if (server_connection_is_tcp (address))
+        return server_connection_open_tcp (address, false);
+
+    if (! server_connection_get_address (address, &unix_address))
+        return -1;
+
+    server_socket = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_socket < 0)
+        return -1;
+
+    if (connect (server_socket, (struct sockaddr *) &unix_address,
+                 sizeof (struct sockaddr_un))) {
+        close (server_socket);
+        return -1;
+    }
+    return server_socket;
+}
+
+int
+server_connection_listen (const char *address)
+{
+    struct sockaddr_un unix_address;
+    int listen_socket;
+
+    if (server_connection_is_tcp (address))
+        return server_connection_open_tcp (address, true);
+
+    if (! server_connection_get_address (address, &unix_address))
+        return -1;
+
+    listen_socket = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_socket < 0)
+        return -1;
+
+    /* A socket left behind by a server that didn't exit cleanly. */
+    unlink (address);
+
+    if (bind (listen_socket, (struct sockaddr *) &unix_address,
+              sizeof (struct sockaddr_un)) ||
+        listen (listen_socket, SOMAXCONN)) {
+        close (listen_socket);
+        return -1;
+    }
+    return listen_socket;
+}
+
+/* The eventfd that may come with the reply ends up in the
+ * consumer_event_fd of |buffer|. */
+static bool
+server_connection_receive_reply (int socket,
+                                 buffer_t *buffer)
+{
+    server_connection_reply_t reply;
+    char control[CMSG_SPACE (sizeof (int))];
+    struct iovec iov = { &reply, sizeof (reply) };
+    struct msghdr message;
+    struct cmsghdr *control_message;
+    int event_fd = -1;
+
+    memset (&message, 0, sizeof (message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof (control);
+
+    if (recvmsg (socket, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) !=
+        sizeof (reply))
+        return false;
+
+    for (control_message = CMSG_FIRSTHDR (&message); control_message;
+         control_message = CMSG_NXTHDR (&message, control_message)) {
+        if (control_message->cmsg_level == SOL_SOCKET &&
+            control_message->cmsg_type == SCM_RIGHTS &&
+            control_message->cmsg_len == CMSG_LEN (sizeof (int)))
+            memcpy (&event_fd, CMSG_DATA (control_message), sizeof (int));
+    }
+
+    if (reply.version != SERVER_CONNECTION_VERSION || ! reply.accepted) {
+        if (event_fd >= 0)
+            close (event_fd);
+        return false;
+    }
+    buffer->consumer_event_fd = event_fd;
+    return true;
+}
+
+bool
+server_connection_send_request (int socket,
+                                buffer_t *buffer,
+                                buffer_t *transfer_buffer)
+{
+    server_connection_request_t request;
+    int file_descriptors[SERVER_CONNECTION_MAX_FILES];
+    char control[CMSG_SPACE (sizeof (file_descriptors))];
+    struct iovec iov = { &request, sizeof (request) };
+    struct msghdr message;
+    struct cmsghdr *control_message;
+
+    if (buffer->file_descriptor < 0 || buffer->shared_file_descriptor < 0)
+        return false;
+
+    memset (&request, 0, sizeof (request));
+    request.version = SERVER_CONNECTION_VERSION;
+    request.buffer.address = (uintptr_t) buffer->address;
+    request.buffer.length = buffer->length;
+    file_descriptors[0] = buffer->file_descriptor;
+    file_descriptors[1] = buffer->shared_file_descriptor;
+    request.file_count = 2;
+
+    if (transfer_buffer->address &&
+        transfer_buffer->file_descriptor >= 0 &&
+        transfer_buffer->shared_file_descriptor >= 0) {
+        request.transfer_buffer.address = (uintptr_t) transfer_buffer->address;
+        request.transfer_buffer.length = transfer_buffer->length;
+        file_descriptors[2] = transfer_buffer->file_descriptor;
+        file_descriptors[3] = transfer_buffer->shared_file_descriptor;
+        request.file_count = 4;
+    }
+
+    memset (&message, 0, sizeof (message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE (request.file_count * sizeof (int));
+
+    control_message = CMSG_FIRSTHDR (&message);
+    control_message->cmsg_level = SOL_SOCKET;
+    control_message->cmsg_type = SCM_RIGHTS;
+    control_message->cmsg_len = CMSG_LEN (request.file_count * sizeof (int));
+    memcpy (CMSG_DATA (control_message), file_descriptors,
+            request.file_count * sizeof (int));
+
+    if (sendmsg (socket, &message, MSG_NOSIGNAL) != sizeof (request))
+        return false;
+    return server_connection_receive_reply (socket, buffer);
+}
+
+bool
+server_connection_send_stream_request (int socket,
+                                       buffer_t *buffer,
+                                       buffer_t *transfer_buffer,
+                                       uint32_t flags,
+                                       uint32_t cache_size)
+{
+    server_connection_request_t request;
+
+    memset (&request, 0, sizeof (request));
+    request.version = SERVER_CONNECTION_VERSION;
+    request.buffer.address = (uintptr_t) buffer->address;
+    request.buffer.length = buffer->length;
+    request.transfer_buffer.address = (uintptr_t) transfer_buffer->address;
+    request.transfer_buffer.length = transfer_buffer->length;
+    request.flags = flags | SERVER_CONNECTION_STREAM;
+    request.cache_size = cache_size;
+
+    if (send (socket, &request, sizeof (request), MSG_NOSIGNAL) !=
+        sizeof (request))
+        return false;
+    return server_connection_receive_reply (socket, buffer);
+}
+
+int
+server_connection_receive_request (int socket,
+                                   server_connection_request_t *request,
+                                   int *file_descriptors)
+{
+    char control[CMSG_SPACE (SERVER_CONNECTION_MAX_FILES * sizeof (int))];
+    struct iovec iov = { request, sizeof (server_connection_request_t) };
+    struct msghdr message;
+    struct cmsghdr *control_message;
+    int file_count = 0;
+    int i;
+
+    memset (&message, 0, sizeof (message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof (control);
+
+    if (recvmsg (socket, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) !=
+        sizeof (server_connection_request_t))
+        return -1;
+
+    for (control_message = CMSG_FIRSTHDR (&message); control_message;
+         control_message = CMSG_NXTHDR (&message, control_message)) {
+        if (control_message->cmsg_level != SOL_SOCKET ||
+            control_message->cmsg_type != SCM_RIGHTS)
+            continue;
+        file_count = (control_message->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+        memcpy (file_descriptors, CMSG_DATA (control_message),
+                file_count * sizeof (int));
+        break;
+    }
+
+    if (request->version != SERVER_CONNECTION_VERSION ||
+        (message.msg_flags & MSG_CTRUNC) ||
+        file_count != request->file_count ||
+        (request->flags & SERVER_CONNECTION_STREAM ?
+             file_count != 0 : file_count != 2 && file_count != 4)) {
+        for (i = 0; i < file_count; i++)
+            close (file_descriptors[i]);
+        return -1;
+    }
+    return file_count;
+}
+
+bool
+server_connection_send_reply (int socket,
+                              bool accepted,
+                              int event_fd)
+{
+    server_connection_reply_t reply = { SERVER_CONNECTION_VERSION, accepted };
+    char control[CMSG_SPACE (sizeof (int))];
+    struct iovec iov = { &reply, sizeof (reply) };
+    struct msghdr message;
+    struct cmsghdr *control_message;
+
+    memset (&message, 0, sizeof (message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    if (accepted && event_fd >= 0) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof (control);
+        control_message = CMSG_FIRSTHDR (&message);
+        control_message->cmsg_level = SOL_SOCKET;
+        control_message->cmsg_type = SCM_RIGHTS;
+        control_message->cmsg_len = CMSG_LEN (sizeof (int));
+        memcpy (CMSG_DATA (control_message), &event_fd, sizeof (int));
+    }
+
+    return sendmsg (socket, &message, MSG_NOSIGNAL) == sizeof (reply);
+}
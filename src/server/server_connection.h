@@ -0,0 +1,106 @@
+#ifndef GPUPROCESS_SERVER_CONNECTION_H
+#define GPUPROCESS_SERVER_CONNECTION_H
+
+#include "compiler_private.h"
+#include "ring_buffer.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A client can hand its command buffer to a server running in another
+ * process instead of starting a server thread. It connects to the Unix
+ * socket the server listens on and sends a request describing its
+ * buffers, along with the files behind them. The server maps the buffers
+ * at the addresses they have in the client, so the pointers the commands
+ * carry into the command and transfer buffers stay valid, and from then
+ * on the two sides only talk through the shared buffers. The socket just
+ * tells the server when the client has gone away. A server whose threads
+ * serve several clients each sends back the eventfd the client signals
+ * instead of the futex of its command buffer.
+ *
+ * A client that can't share memory with the server, like one on another
+ * machine, sends the same request without the files and then streams
+ * the contents of its buffers over the socket instead; see
+ * server_stream.h. The server then listens at "tcp:host:port" rather
+ * than at a path. */
+#define SERVER_CONNECTION_VERSION 3
+
+/* The most files a request carries: the ring and the shared state of the
+ * command buffer and of the transfer buffer. */
+#define SERVER_CONNECTION_MAX_FILES 4
+
+typedef struct server_connection_buffer {
+    uint64_t address;
+    uint64_t length;
+} server_connection_buffer_t;
+
+typedef enum server_connection_flags {
+    /* The client streams its buffers over the socket, and sends no files. */
+    SERVER_CONNECTION_STREAM = 1 << 0,
+    /* Large data on the stream is compressed, in both directions. */
+    SERVER_CONNECTION_COMPRESS = 1 << 1
+} server_connection_flags_t;
+
+typedef struct server_connection_request {
+    uint32_t version;
+    /* The transfer buffer has no files when it is disabled. */
+    uint32_t file_count;
+    server_connection_buffer_t buffer;
+    server_connection_buffer_t transfer_buffer;
+    uint32_t flags;
+    /* The size in kilobytes of the cache of data the server keeps for a
+     * streaming client. */
+    uint32_t cache_size;
+} server_connection_request_t;
+
+typedef struct server_connection_reply {
+    uint32_t version;
+    uint32_t accepted;
+} server_connection_reply_t;
+
+/* Whether |address| names a TCP socket, "tcp:host:port", rather than the
+ * path of a Unix socket. */
+private bool
+server_connection_is_tcp (const char *address);
+
+/* Returns a socket connected to the server listening at |address|, or
+ * -1. */
+private int
+server_connection_connect (const char *address);
+
+/* Returns a socket listening at |address|, or -1. */
+private int
+server_connection_listen (const char *address);
+
+/* Hands |buffer| and, if it has been mapped, |transfer_buffer| to the
+ * server and waits for its answer. The eventfd that comes with it, if
+ * any, ends up in the consumer_event_fd of |buffer|, and belongs to the
+ * caller. */
+private bool
+server_connection_send_request (int socket,
+                                buffer_t *buffer,
+                                buffer_t *transfer_buffer);
+
+/* Asks the server to mirror |buffer| and |transfer_buffer|, whose contents
+ * the client then streams to it, and waits for its answer. */
+private bool
+server_connection_send_stream_request (int socket,
+                                       buffer_t *buffer,
+                                       buffer_t *transfer_buffer,
+                                       uint32_t flags,
+                                       uint32_t cache_size);
+
+/* Reads a request and the files that come with it. Returns the number of
+ * files received, which is 0 for a streaming client, or -1 if the request
+ * is malformed. */
+private int
+server_connection_receive_request (int socket,
+                                   server_connection_request_t *request,
+                                   int *file_descriptors);
+
+/* |event_fd| is -1 unless the client should signal it. */
+private bool
+server_connection_send_reply (int socket,
+                              bool accepted,
+                              int event_fd);
+
+#endif /* GPUPROCESS_SERVER_CONNECTION_H */
@@ -0,0 +1,180 @@
+#include "config.h"
+#include "server_frame_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SERVER_FRAME_CACHE_INITIAL_SIZE (64 * 1024)
+#define SERVER_FRAME_CACHE_INITIAL_COUNT 1024
+
+struct _server_frame_cache {
+    /* The copies of the commands, one after the other, and where each of
+     * them starts. */
+    char *commands;
+    size_t size;
+    size_t capacity;
+    size_t *offsets;
+    unsigned int count;
+    unsigned int offsets_capacity;
+
+    /* Where a copy runs, as the handlers change commands in place. */
+    char *scratch;
+    size_t scratch_capacity;
+};
+
+void
+server_frame_cache_destroy (server_frame_cache_t *cache)
+{
+    free (cache->commands);
+    free (cache->offsets);
+    free (cache->scratch);
+    free (cache);
+}
+
+static void
+server_frame_cache_reserve (server_frame_cache_t *cache,
+                            size_t size)
+{
+    size_t capacity = cache->capacity ? cache->capacity :
+                                        SERVER_FRAME_CACHE_INITIAL_SIZE;
+    char *commands;
+    unsigned int i;
+
+    if (cache->count == cache->offsets_capacity) {
+        unsigned int count = cache->offsets_capacity ?
+            cache->offsets_capacity * 2 : SERVER_FRAME_CACHE_INITIAL_COUNT;
+        size_t *offsets = realloc (cache->offsets, count * sizeof (size_t));
+        if (! offsets) {
+            fprintf (stderr, "Could not grow the recorded frame to %u "
+                     "commands.\n", count);
+            abort ();
+        }
+        cache->offsets = offsets;
+        cache->offsets_capacity = count;
+    }
+
+    if (cache->size + size <= cache->capacity)
+        return;
+
+    while (capacity < cache->size + size)
+        capacity *= 2;
+    commands = malloc (capacity);
+    if (! commands) {
+        fprintf (stderr, "Could not grow the recorded frame to %zu bytes.\n",
+                 capacity);
+        abort ();
+    }
+
+    /* The payloads of the copies are pointed at where they are, so they
+     * have to move along with them, while the old ones are still there. */
+    if (cache->size)
+        memcpy (commands, cache->commands, cache->size);
+    for (i = 0; i < cache->count; i++)
+        command_relocate_payload ((command_t *) (commands + cache->offsets[i]),
+                                  cache->commands + cache->offsets[i]);
+    free (cache->commands);
+    cache->commands = commands;
+    cache->capacity = capacity;
+}
+
+void
+server_frame_cache_record (server_t *server,
+                           command_t *command)
+{
+    server_frame_cache_t *cache = server->frame_cache;
+    buffer_t *buffer = server->buffer;
+    command_t no_op = {
+        .type = COMMAND_NO_OP, .flags = 0, .size = sizeof (command_t)
+    };
+    const char *from = (const char *) command;
+    command_t *copy;
+
+    if (command->type == COMMAND_FRAME_RECORD ||
+        command->type == COMMAND_FRAME_REPLAY ||
+        cache->count == COMMAND_FRAME_MAX_COMMANDS)
+        return;
+
+    /* The client never replays these, and they may point at memory that
+     * is gone once they have run. */
+    if (! command_is_replayable (command))
+        command = &no_op;
+
+    /* The client pointed the payload into the first half of the mirrored
+     * command buffer, while a batch may have run on into the second. */
+    if (from >= (const char *) buffer->address + buffer->length &&
+        from < (const char *) buffer->address + 2 * buffer->length)
+        from -= buffer->length;
+
+    server_frame_cache_reserve (cache, command->size);
+    copy = (command_t *) (cache->commands + cache->size);
+    memcpy (copy, command, command->size);
+    command_relocate_payload (copy, from);
+
+    cache->offsets[cache->count++] = cache->size;
+    cache->size += command->size;
+}
+
+void
+server_handle_frame_record (server_t *server,
+                            command_t *abstract_command)
+{
+    command_frame_record_t *command =
+        (command_frame_record_t *) abstract_command;
+    server_frame_cache_t *cache = server->frame_cache;
+
+    server->recording_frame = false;
+    if (! command->begin)
+        return;
+
+    if (! cache) {
+        cache = malloc (sizeof (server_frame_cache_t));
+        if (! cache) {
+            fprintf (stderr, "Could not allocate the recorded frame.\n");
+            abort ();
+        }
+        memset (cache, 0, sizeof (server_frame_cache_t));
+        server->frame_cache = cache;
+    }
+
+    cache->size = 0;
+    cache->count = 0;
+    server->recording_frame = true;
+}
+
+void
+server_handle_frame_replay (server_t *server,
+                            command_t *abstract_command)
+{
+    command_frame_replay_t *command =
+        (command_frame_replay_t *) abstract_command;
+    server_frame_cache_t *cache = server->frame_cache;
+    unsigned int i;
+
+    /* Don't trust the range, which may come from another process. */
+    if (! cache || command->first > cache->count ||
+        command->count > cache->count - command->first)
+        return;
+
+    for (i = command->first; i < command->first + command->count; i++) {
+        command_t *recorded = (command_t *) (cache->commands +
+                                             cache->offsets[i]);
+        command_t *copy;
+
+        if (recorded->size > cache->scratch_capacity) {
+            char *scratch = realloc (cache->scratch, recorded->size);
+            if (! scratch) {
+                fprintf (stderr, "Could not replay a command of %u bytes.\n",
+                         recorded->size);
+                abort ();
+            }
+            cache->scratch = scratch;
+            cache->scratch_capacity = recorded->size;
+        }
+
+        copy = (command_t *) cache->scratch;
+        memcpy (copy, recorded, recorded->size);
+        command_relocate_payload (copy, (const char *) recorded);
+        server->handler_table[copy->type](server, copy);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef GPUPROCESS_SERVER_FRAME_CACHE_H
+#define GPUPROCESS_SERVER_FRAME_CACHE_H
+
+#include "compiler_private.h"
+#include "server.h"
+
+/* The frame that the frame cache of the client had the server record,
+ * see frame_cache.h. Between the two COMMAND_FRAME_RECORD commands, the
+ * server keeps a copy of every command it executes, before the handler
+ * translates the names in it, and COMMAND_FRAME_REPLAY runs the copies
+ * again. Commands that can't be replayed are kept as no-ops, so that
+ * their positions still match those the client counts. */
+
+private void
+server_frame_cache_destroy (server_frame_cache_t *cache);
+
+/* Keeps a copy of |command|, while the server records a frame. */
+private void
+server_frame_cache_record (server_t *server,
+                           command_t *command);
+
+private void
+server_handle_frame_record (server_t *server,
+                            command_t *command);
+
+private void
+server_handle_frame_replay (server_t *server,
+                            command_t *command);
+
+#endif /* GPUPROCESS_SERVER_FRAME_CACHE_H */
@@ -0,0 +1,250 @@
+#include "config.h"
+#include "server_pipeline.h"
+
+#include "ring_buffer.h"
+#include "thread_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+
+/* What one stage sleeps on until the other has moved on, with the same
+ * handshake as the ring buffer: the sleeper announces itself before it
+ * looks one last time, and the other side bumps the sequence only if it
+ * sees the announcement. */
+typedef struct server_pipeline_event {
+    unsigned int sequence;
+    unsigned int sleeping;
+} server_pipeline_event_t;
+
+typedef bool (*server_pipeline_condition_t)(server_pipeline_t *pipeline,
+                                            size_t index);
+
+struct _server_pipeline {
+    server_t *server;
+    thread_t thread;
+
+    /* Written by the prepare thread, which has prepared the commands
+     * before this index in the command buffer, and is done for good once
+     * |finished| is set. */
+    size_t prepared cache_line_aligned;
+    unsigned int finished;
+    server_pipeline_event_t prepared_event;
+
+    /* For the prepare thread, waiting for the server thread to run a
+     * command that changes the name mapping. */
+    server_pipeline_event_t executed_event cache_line_aligned;
+};
+
+bool
+server_pipeline_is_enabled (void)
+{
+    const char *value = getenv ("GPUPROCESS_SERVER_PREPARE_THREAD");
+    return value && strcmp (value, "0");
+}
+
+static void
+server_pipeline_signal (server_pipeline_event_t *event)
+{
+    atomic_full_barrier ();
+    if (! atomic_load_relaxed (&event->sleeping))
+        return;
+
+    atomic_increment (&event->sequence);
+    futex_wake (&event->sequence, 1);
+}
+
+/* Spins for at most |spin_time| nanoseconds and then sleeps until
+ * |condition| holds. */
+static void
+server_pipeline_wait (server_pipeline_t *pipeline,
+                      server_pipeline_event_t *event,
+                      server_pipeline_condition_t condition,
+                      size_t index,
+                      uint64_t spin_time)
+{
+    uint64_t start_time, current_time;
+    unsigned int sequence;
+    int i;
+
+    start_time = current_time = get_monotonic_time_ns ();
+    while (current_time - start_time < spin_time) {
+        for (i = 0; i < 64; i++) {
+            if (condition (pipeline, index))
+                return;
+            cpu_relax ();
+        }
+        current_time = get_monotonic_time_ns ();
+    }
+
+    while (! condition (pipeline, index)) {
+        sequence = atomic_load_acquire (&event->sequence);
+        atomic_store_relaxed (&event->sleeping, 1);
+        atomic_full_barrier ();
+
+        if (! condition (pipeline, index))
+            futex_wait (&event->sequence, sequence);
+
+        atomic_store_relaxed (&event->sleeping, 0);
+    }
+}
+
+static bool
+server_pipeline_has_prepared (server_pipeline_t *pipeline,
+                              size_t tail)
+{
+    return atomic_load_acquire (&pipeline->prepared) != tail ||
+           atomic_load_acquire (&pipeline->finished);
+}
+
+static bool
+server_pipeline_has_executed (server_pipeline_t *pipeline,
+                              size_t index)
+{
+    buffer_t *buffer = pipeline->server->buffer;
+    return atomic_load_acquire (&buffer->shared->consumer.tail) == index;
+}
+
+static void
+server_pipeline_hand_over (server_pipeline_t *pipeline,
+                           size_t index)
+{
+    if (pipeline->prepared == index)
+        return;
+    atomic_store_release (&pipeline->prepared, index);
+    server_pipeline_signal (&pipeline->prepared_event);
+}
+
+static void *
+server_pipeline_thread_func (void *ptr)
+{
+    server_pipeline_t *pipeline = (server_pipeline_t *) ptr;
+    server_t *server = pipeline->server;
+    buffer_t *buffer = server->buffer;
+    size_t cursor = pipeline->prepared;
+    /* The server records commands as the client wrote them. */
+    bool recording = false;
+
+    prctl (PR_SET_TIMERSLACK, 1);
+
+    while (true) {
+        size_t available;
+        size_t offset = 0;
+        size_t handed_over = 0;
+        char *commands = buffer_read_address_at (buffer, cursor, &available);
+
+        if (! commands) {
+            if (unlikely (atomic_load_acquire (&server->disconnected)))
+                break;
+            server_wait_for_commands (server, cursor);
+            continue;
+        }
+
+        while (offset < available) {
+            command_t *command = (command_t *) (commands + offset);
+            command_prepare_t prepare = server->prepare_table[command->type];
+
+            offset += command->size;
+
+            if (command->type == COMMAND_SHUTDOWN) {
+                server_pipeline_hand_over (pipeline, cursor + offset);
+                goto FINISHED;
+            }
+
+            if (command->type == COMMAND_FRAME_RECORD)
+                recording = ((command_frame_record_t *) command)->begin;
+
+            if (prepare && ! recording) {
+                switch (prepare (server, command)) {
+                case SERVER_PREPARE_READY:
+                    command->flags |= COMMAND_FLAG_PREPARED;
+                    break;
+                case SERVER_PREPARE_SKIP:
+                    command->type = COMMAND_NO_OP;
+                    break;
+                case SERVER_PREPARE_WAIT:
+                    server_pipeline_hand_over (pipeline, cursor + offset);
+                    server_pipeline_wait (pipeline, &pipeline->executed_event,
+                                          server_pipeline_has_executed,
+                                          cursor + offset, server->spin_limit);
+                    handed_over = offset;
+                    continue;
+                }
+            }
+
+            /* The client waits for these, and the server thread shouldn't
+             * sit idle while we work through a long batch. */
+            if ((command->flags & COMMAND_FLAG_SYNCHRONOUS) ||
+                offset - handed_over >= SERVER_PIPELINE_BATCH) {
+                server_pipeline_hand_over (pipeline, cursor + offset);
+                handed_over = offset;
+            }
+        }
+
+        cursor += available;
+        server_pipeline_hand_over (pipeline, cursor);
+    }
+
+FINISHED:
+    atomic_store_release (&pipeline->finished, 1);
+    server_pipeline_signal (&pipeline->prepared_event);
+    return NULL;
+}
+
+server_pipeline_t *
+server_pipeline_new (server_t *server)
+{
+    server_pipeline_t *pipeline = NULL;
+
+    if (posix_memalign ((void **) &pipeline, CACHE_LINE_SIZE,
+                        sizeof (server_pipeline_t)))
+        return NULL;
+    memset (pipeline, 0, sizeof (server_pipeline_t));
+
+    pipeline->server = server;
+    pipeline->prepared = server->buffer->shared->consumer.tail;
+
+    if (pthread_create (&pipeline->thread, NULL, server_pipeline_thread_func,
+                        pipeline)) {
+        free (pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+void
+server_pipeline_destroy (server_pipeline_t *pipeline)
+{
+    pthread_join (pipeline->thread, NULL);
+    free (pipeline);
+}
+
+char *
+server_pipeline_read_address (server_pipeline_t *pipeline,
+                              size_t *bytes_to_read)
+{
+    buffer_t *buffer = pipeline->server->buffer;
+    size_t tail = buffer->shared->consumer.tail;
+
+    *bytes_to_read = atomic_load_acquire (&pipeline->prepared) - tail;
+    if (*bytes_to_read == 0)
+        return NULL;
+    return (char *) buffer->address + tail % buffer->length;
+}
+
+void
+server_pipeline_signal_executed (server_pipeline_t *pipeline)
+{
+    server_pipeline_signal (&pipeline->executed_event);
+}
+
+bool
+server_pipeline_wait_for_commands (server_pipeline_t *pipeline)
+{
+    buffer_t *buffer = pipeline->server->buffer;
+    size_t tail = buffer->shared->consumer.tail;
+
+    server_pipeline_wait (pipeline, &pipeline->prepared_event,
+                          server_pipeline_has_prepared, tail,
+                          pipeline->server->spin_limit);
+    return atomic_load_acquire (&pipeline->prepared) != tail;
+}
@@ -0,0 +1,54 @@
+#ifndef GPUPROCESS_SERVER_PIPELINE_H
+#define GPUPROCESS_SERVER_PIPELINE_H
+
+#include "compiler_private.h"
+#include "server.h"
+#include <stdbool.h>
+
+/* Splits the work loop of a server in two stages. A prepare thread runs
+ * ahead of the server thread in the command buffer and does the part of
+ * each command that doesn't need the GL context, through the prepare
+ * table of the server: it translates the names the client gave objects
+ * into the driver's, turns commands whose objects don't exist into
+ * no-ops, and flags the rest with COMMAND_FLAG_PREPARED. The server
+ * thread, which owns the context, then only executes what the prepare
+ * thread has handed over, at least every SERVER_PIPELINE_BATCH bytes.
+ * Commands that map new names, like glGenTextures, stop the prepare
+ * thread until they have run, and so do replays of the frame cache. The
+ * commands of a frame that the server records are left as they are.
+ *
+ * The prepare thread is the one that waits for the client, so the client
+ * wakes it rather than the server thread. It only runs when
+ * GPUPROCESS_SERVER_PREPARE_THREAD is set to a value other than 0, and
+ * never for the buffers of GPUPROCESS_SERVER_THREADS. */
+#define SERVER_PIPELINE_BATCH (4 * 1024)
+
+private bool
+server_pipeline_is_enabled (void);
+
+/* Starts the prepare thread at the tail of the command buffer. */
+private server_pipeline_t *
+server_pipeline_new (server_t *server);
+
+/* Waits for the prepare thread to return, which it does after handing
+ * over COMMAND_SHUTDOWN or once the client has gone away. */
+private void
+server_pipeline_destroy (server_pipeline_t *pipeline);
+
+/* For the server thread: returns the commands it may execute, or NULL if
+ * there are none yet. */
+private char *
+server_pipeline_read_address (server_pipeline_t *pipeline,
+                              size_t *bytes_to_read);
+
+/* Called by the server thread after it has retired commands, in case the
+ * prepare thread waits for one of them to run. */
+private void
+server_pipeline_signal_executed (server_pipeline_t *pipeline);
+
+/* Waits until there are prepared commands. Returns false if there won't
+ * be any more, because the client has gone away. */
+private bool
+server_pipeline_wait_for_commands (server_pipeline_t *pipeline);
+
+#endif /* GPUPROCESS_SERVER_PIPELINE_H */
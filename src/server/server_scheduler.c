@@ -0,0 +1,358 @@
+#include "config.h"
+#include "server_scheduler.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+typedef struct _server_scheduler_thread {
+    server_scheduler_t *scheduler;
+    thread_t thread;
+    int event_fd;
+
+    /* The servers the thread serves. Only the thread itself changes the
+     * list, under the mutex, so it can read it without taking the lock;
+     * new servers wait in |pending| until it picks them up. */
+    mutex_t mutex;
+    server_t **servers;
+    size_t server_count;
+    size_t server_capacity;
+    server_t **pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    unsigned int has_pending;
+
+    /* Broadcast whenever the thread lets go of a server. */
+    signal_t server_removed;
+
+    /* The number of servers handed to the thread and not yet destroyed,
+     * which is what buffers are balanced on. */
+    unsigned int load;
+
+    /* The server whose context is current on the thread. */
+    server_t *current;
+} server_scheduler_thread_t;
+
+struct _server_scheduler {
+    server_scheduler_thread_t *threads;
+    unsigned int thread_count;
+    server_scheduler_thread_init_t thread_init;
+    mutex_t mutex;
+};
+
+static void
+server_scheduler_thread_append (server_t ***servers,
+                                size_t *count,
+                                size_t *capacity,
+                                server_t *server)
+{
+    if (*count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 8;
+        server_t **new_servers = realloc (*servers,
+                                          new_capacity * sizeof (server_t *));
+        if (! new_servers) {
+            fprintf (stderr, "Could not grow the buffers of a server thread "
+                     "to %zu.\n", new_capacity);
+            abort ();
+        }
+        *servers = new_servers;
+        *capacity = new_capacity;
+    }
+    (*servers)[(*count)++] = server;
+}
+
+static void
+server_scheduler_thread_take_pending (server_scheduler_thread_t *thread)
+{
+    size_t i;
+
+    mutex_lock (thread->mutex);
+    for (i = 0; i < thread->pending_count; i++)
+        server_scheduler_thread_append (&thread->servers,
+                                        &thread->server_count,
+                                        &thread->server_capacity,
+                                        thread->pending[i]);
+    thread->pending_count = 0;
+    atomic_store_relaxed (&thread->has_pending, 0);
+    mutex_unlock (thread->mutex);
+}
+
+/* Lets go of the server at |index|. Its client either shut it down, in
+ * which case the token is completed last, as the client frees the buffers
+ * as soon as it sees it, or went away. */
+static void
+server_scheduler_thread_remove (server_scheduler_thread_t *thread,
+                                size_t index,
+                                bool shutdown)
+{
+    server_t *server = thread->servers[index];
+    buffer_t *buffer = server->buffer;
+
+    if (thread->current == server) {
+        server_switch_context (server, NULL);
+        thread->current = NULL;
+    }
+
+    mutex_lock (thread->mutex);
+    /* Keep the order, so that the servers still take their turns in the
+     * same sequence. */
+    memmove (thread->servers + index, thread->servers + index + 1,
+             (thread->server_count - index - 1) * sizeof (server_t *));
+    thread->server_count--;
+    server_destroy (server);
+    __atomic_sub_fetch (&thread->load, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast (&thread->server_removed);
+    mutex_unlock (thread->mutex);
+
+    if (shutdown)
+        buffer_complete_token (buffer);
+}
+
+/* Gives every server a turn, and returns whether any of them had work. */
+static bool
+server_scheduler_thread_run (server_scheduler_thread_t *thread)
+{
+    bool busy = false;
+    size_t i = 0;
+
+    while (i < thread->server_count) {
+        server_t *server = thread->servers[i];
+        ssize_t executed;
+
+        if (! buffer_num_entries (server->buffer)) {
+            if (unlikely (atomic_load_acquire (&server->disconnected))) {
+                server_scheduler_thread_remove (thread, i, false);
+                continue;
+            }
+            i++;
+            continue;
+        }
+
+        if (thread->current != server) {
+            server_switch_context (thread->current, server);
+            thread->current = server;
+        }
+
+        executed = server_execute_commands (server, SERVER_SCHEDULER_QUANTUM);
+        if (unlikely (executed < 0)) {
+            server_scheduler_thread_remove (thread, i, true);
+            continue;
+        }
+
+        busy = true;
+        i++;
+    }
+    return busy;
+}
+
+static bool
+server_scheduler_thread_has_work (server_scheduler_thread_t *thread)
+{
+    size_t i;
+
+    if (atomic_load_relaxed (&thread->has_pending))
+        return true;
+    for (i = 0; i < thread->server_count; i++) {
+        if (buffer_num_entries (thread->servers[i]->buffer) ||
+            atomic_load_relaxed (&thread->servers[i]->disconnected))
+            return true;
+    }
+    return false;
+}
+
+/* Like server_wait_for_commands (), but for all the buffers of the thread
+ * at once: spin for a while, then tell the clients to signal the eventfd
+ * and sleep on it. */
+static void
+server_scheduler_thread_wait (server_scheduler_thread_t *thread)
+{
+    uint64_t spin_limit = 0;
+    uint64_t start_time, current_time;
+    bool ready = false;
+    eventfd_t value;
+    size_t prepared;
+    size_t i;
+    int j;
+
+    for (i = 0; i < thread->server_count; i++) {
+        if (thread->servers[i]->spin_limit > spin_limit)
+            spin_limit = thread->servers[i]->spin_limit;
+    }
+
+    start_time = current_time = get_monotonic_time_ns ();
+    while (current_time - start_time < spin_limit) {
+        /* Don't read the clock on every iteration. */
+        for (j = 0; j < 16; j++) {
+            if (server_scheduler_thread_has_work (thread))
+                return;
+            cpu_relax ();
+        }
+        current_time = get_monotonic_time_ns ();
+    }
+
+    for (prepared = 0; prepared < thread->server_count; prepared++) {
+        if (! buffer_prepare_to_sleep (thread->servers[prepared]->buffer)) {
+            ready = true;
+            break;
+        }
+    }
+
+    /* Whoever adds or disconnects a server sets the flag before signaling
+     * the eventfd, and the clients publish their commands before looking
+     * at whether we sleep, so one way or the other the read returns. */
+    if (! ready && ! server_scheduler_thread_has_work (thread)) {
+        while (eventfd_read (thread->event_fd, &value) && errno == EINTR)
+            ;
+    }
+
+    for (i = 0; i < prepared; i++)
+        buffer_finish_sleep (thread->servers[i]->buffer);
+}
+
+static void *
+server_scheduler_thread_func (void *ptr)
+{
+    server_scheduler_thread_t *thread = (server_scheduler_thread_t *) ptr;
+
+    if (thread->scheduler->thread_init)
+        thread->scheduler->thread_init ();
+
+    while (true) {
+        if (atomic_load_relaxed (&thread->has_pending))
+            server_scheduler_thread_take_pending (thread);
+
+        if (! server_scheduler_thread_run (thread))
+            server_scheduler_thread_wait (thread);
+    }
+    return NULL;
+}
+
+server_scheduler_t *
+server_scheduler_new (unsigned int thread_count,
+                      server_scheduler_thread_init_t thread_init)
+{
+    server_scheduler_t *scheduler;
+    unsigned int i;
+
+    if (! thread_count)
+        return NULL;
+
+    scheduler = malloc (sizeof (server_scheduler_t));
+    if (! scheduler) {
+        fprintf (stderr, "Could not allocate the server threads.\n");
+        abort ();
+    }
+    scheduler->thread_init = thread_init;
+    scheduler->thread_count = 0;
+    scheduler->threads = calloc (thread_count,
+                                 sizeof (server_scheduler_thread_t));
+    if (! scheduler->threads) {
+        fprintf (stderr, "Could not allocate %u server threads.\n",
+                 thread_count);
+        abort ();
+    }
+    mutex_init (scheduler->mutex);
+
+    for (i = 0; i < thread_count; i++) {
+        server_scheduler_thread_t *thread = &scheduler->threads[i];
+
+        thread->scheduler = scheduler;
+        thread->event_fd = eventfd (0, EFD_CLOEXEC);
+        if (thread->event_fd < 0)
+            break;
+        mutex_init (thread->mutex);
+        signal_init (thread->server_removed);
+
+        if (pthread_create (&thread->thread, NULL,
+                            server_scheduler_thread_func, thread)) {
+            close (thread->event_fd);
+            break;
+        }
+        scheduler->thread_count++;
+    }
+
+    if (! scheduler->thread_count) {
+        fprintf (stderr, "gpuprocess: could not start the server threads: %s\n",
+                 strerror (errno));
+        free (scheduler->threads);
+        free (scheduler);
+        return NULL;
+    }
+    return scheduler;
+}
+
+int
+server_scheduler_add (server_scheduler_t *scheduler,
+                      server_t *server)
+{
+    server_scheduler_thread_t *thread = &scheduler->threads[0];
+    unsigned int i;
+
+    /* Balance on the number of servers, rather than on how busy they are,
+     * since that changes all the time while a server can't move. */
+    mutex_lock (scheduler->mutex);
+    for (i = 1; i < scheduler->thread_count; i++) {
+        if (atomic_load_relaxed (&scheduler->threads[i].load) <
+            atomic_load_relaxed (&thread->load))
+            thread = &scheduler->threads[i];
+    }
+    __atomic_add_fetch (&thread->load, 1, __ATOMIC_RELAXED);
+    mutex_unlock (scheduler->mutex);
+
+    server->buffer->consumer_event_fd = thread->event_fd;
+
+    mutex_lock (thread->mutex);
+    server_scheduler_thread_append (&thread->pending,
+                                    &thread->pending_count,
+                                    &thread->pending_capacity,
+                                    server);
+    atomic_store_release (&thread->has_pending, 1);
+    mutex_unlock (thread->mutex);
+
+    eventfd_write (thread->event_fd, 1);
+    return thread->event_fd;
+}
+
+static server_t *
+server_scheduler_thread_find (server_scheduler_thread_t *thread,
+                              buffer_t *buffer)
+{
+    size_t i;
+    for (i = 0; i < thread->server_count; i++) {
+        if (thread->servers[i]->buffer == buffer)
+            return thread->servers[i];
+    }
+    for (i = 0; i < thread->pending_count; i++) {
+        if (thread->pending[i]->buffer == buffer)
+            return thread->pending[i];
+    }
+    return NULL;
+}
+
+void
+server_scheduler_remove (server_scheduler_t *scheduler,
+                         buffer_t *buffer)
+{
+    unsigned int i;
+
+    for (i = 0; i < scheduler->thread_count; i++) {
+        server_scheduler_thread_t *thread = &scheduler->threads[i];
+        server_t *server;
+
+        mutex_lock (thread->mutex);
+        server = server_scheduler_thread_find (thread, buffer);
+        if (! server) {
+            mutex_unlock (thread->mutex);
+            continue;
+        }
+
+        atomic_store_release (&server->disconnected, 1);
+        eventfd_write (thread->event_fd, 1);
+        while (server_scheduler_thread_find (thread, buffer))
+            wait_signal (thread->server_removed, thread->mutex);
+        mutex_unlock (thread->mutex);
+        return;
+    }
+}
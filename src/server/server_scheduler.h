@@ -0,0 +1,51 @@
+#ifndef GPUPROCESS_SERVER_SCHEDULER_H
+#define GPUPROCESS_SERVER_SCHEDULER_H
+
+#include "compiler_private.h"
+#include "server.h"
+#include "thread_private.h"
+#include <stdbool.h>
+
+/* Instead of a thread for every client, a small fixed set of server
+ * threads can serve the command buffers of many clients between them.
+ * Each buffer is handed to the thread that has the fewest, and stays
+ * with it until its client goes away, so the contexts of a client are
+ * only ever current on that one thread. A thread takes its buffers in
+ * turn, running at most SERVER_SCHEDULER_QUANTUM bytes of commands from
+ * each before moving on to the next, so that a client streaming large
+ * uploads can't starve the others. When all of its buffers run dry, the
+ * thread spins for a little while and then sleeps on an eventfd, which
+ * the clients signal instead of the futex of their buffer.
+ *
+ * GPUPROCESS_SERVER_THREADS sets the number of threads; it is 0 by
+ * default, which keeps a server thread for every client. */
+#define SERVER_SCHEDULER_QUANTUM (64 * 1024)
+
+typedef struct _server_scheduler server_scheduler_t;
+
+/* Called on each thread before it starts serving buffers. */
+typedef void (*server_scheduler_thread_init_t)(void);
+
+private server_scheduler_t *
+server_scheduler_new (unsigned int thread_count,
+                      server_scheduler_thread_init_t thread_init);
+
+/* Hands |server| to one of the threads, which destroys it once the client
+ * shuts it down, and returns the eventfd the client must signal through
+ * the consumer_event_fd of its buffer, which is set already if the
+ * client shares the buffer_t with the server. The caller must not touch
+ * the server after this. */
+private int
+server_scheduler_add (server_scheduler_t *scheduler,
+                      server_t *server);
+
+/* For a client in another process that has gone away, perhaps without
+ * shutting down the server that reads |buffer|. Returns once the thread
+ * serving it has executed what the client left in the buffer and
+ * destroyed the server, after which the buffers can be freed. The server
+ * is looked up by its buffer, as it may already be gone. */
+private void
+server_scheduler_remove (server_scheduler_t *scheduler,
+                         buffer_t *buffer);
+
+#endif /* GPUPROCESS_SERVER_SCHEDULER_H */
@@ -0,0 +1,632 @@
+#include "config.h"
+#include "server_stream.h"
+
+#include "command.h"
+#include "compress.h"
+#include "server_connection.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Data this large is written straight from the buffers, rather than being
+ * gathered with the frame headers first. */
+#define SERVER_STREAM_DIRECT_WRITE (64 * 1024)
+
+#define SERVER_STREAM_PRIME_1 0x9e3779b185ebca87ull
+#define SERVER_STREAM_PRIME_2 0xc2b2ae3d27d4eb4full
+
+typedef struct server_stream_cache_entry {
+    uint64_t hash;
+    size_t size;
+    uint64_t last_use;
+    /* Only the server keeps the data itself. */
+    void *data;
+} server_stream_cache_entry_t;
+
+struct _server_stream {
+    int socket;
+    buffer_t *buffer;
+    buffer_t *transfer_buffer;
+    bool compress;
+
+    /* Frames waiting to be written. */
+    char *output;
+    size_t output_size;
+    size_t output_capacity;
+
+    /* Compressed data on its way in or out. */
+    char *scratch;
+    size_t scratch_capacity;
+
+    server_stream_cache_entry_t *cache;
+    size_t cache_count;
+    size_t cache_capacity;
+    size_t cache_size;
+    size_t cache_limit;
+    uint64_t cache_clock;
+
+    /* How long the forwarding thread spins waiting for commands, in ns. */
+    uint64_t spin_time;
+};
+
+server_stream_t *
+server_stream_new (int socket,
+                   buffer_t *buffer,
+                   buffer_t *transfer_buffer,
+                   uint32_t flags,
+                   size_t cache_size)
+{
+    server_stream_t *stream = calloc (1, sizeof (server_stream_t));
+    if (! stream) {
+        fprintf (stderr, "Could not allocate a streamed connection.\n");
+        abort ();
+    }
+
+    stream->socket = socket;
+    stream->buffer = buffer;
+    stream->transfer_buffer = transfer_buffer;
+    stream->compress = flags & SERVER_CONNECTION_COMPRESS;
+    stream->cache_limit = cache_size;
+
+    /* Spinning would only keep the client from running. */
+    if (sysconf (_SC_NPROCESSORS_ONLN) > 1)
+        stream->spin_time = SERVER_DEFAULT_SPIN_LIMIT * 1000;
+    return stream;
+}
+
+void
+server_stream_destroy (server_stream_t *stream)
+{
+    size_t i;
+
+    for (i = 0; i < stream->cache_count; i++)
+        free (stream->cache[i].data);
+    free (stream->cache);
+    free (stream->output);
+    free (stream->scratch);
+    free (stream);
+}
+
+static inline uint64_t
+server_stream_hash_round (uint64_t hash,
+                          uint64_t word)
+{
+    hash += word * SERVER_STREAM_PRIME_2;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * SERVER_STREAM_PRIME_1;
+}
+
+/* A fast 64-bit hash, which is good enough to tell uploads apart but not
+ * meant to resist anyone crafting collisions. Four independent lanes keep
+ * the multiplier busy. */
+static uint64_t
+server_stream_hash (const void *data,
+                    size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *) data;
+    uint64_t lanes[4] = { SERVER_STREAM_PRIME_1, SERVER_STREAM_PRIME_2,
+                          0, -SERVER_STREAM_PRIME_1 };
+    uint64_t hash = size;
+    uint64_t word;
+    size_t offset = 0;
+    int i;
+
+    for (; offset + 32 <= size; offset += 32) {
+        for (i = 0; i < 4; i++) {
+            memcpy (&word, bytes + offset + i * 8, sizeof (word));
+            lanes[i] = server_stream_hash_round (lanes[i], word);
+        }
+    }
+    for (i = 0; i < 4; i++)
+        hash = server_stream_hash_round (hash, lanes[i]);
+
+    for (; offset + 8 <= size; offset += 8) {
+        memcpy (&word, bytes + offset, sizeof (word));
+        hash = server_stream_hash_round (hash, word);
+    }
+    if (offset < size) {
+        word = 0;
+        memcpy (&word, bytes + offset, size - offset);
+        hash = server_stream_hash_round (hash, word);
+    }
+
+    hash ^= hash >> 33;
+    hash *= SERVER_STREAM_PRIME_2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+static server_stream_cache_entry_t *
+server_stream_cache_lookup (server_stream_t *stream,
+                            uint64_t hash,
+                            size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < stream->cache_count; i++) {
+        if (stream->cache[i].hash == hash && stream->cache[i].size == size) {
+            stream->cache[i].last_use = ++stream->cache_clock;
+            return &stream->cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Both ends make the same lookups and insertions in the same order, so
+ * they evict the same entries too. The client passes no |data|. */
+static void
+server_stream_cache_insert (server_stream_t *stream,
+                            uint64_t hash,
+                            size_t size,
+                            const void *data)
+{
+    server_stream_cache_entry_t *entry;
+    size_t oldest;
+    size_t i;
+
+    if (size > stream->cache_limit)
+        return;
+
+    while (stream->cache_size + size > stream->cache_limit) {
+        oldest = 0;
+        for (i = 1; i < stream->cache_count; i++) {
+            if (stream->cache[i].last_use < stream->cache[oldest].last_use)
+                oldest = i;
+        }
+        stream->cache_size -= stream->cache[oldest].size;
+        free (stream->cache[oldest].data);
+        stream->cache[oldest] = stream->cache[--stream->cache_count];
+    }
+
+    if (stream->cache_count == stream->cache_capacity) {
+        size_t capacity = stream->cache_capacity ?
+                          stream->cache_capacity * 2 : 64;
+        server_stream_cache_entry_t *cache =
+            realloc (stream->cache,
+                     capacity * sizeof (server_stream_cache_entry_t));
+        if (! cache) {
+            fprintf (stderr, "Could not grow the upload cache to %zu "
+                     "entries.\n", capacity);
+            abort ();
+        }
+        stream->cache = cache;
+        stream->cache_capacity = capacity;
+    }
+
+    entry = &stream->cache[stream->cache_count++];
+    entry->hash = hash;
+    entry->size = size;
+    entry->last_use = ++stream->cache_clock;
+    entry->data = NULL;
+    if (data) {
+        entry->data = malloc (size);
+        if (! entry->data) {
+            fprintf (stderr, "Could not cache an upload of %zu bytes.\n",
+                     size);
+            abort ();
+        }
+        memcpy (entry->data, data, size);
+    }
+    stream->cache_size += size;
+}
+
+static char *
+server_stream_get_scratch (server_stream_t *stream,
+                           size_t size)
+{
+    if (size > stream->scratch_capacity) {
+        free (stream->scratch);
+        stream->scratch = malloc (size);
+        if (! stream->scratch) {
+            fprintf (stderr, "Could not allocate %zu bytes for a streamed "
+                     "frame.\n", size);
+            abort ();
+        }
+        stream->scratch_capacity = size;
+    }
+    return stream->scratch;
+}
+
+static bool
+server_stream_write_all (int socket,
+                         const void *data,
+                         size_t size)
+{
+    const char *bytes = (const char *) data;
+
+    while (size) {
+        ssize_t written = send (socket, bytes, size, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+/* Returns false once the other end has gone away. */
+static bool
+server_stream_read_all (int socket,
+                        void *data,
+                        size_t size)
+{
+    char *bytes = (char *) data;
+
+    while (size) {
+        ssize_t result = recv (socket, bytes, size, MSG_WAITALL);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        bytes += result;
+        size -= result;
+    }
+    return true;
+}
+
+static void
+server_stream_append (server_stream_t *stream,
+                      const void *data,
+                      size_t size)
+{
+    if (stream->output_size + size > stream->output_capacity) {
+        stream->output_capacity = stream->output_capacity ?
+                                  stream->output_capacity * 2 : 16 * 1024;
+        if (stream->output_capacity < stream->output_size + size)
+            stream->output_capacity = stream->output_size + size;
+        stream->output = realloc (stream->output, stream->output_capacity);
+        if (! stream->output) {
+            fprintf (stderr, "Could not grow the output of a stream to %zu "
+                     "bytes.\n", stream->output_capacity);
+            abort ();
+        }
+    }
+    memcpy (stream->output + stream->output_size, data, size);
+    stream->output_size += size;
+}
+
+static bool
+server_stream_flush (server_stream_t *stream)
+{
+    size_t size = stream->output_size;
+
+    stream->output_size = 0;
+    return server_stream_write_all (stream->socket, stream->output, size);
+}
+
+/* Queues a frame carrying the |size| bytes at |index| in the ring of
+ * |type|, which are at |data|. Large data may be written right away. */
+static bool
+server_stream_write_frame (server_stream_t *stream,
+                           uint32_t type,
+                           uint32_t flags,
+                           size_t index,
+                           const void *data,
+                           size_t size,
+                           bool cacheable)
+{
+    server_stream_frame_t frame;
+
+    frame.type = type;
+    frame.flags = flags;
+    frame.index = index;
+    frame.size = size;
+    frame.hash = 0;
+
+    if (cacheable && size >= SERVER_STREAM_CACHE_THRESHOLD &&
+        size <= stream->cache_limit) {
+        frame.hash = server_stream_hash (data, size);
+        if (server_stream_cache_lookup (stream, frame.hash, size)) {
+            frame.flags |= SERVER_STREAM_CACHED;
+            frame.encoded_size = 0;
+            server_stream_append (stream, &frame, sizeof (frame));
+            return true;
+        }
+        server_stream_cache_insert (stream, frame.hash, size, NULL);
+        frame.flags |= SERVER_STREAM_CACHE_STORE;
+    }
+
+    frame.encoded_size = size;
+    if (stream->compress && size >= SERVER_STREAM_COMPRESS_THRESHOLD) {
+        char *scratch = server_stream_get_scratch (stream, size);
+        size_t compressed_size = compress_block (data, size, scratch);
+        if (compressed_size) {
+            frame.flags |= SERVER_STREAM_COMPRESSED;
+            frame.encoded_size = compressed_size;
+            data = scratch;
+        }
+    }
+
+    server_stream_append (stream, &frame, sizeof (frame));
+    if (frame.encoded_size < SERVER_STREAM_DIRECT_WRITE) {
+        server_stream_append (stream, data, frame.encoded_size);
+        return true;
+    }
+    return server_stream_flush (stream) &&
+           server_stream_write_all (stream->socket, data, frame.encoded_size);
+}
+
+/* Reads the data that follows |frame| into |destination|. */
+static bool
+server_stream_read_data (server_stream_t *stream,
+                         const server_stream_frame_t *frame,
+                         void *destination)
+{
+    server_stream_cache_entry_t *entry;
+    char *scratch;
+
+    if (frame->flags & SERVER_STREAM_CACHED) {
+        entry = server_stream_cache_lookup (stream, frame->hash, frame->size);
+        if (! entry || ! entry->data || frame->encoded_size)
+            return false;
+        memcpy (destination, entry->data, frame->size);
+        return true;
+    }
+
+    if (frame->flags & SERVER_STREAM_COMPRESSED) {
+        if (frame->encoded_size >= frame->size)
+            return false;
+        scratch = server_stream_get_scratch (stream, frame->encoded_size);
+        if (! server_stream_read_all (stream->socket, scratch,
+                                      frame->encoded_size) ||
+            ! decompress_block (scratch, frame->encoded_size,
+                                destination, frame->size))
+            return false;
+    } else if (frame->encoded_size != frame->size ||
+               ! server_stream_read_all (stream->socket, destination,
+                                         frame->size))
+        return false;
+
+    if (frame->flags & SERVER_STREAM_CACHE_STORE)
+        server_stream_cache_insert (stream, frame->hash, frame->size,
+                                    destination);
+    return true;
+}
+
+static void
+server_stream_fail (void)
+{
+    fprintf (stderr, "gpuprocess: lost the connection to the server: %s\n",
+             strerror (errno));
+    abort ();
+}
+
+/* Sends the oldest allocation in the transfer buffer, which belongs to the
+ * command being forwarded. It is given back right away, unless the command
+ * is synchronous and the answer goes there. The results of a command are
+ * no use to anyone else, so they stay out of the cache. */
+static bool
+server_stream_forward_transfer (server_stream_t *stream,
+                                bool synchronous)
+{
+    buffer_t *transfer_buffer = stream->transfer_buffer;
+    size_t index = transfer_buffer->shared->consumer.tail;
+    size_t available;
+    uint64_t *allocation = buffer_read_address (transfer_buffer, &available);
+    size_t allocation_size;
+
+    if (! allocation)
+        return false;
+
+    allocation_size = *allocation;
+    if (! server_stream_write_frame (stream, SERVER_STREAM_TRANSFER, 0, index,
+                                     allocation, allocation_size,
+                                     ! synchronous))
+        return false;
+
+    if (! synchronous) {
+        buffer_read_advance (transfer_buffer, allocation_size);
+        buffer_signal_producer (transfer_buffer);
+    }
+    return true;
+}
+
+/* Copies the server's copy of the synchronous |command|, which is at
+ * |index| in the command buffer, and of its transfer payload over ours. */
+static bool
+server_stream_receive_answer (server_stream_t *stream,
+                              command_t *command,
+                              size_t index)
+{
+    server_stream_frame_t frame;
+
+    if (command->flags & COMMAND_FLAG_TRANSFER_PAYLOAD) {
+        buffer_t *transfer_buffer = stream->transfer_buffer;
+        size_t available;
+        uint64_t *allocation = buffer_read_address (transfer_buffer,
+                                                    &available);
+        size_t allocation_size = *allocation;
+
+        if (! server_stream_read_all (stream->socket, &frame, sizeof (frame)) ||
+            frame.type != SERVER_STREAM_TRANSFER ||
+            frame.index != transfer_buffer->shared->consumer.tail ||
+            frame.size != allocation_size ||
+            ! server_stream_read_data (stream, &frame, allocation))
+            return false;
+
+        buffer_read_advance (transfer_buffer, allocation_size);
+        buffer_signal_producer (transfer_buffer);
+    }
+
+    return server_stream_read_all (stream->socket, &frame, sizeof (frame)) &&
+           frame.type == SERVER_STREAM_COMMANDS &&
+           frame.index == index &&
+           frame.size == command->size &&
+           server_stream_read_data (stream, &frame, command);
+}
+
+void *
+server_stream_forward (void *ptr)
+{
+    server_stream_t *stream = (server_stream_t *) ptr;
+    buffer_t *buffer = stream->buffer;
+
+    while (true) {
+        size_t available;
+        size_t offset = 0;
+        size_t start = 0;
+        size_t index = buffer->shared->consumer.tail;
+        char *commands = buffer_read_address (buffer, &available);
+
+        if (! commands) {
+            buffer_wait_for_data (buffer, stream->spin_time);
+            continue;
+        }
+
+        /* Everything published so far goes out as one batch, except that
+         * a synchronous command ends the batch, as the client waits for
+         * its answer. */
+        while (offset < available) {
+            command_t *command = (command_t *) (commands + offset);
+            bool synchronous = command->flags & COMMAND_FLAG_SYNCHRONOUS;
+            bool shutdown = command->type == COMMAND_SHUTDOWN;
+
+            offset += command->size;
+
+            if ((command->flags & COMMAND_FLAG_TRANSFER_PAYLOAD) &&
+                ! server_stream_forward_transfer (stream, synchronous))
+                server_stream_fail ();
+
+            if (! synchronous)
+                continue;
+
+            if (! server_stream_write_frame (stream, SERVER_STREAM_COMMANDS,
+                                             SERVER_STREAM_SYNCHRONOUS,
+                                             index + start, commands + start,
+                                             offset - start, false) ||
+                ! server_stream_flush (stream) ||
+                ! server_stream_receive_answer (stream, command,
+                                                index + offset - command->size))
+                server_stream_fail ();
+
+            buffer_read_advance (buffer, offset - start);
+            start = offset;
+
+            /* The client frees the buffers as soon as it sees the token. */
+            if (shutdown) {
+                server_stream_destroy (stream);
+                buffer_complete_token (buffer);
+                return NULL;
+            }
+            buffer_complete_token (buffer);
+            buffer_signal_producer (buffer);
+        }
+
+        if (start < offset) {
+            if (! server_stream_write_frame (stream, SERVER_STREAM_COMMANDS, 0,
+                                             index + start, commands + start,
+                                             offset - start, false) ||
+                ! server_stream_flush (stream))
+                server_stream_fail ();
+            buffer_read_advance (buffer, offset - start);
+            buffer_signal_producer (buffer);
+        }
+    }
+    return NULL;
+}
+
+/* Where the data of |frame| goes in our copy of the client's ring, which
+ * is at the same index as in the client's. Everything before it has been
+ * executed by now, so there is always room. */
+static void *
+server_stream_reserve (buffer_t *buffer,
+                       const server_stream_frame_t *frame)
+{
+    if (frame->index != buffer->producer.cursor ||
+        ! frame->size || frame->size > buffer->length)
+        return NULL;
+    return buffer_write_address (buffer, frame->size);
+}
+
+/* Sends back the last command of a synchronous batch, and its transfer
+ * payload, as they hold the results. */
+static bool
+server_stream_answer (server_stream_t *stream,
+                      const char *commands,
+                      size_t index,
+                      size_t size,
+                      size_t transfer_index,
+                      size_t transfer_size)
+{
+    buffer_t *transfer_buffer = stream->transfer_buffer;
+    size_t offset = 0;
+    size_t last = 0;
+    command_t *command;
+
+    while (offset < size) {
+        command = (command_t *) (commands + offset);
+        if (! command->size)
+            return false;
+        last = offset;
+        offset += command->size;
+    }
+    command = (command_t *) (commands + last);
+
+    if ((command->flags & COMMAND_FLAG_TRANSFER_PAYLOAD) &&
+        ! server_stream_write_frame (stream, SERVER_STREAM_TRANSFER, 0,
+                                     transfer_index,
+                                     (char *) transfer_buffer->address +
+                                         transfer_index % transfer_buffer->length,
+                                     transfer_size, false))
+        return false;
+
+    return server_stream_write_frame (stream, SERVER_STREAM_COMMANDS, 0,
+                                      index + last, command, command->size,
+                                      false) &&
+           server_stream_flush (stream);
+}
+
+void
+server_stream_serve (server_stream_t *stream,
+                     server_t *server)
+{
+    server_stream_frame_t frame;
+    size_t transfer_index = 0;
+    size_t transfer_size = 0;
+
+    while (server_stream_read_all (stream->socket, &frame, sizeof (frame))) {
+        buffer_t *buffer;
+        void *destination;
+        ssize_t executed;
+
+        if (frame.type == SERVER_STREAM_COMMANDS)
+            buffer = stream->buffer;
+        else if (frame.type == SERVER_STREAM_TRANSFER)
+            buffer = stream->transfer_buffer;
+        else
+            break;
+
+        destination = server_stream_reserve (buffer, &frame);
+        if (! destination ||
+            ! server_stream_read_data (stream, &frame, destination))
+            break;
+        buffer_write_advance (buffer, frame.size);
+        buffer_publish (buffer);
+
+        if (frame.type == SERVER_STREAM_TRANSFER) {
+            transfer_index = frame.index;
+            transfer_size = frame.size;
+            continue;
+        }
+
+        do
+            executed = server_execute_commands (server, SIZE_MAX);
+        while (executed > 0);
+
+        /* The commands and payloads stay intact after they have run, as
+         * nobody else writes to these rings. */
+        if ((frame.flags & SERVER_STREAM_SYNCHRONOUS) &&
+            ! server_stream_answer (stream, destination, frame.index,
+                                    frame.size, transfer_index, transfer_size))
+            break;
+
+        if (executed < 0)
+            break;
+    }
+}
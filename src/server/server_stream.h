@@ -0,0 +1,91 @@
+#ifndef GPUPROCESS_SERVER_STREAM_H
+#define GPUPROCESS_SERVER_STREAM_H
+
+#include "compiler_private.h"
+#include "ring_buffer.h"
+#include "server.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The stream transport carries the commands of a client to a server that
+ * can't share memory with it, over a Unix or TCP socket. The client keeps
+ * writing commands to its own buffers, and a forwarding thread takes the
+ * place of the server thread: it sends what the client publishes to the
+ * server, a batch per flush, and gives the space back. The server copies
+ * each batch into rings of its own, mapped at the addresses the client's
+ * buffers have, so that the pointers commands carry into the buffers stay
+ * valid, and executes it with the usual handlers. Pointers into any other
+ * memory of the client would mean nothing to the server, which is why a
+ * remote client never copies arguments to its heap, see
+ * client_abort_remote_heap_payload (). For a synchronous
+ * command it sends back the command and its transfer payload, which hold
+ * the results, and the forwarding thread copies them over the client's
+ * before completing the token.
+ *
+ * When the connection asks for it, data of SERVER_STREAM_COMPRESS_THRESHOLD
+ * bytes or more is compressed with compress_block (). Transfer payloads of
+ * SERVER_STREAM_CACHE_THRESHOLD bytes or more, like texture and buffer
+ * uploads, are kept by the server in a cache indexed by a hash of their
+ * contents. The client keeps track of what is in the cache, evicting the
+ * least recently used data just like the server does, and sends a
+ * reference instead of the data the server already has. */
+#define SERVER_STREAM_COMPRESS_THRESHOLD 4096
+#define SERVER_STREAM_CACHE_THRESHOLD (16 * 1024)
+
+/* In kilobytes; GPUPROCESS_STREAM_CACHE_SIZE overrides it, and 0 turns the
+ * cache off. */
+#define SERVER_STREAM_DEFAULT_CACHE_SIZE (64 * 1024)
+
+typedef enum server_stream_frame_type {
+    SERVER_STREAM_COMMANDS,
+    SERVER_STREAM_TRANSFER
+} server_stream_frame_type_t;
+
+typedef enum server_stream_frame_flags {
+    /* The server answers once it has executed the commands. */
+    SERVER_STREAM_SYNCHRONOUS = 1 << 0,
+    SERVER_STREAM_COMPRESSED = 1 << 1,
+    /* No data follows, as the server has it in its cache. */
+    SERVER_STREAM_CACHED = 1 << 2,
+    /* The server keeps the data in its cache. */
+    SERVER_STREAM_CACHE_STORE = 1 << 3
+} server_stream_frame_flags_t;
+
+/* Every frame starts with this, followed by |encoded_size| bytes that
+ * decode to the |size| bytes at |index| in the ring the type names. */
+typedef struct server_stream_frame {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t index;
+    uint64_t size;
+    uint64_t encoded_size;
+    /* Of the decoded data, for the cache. */
+    uint64_t hash;
+} server_stream_frame_t;
+
+typedef struct _server_stream server_stream_t;
+
+/* |flags| are those of the server_connection_request_t, and |cache_size|
+ * is in bytes. The socket stays with the caller. */
+private server_stream_t *
+server_stream_new (int socket,
+                   buffer_t *buffer,
+                   buffer_t *transfer_buffer,
+                   uint32_t flags,
+                   size_t cache_size);
+
+private void
+server_stream_destroy (server_stream_t *stream);
+
+/* The thread function of the client's forwarding thread. It destroys the
+ * stream and returns once it has forwarded COMMAND_SHUTDOWN. */
+private void *
+server_stream_forward (void *stream);
+
+/* Executes what the client sends with |server|, whose buffers are those
+ * of the stream, until the client shuts it down or goes away. */
+private void
+server_stream_serve (server_stream_t *stream,
+                     server_t *server);
+
+#endif /* GPUPROCESS_SERVER_STREAM_H */
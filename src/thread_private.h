@@ -1,7 +1,12 @@
 #ifndef GPUPROCESS_THREAD_H
 #define GPUPROCESS_THREAD_H
 
+#include <linux/futex.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 /* mutex definition */
 typedef pthread_mutex_t                 mutex_t;
@@ -28,4 +33,45 @@ typedef pthread_t                       thread_t;
 #define signal_static_init(name) \
     static signal_t name = PTHREAD_COND_INITIALIZER
 
+/* atomic access for data shared between the client and server threads */
+#define atomic_load_relaxed(ptr)         __atomic_load_n ((ptr), __ATOMIC_RELAXED)
+#define atomic_load_acquire(ptr)         __atomic_load_n ((ptr), __ATOMIC_ACQUIRE)
+#define atomic_store_relaxed(ptr, value) __atomic_store_n ((ptr), (value), __ATOMIC_RELAXED)
+#define atomic_store_release(ptr, value) __atomic_store_n ((ptr), (value), __ATOMIC_RELEASE)
+#define atomic_increment(ptr)            __atomic_add_fetch ((ptr), 1, __ATOMIC_RELEASE)
+#define atomic_full_barrier()            __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
+/* futex on a 32-bit word; the non-private operations work for words in
+ * memory shared with another process too */
+#define futex_wait(address, value) \
+    syscall (SYS_futex, (address), FUTEX_WAIT, (value), NULL, NULL, 0)
+#define futex_wake(address, count) \
+    syscall (SYS_futex, (address), FUTEX_WAKE, (count), NULL, NULL, 0)
+
+/* busy-wait hint for the cpu */
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause ()
+#elif defined(__arm__) || defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__ ("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+static inline uint64_t
+get_monotonic_time_ns (void)
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/* Only accurate to a few milliseconds, but much cheaper to read. */
+static inline uint64_t
+get_coarse_monotonic_time_ns (void)
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
 #endif /* GPUPROCESS_THREAD_H */
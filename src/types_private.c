@@ -1,4 +1,5 @@
 #include "types_private.h"
+#include "memory_pool.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -7,7 +8,7 @@ link_list_append (link_list_t **list,
                   void *data,
                   list_delete_function_t delete_function)
 {
-    link_list_t *new_element = (link_list_t *) malloc (sizeof (link_list_t));
+    link_list_t *new_element = (link_list_t *) memory_pool_alloc (sizeof (link_list_t));
     new_element->data = data;
     new_element->next = NULL;
     new_element->prev = NULL;
@@ -31,7 +32,7 @@ link_list_prepend (link_list_t **list,
                    void *data,
                    list_delete_function_t delete_function)
 {
-    link_list_t *new_list = (link_list_t *) malloc (sizeof (link_list_t));
+    link_list_t *new_list = (link_list_t *) memory_pool_alloc (sizeof (link_list_t));
     new_list->data = data;
     new_list->delete_function = delete_function;
     new_list->prev = NULL;
@@ -72,7 +73,7 @@ link_list_delete_element (link_list_t **list, link_list_t *element)
 
     if (element->delete_function)
         element->delete_function (element->data);
-    free (element);
+    memory_pool_free (element);
 }
 
 void
@@ -86,7 +87,7 @@ link_list_clear (link_list_t** list)
         link_list_t *next = current->next;
         if (current->delete_function)
             current->delete_function (current->data);
-        free (current);
+        memory_pool_free (current);
         current = next;
     }
 
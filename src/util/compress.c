@@ -0,0 +1,236 @@
+#include "config.h"
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_MAX_OFFSET 65535
+#define COMPRESS_HASH_BITS 12
+
+/* The data isn't worth the tokens below this. */
+#define COMPRESS_MIN_SIZE 16
+
+static inline uint32_t
+compress_read_32 (const uint8_t *address)
+{
+    uint32_t value;
+    memcpy (&value, address, sizeof (value));
+    return value;
+}
+
+static inline uint64_t
+compress_read_64 (const uint8_t *address)
+{
+    uint64_t value;
+    memcpy (&value, address, sizeof (value));
+    return value;
+}
+
+static inline uint32_t
+compress_hash (uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+/* Writes the part of a length that didn't fit in its nibble. */
+static uint8_t *
+compress_write_length (uint8_t *out,
+                       uint8_t *out_end,
+                       size_t length)
+{
+    while (length >= 255) {
+        if (out >= out_end)
+            return NULL;
+        *out++ = 255;
+        length -= 255;
+    }
+    if (out >= out_end)
+        return NULL;
+    *out++ = length;
+    return out;
+}
+
+/* Writes a token, or returns NULL if it doesn't fit. A |match_length| of
+ * 0 ends the block. */
+static uint8_t *
+compress_write_token (uint8_t *out,
+                      uint8_t *out_end,
+                      const uint8_t *literals,
+                      size_t literal_length,
+                      size_t offset,
+                      size_t match_length)
+{
+    uint8_t *token;
+
+    if (out >= out_end)
+        return NULL;
+    token = out++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15) {
+        out = compress_write_length (out, out_end, literal_length - 15);
+        if (! out)
+            return NULL;
+    }
+
+    if ((size_t) (out_end - out) < literal_length)
+        return NULL;
+    memcpy (out, literals, literal_length);
+    out += literal_length;
+
+    if (! match_length)
+        return out;
+
+    if (out_end - out < 2)
+        return NULL;
+    out[0] = offset & 0xff;
+    out[1] = offset >> 8;
+    out += 2;
+
+    match_length -= COMPRESS_MIN_MATCH;
+    *token |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15)
+        out = compress_write_length (out, out_end, match_length - 15);
+    return out;
+}
+
+size_t
+compress_block (const void *source,
+                size_t size,
+                void *destination)
+{
+    const uint8_t *in = (const uint8_t *) source;
+    const uint8_t *end = in + size;
+    const uint8_t *anchor = in;
+    const uint8_t *position = in;
+    uint8_t *out = (uint8_t *) destination;
+    uint8_t *out_end = out + size;
+    uint32_t table[1 << COMPRESS_HASH_BITS];
+    unsigned int misses = 0;
+
+    /* The table holds 32-bit offsets. */
+    if (size < COMPRESS_MIN_SIZE || size > UINT32_MAX)
+        return 0;
+    memset (table, 0, sizeof (table));
+
+    while (position + COMPRESS_MIN_MATCH <= end) {
+        uint32_t value = compress_read_32 (position);
+        uint32_t hash = compress_hash (value);
+        const uint8_t *candidate = in + table[hash];
+        const uint8_t *match_end;
+
+        table[hash] = position - in;
+        if (candidate >= position ||
+            position - candidate > COMPRESS_MAX_OFFSET ||
+            compress_read_32 (candidate) != value) {
+            /* Skip ahead faster through data that doesn't compress. */
+            position += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        match_end = position + COMPRESS_MIN_MATCH;
+        candidate += COMPRESS_MIN_MATCH;
+        while (match_end + 8 <= end &&
+               compress_read_64 (match_end) == compress_read_64 (candidate)) {
+            match_end += 8;
+            candidate += 8;
+        }
+        while (match_end < end && *match_end == *candidate) {
+            match_end++;
+            candidate++;
+        }
+        candidate -= match_end - position;
+
+        /* The literals may end with the start of the match. */
+        while (position > anchor && candidate > in &&
+               position[-1] == candidate[-1]) {
+            position--;
+            candidate--;
+        }
+
+        out = compress_write_token (out, out_end, anchor, position - anchor,
+                                    position - candidate, match_end - position);
+        if (! out)
+            return 0;
+
+        position = anchor = match_end;
+        misses = 0;
+    }
+
+    out = compress_write_token (out, out_end, anchor, end - anchor, 0, 0);
+    if (! out || out == out_end)
+        return 0;
+    return out - (uint8_t *) destination;
+}
+
+static bool
+decompress_read_length (const uint8_t **in,
+                        const uint8_t *end,
+                        size_t *length)
+{
+    uint8_t byte;
+
+    do {
+        if (*in >= end)
+            return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool
+decompress_block (const void *source,
+                  size_t size,
+                  void *destination,
+                  size_t decompressed_size)
+{
+    const uint8_t *in = (const uint8_t *) source;
+    const uint8_t *end = in + size;
+    uint8_t *out = (uint8_t *) destination;
+    uint8_t *out_end = out + decompressed_size;
+
+    while (in < end) {
+        uint8_t token = *in++;
+        size_t length = token >> 4;
+        size_t offset;
+        const uint8_t *match;
+
+        if (length == 15 && ! decompress_read_length (&in, end, &length))
+            return false;
+        if ((size_t) (end - in) < length || (size_t) (out_end - out) < length)
+            return false;
+        memcpy (out, in, length);
+        in += length;
+        out += length;
+
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return false;
+        offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        length = token & 15;
+        if (length == 15 && ! decompress_read_length (&in, end, &length))
+            return false;
+        length += COMPRESS_MIN_MATCH;
+
+        if (! offset || offset > (size_t) (out - (uint8_t *) destination) ||
+            (size_t) (out_end - out) < length)
+            return false;
+
+        /* A match can overlap the bytes it produces, which is how runs
+         * are encoded. */
+        match = out - offset;
+        if (offset >= length) {
+            memcpy (out, match, length);
+            out += length;
+        } else {
+            while (length--)
+                *out++ = *match++;
+        }
+    }
+    return out == out_end;
+}
@@ -0,0 +1,32 @@
+#ifndef GPUPROCESS_COMPRESS_H
+#define GPUPROCESS_COMPRESS_H
+
+#include "compiler_private.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A byte-oriented LZ77 codec in the spirit of LZ4, tuned for speed over
+ * ratio: it only has to pay for itself on a network link. A block is a
+ * sequence of tokens, each made of a run of literals and a match of at
+ * least four bytes up to 64 KB back; the high nibble of the token holds
+ * the literal length and the low one the match length, with 15 meaning
+ * that more length bytes follow. The last token has no match. */
+
+/* Compresses |size| bytes at |source| into |destination|, which has room
+ * for |size| bytes. Returns the compressed size, or 0 if the data doesn't
+ * get any smaller. */
+private size_t
+compress_block (const void *source,
+                size_t size,
+                void *destination);
+
+/* Decompresses the |size| bytes at |source| into exactly
+ * |decompressed_size| bytes at |destination|. Returns false if the block
+ * is malformed, which never makes it read or write out of bounds. */
+private bool
+decompress_block (const void *source,
+                  size_t size,
+                  void *destination,
+                  size_t decompressed_size);
+
+#endif /* GPUPROCESS_COMPRESS_H */
@@ -0,0 +1,312 @@
+#include "config.h"
+#include "content_hash.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONTENT_HASH_HAS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#define CONTENT_HASH_LANES 4
+#define CONTENT_HASH_STRIPE_SIZE (CONTENT_HASH_LANES * sizeof (uint64_t))
+#define CONTENT_HASH_STRIPES_PER_BLOCK 16
+
+/* Stripe |i| of a block takes the keys from |i| on, so that the same data
+ * in two places of a block adds up differently. The scrambles after each
+ * block and the last stripe have keys of their own. */
+#define CONTENT_HASH_SCRAMBLE_KEYS (CONTENT_HASH_STRIPES_PER_BLOCK + CONTENT_HASH_LANES - 1)
+#define CONTENT_HASH_LAST_STRIPE_KEYS (CONTENT_HASH_SCRAMBLE_KEYS + CONTENT_HASH_LANES)
+#define CONTENT_HASH_KEY_COUNT (CONTENT_HASH_LAST_STRIPE_KEYS + CONTENT_HASH_LANES)
+
+#define CONTENT_HASH_PRIME_32 0x9e3779b1u
+#define CONTENT_HASH_PRIME_64_1 0x9e3779b185ebca87ull
+#define CONTENT_HASH_PRIME_64_2 0xc2b2ae3d27d4eb4full
+#define CONTENT_HASH_PRIME_64_3 0x165667b19e3779f9ull
+
+static const uint64_t content_hash_keys[CONTENT_HASH_KEY_COUNT] = {
+    0x2cb0f69f4abea221ull, 0x9417034723148989ull, 0xdd555950609dfe03ull,
+    0xdbafb150deb12800ull, 0x7e789b2e6c442cb6ull, 0xf41e5636c7e4f8c4ull,
+    0x0959d150f8fba7e4ull, 0xa97316f13cdb9eeaull, 0x74cd8258f9520068ull,
+    0x55c74a62e116868bull, 0xd2f4c799a2023cbdull, 0xdf98cb79a37b51b9ull,
+    0x396f5885524f3905ull, 0xaf1d56386ca3b276ull, 0xa9ffbe6b5104e85aull,
+    0x6bd0c51b9fd533b3ull, 0x980ce91c50ab4b56ull, 0x28ac395780fe62c5ull,
+    0x768912e3a6bcedc7ull, 0x50b3e8c9332c7c88ull, 0xce3bbfe520bd47daull,
+    0xcba6c8e8e0bb7c4full, 0xbf194db8434a346dull, 0x7d8f2a7b60416d7full,
+    0x0849d1f6e0e10a5eull, 0x7654b590d064e22full, 0x16d1da9507df3af2ull,
+};
+
+static const uint64_t content_hash_initial_lanes[CONTENT_HASH_LANES] = {
+    CONTENT_HASH_PRIME_32, CONTENT_HASH_PRIME_64_1,
+    CONTENT_HASH_PRIME_64_2, CONTENT_HASH_PRIME_64_3
+};
+
+typedef void (*content_hash_func_t) (const char *data,
+                                     size_t size,
+                                     uint64_t *lanes);
+
+/* Hashes |size| bytes, at least a stripe, into |lanes|, made of the
+ * |isa|_accumulate operation, which adds a stripe to the lanes, and
+ * |isa|_scramble on |vector_t|. Every full block is scrambled, the stripes
+ * after them aren't, and the last stripe, which may overlap the others,
+ * is always added on its own, so that there is no scalar tail. */
+#define CONTENT_HASH_DEFINE_KERNEL(isa, vector_t, target)                   \
+static target void                                                          \
+content_hash_lanes_##isa (const char *data,                                 \
+                          size_t size,                                      \
+                          uint64_t *lanes)                                  \
+{                                                                           \
+    vector_t acc[CONTENT_HASH_STRIPE_SIZE / sizeof (vector_t)];             \
+    size_t stripes = (size - 1) / CONTENT_HASH_STRIPE_SIZE;                 \
+    size_t stripe = 0;                                                      \
+    size_t i;                                                               \
+                                                                            \
+    memcpy (acc, content_hash_initial_lanes, sizeof (acc));                 \
+                                                                            \
+    for (; stripe + CONTENT_HASH_STRIPES_PER_BLOCK <= stripes;              \
+         stripe += CONTENT_HASH_STRIPES_PER_BLOCK) {                        \
+        for (i = 0; i < CONTENT_HASH_STRIPES_PER_BLOCK; i++)                \
+            isa##_accumulate (acc,                                          \
+                              data + (stripe + i) * CONTENT_HASH_STRIPE_SIZE, \
+                              content_hash_keys + i);                       \
+        isa##_scramble (acc, content_hash_keys + CONTENT_HASH_SCRAMBLE_KEYS); \
+    }                                                                       \
+    for (i = 0; stripe + i < stripes; i++)                                  \
+        isa##_accumulate (acc,                                              \
+                          data + (stripe + i) * CONTENT_HASH_STRIPE_SIZE,   \
+                          content_hash_keys + i);                           \
+    isa##_accumulate (acc, data + size - CONTENT_HASH_STRIPE_SIZE,          \
+                      content_hash_keys + CONTENT_HASH_LAST_STRIPE_KEYS);   \
+                                                                            \
+    memcpy (lanes, acc, sizeof (acc));                                      \
+}
+
+/* Each lane adds the product of the halves of its word, mixed with the
+ * key, and the word of its neighbour as it is, so that no word is lost
+ * when its product is 0. */
+static inline void
+scalar_accumulate (uint64_t *acc,
+                   const char *stripe,
+                   const uint64_t *keys)
+{
+    uint64_t words[CONTENT_HASH_LANES];
+    int i;
+
+    memcpy (words, stripe, CONTENT_HASH_STRIPE_SIZE);
+    for (i = 0; i < CONTENT_HASH_LANES; i++) {
+        uint64_t mixed = words[i] ^ keys[i];
+        acc[i] += (mixed & 0xffffffff) * (mixed >> 32);
+        acc[i ^ 1] += words[i];
+    }
+}
+
+static inline void
+scalar_scramble (uint64_t *acc,
+                 const uint64_t *keys)
+{
+    int i;
+
+    for (i = 0; i < CONTENT_HASH_LANES; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= keys[i];
+        acc[i] *= CONTENT_HASH_PRIME_32;
+    }
+}
+
+CONTENT_HASH_DEFINE_KERNEL (scalar, uint64_t, )
+
+#ifdef CONTENT_HASH_HAS_X86_KERNELS
+#define CONTENT_HASH_SSE2 __attribute__((target ("sse2")))
+#define CONTENT_HASH_AVX2 __attribute__((target ("avx2")))
+
+/* The shuffles swap the two words of each 16 bytes, which hands every
+ * lane the word of its neighbour. Multiplying by a 32-bit prime takes a
+ * product for each half of the lanes, as there is no 64-bit multiply. */
+static inline CONTENT_HASH_SSE2 void
+sse2_accumulate (__m128i *acc,
+                 const char *stripe,
+                 const uint64_t *keys)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        __m128i words = _mm_loadu_si128 ((const __m128i *) stripe + i);
+        __m128i mixed = _mm_xor_si128 (words,
+                                       _mm_loadu_si128 ((const __m128i *) keys + i));
+        acc[i] = _mm_add_epi64 (acc[i],
+                                _mm_mul_epu32 (mixed, _mm_srli_epi64 (mixed, 32)));
+        acc[i] = _mm_add_epi64 (acc[i],
+                                _mm_shuffle_epi32 (words, _MM_SHUFFLE (1, 0, 3, 2)));
+    }
+}
+
+static inline CONTENT_HASH_SSE2 void
+sse2_scramble (__m128i *acc,
+               const uint64_t *keys)
+{
+    const __m128i prime = _mm_set1_epi32 (CONTENT_HASH_PRIME_32);
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        __m128i lanes = _mm_xor_si128 (acc[i], _mm_srli_epi64 (acc[i], 47));
+        lanes = _mm_xor_si128 (lanes, _mm_loadu_si128 ((const __m128i *) keys + i));
+        acc[i] = _mm_add_epi64 (_mm_mul_epu32 (lanes, prime),
+                                _mm_slli_epi64 (_mm_mul_epu32 (_mm_srli_epi64 (lanes, 32),
+                                                               prime), 32));
+    }
+}
+
+static inline CONTENT_HASH_AVX2 void
+avx2_accumulate (__m256i *acc,
+                 const char *stripe,
+                 const uint64_t *keys)
+{
+    __m256i words = _mm256_loadu_si256 ((const __m256i *) stripe);
+    __m256i mixed = _mm256_xor_si256 (words,
+                                      _mm256_loadu_si256 ((const __m256i *) keys));
+    *acc = _mm256_add_epi64 (*acc,
+                             _mm256_mul_epu32 (mixed, _mm256_srli_epi64 (mixed, 32)));
+    *acc = _mm256_add_epi64 (*acc,
+                             _mm256_shuffle_epi32 (words, _MM_SHUFFLE (1, 0, 3, 2)));
+}
+
+static inline CONTENT_HASH_AVX2 void
+avx2_scramble (__m256i *acc,
+               const uint64_t *keys)
+{
+    const __m256i prime = _mm256_set1_epi32 (CONTENT_HASH_PRIME_32);
+    __m256i lanes = _mm256_xor_si256 (*acc, _mm256_srli_epi64 (*acc, 47));
+
+    lanes = _mm256_xor_si256 (lanes, _mm256_loadu_si256 ((const __m256i *) keys));
+    *acc = _mm256_add_epi64 (_mm256_mul_epu32 (lanes, prime),
+                             _mm256_slli_epi64 (_mm256_mul_epu32 (_mm256_srli_epi64 (lanes, 32),
+                                                                  prime), 32));
+}
+
+CONTENT_HASH_DEFINE_KERNEL (sse2, __m128i, CONTENT_HASH_SSE2)
+CONTENT_HASH_DEFINE_KERNEL (avx2, __m256i, CONTENT_HASH_AVX2)
+#endif /* CONTENT_HASH_HAS_X86_KERNELS */
+
+/* Kernels that aren't built in for this architecture are left empty. */
+static const content_hash_func_t content_hash_kernels[CONTENT_HASH_KERNEL_COUNT] = {
+    [CONTENT_HASH_KERNEL_SCALAR] = content_hash_lanes_scalar,
+#ifdef CONTENT_HASH_HAS_X86_KERNELS
+    [CONTENT_HASH_KERNEL_SSE2] = content_hash_lanes_sse2,
+    [CONTENT_HASH_KERNEL_AVX2] = content_hash_lanes_avx2,
+#endif
+};
+
+static const char *content_hash_kernel_names[CONTENT_HASH_KERNEL_COUNT] = {
+    [CONTENT_HASH_KERNEL_SCALAR] = "scalar",
+    [CONTENT_HASH_KERNEL_SSE2] = "sse2",
+    [CONTENT_HASH_KERNEL_AVX2] = "avx2",
+};
+
+static pthread_once_t content_hash_kernel_once = PTHREAD_ONCE_INIT;
+static content_hash_kernel_t content_hash_best_kernel = CONTENT_HASH_KERNEL_SCALAR;
+
+bool
+content_hash_kernel_is_supported (content_hash_kernel_t kernel)
+{
+    if (kernel >= CONTENT_HASH_KERNEL_COUNT || ! content_hash_kernels[kernel])
+        return false;
+
+#ifdef CONTENT_HASH_HAS_X86_KERNELS
+    __builtin_cpu_init ();
+    switch (kernel) {
+    case CONTENT_HASH_KERNEL_SSE2:
+        return __builtin_cpu_supports ("sse2");
+    case CONTENT_HASH_KERNEL_AVX2:
+        return __builtin_cpu_supports ("avx2");
+    default:
+        break;
+    }
+#endif
+    return true;
+}
+
+const char *
+content_hash_kernel_get_name (content_hash_kernel_t kernel)
+{
+    if (kernel >= CONTENT_HASH_KERNEL_COUNT)
+        return "unknown";
+    return content_hash_kernel_names[kernel];
+}
+
+static void
+content_hash_pick_kernel (void)
+{
+    if (content_hash_kernel_is_supported (CONTENT_HASH_KERNEL_AVX2))
+        content_hash_best_kernel = CONTENT_HASH_KERNEL_AVX2;
+    else if (content_hash_kernel_is_supported (CONTENT_HASH_KERNEL_SSE2))
+        content_hash_best_kernel = CONTENT_HASH_KERNEL_SSE2;
+}
+
+static inline uint64_t
+content_hash_mix (uint64_t hash,
+                  uint64_t word)
+{
+    hash ^= word * CONTENT_HASH_PRIME_64_2;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * CONTENT_HASH_PRIME_64_1;
+}
+
+/* Spreads every bit of |hash| over all of them. */
+static inline uint64_t
+content_hash_avalanche (uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= CONTENT_HASH_PRIME_64_2;
+    hash ^= hash >> 29;
+    hash *= CONTENT_HASH_PRIME_64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static uint64_t
+content_hash_with_func (content_hash_func_t func,
+                        const char *data,
+                        size_t size)
+{
+    uint64_t hash = size * CONTENT_HASH_PRIME_64_1;
+    uint64_t lanes[CONTENT_HASH_LANES];
+    uint64_t word;
+    size_t i;
+
+    /* Less than a stripe is mixed a word at a time. */
+    if (size < CONTENT_HASH_STRIPE_SIZE) {
+        for (i = 0; i + sizeof (uint64_t) <= size; i += sizeof (uint64_t)) {
+            memcpy (&word, data + i, sizeof (uint64_t));
+            hash = content_hash_mix (hash, word ^ content_hash_keys[i / sizeof (uint64_t)]);
+        }
+        if (i < size) {
+            word = 0;
+            memcpy (&word, data + i, size - i);
+            hash = content_hash_mix (hash, word ^ content_hash_keys[i / sizeof (uint64_t)]);
+        }
+        return content_hash_avalanche (hash);
+    }
+
+    func (data, size, lanes);
+    for (i = 0; i < CONTENT_HASH_LANES; i++)
+        hash = content_hash_mix (hash, lanes[i]);
+    return content_hash_avalanche (hash);
+}
+
+uint64_t
+content_hash_with_kernel (content_hash_kernel_t kernel,
+                          const void *data,
+                          size_t size)
+{
+    return content_hash_with_func (content_hash_kernels[kernel], data, size);
+}
+
+uint64_t
+content_hash (const void *data,
+              size_t size)
+{
+    pthread_once (&content_hash_kernel_once, content_hash_pick_kernel);
+    return content_hash_with_func (content_hash_kernels[content_hash_best_kernel],
+                                   data, size);
+}
@@ -0,0 +1,45 @@
+#ifndef GPUPROCESS_CONTENT_HASH_H
+#define GPUPROCESS_CONTENT_HASH_H
+
+#include "compiler_private.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A 64-bit hash of a block of memory, which the caching client tells
+ * client-side arrays apart by, so that it only has to be fast and spread
+ * its values well, not resist attacks. It is built like XXH3: four 64-bit
+ * lanes each add up the products of the two halves of their words, after
+ * these were mixed with a key that depends on the position of the word in
+ * a block of 512 bytes, and the lanes are scrambled after every block.
+ * There is a kernel for SSE2 and one for AVX2 on x86, which give the same
+ * hash as the scalar one, and the first hash picks the widest that the CPU
+ * supports. */
+
+typedef enum content_hash_kernel {
+    CONTENT_HASH_KERNEL_SCALAR,
+    CONTENT_HASH_KERNEL_SSE2,
+    CONTENT_HASH_KERNEL_AVX2,
+    CONTENT_HASH_KERNEL_COUNT
+} content_hash_kernel_t;
+
+/* Returns the hash of the |size| bytes at |data|. */
+private uint64_t
+content_hash (const void *data,
+              size_t size);
+
+/* The same, with a given kernel, which must be supported, for the
+ * benchmark. */
+private uint64_t
+content_hash_with_kernel (content_hash_kernel_t kernel,
+                          const void *data,
+                          size_t size);
+
+/* Whether |kernel| was built in and the CPU can run it. */
+private bool
+content_hash_kernel_is_supported (content_hash_kernel_t kernel);
+
+private const char *
+content_hash_kernel_get_name (content_hash_kernel_t kernel);
+
+#endif /* GPUPROCESS_CONTENT_HASH_H */
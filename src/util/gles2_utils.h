@@ -1,3 +1,6 @@
+#ifndef GPUPROCESS_GLES2_UTILS_H
+#define GPUPROCESS_GLES2_UTILS_H
+
 #include "compiler_private.h"
 #include <EGL/egl.h>
 #include <stdint.h>
@@ -34,3 +37,4 @@ compute_image_group_size (int format,
 private size_t
 _get_egl_attrib_list_size (const EGLint *attrib_list);
 
+#endif /* GPUPROCESS_GLES2_UTILS_H */
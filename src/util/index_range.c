@@ -0,0 +1,572 @@
+#include "config.h"
+#include "index_range.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define INDEX_RANGE_HAS_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define INDEX_RANGE_HAS_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+typedef void (*index_range_func_t) (const void *indices,
+                                    size_t count,
+                                    uint32_t *min,
+                                    uint32_t *max);
+
+/* Folds |count| more indices into |*min| and |*max|. The vector kernels
+ * use this for the lanes of their results. */
+#define INDEX_RANGE_DEFINE_UPDATE(bits)                                     \
+static inline void                                                          \
+index_range_update_u##bits (const uint##bits##_t *indices,                  \
+                            size_t count,                                   \
+                            uint32_t *min,                                  \
+                            uint32_t *max)                                  \
+{                                                                           \
+    uint32_t smallest = *min;                                               \
+    uint32_t largest = *max;                                                \
+    size_t i;                                                               \
+                                                                            \
+    for (i = 0; i < count; i++) {                                           \
+        if (indices[i] < smallest)                                          \
+            smallest = indices[i];                                          \
+        if (indices[i] > largest)                                           \
+            largest = indices[i];                                           \
+    }                                                                       \
+    *min = smallest;                                                        \
+    *max = largest;                                                         \
+}                                                                           \
+                                                                            \
+static void                                                                 \
+index_range_scan_u##bits##_scalar (const void *indices,                     \
+                                   size_t count,                            \
+                                   uint32_t *min,                           \
+                                   uint32_t *max)                           \
+{                                                                           \
+    *min = UINT32_MAX;                                                      \
+    *max = 0;                                                               \
+    index_range_update_u##bits (indices, count, min, max);                  \
+}
+
+INDEX_RANGE_DEFINE_UPDATE (8)
+INDEX_RANGE_DEFINE_UPDATE (16)
+INDEX_RANGE_DEFINE_UPDATE (32)
+
+/* A vector kernel, made of the |isa|_load_u|bits|, _min_u|bits| and
+ * _max_u|bits| operations on |vector_t|, and _store_min_u|bits| and
+ * _store_max_u|bits|, which fold a vector down to 16 bytes and store them.
+ * It keeps two minimums and two maximums, so that consecutive vectors
+ * don't wait on each other. The first vector starts one pair and the last
+ * one, which may overlap the others, starts the other, so that there is
+ * no scalar tail and every lane only ever holds real indices. Arrays
+ * shorter than a vector go to the |narrower| kernel. */
+#define INDEX_RANGE_DEFINE_KERNEL(isa, bits, vector_t, target, narrower)    \
+static target void                                                          \
+index_range_scan_u##bits##_##isa (const void *indices,                      \
+                                  size_t count,                             \
+                                  uint32_t *min,                            \
+                                  uint32_t *max)                            \
+{                                                                           \
+    const uint##bits##_t *p = indices;                                      \
+    const size_t lanes = sizeof (vector_t) / sizeof (uint##bits##_t);      \
+    uint##bits##_t result[16 / sizeof (uint##bits##_t)];                    \
+    size_t i;                                                               \
+                                                                            \
+    *min = UINT32_MAX;                                                      \
+    *max = 0;                                                               \
+                                                                            \
+    if (count < lanes) {                                                    \
+        index_range_scan_u##bits##_##narrower (p, count, min, max);         \
+        return;                                                             \
+    }                                                                       \
+                                                                            \
+    vector_t min0 = isa##_load_u##bits (p);                                 \
+    vector_t min1 = isa##_load_u##bits (p + count - lanes);                 \
+    vector_t max0 = min0;                                                   \
+    vector_t max1 = min1;                                                   \
+                                                                            \
+    for (i = lanes; i + 2 * lanes <= count; i += 2 * lanes) {               \
+        vector_t v0 = isa##_load_u##bits (p + i);                           \
+        vector_t v1 = isa##_load_u##bits (p + i + lanes);                   \
+        min0 = isa##_min_u##bits (min0, v0);                                \
+        min1 = isa##_min_u##bits (min1, v1);                                \
+        max0 = isa##_max_u##bits (max0, v0);                                \
+        max1 = isa##_max_u##bits (max1, v1);                                \
+    }                                                                       \
+    if (i + lanes < count) {                                                \
+        vector_t v0 = isa##_load_u##bits (p + i);                           \
+        min0 = isa##_min_u##bits (min0, v0);                                \
+        max0 = isa##_max_u##bits (max0, v0);                                \
+    }                                                                       \
+                                                                            \
+    isa##_store_min_u##bits (result, isa##_min_u##bits (min0, min1));       \
+    index_range_update_u##bits (result, 16 / sizeof (result[0]), min, max); \
+    isa##_store_max_u##bits (result, isa##_max_u##bits (max0, max1));       \
+    index_range_update_u##bits (result, 16 / sizeof (result[0]), min, max); \
+}
+
+#ifdef INDEX_RANGE_HAS_X86_KERNELS
+#define INDEX_RANGE_SSE2 __attribute__((target ("sse2")))
+#define INDEX_RANGE_AVX2 __attribute__((target ("avx2")))
+#define INDEX_RANGE_AVX512 __attribute__((target ("avx512f,avx512bw")))
+
+/* SSE2 only compares bytes as unsigned, so shorts and ints are flipped
+ * into the signed range as they are loaded, and back as they are stored. */
+#define sse2_load_u8(p) _mm_loadu_si128 ((const __m128i *) (p))
+#define sse2_min_u8(a, b) _mm_min_epu8 (a, b)
+#define sse2_max_u8(a, b) _mm_max_epu8 (a, b)
+#define sse2_store_min_u8(p, v) _mm_storeu_si128 ((__m128i *) (p), v)
+#define sse2_store_max_u8 sse2_store_min_u8
+
+#define sse2_load_u16(p) \
+    _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (p)), \
+                   _mm_set1_epi16 ((short) 0x8000))
+#define sse2_min_u16(a, b) _mm_min_epi16 (a, b)
+#define sse2_max_u16(a, b) _mm_max_epi16 (a, b)
+#define sse2_store_min_u16(p, v) \
+    _mm_storeu_si128 ((__m128i *) (p), \
+                      _mm_xor_si128 (v, _mm_set1_epi16 ((short) 0x8000)))
+#define sse2_store_max_u16 sse2_store_min_u16
+
+#define sse2_load_u32(p) \
+    _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (p)), \
+                   _mm_set1_epi32 ((int) 0x80000000))
+#define sse2_store_min_u32(p, v) \
+    _mm_storeu_si128 ((__m128i *) (p), \
+                      _mm_xor_si128 (v, _mm_set1_epi32 ((int) 0x80000000)))
+#define sse2_store_max_u32 sse2_store_min_u32
+
+static inline INDEX_RANGE_SSE2 __m128i
+sse2_min_u32 (__m128i a, __m128i b)
+{
+    __m128i a_is_greater = _mm_cmpgt_epi32 (a, b);
+    return _mm_or_si128 (_mm_and_si128 (a_is_greater, b),
+                         _mm_andnot_si128 (a_is_greater, a));
+}
+
+static inline INDEX_RANGE_SSE2 __m128i
+sse2_max_u32 (__m128i a, __m128i b)
+{
+    __m128i a_is_greater = _mm_cmpgt_epi32 (a, b);
+    return _mm_or_si128 (_mm_and_si128 (a_is_greater, a),
+                         _mm_andnot_si128 (a_is_greater, b));
+}
+
+INDEX_RANGE_DEFINE_KERNEL (sse2, 8, __m128i, INDEX_RANGE_SSE2, scalar)
+INDEX_RANGE_DEFINE_KERNEL (sse2, 16, __m128i, INDEX_RANGE_SSE2, scalar)
+INDEX_RANGE_DEFINE_KERNEL (sse2, 32, __m128i, INDEX_RANGE_SSE2, scalar)
+
+/* The wider kernels fold their results in halves, with the unsigned
+ * comparisons that SSE4.1 added, which every CPU with AVX2 has. */
+#define INDEX_RANGE_DEFINE_AVX2_STORE(op, bits)                             \
+static inline INDEX_RANGE_AVX2 void                                         \
+avx2_store_##op##_u##bits (void *p, __m256i v)                              \
+{                                                                           \
+    _mm_storeu_si128 ((__m128i *) p,                                        \
+                      _mm_##op##_epu##bits (_mm256_castsi256_si128 (v),     \
+                                            _mm256_extracti128_si256 (v, 1))); \
+}
+
+#define INDEX_RANGE_DEFINE_AVX512_STORE(op, bits)                           \
+static inline INDEX_RANGE_AVX512 void                                       \
+avx512_store_##op##_u##bits (void *p, __m512i v)                            \
+{                                                                           \
+    avx2_store_##op##_u##bits (p,                                           \
+        _mm256_##op##_epu##bits (_mm512_extracti64x4_epi64 (v, 0),          \
+                                 _mm512_extracti64x4_epi64 (v, 1)));        \
+}
+
+#define avx2_load_u8(p) _mm256_loadu_si256 ((const __m256i *) (p))
+#define avx2_load_u16 avx2_load_u8
+#define avx2_load_u32 avx2_load_u8
+#define avx2_min_u8(a, b) _mm256_min_epu8 (a, b)
+#define avx2_min_u16(a, b) _mm256_min_epu16 (a, b)
+#define avx2_min_u32(a, b) _mm256_min_epu32 (a, b)
+#define avx2_max_u8(a, b) _mm256_max_epu8 (a, b)
+#define avx2_max_u16(a, b) _mm256_max_epu16 (a, b)
+#define avx2_max_u32(a, b) _mm256_max_epu32 (a, b)
+INDEX_RANGE_DEFINE_AVX2_STORE (min, 8)
+INDEX_RANGE_DEFINE_AVX2_STORE (min, 16)
+INDEX_RANGE_DEFINE_AVX2_STORE (min, 32)
+INDEX_RANGE_DEFINE_AVX2_STORE (max, 8)
+INDEX_RANGE_DEFINE_AVX2_STORE (max, 16)
+INDEX_RANGE_DEFINE_AVX2_STORE (max, 32)
+
+INDEX_RANGE_DEFINE_KERNEL (avx2, 8, __m256i, INDEX_RANGE_AVX2, sse2)
+INDEX_RANGE_DEFINE_KERNEL (avx2, 16, __m256i, INDEX_RANGE_AVX2, sse2)
+INDEX_RANGE_DEFINE_KERNEL (avx2, 32, __m256i, INDEX_RANGE_AVX2, sse2)
+
+#define avx512_load_u8(p) _mm512_loadu_si512 ((const void *) (p))
+#define avx512_load_u16 avx512_load_u8
+#define avx512_load_u32 avx512_load_u8
+#define avx512_min_u8(a, b) _mm512_min_epu8 (a, b)
+#define avx512_min_u16(a, b) _mm512_min_epu16 (a, b)
+#define avx512_min_u32(a, b) _mm512_min_epu32 (a, b)
+#define avx512_max_u8(a, b) _mm512_max_epu8 (a, b)
+#define avx512_max_u16(a, b) _mm512_max_epu16 (a, b)
+#define avx512_max_u32(a, b) _mm512_max_epu32 (a, b)
+INDEX_RANGE_DEFINE_AVX512_STORE (min, 8)
+INDEX_RANGE_DEFINE_AVX512_STORE (min, 16)
+INDEX_RANGE_DEFINE_AVX512_STORE (min, 32)
+INDEX_RANGE_DEFINE_AVX512_STORE (max, 8)
+INDEX_RANGE_DEFINE_AVX512_STORE (max, 16)
+INDEX_RANGE_DEFINE_AVX512_STORE (max, 32)
+
+INDEX_RANGE_DEFINE_KERNEL (avx512, 8, __m512i, INDEX_RANGE_AVX512, avx2)
+INDEX_RANGE_DEFINE_KERNEL (avx512, 16, __m512i, INDEX_RANGE_AVX512, avx2)
+INDEX_RANGE_DEFINE_KERNEL (avx512, 32, __m512i, INDEX_RANGE_AVX512, avx2)
+#endif /* INDEX_RANGE_HAS_X86_KERNELS */
+
+#ifdef INDEX_RANGE_HAS_NEON_KERNELS
+#define neon_load_u8(p) vld1q_u8 (p)
+#define neon_load_u16(p) vld1q_u16 (p)
+#define neon_load_u32(p) vld1q_u32 (p)
+#define neon_min_u8(a, b) vminq_u8 (a, b)
+#define neon_min_u16(a, b) vminq_u16 (a, b)
+#define neon_min_u32(a, b) vminq_u32 (a, b)
+#define neon_max_u8(a, b) vmaxq_u8 (a, b)
+#define neon_max_u16(a, b) vmaxq_u16 (a, b)
+#define neon_max_u32(a, b) vmaxq_u32 (a, b)
+#define neon_store_min_u8(p, v) vst1q_u8 (p, v)
+#define neon_store_min_u16(p, v) vst1q_u16 (p, v)
+#define neon_store_min_u32(p, v) vst1q_u32 (p, v)
+#define neon_store_max_u8 neon_store_min_u8
+#define neon_store_max_u16 neon_store_min_u16
+#define neon_store_max_u32 neon_store_min_u32
+
+INDEX_RANGE_DEFINE_KERNEL (neon, 8, uint8x16_t, , scalar)
+INDEX_RANGE_DEFINE_KERNEL (neon, 16, uint16x8_t, , scalar)
+INDEX_RANGE_DEFINE_KERNEL (neon, 32, uint32x4_t, , scalar)
+#endif /* INDEX_RANGE_HAS_NEON_KERNELS */
+
+/* By kernel, then by index size: 1, 2 and 4 bytes. Kernels that aren't
+ * built in for this architecture are left empty. */
+static const index_range_func_t index_range_kernels[INDEX_RANGE_KERNEL_COUNT][3] = {
+    [INDEX_RANGE_KERNEL_SCALAR] = {
+        index_range_scan_u8_scalar,
+        index_range_scan_u16_scalar,
+        index_range_scan_u32_scalar
+    },
+#ifdef INDEX_RANGE_HAS_X86_KERNELS
+    [INDEX_RANGE_KERNEL_SSE2] = {
+        index_range_scan_u8_sse2,
+        index_range_scan_u16_sse2,
+        index_range_scan_u32_sse2
+    },
+    [INDEX_RANGE_KERNEL_AVX2] = {
+        index_range_scan_u8_avx2,
+        index_range_scan_u16_avx2,
+        index_range_scan_u32_avx2
+    },
+    [INDEX_RANGE_KERNEL_AVX512] = {
+        index_range_scan_u8_avx512,
+        index_range_scan_u16_avx512,
+        index_range_scan_u32_avx512
+    },
+#endif
+#ifdef INDEX_RANGE_HAS_NEON_KERNELS
+    [INDEX_RANGE_KERNEL_NEON] = {
+        index_range_scan_u8_neon,
+        index_range_scan_u16_neon,
+        index_range_scan_u32_neon
+    },
+#endif
+};
+
+static const char *index_range_kernel_names[INDEX_RANGE_KERNEL_COUNT] = {
+    [INDEX_RANGE_KERNEL_SCALAR] = "scalar",
+    [INDEX_RANGE_KERNEL_SSE2] = "sse2",
+    [INDEX_RANGE_KERNEL_AVX2] = "avx2",
+    [INDEX_RANGE_KERNEL_AVX512] = "avx512",
+    [INDEX_RANGE_KERNEL_NEON] = "neon",
+};
+
+static pthread_once_t index_range_kernel_once = PTHREAD_ONCE_INIT;
+static index_range_kernel_t index_range_best_kernel = INDEX_RANGE_KERNEL_SCALAR;
+
+bool
+index_range_kernel_is_supported (index_range_kernel_t kernel)
+{
+    if (kernel >= INDEX_RANGE_KERNEL_COUNT || ! index_range_kernels[kernel][0])
+        return false;
+
+#ifdef INDEX_RANGE_HAS_X86_KERNELS
+    /* This asks CPUID, and XGETBV for whether the operating system saves
+     * the wider registers. */
+    __builtin_cpu_init ();
+    switch (kernel) {
+    case INDEX_RANGE_KERNEL_SSE2:
+        return __builtin_cpu_supports ("sse2");
+    case INDEX_RANGE_KERNEL_AVX2:
+        return __builtin_cpu_supports ("avx2");
+    case INDEX_RANGE_KERNEL_AVX512:
+        return __builtin_cpu_supports ("avx512f") &&
+               __builtin_cpu_supports ("avx512bw");
+    default:
+        break;
+    }
+#endif
+    return true;
+}
+
+const char *
+index_range_kernel_get_name (index_range_kernel_t kernel)
+{
+    if (kernel >= INDEX_RANGE_KERNEL_COUNT)
+        return "unknown";
+    return index_range_kernel_names[kernel];
+}
+
+static void
+index_range_pick_kernel (void)
+{
+    static const index_range_kernel_t preferred[] = {
+        INDEX_RANGE_KERNEL_AVX512,
+        INDEX_RANGE_KERNEL_AVX2,
+        INDEX_RANGE_KERNEL_SSE2,
+        INDEX_RANGE_KERNEL_NEON
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof (preferred) / sizeof (preferred[0]); i++) {
+        if (index_range_kernel_is_supported (preferred[i])) {
+            index_range_best_kernel = preferred[i];
+            return;
+        }
+    }
+}
+
+static inline int
+index_range_size_to_column (size_t index_size)
+{
+    return index_size == 1 ? 0 : index_size == 2 ? 1 : 2;
+}
+
+void
+index_range_scan_with_kernel (index_range_kernel_t kernel,
+                              const void *indices,
+                              size_t count,
+                              size_t index_size,
+                              uint32_t *min,
+                              uint32_t *max)
+{
+    index_range_kernels[kernel][index_range_size_to_column (index_size)] (
+        indices, count, min, max);
+}
+
+void
+index_range_scan (const void *indices,
+                  size_t count,
+                  size_t index_size,
+                  uint32_t *min,
+                  uint32_t *max)
+{
+    pthread_once (&index_range_kernel_once, index_range_pick_kernel);
+    index_range_kernels[index_range_best_kernel]
+                       [index_range_size_to_column (index_size)] (
+        indices, count, min, max);
+}
+
+#define INDEX_RANGE_CACHE_ENTRIES 32
+
+typedef struct index_range_cache_entry {
+    size_t offset;
+    size_t count;
+    size_t index_size;
+    uint32_t min;
+    uint32_t max;
+    bool valid;
+} index_range_cache_entry_t;
+
+/* A block that changed, or was never scanned, has a minimum above its
+ * maximum. */
+typedef struct index_range_block {
+    uint32_t min;
+    uint32_t max;
+} index_range_block_t;
+
+struct _index_range_cache {
+    size_t size;
+    index_range_cache_entry_t entries[INDEX_RANGE_CACHE_ENTRIES];
+
+    /* Only the whole blocks are summarized, for the index size that the
+     * last draw used, or none if the buffer is small. */
+    index_range_block_t *blocks;
+    size_t block_count;
+    size_t block_index_size;
+};
+
+static void
+index_range_cache_clear_blocks (index_range_cache_t *cache,
+                                size_t first,
+                                size_t last)
+{
+    size_t i;
+
+    for (i = first; i < last; i++) {
+        cache->blocks[i].min = UINT32_MAX;
+        cache->blocks[i].max = 0;
+    }
+}
+
+index_range_cache_t *
+index_range_cache_new (size_t size)
+{
+    index_range_cache_t *cache = malloc (sizeof (index_range_cache_t));
+    if (! cache)
+        return NULL;
+    memset (cache, 0, sizeof (index_range_cache_t));
+    cache->size = size;
+
+    /* Without a summary, every new range is scanned in full. */
+    if (size >= INDEX_RANGE_SUMMARY_MIN_SIZE) {
+        cache->block_count = size / INDEX_RANGE_BLOCK_SIZE;
+        cache->blocks = malloc (cache->block_count * sizeof (index_range_block_t));
+        if (! cache->blocks)
+            cache->block_count = 0;
+        else
+            index_range_cache_clear_blocks (cache, 0, cache->block_count);
+    }
+    return cache;
+}
+
+void
+index_range_cache_destroy (index_range_cache_t *cache)
+{
+    free (cache->blocks);
+    free (cache);
+}
+
+static inline void
+index_range_merge (uint32_t *min,
+                   uint32_t *max,
+                   uint32_t other_min,
+                   uint32_t other_max)
+{
+    if (other_min < *min)
+        *min = other_min;
+    if (other_max > *max)
+        *max = other_max;
+}
+
+/* Scans the bytes from |start| to |end| of |data|, taking the whole blocks
+ * in between from the summary, and scanning those that changed. */
+static void
+index_range_cache_scan_blocks (index_range_cache_t *cache,
+                               const char *data,
+                               size_t start,
+                               size_t end,
+                               size_t index_size,
+                               uint32_t *min,
+                               uint32_t *max)
+{
+    size_t first_block = (start + INDEX_RANGE_BLOCK_SIZE - 1) / INDEX_RANGE_BLOCK_SIZE;
+    size_t last_block = end / INDEX_RANGE_BLOCK_SIZE;
+    uint32_t part_min, part_max;
+    size_t i;
+
+    *min = UINT32_MAX;
+    *max = 0;
+
+    if (start < first_block * INDEX_RANGE_BLOCK_SIZE) {
+        index_range_scan (data + start,
+                          (first_block * INDEX_RANGE_BLOCK_SIZE - start) / index_size,
+                          index_size, &part_min, &part_max);
+        index_range_merge (min, max, part_min, part_max);
+    }
+
+    if (cache->block_index_size != index_size) {
+        index_range_cache_clear_blocks (cache, 0, cache->block_count);
+        cache->block_index_size = index_size;
+    }
+    for (i = first_block; i < last_block; i++) {
+        index_range_block_t *block = &cache->blocks[i];
+        if (block->min > block->max)
+            index_range_scan (data + i * INDEX_RANGE_BLOCK_SIZE,
+                              INDEX_RANGE_BLOCK_SIZE / index_size, index_size,
+                              &block->min, &block->max);
+        index_range_merge (min, max, block->min, block->max);
+    }
+
+    if (last_block * INDEX_RANGE_BLOCK_SIZE < end) {
+        index_range_scan (data + last_block * INDEX_RANGE_BLOCK_SIZE,
+                          (end - last_block * INDEX_RANGE_BLOCK_SIZE) / index_size,
+                          index_size, &part_min, &part_max);
+        index_range_merge (min, max, part_min, part_max);
+    }
+}
+
+bool
+index_range_cache_scan (index_range_cache_t *cache,
+                        const void *data,
+                        size_t offset,
+                        size_t count,
+                        size_t index_size,
+                        uint32_t *min,
+                        uint32_t *max)
+{
+    index_range_cache_entry_t *entry;
+    size_t end;
+
+    if (! count || offset > cache->size ||
+        count > (cache->size - offset) / index_size)
+        return false;
+    end = offset + count * index_size;
+
+    entry = &cache->entries[((offset / index_size) ^ (count * 2654435761u) ^
+                             index_size) % INDEX_RANGE_CACHE_ENTRIES];
+    if (entry->valid && entry->offset == offset && entry->count == count &&
+        entry->index_size == index_size) {
+        *min = entry->min;
+        *max = entry->max;
+        return true;
+    }
+
+    /* Blocks are aligned to every index size, but the indices only line
+     * up with them if the offset is aligned too, as GL requires. */
+    if (cache->blocks && offset % index_size == 0 &&
+        end / INDEX_RANGE_BLOCK_SIZE >
+        (offset + INDEX_RANGE_BLOCK_SIZE - 1) / INDEX_RANGE_BLOCK_SIZE)
+        index_range_cache_scan_blocks (cache, data, offset, end, index_size,
+                                       min, max);
+    else
+        index_range_scan ((const char *) data + offset, count, index_size,
+                          min, max);
+
+    entry->offset = offset;
+    entry->count = count;
+    entry->index_size = index_size;
+    entry->min = *min;
+    entry->max = *max;
+    entry->valid = true;
+    return true;
+}
+
+void
+index_range_cache_invalidate (index_range_cache_t *cache,
+                              size_t offset,
+                              size_t size)
+{
+    size_t i;
+
+    if (! size)
+        return;
+
+    for (i = 0; i < INDEX_RANGE_CACHE_ENTRIES; i++) {
+        index_range_cache_entry_t *entry = &cache->entries[i];
+        if (entry->valid && entry->offset < offset + size &&
+            offset < entry->offset + entry->count * entry->index_size)
+            entry->valid = false;
+    }
+
+    if (cache->blocks && offset < cache->block_count * INDEX_RANGE_BLOCK_SIZE) {
+        size_t last = (offset + size + INDEX_RANGE_BLOCK_SIZE - 1) / INDEX_RANGE_BLOCK_SIZE;
+        if (last > cache->block_count)
+            last = cache->block_count;
+        index_range_cache_clear_blocks (cache, offset / INDEX_RANGE_BLOCK_SIZE, last);
+    }
+}
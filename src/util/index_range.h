@@ -0,0 +1,89 @@
+#ifndef GPUPROCESS_INDEX_RANGE_H
+#define GPUPROCESS_INDEX_RANGE_H
+
+#include "compiler_private.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Finds the smallest and the largest of the indices of a draw, which
+ * tell the caching client which vertices of the client arrays it has to
+ * copy. There is a kernel for each vector unit that is worth it: SSE2,
+ * AVX2 and AVX-512 on x86 and NEON on ARM, and the first scan picks the
+ * widest that the CPU supports, after which every scan uses it. */
+
+typedef enum index_range_kernel {
+    INDEX_RANGE_KERNEL_SCALAR,
+    INDEX_RANGE_KERNEL_SSE2,
+    INDEX_RANGE_KERNEL_AVX2,
+    INDEX_RANGE_KERNEL_AVX512,
+    INDEX_RANGE_KERNEL_NEON,
+    INDEX_RANGE_KERNEL_COUNT
+} index_range_kernel_t;
+
+/* Sets |*min| and |*max| to the smallest and the largest of the |count|
+ * indices at |indices|, which are |index_size| bytes each: 1, 2 or 4.
+ * |count| must not be 0. */
+private void
+index_range_scan (const void *indices,
+                  size_t count,
+                  size_t index_size,
+                  uint32_t *min,
+                  uint32_t *max);
+
+/* The same, with a given kernel, which must be supported, for the
+ * benchmark. */
+private void
+index_range_scan_with_kernel (index_range_kernel_t kernel,
+                              const void *indices,
+                              size_t count,
+                              size_t index_size,
+                              uint32_t *min,
+                              uint32_t *max);
+
+/* Whether |kernel| was built in and the CPU can run it. */
+private bool
+index_range_kernel_is_supported (index_range_kernel_t kernel);
+
+private const char *
+index_range_kernel_get_name (index_range_kernel_t kernel);
+
+/* The ranges that draws asked for in an element array buffer that the
+ * caching client keeps a copy of, so that the indices of a static buffer
+ * are only scanned once. Each range is cached by its offset, count and
+ * index size. Buffers of INDEX_RANGE_SUMMARY_MIN_SIZE bytes and more also
+ * keep the smallest and largest index of every INDEX_RANGE_BLOCK_SIZE
+ * bytes, so that a range that wasn't asked for before only scans its
+ * partial blocks and the blocks that changed. */
+#define INDEX_RANGE_BLOCK_SIZE 4096
+#define INDEX_RANGE_SUMMARY_MIN_SIZE (16 * INDEX_RANGE_BLOCK_SIZE)
+
+typedef struct _index_range_cache index_range_cache_t;
+
+/* For a buffer of |size| bytes. Returns NULL if out of memory. */
+private index_range_cache_t *
+index_range_cache_new (size_t size);
+
+private void
+index_range_cache_destroy (index_range_cache_t *cache);
+
+/* Like index_range_scan () on the |count| indices at |offset| bytes into
+ * |data|, the contents of the buffer. Returns false, without scanning, if
+ * they aren't all within the buffer. */
+private bool
+index_range_cache_scan (index_range_cache_t *cache,
+                        const void *data,
+                        size_t offset,
+                        size_t count,
+                        size_t index_size,
+                        uint32_t *min,
+                        uint32_t *max);
+
+/* Forgets the ranges and blocks that overlap the |size| bytes at |offset|,
+ * which were just written. */
+private void
+index_range_cache_invalidate (index_range_cache_t *cache,
+                              size_t offset,
+                              size_t size);
+
+#endif /* GPUPROCESS_INDEX_RANGE_H */
@@ -0,0 +1,254 @@
+#include "config.h"
+#include "memory_pool.h"
+
+#include "thread_private.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_POOL_CLASS_COUNT 8
+
+typedef struct memory_pool memory_pool_t;
+typedef struct memory_pool_class memory_pool_class_t;
+
+/* Precedes every block, and every slab. The memory after it is aligned
+ * like that of malloc. */
+typedef struct memory_pool_block {
+    /* NULL for memory from malloc. */
+    memory_pool_class_t *size_class;
+    struct memory_pool_block *next;
+} __attribute__((aligned (16))) memory_pool_block_t;
+
+struct memory_pool_class {
+    memory_pool_t *pool;
+    size_t size;
+    unsigned int slab_count;
+    memory_pool_block_t *free_blocks;
+
+    uint64_t allocations;
+    uint64_t hits;
+    uint64_t slabs;
+
+    /* The only field other threads write to. */
+    memory_pool_block_t *returned_blocks cache_line_aligned;
+};
+
+struct memory_pool {
+    memory_pool_class_t classes[MEMORY_POOL_CLASS_COUNT];
+    memory_pool_block_t *slabs;
+    uint64_t large_allocations;
+
+    /* One for every block in use, and one for as long as the thread that
+     * owns the pool is alive. */
+    unsigned long references cache_line_aligned;
+};
+
+static const size_t memory_pool_sizes[MEMORY_POOL_CLASS_COUNT] = {
+    64, 256, 1024, 2 * 1024, 4 * 1024, 8 * 1024, 16 * 1024, 32 * 1024
+};
+
+static const unsigned int memory_pool_counts[MEMORY_POOL_CLASS_COUNT] = {
+    MEMORY_POOL_64_COUNT,
+    MEMORY_POOL_256_COUNT,
+    MEMORY_POOL_1K_COUNT,
+    MEMORY_POOL_2K_COUNT,
+    MEMORY_POOL_4K_COUNT,
+    MEMORY_POOL_8K_COUNT,
+    MEMORY_POOL_16K_COUNT,
+    MEMORY_POOL_32K_COUNT
+};
+
+static __thread memory_pool_t *thread_pool
+    __attribute__(( tls_model ("initial-exec"))) = NULL;
+
+/* Only there to let go of the pool of a thread when it exits. */
+static pthread_key_t memory_pool_key;
+static pthread_once_t memory_pool_key_once = PTHREAD_ONCE_INIT;
+
+static void
+memory_pool_destroy (memory_pool_t *pool)
+{
+    while (pool->slabs) {
+        memory_pool_block_t *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free (slab);
+    }
+    free (pool);
+}
+
+static void
+memory_pool_unreference (memory_pool_t *pool)
+{
+    if (! __atomic_sub_fetch (&pool->references, 1, __ATOMIC_ACQ_REL))
+        memory_pool_destroy (pool);
+}
+
+#if ENABLE_PROFILING
+static void
+memory_pool_print_statistics (memory_pool_t *pool)
+{
+    unsigned int i;
+
+    for (i = 0; i < MEMORY_POOL_CLASS_COUNT; i++) {
+        memory_pool_class_t *size_class = &pool->classes[i];
+        if (! size_class->allocations)
+            continue;
+        printf ("memory pool: %5zu byte blocks: %" PRIu64 " allocations, "
+                "%.1f%% from free blocks, %" PRIu64 " slabs\n",
+                size_class->size, size_class->allocations,
+                100.0 * size_class->hits / size_class->allocations,
+                size_class->slabs);
+    }
+    if (pool->large_allocations)
+        printf ("memory pool: %" PRIu64 " allocations of more than %d bytes\n",
+                pool->large_allocations, MEMORY_POOL_MAX_SIZE);
+}
+#endif
+
+static void
+memory_pool_thread_exit (void *ptr)
+{
+    memory_pool_t *pool = (memory_pool_t *) ptr;
+
+#if ENABLE_PROFILING
+    memory_pool_print_statistics (pool);
+#endif
+
+    thread_pool = NULL;
+    memory_pool_unreference (pool);
+}
+
+static void
+memory_pool_create_key (void)
+{
+    pthread_key_create (&memory_pool_key, memory_pool_thread_exit);
+}
+
+static memory_pool_t *
+memory_pool_get_thread_pool (void)
+{
+    memory_pool_t *pool = NULL;
+    unsigned int i;
+
+    if (likely (thread_pool != NULL))
+        return thread_pool;
+
+    pthread_once (&memory_pool_key_once, memory_pool_create_key);
+    if (posix_memalign ((void **) &pool, CACHE_LINE_SIZE,
+                        sizeof (memory_pool_t)))
+        return NULL;
+    memset (pool, 0, sizeof (memory_pool_t));
+
+    for (i = 0; i < MEMORY_POOL_CLASS_COUNT; i++) {
+        pool->classes[i].pool = pool;
+        pool->classes[i].size = memory_pool_sizes[i];
+        pool->classes[i].slab_count = memory_pool_counts[i];
+    }
+    pool->references = 1;
+
+    pthread_setspecific (memory_pool_key, pool);
+    thread_pool = pool;
+    return pool;
+}
+
+/* Fills the free list of |size_class| with the blocks of a new slab. */
+static bool
+memory_pool_add_slab (memory_pool_t *pool,
+                      memory_pool_class_t *size_class)
+{
+    size_t stride = sizeof (memory_pool_block_t) + size_class->size;
+    memory_pool_block_t *slab = malloc (sizeof (memory_pool_block_t) +
+                                        size_class->slab_count * stride);
+    char *blocks = (char *) (slab + 1);
+    unsigned int i;
+
+    if (! slab)
+        return false;
+    slab->size_class = NULL;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    size_class->slabs++;
+
+    for (i = size_class->slab_count; i-- > 0;) {
+        memory_pool_block_t *block = (memory_pool_block_t *) (blocks + i * stride);
+        block->size_class = size_class;
+        block->next = size_class->free_blocks;
+        size_class->free_blocks = block;
+    }
+    return true;
+}
+
+void *
+memory_pool_alloc (size_t size)
+{
+    memory_pool_t *pool = memory_pool_get_thread_pool ();
+    memory_pool_class_t *size_class;
+    memory_pool_block_t *block;
+    unsigned int i;
+
+    if (unlikely (! pool || size > MEMORY_POOL_MAX_SIZE)) {
+        block = malloc (sizeof (memory_pool_block_t) + size);
+        if (! block)
+            return NULL;
+        block->size_class = NULL;
+        if (pool)
+            pool->large_allocations++;
+        return block + 1;
+    }
+
+    for (i = 0; memory_pool_sizes[i] < size; i++)
+        ;
+    size_class = &pool->classes[i];
+    size_class->allocations++;
+
+    /* Other threads only ever push blocks, so taking them all at once is
+     * safe from them being popped and pushed back meanwhile. */
+    if (! size_class->free_blocks &&
+        atomic_load_relaxed (&size_class->returned_blocks))
+        size_class->free_blocks =
+            __atomic_exchange_n (&size_class->returned_blocks, NULL,
+                                 __ATOMIC_ACQUIRE);
+
+    if (size_class->free_blocks)
+        size_class->hits++;
+    else if (! memory_pool_add_slab (pool, size_class))
+        return NULL;
+
+    block = size_class->free_blocks;
+    size_class->free_blocks = block->next;
+    __atomic_add_fetch (&pool->references, 1, __ATOMIC_RELAXED);
+    return block + 1;
+}
+
+void
+memory_pool_free (void *pointer)
+{
+    memory_pool_block_t *block;
+    memory_pool_class_t *size_class;
+
+    if (! pointer)
+        return;
+
+    block = (memory_pool_block_t *) pointer - 1;
+    size_class = block->size_class;
+    if (! size_class) {
+        free (block);
+        return;
+    }
+
+    if (size_class->pool == thread_pool) {
+        block->next = size_class->free_blocks;
+        size_class->free_blocks = block;
+    } else {
+        block->next = atomic_load_relaxed (&size_class->returned_blocks);
+        while (! __atomic_compare_exchange_n (&size_class->returned_blocks,
+                                              &block->next, block, true,
+                                              __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED))
+            ;
+    }
+    memory_pool_unreference (size_class->pool);
+}
@@ -0,0 +1,38 @@
+#ifndef GPUPROCESS_MEMORY_POOL_H
+#define GPUPROCESS_MEMORY_POOL_H
+
+#include "compiler_private.h"
+#include <stddef.h>
+
+/* Memory that a client thread allocates for the arguments of a command,
+ * and that the server thread frees once it has executed the command,
+ * comes from a pool of the client thread rather than from malloc, whose
+ * per-thread arenas handle that pattern poorly. Each thread has blocks of
+ * a few size classes, carved from slabs of MEMORY_POOL_*_COUNT blocks,
+ * on free lists only it touches. Blocks freed by other threads are pushed
+ * onto a lock-free list of their size class, which the owner takes over
+ * whole once its own free list runs dry. The slabs are kept until the
+ * thread has exited and the last of its blocks has come back.
+ *
+ * Larger allocations go to malloc. With profiling enabled, each thread
+ * prints how often it found a free block, per size class, as it exits. */
+#define MEMORY_POOL_64_COUNT  256
+#define MEMORY_POOL_256_COUNT 128
+#define MEMORY_POOL_1K_COUNT  64
+#define MEMORY_POOL_2K_COUNT  64
+#define MEMORY_POOL_4K_COUNT  64
+#define MEMORY_POOL_8K_COUNT  64
+#define MEMORY_POOL_16K_COUNT 32
+#define MEMORY_POOL_32K_COUNT 32
+
+#define MEMORY_POOL_MAX_SIZE (32 * 1024)
+
+/* Any thread can free the memory, with memory_pool_free () and never
+ * with free (). */
+private void *
+memory_pool_alloc (size_t size);
+
+private void
+memory_pool_free (void *pointer);
+
+#endif /* GPUPROCESS_MEMORY_POOL_H */